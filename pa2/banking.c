@@ -2,26 +2,305 @@
  * @file     banking.c
  * @Author   @seniorkot
  * @date     May, 2018
- * @brief    Transfer function
+ * @brief    Transfer functions: parent keeps a window of transfers in flight
  */
  
 #include "banking.h"
 #include "communication.h"
 #include "log2pa.h"
 
-void transfer(void * parent_data, local_id src, local_id dst, balance_t amount){
+#include <stdlib.h>
+#include <string.h>
+
+/** Free slot of transfer whose orders are all done
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ * @param slot		Busy slot
+ */
+static void complete_slot(PipesCommunication* comm, PendingTransfer* slot){
+	size_t i;
+	
+	slot->busy = 0;
+	comm->in_flight--;
+	if (!slot->batch){
+		log_transfer_in(slot->order.s_src, slot->order.s_dst, slot->order.s_amount);
+		return;
+	}
+	for (i = 0; i < slot->count; i++){
+		log_transfer_in(slot->batch[i].s_src, slot->batch[i].s_dst, slot->batch[i].s_amount);
+	}
+	free(slot->batch);
+	slot->batch = NULL;
+}
+
+/** Free slots of all orders to destination below its watermark
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ * @param watermark	WATERMARK payload
+ */
+static void settle_slots(PipesCommunication* comm, const TransferWatermark* watermark){
+	size_t i;
+	
+	if (watermark->s_dst <= PARENT_ID || watermark->s_dst >= comm->total_ids || !comm->settle){
+		return;
+	}
+	comm->settle[watermark->s_dst].settled = watermark->s_settled;
+	
+	for (i = 0; i < comm->window && comm->in_flight; i++){
+		PendingTransfer* slot = &comm->pending[i];
+		
+		if (slot->busy && !slot->batch && slot->order.s_dst == watermark->s_dst
+				&& (int16_t) (watermark->s_settled - slot->dst_seq) > 0){
+			complete_slot(comm, slot);
+		}
+	}
+}
+
+/** Receive one ACK or WATERMARK and free slots of transfers whose orders are all done
+ * 
+ * ACKs of different destinations may come in any order, so they are
+ * matched by sequence number. Unknown ACKs are dropped.
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ */
+static void receive_ack(PipesCommunication* comm){
 	Message msg;
-	PipesCommunication* parent = (PipesCommunication*) parent_data;
-	TransferOrder order;
-	order.s_src = src;
-    order.s_dst = dst;
-    order.s_amount = amount;
+	PendingTransfer* slot;
+	TransferAck ack;
+	
+	while (1){
+		while (receive_any(comm, &msg));
+		
+		if (msg.s_header.s_type == ACK && msg.s_header.s_payload_len == sizeof(TransferAck)){
+			break;
+		}
+		if (msg.s_header.s_type == WATERMARK && msg.s_header.s_payload_len == sizeof(TransferWatermark)){
+			settle_slots(comm, (TransferWatermark*) msg.s_payload);
+			return;
+		}
+	}
+	
+	memcpy(&ack, msg.s_payload, sizeof(TransferAck));
+	slot = &comm->pending[ack.s_seq % comm->window];
+	if (!slot->busy || slot->seq != ack.s_seq || slot->left < ack.s_count){
+		return;
+	}
+	if (!(slot->left -= ack.s_count)){
+		complete_slot(comm, slot);
+	}
+}
+
+/** Wait for some transfer to be done
+ * 
+ * With ACK_WATERMARK destinations report on their own only every
+ * WATERMARK_INTERVAL orders, so before waiting parent asks every
+ * destination with orders in flight to report once they are done.
+ * Each of them is asked once for the orders sent so far.
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ */
+static void wait_ack(PipesCommunication* comm){
+	local_id i;
+	
+	if (comm->settle){
+		for (i = 1; i < comm->total_ids; i++){
+			SettleState* state = &comm->settle[i];
+			
+			if (state->settled != state->next && state->requested != state->next){
+				state->requested = state->next;
+				send_watermark_request_msg(comm, i, state->next);
+			}
+		}
+	}
+	receive_ack(comm);
+}
+
+/** Take slot of the next sequence number
+ * 
+ * Waits only while the slot is taken, so at most comm->window
+ * transfers are in flight.
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ * @param count		Orders of the transfer
+ *
+ * @return slot with sequence number set
+ */
+static PendingTransfer* take_slot(PipesCommunication* comm, size_t count){
+	PendingTransfer* slot;
+	
+	if (!comm->pending){
+		set_transfer_window(comm, comm->window);
+	}
+	
+	slot = &comm->pending[comm->next_seq % comm->window];
+	while (slot->busy){
+		wait_ack(comm);
+	}
+	
+	slot->seq = comm->next_seq++;
+	slot->count = slot->left = count;
+	slot->busy = 1;
+	comm->in_flight++;
+	return slot;
+}
+
+/** Send orders collected for source as one TRANSFER_BATCH
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ * @param src		Source process
+ */
+static void flush_batch(PipesCommunication* comm, local_id src){
+	size_t count = comm->batch_lens[src];
+	PendingTransfer* slot;
+	size_t i;
+	
+	if (!count){
+		return;
+	}
 	
-    send_transfer_msg(parent, src, &order);
+	slot = take_slot(comm, count);
+	slot->batch = malloc(sizeof(TransferOrder) * count);
+	memcpy(slot->batch, comm->batches[src], sizeof(TransferOrder) * count);
+	comm->batch_lens[src] = 0;
 	
+	send_transfer_batch_msg(comm, src, slot->seq, slot->batch, count);
+	for (i = 0; i < count; i++){
+		log_transfer_out(slot->batch[i].s_src, slot->batch[i].s_dst, slot->batch[i].s_amount);
+	}
+}
+
+/** Send transfer without waiting for its ACK
+ * 
+ * With comm->batch > 1 the order is collected with other orders of
+ * the same source and sent once comm->batch of them are collected
+ * or by transfer_wait_all().
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ * @param src		Source process
+ * @param dst		Destination process
+ * @param amount	Amount of money
+ */
+void transfer_async(PipesCommunication* comm, local_id src, local_id dst, balance_t amount){
+	SeqTransferOrder order;
+	PendingTransfer* slot;
+	
+	order.s_order.s_src = src;
+	order.s_order.s_dst = dst;
+	order.s_order.s_amount = amount;
+	
+	if (comm->batch > 1){
+		if (!comm->batches){
+			comm->batches = calloc(comm->total_ids, sizeof(TransferOrder*));
+			comm->batch_lens = calloc(comm->total_ids, sizeof(size_t));
+		}
+		if (!comm->batches[src]){
+			comm->batches[src] = malloc(sizeof(TransferOrder) * comm->batch);
+		}
+		comm->batches[src][comm->batch_lens[src]++] = order.s_order;
+		if (comm->batch_lens[src] == comm->batch){
+			flush_batch(comm, src);
+		}
+		return;
+	}
+	
+	slot = take_slot(comm, 1);
+	slot->order = order.s_order;
+	order.s_seq = slot->seq;
+	
+	/* Destination counts its orders, so they are numbered per destination */
+	if (comm->ack_mode == ACK_WATERMARK){
+		if (!comm->settle){
+			comm->settle = calloc(comm->total_ids, sizeof(SettleState));
+		}
+		slot->dst_seq = order.s_seq = comm->settle[dst].next++;
+	}
+	
+	send_transfer_msg(comm, src, &order);
 	log_transfer_out(src, dst, amount);
-		
-    while (receive(parent, dst, &msg) < 0 || msg.s_header.s_type != ACK);
+}
+
+/** Send collected orders and wait for ACKs of all transfers in flight
+ * 
+ * @param comm		Pointer to PipesCommunication of parent
+ */
+void transfer_wait_all(PipesCommunication* comm){
+	local_id i;
+	
+	if (comm->batches){
+		for (i = 1; i < comm->total_ids; i++){
+			flush_batch(comm, i);
+		}
+	}
+	while (comm->in_flight){
+		wait_ack(comm);
+	}
+}
+
+/** Send watermark if parent waits for it or enough orders are done since the last one
+ * 
+ * @param comm		Pointer to PipesCommunication of destination
+ */
+static void report_settled(PipesCommunication* comm){
+	SettleMarks* marks = comm->marks;
+	int reached = marks->asked && (int16_t) (marks->settled - marks->target) >= 0;
+	
+	if (reached){
+		marks->asked = 0;
+	}
+	if (marks->settled != marks->reported && (reached || (uint16_t) (marks->settled - marks->reported) >= WATERMARK_INTERVAL)){
+		marks->reported = marks->settled;
+		send_watermark_msg(comm, PARENT_ID, marks->settled);
+	}
+}
+
+/** Mark order to current process done instead of sending its ACK
+ * 
+ * Orders of different sources may come out of their order, so
+ * watermark moves only over orders done without gaps.
+ * 
+ * @param comm		Pointer to PipesCommunication of destination
+ * @param seq		Sequence number of order among orders to current process
+ */
+void settle_order(PipesCommunication* comm, uint16_t seq){
+	SettleMarks* marks;
+	
+	if (!comm->marks){
+		comm->marks = calloc(1, sizeof(SettleMarks));
+	}
+	marks = comm->marks;
+	
+	marks->done[seq % MAX_TRANSFER_WINDOW] = 1;
+	while (marks->done[marks->settled % MAX_TRANSFER_WINDOW]){
+		marks->done[marks->settled % MAX_TRANSFER_WINDOW] = 0;
+		marks->settled++;
+	}
+	report_settled(comm);
+}
+
+/** Take WATERMARK_REQUEST of parent
+ * 
+ * @param comm		Pointer to PipesCommunication of destination
+ * @param msg		Received message
+ */
+void settle_request(PipesCommunication* comm, const Message* msg){
+	if (msg->s_header.s_payload_len != sizeof(uint16_t)){
+		return;
+	}
+	if (!comm->marks){
+		comm->marks = calloc(1, sizeof(SettleMarks));
+	}
+	memcpy(&comm->marks->target, msg->s_payload, sizeof(uint16_t));
+	comm->marks->asked = 1;
+	report_settled(comm);
+}
+
+void transfer(void * parent_data, local_id src, local_id dst, balance_t amount){
+	PipesCommunication* parent = (PipesCommunication*) parent_data;
+	
+	transfer_async(parent, src, dst, amount);
 	
-	log_transfer_in(src, dst, amount);		
+	/* Without window the transfer is done on return, as before */
+	if (parent->window == 1){
+		transfer_wait_all(parent);
+	}
 }
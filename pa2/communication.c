@@ -4,7 +4,9 @@
  * @date     May, 2018
  * @brief    Functions that help to organize IPC
  */
- 
+
+#define _GNU_SOURCE
+
 #include "communication.h"
 #include "log2pa.h"
 #include "pa2345.h"
@@ -14,6 +16,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/epoll.h>
 
 /** Set 0_NONBLOCK flag to fd
  * 
@@ -33,69 +38,400 @@ int set_nonblock(int pipe_id){
     return 0;
 }
 
-/** Open pipes fds
+/** Close all fds of array but one
+ *
+ * Fds opened one after another are closed by close_range() around the one
+ * kept, so a child drops descriptors of all other processes in two syscalls.
+ *
+ * @param fds			Fds array
+ * @param count			Count of fds
+ * @param keep			Fd left open
+ */
+static void close_all_but(const int* fds, size_t count, int keep){
+	int first = fds[0];
+	int last = fds[count - 1];
+	size_t i;
+	
+	for (i = 0; i < count && fds[i] == first + (int) i; i++);
+	if (i == count && (keep == first || !close_range(first, keep - 1, 0)) && (keep == last || !close_range(keep + 1, last, 0))){
+		return;
+	}
+	
+	for (i = 0; i < count; i++){
+		if (fds[i] != keep){
+			close(fds[i]);
+		}
+	}
+}
+
+/** Get transport type by its command line name
  * 
- * @param proc_count    Process count including parent process.
+ * @param name			Transport name: pipe / shm / seqpacket
  *
- * @return pointer to pipe fds array
+ * @return -1 on unknown name, TransportType on success
  */
-int* pipes_init(size_t proc_count){
-	size_t i, j;
-	size_t offset = proc_count - 1;
-	int* pipes = malloc(sizeof(int) * 2 * proc_count * (proc_count-1));
+int get_transport_type(const char* name){
+	int i;
 	
-	for (i = 0; i < proc_count; i++){
-		for (j = 0; j < proc_count; j++){
-			int tmp_fd[2];
-			
-			if (i == j){
-				continue;
-			}
-			
-			if (pipe(tmp_fd) < 0){
-				return (int*)NULL;
-			}
-			
-			if (set_nonblock(tmp_fd[0]) || set_nonblock(tmp_fd[1])){
-				return (int*)NULL;
-			}
-			pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_READ_TYPE] = tmp_fd[0];  /* READ */
-			pipes[j * offset * 2 + (j > i ? i : i - 1) * 2 + PIPE_WRITE_TYPE] = tmp_fd[1]; /* WRITE */
+	for (i = 0; i < TRANSPORT_COUNT; i++){
+		if (!strcmp(name, transports[i]->name)){
+			return i;
 		}
 	}
-	return pipes;
+	return -1;
+}
+
+/** Get flush policy by its command line name
+ * 
+ * @param name			Policy name: immediate / batch
+ *
+ * @return -1 on unknown name, FlushPolicy on success
+ */
+int get_flush_policy(const char* name){
+	if (!strcmp(name, "immediate")){
+		return FLUSH_IMMEDIATE;
+	}
+	if (!strcmp(name, "batch")){
+		return FLUSH_BATCH;
+	}
+	return -1;
+}
+
+/** Get barrier type by its command line name
+ * 
+ * @param name			Barrier name: all / tree
+ *
+ * @return -1 on unknown name, BarrierType on success
+ */
+int get_barrier_type(const char* name){
+	if (!strcmp(name, "all")){
+		return BARRIER_ALL;
+	}
+	if (!strcmp(name, "tree")){
+		return BARRIER_TREE;
+	}
+	return -1;
+}
+
+/** Parse count of command line option
+ * 
+ * @return -1 if value isn't a number in 1..max, count on success
+ */
+static int get_count(const char* value, long max){
+	char* end;
+	long count = strtol(value, &end, 10);
+	
+	if (*end || count < 1 || count > max){
+		return -1;
+	}
+	return count;
+}
+
+/** Get transfer window by its command line value
+ * 
+ * @param value			Count of transfers in flight: 1..MAX_TRANSFER_WINDOW
+ *
+ * @return -1 on invalid value, window on success
+ */
+int get_transfer_window(const char* value){
+	return get_count(value, MAX_TRANSFER_WINDOW);
+}
+
+/** Get transfer batch size by its command line value
+ * 
+ * @param value			Orders in one message: 1..MAX_TRANSFER_BATCH
+ *
+ * @return -1 on invalid value, batch size on success
+ */
+int get_transfer_batch(const char* value){
+	return get_count(value, MAX_TRANSFER_BATCH);
+}
+
+/** Get ACK mode by its command line name
+ * 
+ * @param name			ACK mode name: each / watermark
+ *
+ * @return -1 on unknown name, AckMode on success
+ */
+int get_ack_mode(const char* name){
+	if (!strcmp(name, "each")){
+		return ACK_EACH;
+	}
+	if (!strcmp(name, "watermark")){
+		return ACK_WATERMARK;
+	}
+	return -1;
+}
+
+/** Get receive_any() policy by its command line name
+ * 
+ * @param name			Policy name: first / round-robin / weighted / oldest
+ *
+ * @return -1 on unknown name, ReceivePolicy on success
+ */
+int get_receive_policy(const char* name){
+	if (!strcmp(name, "first")){
+		return RECEIVE_FIRST;
+	}
+	if (!strcmp(name, "round-robin")){
+		return RECEIVE_ROUND_ROBIN;
+	}
+	if (!strcmp(name, "weighted")){
+		return RECEIVE_WEIGHTED;
+	}
+	if (!strcmp(name, "oldest")){
+		return RECEIVE_OLDEST;
+	}
+	return -1;
+}
+
+/** Get lane mode by its command line name
+ * 
+ * @param name			Mode name: single / control
+ *
+ * @return -1 on unknown name, LaneMode on success
+ */
+int get_lane_mode(const char* name){
+	if (!strcmp(name, "single")){
+		return LANES_SINGLE;
+	}
+	if (!strcmp(name, "control")){
+		return LANES_CONTROL;
+	}
+	return -1;
+}
+
+/** Get credit window by its command line value
+ * 
+ * @param value			off, or bytes: MIN_CREDIT_WINDOW..MAX_CREDIT_WINDOW
+ *
+ * @return -1 on invalid value, 0 for off, window on success
+ */
+int get_credit_window(const char* value){
+	int window;
+	
+	if (!strcmp(value, "off")){
+		return 0;
+	}
+	window = get_count(value, MAX_CREDIT_WINDOW);
+	return window < MIN_CREDIT_WINDOW ? -1 : window;
+}
+
+/** Get pipe capacity by its command line value
+ * 
+ * @param value			default, or bytes: MIN_PIPE_SIZE..MAX_PIPE_SIZE
+ *
+ * @return -1 on invalid value, 0 for default, capacity on success
+ */
+int get_pipe_size(const char* value){
+	int size;
+	
+	if (!strcmp(value, "default")){
+		return 0;
+	}
+	size = get_count(value, MAX_PIPE_SIZE);
+	return size < MIN_PIPE_SIZE ? -1 : size;
+}
+
+/** Get pipe growth threshold by its command line value
+ * 
+ * @param value			off, or times pipe is found full between growths: 1..INT_MAX
+ *
+ * @return -1 on invalid value, 0 for off, threshold on success
+ */
+int get_pipe_grow(const char* value){
+	return strcmp(value, "off") ? get_count(value, INT_MAX) : 0;
+}
+
+/** Get count of children of current process in barrier tree
+ *
+ * Process i is the parent of 2i + 1 and 2i + 2, like in --fork-tree.
+ */
+static size_t tree_children_count(PipesCommunication* comm){
+	size_t first = 2 * comm->current_id + 1;
+	
+	if (first >= comm->active_ids){
+		return 0;
+	}
+	return first + 1 < comm->active_ids ? 2 : 1;
+}
+
+/** Wait for events of all children in barrier tree
+ *
+ * Nothing else can come meanwhile: the rest of processes wait for release,
+ * which needs our event, so receive_any() is enough.
+ * Events taken by the caller's own receive_any() are counted in comm->arrived.
+ */
+static void receive_tree_arrivals(PipesCommunication* comm){
+	Message msg;
+	
+	while (comm->arrived < tree_children_count(comm)){
+		while (receive_any(comm, &msg));
+		comm->arrived++;
+	}
+	comm->arrived = 0;
+}
+
+/** Send release of barrier to children in barrier tree
+ *
+ * @param type		STARTED / DONE
+ */
+static void send_tree_release(PipesCommunication* comm, MessageType type){
+	Message msg;
+	size_t i;
+	
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = type;
+    msg.s_header.s_local_time = get_physical_time();
+	msg.s_header.s_payload_len = 0;
+	
+	for (i = 2 * comm->current_id + 1; i <= 2 * comm->current_id + 2 && i < comm->active_ids; i++){
+		send_blocking(comm, i, &msg);
+	}
+}
+
+/** Open control sockets of channel broker
+ * 
+ * Pipes are not opened here: broker thread of parent opens every channel
+ * when its writer sends to it for the first time.
+ * 
+ * @param proc_count    Process count including parent process.
+ * @param transport		TRANSPORT_PIPE or TRANSPORT_SEQPACKET (socketpairs are used as pipes)
+ *
+ * @return pointer to control socket fds array
+ */
+int* pipes_init(size_t proc_count, TransportType transport){
+	return broker_init(proc_count);
 }
 
 /** Init PipesCommunication
  * 
- * @param pipes			Pointer to opened pipes fd
+ * @param transport		Transport type
+ * @param pipes			Pointer to control sockets of broker (NULL if shm is used)
+ * @param shm			Pointer to mapped shared rings (NULL if pipes are used)
+ * @param mailboxes		Pointer to mailboxes of all threads (NULL if processes are forked)
  * @param proc_count    Process count including parent process.
  * @param curr_proc		Current process local id
  *
  * @return pointer to PipesCommunication
  */
-PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id curr_proc, balance_t balance){
+PipesCommunication* communication_init(TransportType transport, int* pipes, ShmRegion* shm, Mailbox* mailboxes, size_t proc_count, local_id curr_proc, balance_t balance){
 	PipesCommunication* this = malloc(sizeof(PipesCommunication));;
-	size_t i, j;
+	struct epoll_event event;
+	size_t i;
 	size_t offset = proc_count - 1;
-	this->pipes = malloc(sizeof(int) * offset * 2);
 	this->total_ids = proc_count;
+	this->active_ids = proc_count;
+	this->time_base = 0;
 	this->current_id = curr_proc;
 	this->balance = balance;
 	
-	memcpy(this->pipes, pipes + curr_proc * 2 * offset, sizeof(int) * offset * 2);
-	
-	/* Close unnecessary fds */
+	this->ready = calloc(proc_count, sizeof(char));
+	this->buffers = calloc(proc_count, sizeof(ReadBuffer*));
+	this->out_buffers = calloc(proc_count, sizeof(WriteBuffer*));
+	this->send_stats = calloc(proc_count, sizeof(SendStats));
+	this->closed = calloc(proc_count, sizeof(char));
+	this->open_channels = 0;
+	this->wakeups = 0;
+	this->spurious_polls = 0;
+	this->reads = 0;
+	this->writes = 0;
+	this->flush_policy = FLUSH_IMMEDIATE;
+	this->barrier = BARRIER_ALL;
+	this->arrived = 0;
+	this->window = 1;
+	this->pending = NULL;
+	this->in_flight = 0;
+	this->next_seq = 0;
+	this->batch = 1;
+	this->batches = NULL;
+	this->batch_lens = NULL;
+	this->ack_mode = ACK_EACH;
+	this->settle = NULL;
+	this->marks = NULL;
+	this->stashes = calloc(proc_count, sizeof(Stash*));
+	this->parked = 0;
+	this->stashed = 0;
+	this->receive_policy = RECEIVE_FIRST;
+	this->scan_start = 0;
+	this->burst = 0;
+	this->weights = malloc(sizeof(size_t) * proc_count);
 	for (i = 0; i < proc_count; i++){
-		if (i == curr_proc){
-			continue;
+		this->weights[i] = 1;
+	}
+	this->receive_stats = calloc(proc_count, sizeof(ReceiveStats));
+	this->received = 0;
+	this->last_msg_from = -1;
+	this->lanes = LANES_SINGLE;
+	this->overtaken = 0;
+	this->credit_window = 0;
+	this->credits = NULL;
+	this->credit_wait = -1;
+	this->grants = 0;
+	this->pipe_size = 0;
+	this->parent_pipe_size = 0;
+	this->pipe_grow = 0;
+	this->pipe_stats = calloc(proc_count, sizeof(PipeStats));
+	
+	this->transport = transport;
+	this->ops = transports[transport];
+	
+	this->mailboxes = NULL;
+	this->queues = NULL;
+	this->broker_fd = -1;
+	
+	/* Shared rings are already mapped, nothing to close */
+	if (transport == TRANSPORT_SHM){
+		this->shm = shm;
+		this->pipes = NULL;
+		this->epoll_fd = -1;
+		return this;
+	}
+	
+	/* Mailboxes belong to all threads, each thread keeps only its queues */
+	if (transport == TRANSPORT_MAILBOX){
+		this->mailboxes = mailboxes;
+		this->queues = calloc(proc_count, sizeof(MailQueue));
+		this->shm = NULL;
+		this->pipes = NULL;
+		this->epoll_fd = -1;
+		return this;
+	}
+	
+	/* Gone reader must be a send error, not a signal killing the process */
+	signal(SIGPIPE, SIG_IGN);
+	
+	this->shm = NULL;
+	this->pipes = malloc(sizeof(int) * offset * 2);
+	for (i = 0; i < offset * 2; i++){
+		this->pipes[i] = -1;
+	}
+	this->broker_fd = pipes[curr_proc * 2 + 1];
+	
+	/* Close control sockets of other processes, parent keeps broker ends */
+	if (curr_proc != PARENT_ID){
+		close_all_but(pipes, proc_count * 2, this->broker_fd);
+	}
+	else{
+		for (i = 1; i < proc_count; i++){
+			close(pipes[i * 2 + 1]);
 		}
-		for (j = 0; j < proc_count; j++){
-			close(pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_READ_TYPE]);
-			close(pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_WRITE_TYPE]);
+	}
+	
+	/* Without broker processes see it gone, so their sends fail */
+	if (curr_proc == PARENT_ID && broker_start(pipes, proc_count, this->ops->packets)){
+		for (i = 0; i < proc_count; i++){
+			close(pipes[i * 2]);
 		}
 	}
 	free(pipes);
+	
+	/* Watch control socket, inbound pipes are added when broker hands them out */
+	this->epoll_fd = epoll_create1(0);
+	event.events = EPOLLIN;
+	event.data.u32 = curr_proc;
+	epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->broker_fd, &event);
+	this->open_channels = proc_count - 1;
 	return this;
 }
 
@@ -104,15 +440,177 @@ PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id c
  * @param comm		Pointer to PipesCommunication
  */
 void communication_destroy(PipesCommunication* comm){
-	size_t i;
-	for (i = 0; i < comm->total_ids - 1; i++){
-		close(comm->pipes[i * 2 + PIPE_READ_TYPE]);
-		close(comm->pipes[i * 2 + PIPE_WRITE_TYPE]);
+	size_t i, j;
+	
+	if (comm->transport == TRANSPORT_SHM){
+		shm_destroy(comm->shm);
+	}
+	else if (comm->transport == TRANSPORT_MAILBOX){
+		mailbox_clear(comm->queues, comm->total_ids);
+		free(comm->queues);
+	}
+	else{
+		for (i = 0; i < comm->total_ids - 1; i++){
+			close(comm->pipes[i * 2 + PIPE_READ_TYPE]);
+			close(comm->pipes[i * 2 + PIPE_WRITE_TYPE]);
+		}
+		close(comm->broker_fd);
+		close(comm->epoll_fd);
+		free(comm->pipes);
+	}
+	
+	for (i = 0; i < comm->total_ids; i++){
+		free(comm->buffers[i]);
+		free(comm->out_buffers[i]);
+	}
+	free(comm->buffers);
+	free(comm->out_buffers);
+	free(comm->send_stats);
+	free(comm->closed);
+	free(comm->pending);
+	if (comm->batches){
+		for (i = 0; i < comm->total_ids; i++){
+			free(comm->batches[i]);
+		}
+		free(comm->batches);
+		free(comm->batch_lens);
 	}
+	free(comm->settle);
+	free(comm->marks);
+	free(comm->credits);
+	free(comm->pipe_stats);
+	for (i = 0; i < comm->total_ids; i++){
+		if (comm->stashes[i]){
+			for (j = 0; j <= MESSAGE_TYPE_COUNT; j++){
+				while (comm->stashes[i]->first[j]){
+					StashNode* next = comm->stashes[i]->first[j]->next;
+					
+					free(comm->stashes[i]->first[j]);
+					comm->stashes[i]->first[j] = next;
+				}
+			}
+			free(comm->stashes[i]);
+		}
+	}
+	free(comm->stashes);
+	free(comm->weights);
+	free(comm->receive_stats);
+	free(comm->ready);
 	free(comm);
 }
 
+/** Set how sent messages are written to pipes
+ * 
+ * Messages collected so far are written out when switching to FLUSH_IMMEDIATE.
+ * Shared rings and sockets always write at once: rings need no syscalls and
+ * socket packets can't be merged.
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param policy	FLUSH_IMMEDIATE / FLUSH_BATCH
+ */
+void set_flush_policy(PipesCommunication* comm, FlushPolicy policy){
+	if (policy == FLUSH_IMMEDIATE){
+		ipc_flush(comm);
+	}
+	comm->flush_policy = comm->transport == TRANSPORT_PIPE ? policy : FLUSH_IMMEDIATE;
+}
+
+/** Set order in which receive_any() serves inbound channels
+ * 
+ * With RECEIVE_WEIGHTED the channel from PARENT_ID weighs as much as all
+ * other children: it carries orders and control for all of them.
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param policy	RECEIVE_FIRST / RECEIVE_ROUND_ROBIN / RECEIVE_WEIGHTED / RECEIVE_OLDEST
+ */
+void set_receive_policy(PipesCommunication* comm, ReceivePolicy policy){
+	comm->receive_policy = policy;
+	comm->scan_start = 0;
+	comm->burst = 0;
+	if (policy == RECEIVE_WEIGHTED && comm->total_ids > 3){
+		comm->weights[PARENT_ID] = comm->total_ids - 2;
+	}
+}
+
+/** Set count of transfers parent keeps in flight
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param window	1..MAX_TRANSFER_WINDOW, 1 waits for every ACK
+ *
+ * @return -1 on invalid window or if some transfers are in flight, 0 on success
+ */
+int set_transfer_window(PipesCommunication* comm, size_t window){
+	PendingTransfer* pending;
+	
+	if (window < 1 || window > MAX_TRANSFER_WINDOW || comm->in_flight){
+		return -1;
+	}
+	if (!(pending = calloc(window, sizeof(PendingTransfer)))){
+		return -1;
+	}
+	free(comm->pending);
+	comm->pending = pending;
+	comm->window = window;
+	return 0;
+}
+
+/** Set bytes a sender may have in channel which its receiver hasn't read yet
+ * 
+ * Receivers grant credit for what they read out of channels, on messages
+ * going back or by CREDIT messages. Senders write only what fits into the
+ * credit and otherwise wait for their own inbound channels. Must be the
+ * same in all processes and set before the first message. Shared rings
+ * and mailboxes have no credit: rings wait on their own and mailboxes
+ * are never full.
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param window	MIN_CREDIT_WINDOW..MAX_CREDIT_WINDOW, 0 turns credit off
+ *
+ * @return -1 on invalid window or if there is no memory, 0 on success
+ */
+int set_credit_window(PipesCommunication* comm, size_t window){
+	if (window && (window < MIN_CREDIT_WINDOW || window > MAX_CREDIT_WINDOW)){
+		return -1;
+	}
+	if (!window || (comm->transport != TRANSPORT_PIPE && comm->transport != TRANSPORT_SEQPACKET)){
+		comm->credit_window = 0;
+		return 0;
+	}
+	if (!comm->credits && !(comm->credits = calloc(comm->total_ids, sizeof(ChannelCredit)))){
+		return -1;
+	}
+	comm->credit_window = window;
+	return 0;
+}
+
+/** Set capacity of pipes opened from now on, and how they grow
+ * 
+ * Every process sizes pipes it writes to, pipes to PARENT_ID may be
+ * given more as all children report to it. A pipe found full grow
+ * times is doubled, up to MAX_PIPE_SIZE. Sockets, shared rings and
+ * mailboxes aren't pipes and keep their size.
+ * 
+ * @param comm			Pointer to PipesCommunication
+ * @param size			MIN_PIPE_SIZE..MAX_PIPE_SIZE, 0 keeps the kernel default
+ * @param parent_size	The same for pipes to PARENT_ID, 0 makes it size
+ * @param grow			Times pipe is found full between growths, 0 never grows it
+ *
+ * @return -1 on invalid size, 0 on success
+ */
+int set_pipe_size(PipesCommunication* comm, size_t size, size_t parent_size, size_t grow){
+	if ((size && (size < MIN_PIPE_SIZE || size > MAX_PIPE_SIZE)) || (parent_size && (parent_size < MIN_PIPE_SIZE || parent_size > MAX_PIPE_SIZE))){
+		return -1;
+	}
+	comm->pipe_size = size;
+	comm->parent_pipe_size = parent_size;
+	comm->pipe_grow = grow;
+	return 0;
+}
+
 /** Send event (STARTED / DONE) message to all processes
+ * 
+ * With tree barrier it is sent to the parent in barrier tree
+ * once events of the whole subtree have come.
  * 
  * @param comm		Pointer to PipesCommunication
  * @param type		Message type: STARTED / DONE
@@ -124,10 +622,14 @@ int send_all_proc_event_msg(PipesCommunication* comm, MessageType type){
 	uint16_t length = 0;
 	char buf[MAX_PAYLOAD_LEN];
 	
+	if (comm->barrier == BARRIER_TREE){
+		receive_tree_arrivals(comm);
+	}
+	
 	msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = type;
     msg.s_header.s_local_time = get_physical_time();
-	
+
 	switch (type){
         case STARTED:
 			length = snprintf(buf, MAX_PAYLOAD_LEN, log_started_fmt, get_physical_time(), comm->current_id, getpid(), getppid(), comm->balance);
@@ -138,15 +640,17 @@ int send_all_proc_event_msg(PipesCommunication* comm, MessageType type){
 		default:
 			return -1;
 	}
-		
+	
 	if (length <= 0){
 		return -2;
 	}
 	
 	msg.s_header.s_payload_len = length;
     memcpy(msg.s_payload, buf, sizeof(char) * length);
-	
-	send_multicast(comm, &msg);
+
+	if (comm->barrier == BARRIER_TREE ? send_blocking(comm, (comm->current_id - 1) / 2, &msg) : send_multicast(comm, &msg)){
+		return -3;
+	}
 	
 	type == STARTED ? log_started(comm->current_id, comm->balance) : log_done(comm->current_id, comm->balance);
 	
@@ -171,36 +675,151 @@ void send_all_stop_msg(PipesCommunication* comm){
  * 
  * @param comm		Pointer to PipesCommunication
  * @param dst 		Destination local_id
- * @param order 	Transfer Order information
+ * @param order 	Transfer Order information with its sequence number
  */
-void send_transfer_msg(PipesCommunication* comm, local_id dst, TransferOrder* order){
+void send_transfer_msg(PipesCommunication* comm, local_id dst, SeqTransferOrder* order){
 	Message msg;
 	msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = TRANSFER;
     msg.s_header.s_local_time = get_physical_time();
-	msg.s_header.s_payload_len = sizeof(TransferOrder);
+	msg.s_header.s_payload_len = sizeof(SeqTransferOrder);
 	
 	memcpy(msg.s_payload, order, msg.s_header.s_payload_len);
 	
-	while (send(comm, dst, &msg) < 0);
+	send_blocking(comm, dst, &msg);
+}
+
+/** Send TRANSFER_BATCH message
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param dst 		Destination local_id
+ * @param seq 		Sequence number of the batch
+ * @param orders 	Orders of one source or one destination
+ * @param count 	Orders count, up to MAX_TRANSFER_BATCH
+ */
+void send_transfer_batch_msg(PipesCommunication* comm, local_id dst, uint16_t seq, const TransferOrder* orders, size_t count){
+	Message msg;
+	TransferBatch* batch = (TransferBatch*) msg.s_payload;
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = TRANSFER_BATCH;
+    msg.s_header.s_local_time = get_physical_time();
+	msg.s_header.s_payload_len = sizeof(TransferBatch) + sizeof(TransferOrder) * count;
+	
+	batch->s_seq = seq;
+	memcpy(batch->s_orders, orders, sizeof(TransferOrder) * count);
+	
+	send_blocking(comm, dst, &msg);
 }
 
 /** Send ACK message
  * 
  * @param comm		Pointer to PipesCommunication
  * @param dst 		Destination local_id
+ * @param seq 		Sequence number of acknowledged transfer or batch
+ * @param count 	Orders of it done by the sender
  */
-void send_ack_msg(PipesCommunication* comm, local_id dst){
+void send_ack_msg(PipesCommunication* comm, local_id dst, uint16_t seq, uint16_t count){
 	Message msg;
+	TransferAck ack;
 	msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = ACK;
     msg.s_header.s_local_time = get_physical_time();
-	msg.s_header.s_payload_len = 0;
+	msg.s_header.s_payload_len = sizeof(TransferAck);
+	
+	ack.s_seq = seq;
+	ack.s_count = count;
+	memcpy(msg.s_payload, &ack, msg.s_header.s_payload_len);
+	
+	send_blocking(comm, dst, &msg);
+}
+
+/** Send WATERMARK message
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param dst 		Destination local_id
+ * @param settled 	Orders to current process with sequence numbers below are done
+ */
+void send_watermark_msg(PipesCommunication* comm, local_id dst, uint16_t settled){
+	Message msg;
+	TransferWatermark watermark;
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = WATERMARK;
+    msg.s_header.s_local_time = get_physical_time();
+	msg.s_header.s_payload_len = sizeof(TransferWatermark);
+	
+	watermark.s_dst = comm->current_id;
+	watermark.s_settled = settled;
+	memcpy(msg.s_payload, &watermark, msg.s_header.s_payload_len);
+	
+	send_blocking(comm, dst, &msg);
+}
+
+/** Send WATERMARK_REQUEST message
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param dst 		Destination local_id
+ * @param target 	Watermark to send once orders below it are done
+ */
+void send_watermark_request_msg(PipesCommunication* comm, local_id dst, uint16_t target){
+	Message msg;
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = WATERMARK_REQUEST;
+    msg.s_header.s_local_time = get_physical_time();
+	msg.s_header.s_payload_len = sizeof(uint16_t);
+	
+	memcpy(msg.s_payload, &target, msg.s_header.s_payload_len);
 	
-	while (send(comm, dst, &msg) < 0);
+	send_blocking(comm, dst, &msg);
 }
 
+/** Write value as varint: 7 bits per byte, low bits first, high bit set if more follow
+ *
+ * @return bytes written, 5 at most
+ */
+static size_t put_varint(uint8_t* data, uint32_t value){
+	size_t len = 0;
+	
+	while (value >= 0x80){
+		data[len++] = (uint8_t) (value | 0x80);
+		value >>= 7;
+	}
+	data[len++] = (uint8_t) value;
+	return len;
+}
+
+/** Read varint written by put_varint()
+ *
+ * @param pos		Position to read at, moved past the varint
+ *
+ * @return -1 if varint is cut off or too long, 0 on success
+ */
+static int get_varint(const uint8_t* data, size_t len, size_t* pos, uint32_t* value){
+	int shift;
+	
+	*value = 0;
+	for (shift = 0; shift < 32 && *pos < len; shift += 7){
+		uint8_t byte = data[(*pos)++];
+		
+		*value |= (uint32_t) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Signed delta as varint: small values of either sign take one byte */
+#define ZIGZAG(x) (((uint32_t) (x) << 1) ^ (uint32_t) -((x) < 0))
+#define UNZIGZAG(x) ((int32_t) ((x) >> 1) ^ -(int32_t) ((x) & 1))
+
 /** Send Balance History
+ * 
+ * Only times the state has changed at go, entry t holding the state at
+ * time t. Payload is s_id, then varint history length, then per changed
+ * entry varints of time, balance and pending balance, each as delta from
+ * the entry before. The first entry is delta from time 0 and zero state.
+ * Nothing in it is bounded by MAX_T; all of MAX_T + 1 entries changing
+ * take less than MAX_PAYLOAD_LEN.
  * 
  * @param comm		Pointer to PipesCommunication
  * @param dst 		Destination local_id
@@ -208,17 +827,116 @@ void send_ack_msg(PipesCommunication* comm, local_id dst){
  */
 void send_balance_history(PipesCommunication* comm, local_id dst, BalanceHistory* history){
 	Message msg;
+	uint8_t* data = (uint8_t*) msg.s_payload;
+	BalanceState prev = {0, 0, 0};
+	size_t len = 0;
+	size_t t;
+	
 	msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = BALANCE_HISTORY;
     msg.s_header.s_local_time = get_physical_time();
-	msg.s_header.s_payload_len = sizeof(BalanceHistory);
+
+	data[len++] = history->s_id;
+	len += put_varint(data + len, history->s_history_len);
+	for (t = 0; t < history->s_history_len; t++){
+		const BalanceState* state = &history->s_history[t];
+		
+		if (t && state->s_balance == prev.s_balance && state->s_balance_pending_in == prev.s_balance_pending_in){
+			continue;
+		}
+		len += put_varint(data + len, t - prev.s_time);
+		len += put_varint(data + len, ZIGZAG((int32_t) state->s_balance - prev.s_balance));
+		len += put_varint(data + len, ZIGZAG((int32_t) state->s_balance_pending_in - prev.s_balance_pending_in));
+		prev = *state;
+		prev.s_time = t;
+	}
+	msg.s_header.s_payload_len = len;
+	
+	send_blocking(comm, dst, &msg);
+}
+
+/** Expand Balance History sent by send_balance_history()
+ * 
+ * Times between changed entries get the state of the entry before.
+ * Times past MAX_T don't fit into BalanceHistory and are dropped.
+ * 
+ * @param msg		BALANCE_HISTORY message
+ * @param history	Where to store Balance History
+ *
+ * @return -1 on broken payload, 0 on success
+ */
+int read_balance_history(const Message* msg, BalanceHistory* history){
+	const uint8_t* data = (const uint8_t*) msg->s_payload;
+	size_t len = msg->s_header.s_payload_len;
+	size_t pos = 1;
+	BalanceState state = {0, 0, 0};
+	uint32_t history_len, delta;
+	uint32_t time = 0, t = 0;
+	int entries = 0;
+	
+	if (!len || get_varint(data, len, &pos, &history_len)){
+		return -1;
+	}
+	history->s_id = data[0];
+	history->s_history_len = history_len < MAX_T ? history_len : MAX_T;
+	
+	while (pos < len){
+		if (get_varint(data, len, &pos, &delta)){
+			return -1;
+		}
+		/* The first entry is time 0, others go strictly forward */
+		if ((entries ? !delta : delta != 0) || delta >= history_len - time){
+			return -1;
+		}
+		time += delta;
+		/* Times since the previous entry keep its state */
+		for (; t < time && t < history->s_history_len; t++){
+			history->s_history[t] = state;
+			history->s_history[t].s_time = t;
+		}
+		if (get_varint(data, len, &pos, &delta)){
+			return -1;
+		}
+		state.s_balance = (int32_t) state.s_balance + UNZIGZAG(delta);
+		if (get_varint(data, len, &pos, &delta)){
+			return -1;
+		}
+		state.s_balance_pending_in = (int32_t) state.s_balance_pending_in + UNZIGZAG(delta);
+		entries++;
+	}
+	if (history_len && !entries){
+		return -1;
+	}
+	for (; t < history->s_history_len; t++){
+		history->s_history[t] = state;
+		history->s_history[t].s_time = t;
+	}
+	return 0;
+}
+
+/** Send RESET message
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param dst 		Destination local_id
+ * @param order		Scenario to start
+ */
+void send_reset_msg(PipesCommunication* comm, local_id dst, ResetOrder* order){
+	Message msg;
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = RESET;
+    msg.s_header.s_local_time = get_physical_time();
+	msg.s_header.s_payload_len = sizeof(ResetOrder);
 	
-	memcpy(msg.s_payload, history, msg.s_header.s_payload_len);
+	memcpy(msg.s_payload, order, msg.s_header.s_payload_len);
 	
-	while (send(comm, dst, &msg) < 0);
+	send_blocking(comm, dst, &msg);
 }
 
 /** Receive all messages
+ * 
+ * With tree barrier PARENT_ID receives events of its children in barrier tree,
+ * other processes receive release from their parent. Release is passed down.
+ * Messages of other types coming meanwhile are parked for later receives.
  * 
  * @param comm		Pointer to PipesCommunication
  * @param type		Message Type
@@ -227,11 +945,22 @@ void receive_all_msgs(PipesCommunication* comm, MessageType type){
 	Message msg;
 	local_id i;
 	
-	for (i = 1; i < comm->total_ids; i++){
-		if (i == comm->current_id){
-			continue;
+	if (comm->barrier == BARRIER_TREE){
+		if (comm->current_id == PARENT_ID){
+			receive_tree_arrivals(comm);
+		}
+		else{
+			while (receive_type(comm, (comm->current_id - 1) / 2, type, &msg) < 0);
+		}
+		send_tree_release(comm, type);
+	}
+	else{
+		for (i = 1; i < comm->active_ids; i++){
+			if (i == comm->current_id){
+				continue;
+			}
+			while (receive_type(comm, i, type, &msg) < 0);
 		}
-		while (receive(comm, i, &msg) < 0);
 	}
 	
 	switch (type){
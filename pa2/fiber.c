@@ -0,0 +1,175 @@
+/**
+ * @file     fiber.c
+ * @Author   @seniorkot
+ * @date     May, 2018
+ * @brief    Round-robin scheduler running processes as fibers of one thread
+ */
+
+#define _GNU_SOURCE
+
+#include "fiber.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+typedef struct{
+	ucontext_t ctx;
+	char* stack;
+	void* arg;
+	void* const* wait;		/* Fiber is blocked until *wait is not NULL */
+	int done;
+	uint64_t locals[FIBER_LOCAL_COUNT];	/* Values of fiber-local variables while fiber is switched out */
+} Fiber;
+
+/* Scheduler of the thread calling fiber_run(). Only one can run at a time. */
+static struct{
+	Fiber* fibers;
+	size_t count;
+	int current;			/* Running fiber, -1 in scheduler */
+	ucontext_t ctx;			/* Scheduler context fibers switch back to */
+	void* (*func)(void*);
+	void* locals[FIBER_LOCAL_COUNT];
+	size_t local_sizes[FIBER_LOCAL_COUNT];
+	size_t local_count;
+} sched = {NULL, 0, -1};
+
+/** Entry point of every fiber */
+static void fiber_start(){
+	Fiber* fiber = &sched.fibers[sched.current];
+	
+	sched.func(fiber->arg);
+	fiber->done = 1;
+	/* Returning resumes uc_link, i.e. the scheduler */
+}
+
+/** Run fiber until it blocks or returns, with its own values of fiber-local variables */
+static void switch_to(int id){
+	Fiber* fiber = &sched.fibers[id];
+	size_t i;
+	
+	for (i = 0; i < sched.local_count; i++){
+		memcpy(sched.locals[i], &fiber->locals[i], sched.local_sizes[i]);
+	}
+	fiber->wait = NULL;
+	sched.current = id;
+	swapcontext(&sched.ctx, &fiber->ctx);
+	sched.current = -1;
+	for (i = 0; i < sched.local_count; i++){
+		memcpy(&fiber->locals[i], sched.locals[i], sched.local_sizes[i]);
+	}
+}
+
+/** Free stacks of fibers */
+static void free_fibers(){
+	size_t i;
+	
+	for (i = 0; i < sched.count; i++){
+		munmap(sched.fibers[i].stack, FIBER_STACK_SIZE);
+	}
+	free(sched.fibers);
+	sched.fibers = NULL;
+	sched.count = 0;
+}
+
+/** Make variable private to every fiber
+ *
+ * Its value is saved when a fiber is switched out and restored when it is switched in.
+ * Every fiber starts with the value the variable has when fiber_run() is called.
+ *
+ * @param var		Pointer to variable
+ * @param size		Size of variable, FIBER_LOCAL_SIZE at most
+ *
+ * @return -1 if there are too many variables or variable is too big, 0 on success
+ */
+int fiber_local(void* var, size_t size){
+	if (sched.local_count == FIBER_LOCAL_COUNT || size > FIBER_LOCAL_SIZE){
+		return -1;
+	}
+	sched.locals[sched.local_count] = var;
+	sched.local_sizes[sched.local_count] = size;
+	sched.local_count++;
+	return 0;
+}
+
+/** Run func for every argument as a fiber, return when all fibers have returned
+ *
+ * Fibers are switched in id order and only when running fiber blocks in fiber_wait(),
+ * so a run is fully deterministic. Blocked fibers are skipped until what they wait for comes.
+ *
+ * @param count		Count of fibers
+ * @param func		Fiber function
+ * @param args		Array of count arguments, pointer to one is passed to func
+ * @param arg_size	Size of one argument
+ *
+ * @return -1 on stack allocation error, -2 if all fibers are blocked, 0 on success
+ */
+int fiber_run(size_t count, void* (*func)(void*), void* args, size_t arg_size){
+	size_t i, j, alive = count;
+	
+	sched.fibers = calloc(count, sizeof(Fiber));
+	sched.count = count;
+	sched.func = func;
+	for (i = 0; i < count; i++){
+		Fiber* fiber = &sched.fibers[i];
+		
+		fiber->stack = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (fiber->stack == MAP_FAILED){
+			sched.count = i;
+			free_fibers();
+			return -1;
+		}
+		fiber->arg = (char*) args + i * arg_size;
+		for (j = 0; j < sched.local_count; j++){
+			memcpy(&fiber->locals[j], sched.locals[j], sched.local_sizes[j]);
+		}
+		getcontext(&fiber->ctx);
+		fiber->ctx.uc_stack.ss_sp = fiber->stack;
+		fiber->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+		fiber->ctx.uc_link = &sched.ctx;
+		makecontext(&fiber->ctx, fiber_start, 0);
+	}
+	
+	while (alive){
+		int progress = 0;
+		
+		for (i = 0; i < count; i++){
+			Fiber* fiber = &sched.fibers[i];
+			
+			if (fiber->done || (fiber->wait && !__atomic_load_n(fiber->wait, __ATOMIC_ACQUIRE))){
+				continue;
+			}
+			switch_to(i);
+			alive -= fiber->done;
+			progress = 1;
+		}
+		/* Nobody can send a message anymore */
+		if (!progress){
+			free_fibers();
+			return -2;
+		}
+	}
+	free_fibers();
+	return 0;
+}
+
+/** Get id of running fiber
+ *
+ * @return index of fiber in fiber_run() arguments, -1 if caller isn't a fiber
+ */
+int fiber_current(){
+	return sched.current;
+}
+
+/** Block running fiber until *ptr is not NULL and switch to the next runnable one
+ *
+ * @param ptr		Pointer that other fibers make not NULL, e.g. mailbox head
+ */
+void fiber_wait(void* const* ptr){
+	Fiber* fiber = &sched.fibers[sched.current];
+	
+	fiber->wait = ptr;
+	swapcontext(&fiber->ctx, &sched.ctx);
+}
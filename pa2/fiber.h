@@ -0,0 +1,25 @@
+/**
+ * @file     fiber.h
+ * @Author   @seniorkot
+ * @date     May, 2018
+ * @brief    Header file for user-space scheduler of fibers
+ */
+
+#ifndef __IFMO_DISTRIBUTED_CLASS_FIBER__H
+#define __IFMO_DISTRIBUTED_CLASS_FIBER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	FIBER_STACK_SIZE = 1024 * 1024,	/* Reserved only, pages are taken on first touch */
+	FIBER_LOCAL_COUNT = 4,			/* Variables that can be made private to fibers */
+	FIBER_LOCAL_SIZE = sizeof(uint64_t)
+};
+
+int fiber_local(void* var, size_t size);
+int fiber_run(size_t count, void* (*func)(void*), void* args, size_t arg_size);
+int fiber_current();
+void fiber_wait(void* const* ptr);
+
+#endif
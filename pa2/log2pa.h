@@ -17,6 +17,7 @@ void log_init();
 void log_destroy();
 
 void log_pipes(PipesCommunication* comm);
+void log_poll_stats(PipesCommunication* comm);
 
 void log_started(local_id id, balance_t balance);
 void log_received_all_started(local_id id);
@@ -4,136 +4,544 @@
  * @date     May, 2018
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include "log2pa.h"
 #include "communication.h"
 #include "banking.h"
+#include "fiber.h"
 
-int get_proc_count(int argc, char** argv);
+const char* get_option(int* argc, char** argv, const char* option, const char* value);
+int get_proc_count(int argc, char** argv, int balances);
 balance_t get_proc_balance(local_id proc_id, char** argv);
 
-int do_parent_work(PipesCommunication* comm);
+/* Arguments of process running as thread */
+typedef struct{
+	Mailbox* mailboxes;
+	size_t proc_count;
+	local_id id;
+	balance_t balance;
+	int flush;
+	int barrier;
+	int window;
+	int batch;
+	int ack;
+	int receive;
+	int lanes;
+	int credit;
+	int pipe_size;
+	int parent_pipe_size;
+	int pipe_grow;
+	FILE* pool;
+} ThreadArgs;
+
+/* One run of pool mode */
+typedef struct{
+	local_id proc_count;
+	balance_t balances[MAX_PROCESS_COUNT];
+	size_t transfers_count;
+	size_t transfers_size;		/* Allocated orders */
+	TransferOrder* transfers;	/* bank_robbery() is done if there are none */
+} Scenario;
+
+local_id fork_children(size_t proc_count, int tree, pid_t* children, size_t* count);
+int run_threads(int proc_count, int fibers, int flush, int barrier, int window, int batch, int ack, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow, FILE* pool, char** argv);
+void* thread_main(void* arg);
+void do_work(PipesCommunication* comm, int flush, int barrier, int window, int batch, int ack, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow, FILE* pool);
+
+int run_pool(PipesCommunication* comm, FILE* pool);
+int serve_pool(PipesCommunication* comm);
+int parse_scenario(char* line, size_t pool_size, Scenario* scenario);
+
+int do_parent_work(PipesCommunication* comm, const Scenario* scenario);
 int do_child_work(PipesCommunication* comm);
 
 int do_transfer(PipesCommunication* comm, Message* msg, BalanceState* state, BalanceHistory* history);
-void update_history(BalanceState* state, BalanceHistory* history, balance_t amount);
+int do_transfer_batch(PipesCommunication* comm, Message* msg, BalanceState* state, BalanceHistory* history);
+void update_history(PipesCommunication* comm, BalanceState* state, BalanceHistory* history, balance_t amount);
 
 /**
- * @return -1 on invalid arguments, -2 on fork error, 0 on success
+ * @return -1 on invalid arguments, -2 on fork error, -3 on channels init error, 0 on success
  */
 int main(int argc, char** argv){
 	size_t i;
 	int proc_count;
-	int* pipes;
+	int threads;
+	int fibers;
+	int fork_tree;
+	int transport;
+	int flush;
+	int barrier;
+	int window;
+	int batch;
+	int ack;
+	int receive;
+	int lanes;
+	int credit;
+	int pipe_size;
+	int parent_pipe_size;
+	int pipe_grow;
+	const char* pool_name;
+	FILE* pool = NULL;
+	int* pipes = NULL;
+	ShmRegion* shm = NULL;
 	pid_t* children;
-	pid_t fork_id;
+	size_t children_count;
 	local_id current_proc_id;
 	PipesCommunication* comm;
 	
 	/* Check args */
-	if (argc < 4 || (proc_count = get_proc_count(argc, argv)) == -1){
-		fprintf(stderr, "Usage: %s -p X y1 y2 ... yX\n", argv[0]);
+	threads = get_option(&argc, argv, "--threads", NULL) != NULL;
+	fibers = get_option(&argc, argv, "--fibers", NULL) != NULL;
+	fork_tree = get_option(&argc, argv, "--fork-tree", NULL) != NULL;
+	transport = get_transport_type(get_option(&argc, argv, "--transport=", threads || fibers ? "mailbox" : "pipe"));
+	flush = get_flush_policy(get_option(&argc, argv, "--flush=", "immediate"));
+	barrier = get_barrier_type(get_option(&argc, argv, "--barrier=", "all"));
+	window = get_transfer_window(get_option(&argc, argv, "--window=", "1"));
+	batch = get_transfer_batch(get_option(&argc, argv, "--batch=", "1"));
+	ack = get_ack_mode(get_option(&argc, argv, "--ack=", "each"));
+	receive = get_receive_policy(get_option(&argc, argv, "--receive=", "first"));
+	lanes = get_lane_mode(get_option(&argc, argv, "--lanes=", "single"));
+	credit = get_credit_window(get_option(&argc, argv, "--credit=", "off"));
+	pipe_size = get_pipe_size(get_option(&argc, argv, "--pipe-size=", "default"));
+	parent_pipe_size = get_pipe_size(get_option(&argc, argv, "--parent-pipe-size=", "default"));
+	pipe_grow = get_pipe_grow(get_option(&argc, argv, "--pipe-grow=", "off"));
+	pool_name = get_option(&argc, argv, "--pool=", NULL);
+	if (transport == -1 || flush == -1 || barrier == -1 || window == -1 || batch == -1 || ack == -1 || receive == -1 || lanes == -1 || credit == -1 || pipe_size == -1 || parent_pipe_size == -1 || pipe_grow == -1 || (threads && fibers) || (threads || fibers) != (transport == TRANSPORT_MAILBOX)
+			|| argc < 3 || (proc_count = get_proc_count(argc, argv, pool_name == NULL)) == -1){
+		fprintf(stderr, "Usage: %s [--threads | --fibers | --transport=pipe|shm|seqpacket] [--flush=immediate|batch] [--barrier=all|tree] [--window=N] [--batch=N] [--ack=each|watermark] [--receive=first|round-robin|weighted|oldest] [--lanes=single|control] [--credit=off|BYTES] [--pipe-size=default|BYTES] [--parent-pipe-size=default|BYTES] [--pipe-grow=off|N] [--fork-tree] -p X y1 y2 ... yX\n"
+				"       %s [options] --pool=FILE|- -p X\n", argv[0], argv[0]);
+		return -1;
+	}
+	
+	/* Scenarios are read by parent only, children get them by RESET messages */
+	if (pool_name && !(pool = strcmp(pool_name, "-") ? fopen(pool_name, "r") : stdin)){
+		perror(pool_name);
 		return -1;
 	}
 	
 	/* Initialize log files */
 	log_init();
 	
+	/* Run processes as threads or fibers of this one */
+	if (threads || fibers){
+		return run_threads(proc_count, fibers, flush, barrier, window, batch, ack, receive, lanes, credit, pipe_size, parent_pipe_size, pipe_grow, pool, argv);
+	}
+	
 	/* Allocate memory for children */
 	children = malloc(sizeof(pid_t) * proc_count);
 	
-	/* Open pipes for all processes */
-	pipes = pipes_init(proc_count + 1);
+	/* Open pipes or map shared rings for all processes */
+	if (transport == TRANSPORT_SHM){
+		shm = shm_init(proc_count + 1);
+	}
+	else{
+		pipes = pipes_init(proc_count + 1, transport);
+	}
+	if (pipes == NULL && shm == NULL){
+		return -3;
+	}
 	
 	/* Create children processes */
-	for (i = 0; i < proc_count; i++){
-		fork_id = fork();
-		if (fork_id < 0){
-			return -2;
+	if ((current_proc_id = fork_children(proc_count, fork_tree, children, &children_count)) < 0){
+		return -2;
+	}
+	
+	/* Set pipe fds to process params */
+	comm = communication_init(transport, pipes, shm, NULL, proc_count + 1, current_proc_id, pool ? 0 : get_proc_balance(current_proc_id, argv));
+	do_work(comm, flush, barrier, window, batch, ack, receive, lanes, credit, pipe_size, parent_pipe_size, pipe_grow, pool);
+	
+	/* Waiting for children forked by this process */
+	for (i = 0; i < children_count; i++){
+		waitpid(children[i], NULL, 0);
+	}
+	
+	/* Finish work */
+	log_poll_stats(comm);
+	log_destroy();
+	communication_destroy(comm);
+	free(children);
+	return 0;
+}
+
+/** Fork child processes
+ *
+ * Serially the parent forks all children. As a tree process i forks
+ * 2i + 1 and 2i + 2, so forks of one level run in parallel and startup
+ * grows with log of process count. Every process waits for its own children.
+ *
+ * @param proc_count	Count of child processes
+ * @param tree			Fork as a binary tree
+ * @param children		Where to store pids of children forked by current process
+ * @param count			Where to store count of them
+ *
+ * @return -1 on fork error, local id of current process otherwise
+ */
+local_id fork_children(size_t proc_count, int tree, pid_t* children, size_t* count){
+	local_id id = PARENT_ID;
+	size_t next = 1;
+	size_t last = tree ? 2 : proc_count;
+	
+	*count = 0;
+	while (next <= last && next <= proc_count){
+		pid_t pid = fork();
+		
+		if (pid < 0){
+			return -1;
 		}
-		else if (!fork_id){
-			free(children);
-			break;
+		if (pid){
+			children[(*count)++] = pid;
+			next++;
+			continue;
 		}
-		children[i] = fork_id;
+		
+		id = next;
+		*count = 0;
+		next = 2 * id + 1;
+		last = tree ? next + 1 : 0;
 	}
+	return id;
+}
+
+/** Run every process as a thread sharing one address space
+ *
+ * Children get threads of their own, parent work is done by the main thread.
+ * With fibers all processes are fibers of the main thread, switched when
+ * their mailbox is empty. Messages go through mailboxes instead of pipes.
+ *
+ * @param proc_count	Count of child processes
+ * @param fibers		Run processes as fibers instead of threads
+ * @param flush			Flush policy
+ * @param barrier		Barrier type of STARTED / DONE
+ * @param window		Transfers parent keeps in flight
+ * @param batch			Orders of one source parent sends in one message
+ * @param ack			ACK mode of transfers
+ * @param receive		Order in which receive_any() serves channels
+ * @param lanes			Take control messages ahead of others
+ * @param credit		Credit window of channels, 0 for none
+ * @param pipe_size		Capacity of pipes, 0 for the kernel default
+ * @param parent_pipe_size	Capacity of pipes to parent, 0 for pipe_size
+ * @param pipe_grow		Times pipe is found full before it is doubled, 0 for never
+ * @param pool			Scenarios of pool mode, NULL to run once
+ * @param argv			Double char array containing command line arguments.
+ *
+ * @return -2 on thread creation error or fibers deadlock, -3 on mailboxes init error, 0 on success
+ */
+int run_threads(int proc_count, int fibers, int flush, int barrier, int window, int batch, int ack, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow, FILE* pool, char** argv){
+	pthread_t* threads = malloc(sizeof(pthread_t) * proc_count);
+	ThreadArgs* args = malloc(sizeof(ThreadArgs) * (proc_count + 1));
+	Mailbox* mailboxes = mailbox_init(proc_count + 1);
+	local_id i;
+	int retval = 0;
 	
-	/* Set current process id */
-	if (!fork_id){
-		current_proc_id = i + 1;
-	}
-	else{
-		current_proc_id = PARENT_ID;
+	if (mailboxes == NULL){
+		return -3;
 	}
 	
-	/* Set pipe fds to process params */
-	comm = communication_init(pipes, proc_count + 1, current_proc_id, get_proc_balance(current_proc_id, argv));
-	log_pipes(comm);
+	for (i = 0; i <= proc_count; i++){
+		args[i].mailboxes = mailboxes;
+		args[i].proc_count = proc_count + 1;
+		args[i].id = i;
+		args[i].balance = pool ? 0 : get_proc_balance(i, argv);
+		args[i].flush = flush;
+		args[i].barrier = barrier;
+		args[i].window = window;
+		args[i].batch = batch;
+		args[i].ack = ack;
+		args[i].receive = receive;
+		args[i].lanes = lanes;
+		args[i].credit = credit;
+		args[i].pipe_size = pipe_size;
+		args[i].parent_pipe_size = parent_pipe_size;
+		args[i].pipe_grow = pipe_grow;
+		args[i].pool = pool;
+	}
 	
-	/* Do process work */
-	if (current_proc_id == PARENT_ID){
-		do_parent_work(comm);
+	if (fibers){
+		retval = fiber_run(proc_count + 1, thread_main, args, sizeof(ThreadArgs)) ? -2 : 0;
 	}
 	else{
-		do_child_work(comm);
-	}
-	
-	/* Waiting for all children if parent process */
-	if (current_proc_id == PARENT_ID){
+		for (i = 1; i <= proc_count; i++){
+			if (pthread_create(&threads[i - 1], NULL, thread_main, &args[i])){
+				return -2;
+			}
+		}
+		
+		thread_main(&args[PARENT_ID]);
+		
+		/* Waiting for all children */
 		for (i = 0; i < proc_count; i++){
-			waitpid(children[i], NULL, 0);
+			pthread_join(threads[i], NULL);
 		}
 	}
 	
 	/* Finish work */
 	log_destroy();
+	mailbox_destroy(mailboxes, proc_count + 1);
+	free(args);
+	free(threads);
+	return retval;
+}
+
+/** Run process work in its own thread or fiber
+ *
+ * @param arg		Pointer to ThreadArgs
+ *
+ * @return NULL
+ */
+void* thread_main(void* arg){
+	ThreadArgs* args = (ThreadArgs*) arg;
+	PipesCommunication* comm;
+	
+	comm = communication_init(TRANSPORT_MAILBOX, NULL, NULL, args->mailboxes, args->proc_count, args->id, args->balance);
+	do_work(comm, args->flush, args->barrier, args->window, args->batch, args->ack, args->receive, args->lanes, args->credit, args->pipe_size, args->parent_pipe_size, args->pipe_grow, args->pool);
+	log_poll_stats(comm);
 	communication_destroy(comm);
-	return 0;
+	return NULL;
 }
 
-/** Do parent process work (Receive messages, payload, print history)
+/** Do work of parent or child process
+ *
+ * @param comm		Pointer to PipesCommunication
+ * @param flush		Flush policy
+ * @param barrier	Barrier type of STARTED / DONE
+ * @param window	Transfers parent keeps in flight
+ * @param batch		Orders of one source parent sends in one message
+ * @param ack		ACK mode of transfers
+ * @param receive	Order in which receive_any() serves channels
+ * @param lanes		Take control messages ahead of others
+ * @param credit	Credit window of channels, 0 for none
+ * @param pipe_size	Capacity of pipes, 0 for the kernel default
+ * @param parent_pipe_size	Capacity of pipes to parent, 0 for pipe_size
+ * @param pipe_grow	Times pipe is found full before it is doubled, 0 for never
+ * @param pool		Scenarios of pool mode, NULL to run once
+ */
+void do_work(PipesCommunication* comm, int flush, int barrier, int window, int batch, int ack, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow, FILE* pool){
+	set_flush_policy(comm, flush);
+	comm->barrier = barrier;
+	comm->window = window;
+	comm->batch = batch;
+	comm->ack_mode = ack;
+	set_receive_policy(comm, receive);
+	comm->lanes = lanes;
+	set_credit_window(comm, credit);
+	set_pipe_size(comm, pipe_size, parent_pipe_size, pipe_grow);
+	
+	if (comm->current_id == PARENT_ID){
+		pool ? run_pool(comm, pool) : do_parent_work(comm, NULL);
+	}
+	else{
+		pool ? serve_pool(comm) : do_child_work(comm);
+	}
+	
+	/* Write out collected messages, nobody would read them after exit */
+	ipc_flush(comm);
+	log_pipes(comm);
+}
+
+/** Run scenarios of pool one after another on the same children
+ *
+ * Every scenario line is "X y1 ... yX [src dst amount]...". Children
+ * 1..X are reset by RESET messages and do the scenario, the rest wait for
+ * the next one. History is printed as soon as the scenario is done.
+ *
+ * @param comm		Pointer to PipesCommunication
+ * @param pool		Scenarios file
+ *
+ * @return -1 if some scenario failed, 0 on success.
+ */
+int run_pool(PipesCommunication* comm, FILE* pool){
+	Scenario scenario;
+	char* line = NULL;
+	size_t line_size = 0;
+	size_t number = 0;
+	int retval = 0;
+	
+	scenario.transfers = NULL;
+	scenario.transfers_size = 0;
+	
+	while (getline(&line, &line_size, pool) != -1){
+		ResetOrder order;
+		local_id i;
+		int result = parse_scenario(line, comm->total_ids - 1, &scenario);
+		
+		if (result > 0){
+			continue;
+		}
+		number++;
+		if (result < 0){
+			fprintf(stderr, "Scenario %lu is invalid, skipped\n", (unsigned long) number);
+			continue;
+		}
+		
+		/* History times of every scenario start from 0 */
+		comm->active_ids = scenario.proc_count + 1;
+		comm->time_base = get_physical_time();
+		order.s_time_base = comm->time_base;
+		order.s_proc_count = scenario.proc_count;
+		for (i = 1; i <= scenario.proc_count; i++){
+			order.s_balance = scenario.balances[i - 1];
+			send_reset_msg(comm, i, &order);
+		}
+		
+		printf("Scenario %lu:\n", (unsigned long) number);
+		if (do_parent_work(comm, &scenario)){
+			retval = -1;
+			break;
+		}
+		fflush(stdout);
+	}
+	
+	/* Children waiting for RESET stop too */
+	comm->active_ids = comm->total_ids;
+	send_all_stop_msg(comm);
+	
+	free(scenario.transfers);
+	free(line);
+	if (pool != stdin){
+		fclose(pool);
+	}
+	return retval;
+}
+
+/** Do child process work for every RESET of pool until STOP comes
  *
  * @param comm		Pointer to PipesCommunication
  *
  * @return -1 on incorrect message type, 0 on success.
  */
-int do_parent_work(PipesCommunication* comm){
-	AllHistory all_history;
+int serve_pool(PipesCommunication* comm){
+	for (;;){
+		Message msg;
+		ResetOrder order;
+		
+		while (receive(comm, PARENT_ID, &msg));
+		
+		if (msg.s_header.s_type == STOP){
+			return 0;
+		}
+		if (msg.s_header.s_type != RESET){
+			return -1;
+		}
+		
+		memcpy(&order, msg.s_payload, sizeof(ResetOrder));
+		comm->balance = order.s_balance;
+		comm->active_ids = order.s_proc_count + 1;
+		comm->time_base = order.s_time_base;
+		
+		if (do_child_work(comm)){
+			return -1;
+		}
+	}
+}
+
+/** Parse scenario line of pool
+ *
+ * @param line			Line, it is split into tokens
+ * @param pool_size		Count of child processes in pool
+ * @param scenario		Where to store scenario
+ *
+ * @return 1 on blank or comment line, -1 on invalid scenario, 0 on success.
+ */
+int parse_scenario(char* line, size_t pool_size, Scenario* scenario){
+	const char* delim = " \t\r\n";
+	char* token = strtok(line, delim);
 	local_id i;
+	int proc_count;
+	
+	if (!token || token[0] == '#'){
+		return 1;
+	}
+	proc_count = atoi(token);
+	if (proc_count <= 0 || (size_t) proc_count > pool_size){
+		return -1;
+	}
+	scenario->proc_count = proc_count;
+	for (i = 0; i < proc_count; i++){
+		if (!(token = strtok(NULL, delim))){
+			return -1;
+		}
+		scenario->balances[i] = atoi(token);
+	}
 	
-	all_history.s_history_len = comm->total_ids - 1;
+	scenario->transfers_count = 0;
+	while ((token = strtok(NULL, delim))){
+		TransferOrder* order;
+		int src = atoi(token);
+		int dst = (token = strtok(NULL, delim)) ? atoi(token) : 0;
+		int amount = (token = strtok(NULL, delim)) ? atoi(token) : 0;
+		
+		if (src <= 0 || src > proc_count || dst <= 0 || dst > proc_count || src == dst || amount <= 0){
+			return -1;
+		}
+		if (scenario->transfers_count == scenario->transfers_size){
+			scenario->transfers_size = scenario->transfers_size ? scenario->transfers_size * 2 : 16;
+			scenario->transfers = realloc(scenario->transfers, sizeof(TransferOrder) * scenario->transfers_size);
+		}
+		order = &scenario->transfers[scenario->transfers_count++];
+		order->s_src = src;
+		order->s_dst = dst;
+		order->s_amount = amount;
+	}
+	return 0;
+}
+
+/** Do parent process work (Receive messages, payload, print history)
+ *
+ * @param comm		Pointer to PipesCommunication
+ * @param scenario	Transfers of pool scenario, NULL to do bank_robbery()
+ *
+ * @return -1 if history of some child doesn't come, 0 on success.
+ */
+int do_parent_work(PipesCommunication* comm, const Scenario* scenario){
+	AllHistory* all_history;
+	local_id i;
 	
+	/* print_history() takes s_history_len entries, so there may be more than MAX_PROCESS_ID + 1 */
+	all_history = malloc(offsetof(AllHistory, s_history) + sizeof(BalanceHistory) * (comm->active_ids - 1));
+	all_history->s_history_len = comm->active_ids - 1;
+
     receive_all_msgs(comm, STARTED);
 
     /* Payload */
-    bank_robbery(comm, comm->total_ids - 1);
-
+	if (scenario && scenario->transfers_count){
+		size_t j;
+		
+		for (j = 0; j < scenario->transfers_count; j++){
+			const TransferOrder* order = &scenario->transfers[j];
+			
+			transfer_async(comm, order->s_src, order->s_dst, order->s_amount);
+		}
+	}
+	else{
+		bank_robbery(comm, comm->active_ids - 1);
+	}
+	transfer_wait_all(comm);
+	
 	/* Payload ended, stop children work */
     send_all_stop_msg(comm);
     receive_all_msgs(comm, DONE);
-	
+
 	/* Fill in History */
-	for (i = 1; i < comm->total_ids; i++){
-		BalanceHistory balance_history;
+	for (i = 1; i < comm->active_ids; i++){
 		Message msg;
 		
-		while(receive(comm, i, &msg));
-		
-		if (msg.s_header.s_type != BALANCE_HISTORY){
+		if (receive_type(comm, i, BALANCE_HISTORY, &msg) || read_balance_history(&msg, &all_history->s_history[i - 1])){
+			free(all_history);
 			return -1;
 		}
-		
-		memcpy((void*)&balance_history, msg.s_payload, sizeof(char) * msg.s_header.s_payload_len);
-		all_history.s_history[i - 1] = balance_history;
 	}
 	
-	print_history(&all_history);
+	print_history(all_history);
+	free(all_history);
 	return 0;
 }
 
@@ -146,46 +554,64 @@ int do_parent_work(PipesCommunication* comm){
 int do_child_work(PipesCommunication* comm){
 	BalanceState balance_state;
     BalanceHistory balance_history;
-	size_t done_left = comm->total_ids - 2;
+	/* With tree barrier DONE of peers is not received, only of children in barrier tree */
+	size_t done_left = comm->barrier == BARRIER_TREE ? 0 : comm->active_ids - 2;
 	int not_stopped = 1;
 
     balance_history.s_id = comm->current_id;
-	
+
 	balance_state.s_balance = comm->balance;
     balance_state.s_balance_pending_in = 0;
     balance_state.s_time = 0;
-	
-	update_history(&balance_state, &balance_history, 0);
+
+	update_history(comm, &balance_state, &balance_history, 0);
 	
 	/* Send & receive STARTED message */
 	send_all_proc_event_msg(comm, STARTED);
     receive_all_msgs(comm, STARTED);
-	
-	/* Receive TRANSFER, STOP or DONE messages */
+
+	/* Receive TRANSFER, TRANSFER_BATCH, WATERMARK_REQUEST, STOP or DONE messages */
 	while(done_left || not_stopped){
 		Message msg;
-		
+
         while (receive_any(comm, &msg));
-		
+
 		if (msg.s_header.s_type == TRANSFER){
 			do_transfer(comm, &msg, &balance_state, &balance_history);
 		}
+		else if (msg.s_header.s_type == TRANSFER_BATCH){
+			do_transfer_batch(comm, &msg, &balance_state, &balance_history);
+		}
+		else if (msg.s_header.s_type == WATERMARK_REQUEST){
+			settle_request(comm, &msg);
+		}
 		else if (msg.s_header.s_type == STOP){
 			send_all_proc_event_msg(comm, DONE);
 			not_stopped = 0;
 		}
 		else if (msg.s_header.s_type == DONE){
-			done_left--;
+			/* Subtree in barrier tree may be done before STOP comes to us */
+			if (comm->barrier == BARRIER_TREE){
+				comm->arrived++;
+			}
+			else{
+				done_left--;
+			}
 		}
 		else{
 			return -1;
 		}
 	}
 	
-	log_received_all_done(comm->current_id);
+	if (comm->barrier == BARRIER_TREE){
+		receive_all_msgs(comm, DONE);
+	}
+	else{
+		log_received_all_done(comm->current_id);
+	}
 	
 	/* Update history and send to PARENT */
-	update_history(&balance_state, &balance_history, 0);
+	update_history(comm, &balance_state, &balance_history, 0);
 	send_balance_history(comm, PARENT_ID, &balance_history);
 	return 0;
 }
@@ -200,20 +626,29 @@ int do_child_work(PipesCommunication* comm){
  * @return -1 on incorrect address, -2 on sending msg error, 0 on success.
  */
 int do_transfer(PipesCommunication* comm, Message* msg, BalanceState* state, BalanceHistory* history){
-	TransferOrder order;
-	memcpy(&order, msg->s_payload, sizeof(char) * msg->s_header.s_payload_len);
+	SeqTransferOrder order;
 	
-	/* Transfer request */
-	if (comm->current_id == order.s_src){
-		update_history(state, history, -order.s_amount);
-		send_transfer_msg(comm, order.s_dst, &order);
-		comm->balance -= order.s_amount;
+	if (msg->s_header.s_payload_len != sizeof(SeqTransferOrder)){
+		return -1;
+	}
+	memcpy(&order, msg->s_payload, sizeof(SeqTransferOrder));
+	
+	/* Transfer request, sequence number goes along to the destination */
+	if (comm->current_id == order.s_order.s_src){
+		update_history(comm, state, history, -order.s_order.s_amount);
+		send_transfer_msg(comm, order.s_order.s_dst, &order);
+		comm->balance -= order.s_order.s_amount;
 	}
 	/* Transfer income */
-	else if (comm->current_id == order.s_dst){
-		update_history(state, history, order.s_amount);
-		send_ack_msg(comm, PARENT_ID);
-		comm->balance += order.s_amount;
+	else if (comm->current_id == order.s_order.s_dst){
+		update_history(comm, state, history, order.s_order.s_amount);
+		if (comm->ack_mode == ACK_WATERMARK){
+			settle_order(comm, order.s_seq);
+		}
+		else{
+			send_ack_msg(comm, PARENT_ID, order.s_seq, 1);
+		}
+		comm->balance += order.s_order.s_amount;
 	}
 	else{
 		return -1;
@@ -221,40 +656,137 @@ int do_transfer(PipesCommunication* comm, Message* msg, BalanceState* state, Bal
 	return 0;
 }
 
+/** Do transfers of TRANSFER_BATCH message
+ *
+ * Source gets orders from parent, takes their sum at once and forwards
+ * them as one batch per destination. Destination takes the sum of its
+ * batch at once and acknowledges all its orders by one ACK.
+ *
+ * @param comm		Pointer to PipesCommunication
+ * @param msg		Received message
+ * @param state		Balance state
+ * @param history	Balance history
+ *
+ * @return -1 on incorrect address or payload, 0 on success.
+ */
+int do_transfer_batch(PipesCommunication* comm, Message* msg, BalanceState* state, BalanceHistory* history){
+	TransferBatch* batch = (TransferBatch*) msg->s_payload;
+	balance_t amount = 0;
+	size_t count, i;
+	int source;
+	
+	if (msg->s_header.s_payload_len <= sizeof(TransferBatch)){
+		return -1;
+	}
+	count = (msg->s_header.s_payload_len - sizeof(TransferBatch)) / sizeof(TransferOrder);
+	source = batch->s_orders[0].s_src == comm->current_id;
+	for (i = 0; i < count; i++){
+		if ((source ? batch->s_orders[i].s_src : batch->s_orders[i].s_dst) != comm->current_id){
+			return -1;
+		}
+		amount += batch->s_orders[i].s_amount;
+	}
+	
+	/* Transfer request, orders go along by destination in their order */
+	if (source){
+		TransferOrder orders[MAX_TRANSFER_BATCH];
+		local_id dst;
+		
+		update_history(comm, state, history, -amount);
+		comm->balance -= amount;
+		for (dst = 1; dst < comm->active_ids; dst++){
+			size_t len = 0;
+			
+			for (i = 0; i < count; i++){
+				if (batch->s_orders[i].s_dst == dst){
+					orders[len++] = batch->s_orders[i];
+				}
+			}
+			if (len){
+				send_transfer_batch_msg(comm, dst, batch->s_seq, orders, len);
+			}
+		}
+	}
+	/* Transfer income */
+	else{
+		update_history(comm, state, history, amount);
+		send_ack_msg(comm, PARENT_ID, batch->s_seq, count);
+		comm->balance += amount;
+	}
+	return 0;
+}
+
 /** Update process Balance history
  *
+ * @param comm		Pointer to PipesCommunication
  * @param state		Balance state
  * @param history	Balance history
  * @param amount	Balance changes amount
  */
-void update_history(BalanceState* state, BalanceHistory* history, balance_t amount){
-	static timestamp_t prev_time = 0;
-    timestamp_t curr_time = get_physical_time();
+void update_history(PipesCommunication* comm, BalanceState* state, BalanceHistory* history, balance_t amount){
+    timestamp_t curr_time = get_physical_time() - comm->time_base;
+	timestamp_t prev_time = state->s_time;
 	timestamp_t i;
-
-    history->s_history_len = curr_time + 1;
 	
-	for (i = prev_time; i < curr_time; i++){
+	/* History holds times below MAX_T only, s_history_len is uint8_t */
+	timestamp_t last_time = curr_time < MAX_T ? curr_time : MAX_T - 1;
+
+    history->s_history_len = last_time + 1;
+
+	/* Previous update was at state->s_time, fill the gap since then */
+	for (i = prev_time; i < curr_time && i <= last_time; i++){
 		state->s_time = i;
 		history->s_history[i] = *state;
 	}
 	
-	prev_time = curr_time;
 	state->s_time = curr_time;
 	state->s_balance += amount;
-	history->s_history[curr_time] = *state;
+	if (curr_time == last_time){
+		history->s_history[curr_time] = *state;
+	}
+}
+
+/** Get value of "--name=VALUE" option from command line arguments.
+ *  Found option is removed from arguments.
+ *
+ * @param argc		Pointer to arguments count
+ * @param argv		Double char array containing command line arguments.
+ * @param option	Option prefix, e.g. "--transport="
+ * @param value		Default value
+ *
+ * @return option value, default value if there is no option.
+ */
+const char* get_option(int* argc, char** argv, const char* option, const char* value){
+	size_t len = strlen(option);
+	int i;
+	
+	for (i = 1; i < *argc; i++){
+		if (!strncmp(argv[i], option, len)){
+			value = argv[i] + len;
+			memmove(argv + i, argv + i + 1, sizeof(char*) * (*argc - i));
+			(*argc)--;
+			return value;
+		}
+	}
+	return value;
 }
 
 /** Get process count from command line arguments.
  *
  * @param argc		Arguments count
  * @param argv		Double char array containing command line arguments.
+ * @param balances	Balances of processes follow their count
  *
  * @return -1 on error, any other values on success.
  */
-int get_proc_count(int argc, char** argv){
+int get_proc_count(int argc, char** argv, int balances){
 	int proc_count;
-	if (!strcmp(argv[1], "-p") && (proc_count = atoi(argv[2])) == (argc - 3)){
+	if (strcmp(argv[1], "-p")){
+		return -1;
+	}
+	proc_count = atoi(argv[2]);
+	if (argc - 3 == (balances ? proc_count : 0)
+			&& proc_count > 0 && proc_count < MAX_PROCESS_COUNT){
 		return proc_count;
 	}
 	return -1;
@@ -3,6 +3,338 @@
 #include "logger.h"
 #include "lamporttime.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+* 释放账单全部完成的转账占用的格
+*
+* @param pc 父进程管道通讯对象指针
+* @param slot 被占用的格
+*/
+static void complete_slot(PipesCommunication* pc, PendingTransfer* slot)
+{
+    slot->busy = 0;
+    pc->in_flight--;
+    if (!slot->batch)
+    {
+        log_transfer_in(slot->order.s_src, slot->order.s_dst, slot->order.s_amount);
+        return;
+    }
+    for (size_t i = 0; i < slot->count; i++)
+    {
+        log_transfer_in(slot->batch[i].s_src, slot->batch[i].s_dst, slot->batch[i].s_amount);
+    }
+    free(slot->batch);
+    slot->batch = NULL;
+}
+
+/**
+* 释放发给目标进程的序号低于其水位的所有账单占用的格
+*
+* @param pc 父进程管道通讯对象指针
+* @param watermark WATERMARK 消息的内容
+*/
+static void settle_slots(PipesCommunication* pc, const TransferWatermark* watermark)
+{
+    if (watermark->s_dst <= PARENT_ID || watermark->s_dst >= pc->total_ids || !pc->settle)
+    {
+        return;
+    }
+    pc->settle[watermark->s_dst].settled = watermark->s_settled;
+
+    for (size_t i = 0; i < pc->window && pc->in_flight; i++)
+    {
+        PendingTransfer* slot = &pc->pending[i];
+
+        if (slot->busy && !slot->batch && slot->order.s_dst == watermark->s_dst
+            && (int16_t)(watermark->s_settled - slot->dst_seq) > 0)
+        {
+            complete_slot(pc, slot);
+        }
+    }
+}
+
+/**
+* 接收一个 ACK 或 WATERMARK，释放账单全部完成的转账占用的格
+* 不同目标的 ACK 到达顺序不定，按序号匹配，未知的 ACK 丢弃
+*
+* @param pc 父进程管道通讯对象指针
+*/
+static void receive_ack(PipesCommunication* pc)
+{
+    Message msg;
+    PendingTransfer* slot;
+    TransferAck ack;
+
+    while (1)
+    {
+        while (receive_any(pc, &msg));
+
+        //从消息中设置时间
+        set_lamport_time_from_msg(&msg);
+
+        if (msg.s_header.s_type == ACK && msg.s_header.s_payload_len == sizeof(TransferAck))
+        {
+            break;
+        }
+        if (msg.s_header.s_type == WATERMARK && msg.s_header.s_payload_len == sizeof(TransferWatermark))
+        {
+            settle_slots(pc, (TransferWatermark*)msg.s_payload);
+            return;
+        }
+    }
+
+    memcpy(&ack, msg.s_payload, sizeof(TransferAck));
+    slot = &pc->pending[ack.s_seq % pc->window];
+    if (!slot->busy || slot->seq != ack.s_seq || slot->left < ack.s_count)
+    {
+        return;
+    }
+    if (!(slot->left -= ack.s_count))
+    {
+        complete_slot(pc, slot);
+    }
+}
+
+/**
+* 等待某笔转账完成
+* ACK_WATERMARK 时目标进程每 WATERMARK_INTERVAL 笔账单才主动报告一次，
+* 所以等待前父进程请求每个有在途账单的目标进程在其完成后报告，
+* 对已发送的账单每个目标进程只请求一次
+*
+* @param pc 父进程管道通讯对象指针
+*/
+static void wait_ack(PipesCommunication* pc)
+{
+    if (pc->settle)
+    {
+        for (local_id i = 1; i < pc->total_ids; i++)
+        {
+            SettleState* state = &pc->settle[i];
+
+            if (state->settled != state->next && state->requested != state->next)
+            {
+                state->requested = state->next;
+                increase_lamport_time();
+                send_watermark_request_msg(pc, i, state->next);
+            }
+        }
+    }
+    receive_ack(pc);
+}
+
+/**
+* 占用下一个序号的格
+* 只在该格被占用时等待，所以最多 pc->window 笔转账在途
+*
+* @param pc 父进程管道通讯对象指针
+* @param count 转账的账单数量
+*
+* @return 已设置序号的格
+*/
+static PendingTransfer* take_slot(PipesCommunication* pc, size_t count)
+{
+    PendingTransfer* slot;
+
+    if (!pc->pending)
+    {
+        set_transfer_window(pc, pc->window);
+    }
+
+    slot = &pc->pending[pc->next_seq % pc->window];
+    while (slot->busy)
+    {
+        wait_ack(pc);
+    }
+
+    slot->seq = pc->next_seq++;
+    slot->count = slot->left = count;
+    slot->busy = 1;
+    pc->in_flight++;
+    return slot;
+}
+
+/**
+* 把为源进程积累的账单作为一条 TRANSFER_BATCH 发送
+*
+* @param pc 父进程管道通讯对象指针
+* @param src 源进程id
+*/
+static void flush_batch(PipesCommunication* pc, local_id src)
+{
+    size_t count = pc->batch_lens[src];
+    PendingTransfer* slot;
+
+    if (!count)
+    {
+        return;
+    }
+
+    slot = take_slot(pc, count);
+    slot->batch = malloc(sizeof(TransferOrder) * count);
+    memcpy(slot->batch, pc->batches[src], sizeof(TransferOrder) * count);
+    pc->batch_lens[src] = 0;
+
+    increase_lamport_time();
+    send_transfer_batch_msg(pc, src, slot->seq, slot->batch, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        log_transfer_out(slot->batch[i].s_src, slot->batch[i].s_dst, slot->batch[i].s_amount);
+    }
+}
+
+/**
+* 发送转账，不等待 ACK
+* pc->batch > 1 时账单先与同一源进程的其他账单一起积累，
+* 积累到 pc->batch 笔或调用 transfer_wait_all() 时发送
+*
+* @param pc 父进程管道通讯对象指针
+* @param src 源进程id
+* @param dst 目标进程id
+* @param amount 金额
+*/
+void transfer_async(PipesCommunication* pc, local_id src, local_id dst, balance_t amount)
+{
+    SeqTransferOrder order;
+    PendingTransfer* slot;
+
+    order.s_order.s_src = src;
+    order.s_order.s_dst = dst;
+    order.s_order.s_amount = amount;
+
+    if (pc->batch > 1)
+    {
+        if (!pc->batches)
+        {
+            pc->batches = calloc(pc->total_ids, sizeof(TransferOrder*));
+            pc->batch_lens = calloc(pc->total_ids, sizeof(size_t));
+        }
+        if (!pc->batches[src])
+        {
+            pc->batches[src] = malloc(sizeof(TransferOrder) * pc->batch);
+        }
+        pc->batches[src][pc->batch_lens[src]++] = order.s_order;
+        if (pc->batch_lens[src] == pc->batch)
+        {
+            flush_batch(pc, src);
+        }
+        return;
+    }
+
+    slot = take_slot(pc, 1);
+    slot->order = order.s_order;
+    order.s_seq = slot->seq;
+
+    // 目标进程清点发给它的账单，所以按目标进程编号
+    if (pc->ack_mode == ACK_WATERMARK)
+    {
+        if (!pc->settle)
+        {
+            pc->settle = calloc(pc->total_ids, sizeof(SettleState));
+        }
+        slot->dst_seq = order.s_seq = pc->settle[dst].next++;
+    }
+
+    //1. 增加时间戳
+    increase_lamport_time();
+    //2. 发送转账请求消息
+    send_transfer_msg(pc, src, &order);
+    //3. 记录转出
+    log_transfer_out(src, dst, amount);
+}
+
+/**
+* 发送积累的账单，等待所有在途转账的 ACK
+*
+* @param pc 父进程管道通讯对象指针
+*/
+void transfer_wait_all(PipesCommunication* pc)
+{
+    if (pc->batches)
+    {
+        for (local_id i = 1; i < pc->total_ids; i++)
+        {
+            flush_batch(pc, i);
+        }
+    }
+    while (pc->in_flight)
+    {
+        wait_ack(pc);
+    }
+}
+
+/**
+* 父进程在等待水位，或者上次之后完成了足够多的账单时发送水位
+*
+* @param pc 目标进程管道通讯对象指针
+*/
+static void report_settled(PipesCommunication* pc)
+{
+    SettleMarks* marks = pc->marks;
+    int reached = marks->asked && (int16_t)(marks->settled - marks->target) >= 0;
+
+    if (reached)
+    {
+        marks->asked = 0;
+    }
+    if (marks->settled != marks->reported && (reached || (uint16_t)(marks->settled - marks->reported) >= WATERMARK_INTERVAL))
+    {
+        marks->reported = marks->settled;
+        increase_lamport_time();
+        send_watermark_msg(pc, PARENT_ID, marks->settled);
+    }
+}
+
+/**
+* 把发给当前进程的账单标记为完成，代替发送其 ACK
+* 不同源进程的账单可能乱序到达，所以水位只越过连续完成的账单
+*
+* @param pc 目标进程管道通讯对象指针
+* @param seq 账单在发给当前进程的账单中的序号
+*/
+void settle_order(PipesCommunication* pc, uint16_t seq)
+{
+    SettleMarks* marks;
+
+    if (!pc->marks)
+    {
+        pc->marks = calloc(1, sizeof(SettleMarks));
+    }
+    marks = pc->marks;
+
+    marks->done[seq % MAX_TRANSFER_WINDOW] = 1;
+    while (marks->done[marks->settled % MAX_TRANSFER_WINDOW])
+    {
+        marks->done[marks->settled % MAX_TRANSFER_WINDOW] = 0;
+        marks->settled++;
+    }
+    report_settled(pc);
+}
+
+/**
+* 处理父进程的 WATERMARK_REQUEST
+*
+* @param pc 目标进程管道通讯对象指针
+* @param msg 收到的消息
+*/
+void settle_request(PipesCommunication* pc, const Message* msg)
+{
+    if (msg->s_header.s_payload_len != sizeof(uint16_t))
+    {
+        return;
+    }
+    if (!pc->marks)
+    {
+        pc->marks = calloc(1, sizeof(SettleMarks));
+    }
+    //从消息中设置时间
+    set_lamport_time_from_msg(msg);
+    memcpy(&pc->marks->target, msg->s_payload, sizeof(uint16_t));
+    pc->marks->asked = 1;
+    report_settled(pc);
+}
 
 /**
 * 转账函数
@@ -15,22 +347,13 @@
 */
 void transfer(void* parent_data, local_id src, local_id dst, balance_t amount)
 {
-    Message msg;
     PipesCommunication* parent = (PipesCommunication*)parent_data;
-    TransferOrder order;
-    order.s_src = src;
-    order.s_dst = dst;
-    order.s_amount = amount;
-    //1. 增加时间戳
-    increment_lamport_time();
-    //2. 发送转账请求消息
-    send_transfer_msg(parent, src, &order);
-    //3. 记录转出
-    log_transfer_out(src, dst, amount);
-    //4. 发送转账接受消息
-    while (receive(parent, dst, &msg) < 0 || msg.s_header.s_type != ACK);
-    //5. 从消息中设置时间
-    set_lamport_time_from_msg(&msg);
-    //6. 记录转入
-    log_transfer_in(src, dst, amount);
+
+    transfer_async(parent, src, dst, amount);
+
+    // 没有窗口时返回前转账已完成，与以前相同
+    if (parent->window == 1)
+    {
+        transfer_wait_all(parent);
+    }
 }
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "broker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/*
+* 通道代理: 父进程中的线程，按需打开管道或套接字，并通过 SCM_RIGHTS 传递它们的两端
+* 单独放在这个文件中，因为 ipc.h 中的 send() 与 sys/socket.h 中的冲突
+*/
+
+/* 代理线程的状态 */
+typedef struct
+{
+    size_t proc_count;
+    int packets;        // 打开 SOCK_SEQPACKET 套接字对而不是管道
+    struct pollfd* fds; // 控制套接字的代理端，进程退出后为 -1
+    char* opened;       // proc_count * proc_count, 已分发的 (src, dst) 通道
+} Broker;
+
+/** 把通道端发送给进程
+ *
+ * @param fd			通道端, -1 表示没有通道
+ *
+ * @return -1 错误, 0 成功
+ */
+static int send_notice(int sock, int8_t peer, int8_t type, int fd)
+{
+    ChannelNotice notice;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    notice.peer = peer;
+    notice.type = type;
+    iov.iov_base = &notice;
+    iov.iov_len = sizeof(ChannelNotice);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        struct cmsghdr* cmsg;
+
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+* 打开 (src, dst) 通道，读端交给 dst，写端交给 src
+* dst 已经退出或通道无法打开时拒绝
+*/
+static void open_channel(Broker* broker, int8_t src, int8_t dst)
+{
+    int fd[2];
+    int result;
+
+    if (dst < 0 || dst >= (int)broker->proc_count || dst == src || broker->fds[dst].fd < 0)
+    {
+        send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, -1);
+        return;
+    }
+
+    result = broker->packets ? socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fd) : pipe2(fd, O_NONBLOCK);
+    if (result < 0)
+    {
+        send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, -1);
+        return;
+    }
+
+    // 读者在第一条消息写入之前就知道这个通道
+    if (send_notice(broker->fds[dst].fd, src, PIPE_READ_TYPE, fd[0]))
+    {
+        send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, -1);
+    }
+    else
+    {
+        broker->opened[src * broker->proc_count + dst] = 1;
+        send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, fd[1]);
+    }
+    close(fd[0]);
+    close(fd[1]);
+}
+
+/**
+* 忘记已关闭控制套接字的进程
+* 它从未写过的进程会被告知它已退出，就像关闭的管道告诉读者一样
+*/
+static void close_process(Broker* broker, int8_t src)
+{
+    close(broker->fds[src].fd);
+    broker->fds[src].fd = -1;
+
+    for (size_t i = 0; i < broker->proc_count; i++)
+    {
+        if (broker->fds[i].fd >= 0 && !broker->opened[src * broker->proc_count + i])
+        {
+            send_notice(broker->fds[i].fd, src, PIPE_READ_TYPE, -1);
+        }
+    }
+}
+
+/**
+* 处理通道请求，直到所有进程退出
+* 请求是进程想要写入的接收者ID
+*/
+static void* broker_main(void* arg)
+{
+    Broker* broker = (Broker*)arg;
+    size_t open = broker->proc_count;
+
+    while (open)
+    {
+        if (poll(broker->fds, broker->proc_count, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < broker->proc_count; i++)
+        {
+            int8_t dst;
+            ssize_t len;
+
+            if (!broker->fds[i].revents)
+            {
+                continue;
+            }
+            len = recv(broker->fds[i].fd, &dst, sizeof(dst), MSG_DONTWAIT);
+            if (len > 0)
+            {
+                open_channel(broker, i, dst);
+            }
+            else if (!len || errno != EAGAIN)
+            {
+                close_process(broker, i);
+                open--;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < broker->proc_count; i++)
+    {
+        if (broker->fds[i].fd >= 0)
+        {
+            close(broker->fds[i].fd);
+        }
+    }
+    free(broker->fds);
+    free(broker->opened);
+    free(broker);
+    return NULL;
+}
+
+/** 打开代理和每个进程之间的控制套接字，必须在 fork 之前调用
+ *
+ * @param proc_count    包含父进程的进程数量
+ *
+ * @return 文件描述符数组: [id * 2] 代理端, [id * 2 + 1] 进程端; 出错时为 NULL
+ */
+int* broker_init(size_t proc_count)
+{
+    int* sockets = malloc(sizeof(int) * 2 * proc_count);
+
+    for (size_t i = 0; i < proc_count; i++)
+    {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets + i * 2) < 0)
+        {
+            return NULL;
+        }
+    }
+    return sockets;
+}
+
+/** 启动代理线程，父进程在 fork 之后调用
+ *
+ * @param sockets		broker_init() 返回的数组，代理端归线程所有
+ * @param proc_count    包含父进程的进程数量
+ * @param packets		打开 SOCK_SEQPACKET 套接字对而不是管道
+ *
+ * @return -1 错误, 0 成功
+ */
+int broker_start(int* sockets, size_t proc_count, int packets)
+{
+    Broker* broker = malloc(sizeof(Broker));
+    pthread_attr_t attr;
+    pthread_t thread;
+    int result;
+
+    broker->proc_count = proc_count;
+    broker->packets = packets;
+    broker->fds = malloc(sizeof(struct pollfd) * proc_count);
+    broker->opened = calloc(proc_count * proc_count, sizeof(char));
+    for (size_t i = 0; i < proc_count; i++)
+    {
+        broker->fds[i].fd = sockets[i * 2];
+        broker->fds[i].events = POLLIN;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    result = pthread_create(&thread, &attr, broker_main, broker);
+    pthread_attr_destroy(&attr);
+    if (result)
+    {
+        free(broker->fds);
+        free(broker->opened);
+        free(broker);
+        return -1;
+    }
+    return 0;
+}
+
+/** 向代理请求到 dst 的通道，通道端由 broker_take() 取得
+ *
+ * @param sock			控制套接字的进程端
+ *
+ * @return -1 错误, 0 成功
+ */
+int broker_request(int sock, int8_t dst)
+{
+    return write(sock, &dst, sizeof(dst)) == sizeof(dst) ? 0 : -1;
+}
+
+/** 取出代理分发的通道端
+ *
+ * @param sock			控制套接字的进程端
+ * @param wait			休眠直到通道端到来
+ * @param notice		保存通道对端和类型
+ * @param fd			保存通道端, 通道已关闭或被拒绝时为 -1
+ *
+ * @return -1 代理已退出或出错, 0 没有通道端, 1 成功
+ */
+int broker_take(int sock, int wait, ChannelNotice* notice, int* fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t len;
+
+    iov.iov_base = notice;
+    iov.iov_len = sizeof(ChannelNotice);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    while ((len = recvmsg(sock, &msg, wait ? 0 : MSG_DONTWAIT)) < 0)
+    {
+        if (errno == EAGAIN)
+        {
+            return 0;
+        }
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    if (len != sizeof(ChannelNotice))
+    {
+        return -1;
+    }
+
+    *fd = -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_BROKER__H
+#define __IFMO_DISTRIBUTED_CLASS_BROKER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum PipeTypeOffset
+{
+    PIPE_READ_TYPE = 0,
+    PIPE_WRITE_TYPE = 1,
+};
+
+/* 代理分发的通道端，文件描述符随它一起传递 */
+typedef struct
+{
+    int8_t peer; // 通道另一端的进程
+    int8_t type; // PIPE_READ_TYPE / PIPE_WRITE_TYPE
+} ChannelNotice;
+
+int* broker_init(size_t proc_count);
+int broker_start(int* sockets, size_t proc_count, int packets);
+
+int broker_request(int sock, int8_t dst);
+int broker_take(int sock, int wait, ChannelNotice* notice, int* fd);
+
+#endif
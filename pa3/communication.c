@@ -1,13 +1,47 @@
+#define _GNU_SOURCE
+
 #include "communication.h"
 #include "logger.h"
 #include "pa2345.h"
-#include "ltime.h"
+#include "lamporttime.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/epoll.h>
+
+/**
+* 关闭数组中除一个以外的所有文件描述符
+* 连续打开的文件描述符在保留的那个两侧用 close_range() 关闭，子进程用两次系统调用丢掉其他进程的描述符
+*
+* @param fds 文件描述符数组
+* @param count 文件描述符数量
+* @param keep 保留的文件描述符
+*/
+static void close_all_but(const int* fds, size_t count, int keep)
+{
+    int first = fds[0];
+    int last = fds[count - 1];
+    size_t i;
+
+    for (i = 0; i < count && fds[i] == first + (int)i; i++);
+    if (i == count && (keep == first || !close_range(first, keep - 1, 0)) && (keep == last || !close_range(keep + 1, last, 0)))
+    {
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (fds[i] != keep)
+        {
+            close(fds[i]);
+        }
+    }
+}
 
 /** Set 0_NONBLOCK flag to fd
  *
@@ -18,88 +52,425 @@
 int set_nonblock(int pipe_id)
 {
     int flags = fcntl(pipe_id, F_GETFL);
-    if (!flags)
+    if (flags == -1)
     {
         return ERROR_SET_NONBLOCK_NO_FLAGS;
     }
     flags = fcntl(pipe_id, F_SETFL, flags | O_NONBLOCK);
-    if (!flags)
+    if (flags == -1)
     {
         return ERROR_SET_NONBLOCK_NO_SET;
     }
     return RESULT_SET_NONBLOCK_SUCCESS;
 }
 
-/** 打开管道文件描述符
+/** 根据命令行名称取得传输方式
  *
- * @param proc_count    包含父进程的进程数量
+ * @param name          传输方式名称: pipe / shm / seqpacket
  *
- * @return 管道文件描述符数组指针
+ * @return -1 未知名称, 其他值为 TransportType
  */
-int* pipes_init(size_t proc_count)
+int get_transport_type(const char* name)
 {
-    size_t offset = proc_count - 1;
-    int* pipes = malloc(sizeof(int) * 2 * proc_count * (proc_count - 1));
-
-    for (size_t i = 0; i < proc_count; i++)
+    for (int i = 0; i < TRANSPORT_COUNT; i++)
     {
-        for (size_t j = 0; j < proc_count; j++)
+        if (!strcmp(name, transports[i]->name))
         {
-            int tmp_fd[2];
+            return i;
+        }
+    }
+    return -1;
+}
 
-            if (i == j)
-            {
-                continue;
-            }
+/** 根据命令行名称取得写出策略
+ *
+ * @param name          策略名称: immediate / batch
+ *
+ * @return -1 未知名称, 其他值为 FlushPolicy
+ */
+int get_flush_policy(const char* name)
+{
+    if (!strcmp(name, "immediate"))
+    {
+        return FLUSH_IMMEDIATE;
+    }
+    if (!strcmp(name, "batch"))
+    {
+        return FLUSH_BATCH;
+    }
+    return -1;
+}
 
-            if (pipe(tmp_fd) < 0)
-            {
-                return (int*)NULL;
-            }
+/** 根据命令行名称得到屏障类型
+ *
+ * @param name			屏障名称: all / tree
+ *
+ * @return -1 未知名称, 成功时返回 BarrierType
+ */
+int get_barrier_type(const char* name)
+{
+    if (!strcmp(name, "all"))
+    {
+        return BARRIER_ALL;
+    }
+    if (!strcmp(name, "tree"))
+    {
+        return BARRIER_TREE;
+    }
+    return -1;
+}
 
-            if (set_nonblock(tmp_fd[0]) || set_nonblock(tmp_fd[1])) {
-                return (int*)NULL;
-            }
-            pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_READ_TYPE] = tmp_fd[0];  /* READ */
-            pipes[j * offset * 2 + (j > i ? i : i - 1) * 2 + PIPE_WRITE_TYPE] = tmp_fd[1]; /* WRITE */
-        }
+/** 解析命令行选项的数量
+ *
+ * @return -1 不是 1..max 之间的数, 成功时返回数量
+ */
+static int get_count(const char* value, long max)
+{
+    char* end;
+    long count = strtol(value, &end, 10);
+
+    if (*end || count < 1 || count > max)
+    {
+        return -1;
+    }
+    return count;
+}
+
+/** 根据命令行的值得到转账窗口
+ *
+ * @param value			在途转账数量: 1..MAX_TRANSFER_WINDOW
+ *
+ * @return -1 非法值, 成功时返回窗口大小
+ */
+int get_transfer_window(const char* value)
+{
+    return get_count(value, MAX_TRANSFER_WINDOW);
+}
+
+/** 根据命令行的值得到每批账单数量
+ *
+ * @param value			一条消息中的账单数量: 1..MAX_TRANSFER_BATCH
+ *
+ * @return -1 非法值, 成功时返回每批数量
+ */
+int get_transfer_batch(const char* value)
+{
+    return get_count(value, MAX_TRANSFER_BATCH);
+}
+
+/** 根据命令行名称得到 ACK 方式
+ *
+ * @param name			ACK 方式名称: each / watermark
+ *
+ * @return -1 未知名称, 成功时返回 AckMode
+ */
+int get_ack_mode(const char* name)
+{
+    if (!strcmp(name, "each"))
+    {
+        return ACK_EACH;
+    }
+    if (!strcmp(name, "watermark"))
+    {
+        return ACK_WATERMARK;
+    }
+    return -1;
+}
+
+/** 根据命令行名称得到 receive_any() 的策略
+ *
+ * @param name			策略名称: first / round-robin / weighted / oldest
+ *
+ * @return -1 未知名称, 成功时返回 ReceivePolicy
+ */
+int get_receive_policy(const char* name)
+{
+    if (!strcmp(name, "first"))
+    {
+        return RECEIVE_FIRST;
+    }
+    if (!strcmp(name, "round-robin"))
+    {
+        return RECEIVE_ROUND_ROBIN;
+    }
+    if (!strcmp(name, "weighted"))
+    {
+        return RECEIVE_WEIGHTED;
+    }
+    if (!strcmp(name, "oldest"))
+    {
+        return RECEIVE_OLDEST;
+    }
+    return -1;
+}
+
+/** 根据命令行名称得到通道模式
+ *
+ * @param name			模式名称: single / control
+ *
+ * @return -1 未知名称, 成功时返回 LaneMode
+ */
+int get_lane_mode(const char* name)
+{
+    if (!strcmp(name, "single"))
+    {
+        return LANES_SINGLE;
+    }
+    if (!strcmp(name, "control"))
+    {
+        return LANES_CONTROL;
+    }
+    return -1;
+}
+
+/** 根据命令行的值得到信用窗口
+ *
+ * @param value			off，或字节数: MIN_CREDIT_WINDOW..MAX_CREDIT_WINDOW
+ *
+ * @return -1 非法值, 0 不使用信用, 成功时返回窗口大小
+ */
+int get_credit_window(const char* value)
+{
+    int window;
+
+    if (!strcmp(value, "off"))
+    {
+        return 0;
     }
-    return pipes;
+    window = get_count(value, MAX_CREDIT_WINDOW);
+    return window < MIN_CREDIT_WINDOW ? -1 : window;
+}
+
+/** 根据命令行的值得到管道容量
+ *
+ * @param value			default，或字节数: MIN_PIPE_SIZE..MAX_PIPE_SIZE
+ *
+ * @return -1 非法值, 0 内核默认值, 成功时返回容量
+ */
+int get_pipe_size(const char* value)
+{
+    int size;
+
+    if (!strcmp(value, "default"))
+    {
+        return 0;
+    }
+    size = get_count(value, MAX_PIPE_SIZE);
+    return size < MIN_PIPE_SIZE ? -1 : size;
+}
+
+/** 根据命令行的值得到管道增大的阈值
+ *
+ * @param value			off，或两次增大之间管道已满的次数: 1..INT_MAX
+ *
+ * @return -1 非法值, 0 不增大, 成功时返回阈值
+ */
+int get_pipe_grow(const char* value)
+{
+    return strcmp(value, "off") ? get_count(value, INT_MAX) : 0;
+}
+
+/** 得到当前进程在屏障树中的子节点数量
+ * 与 --fork-tree 相同，进程 i 是 2i + 1 和 2i + 2 的父节点
+ */
+static size_t tree_children_count(PipesCommunication* pc)
+{
+    size_t first = 2 * pc->current_id + 1;
+
+    if (first >= pc->active_ids)
+    {
+        return 0;
+    }
+    return first + 1 < pc->active_ids ? 2 : 1;
+}
+
+/** 等待屏障树中所有子节点的事件
+ * 其余进程都在等待释放，而释放需要本进程的事件，所以期间不会收到其他消息，receive_any() 即可
+ * 调用者自己的 receive_any() 已收到的事件记在 pc->arrived 中
+ */
+static void receive_tree_arrivals(PipesCommunication* pc)
+{
+    Message msg;
+
+    while (pc->arrived < tree_children_count(pc))
+    {
+        while (receive_any(pc, &msg));
+
+        set_lamport_time_from_msg(&msg);
+        pc->arrived++;
+    }
+    pc->arrived = 0;
+}
+
+/** 向屏障树中的子节点发送释放消息
+ *
+ * @param pc		管道通讯对象指针
+ * @param type		STARTED / DONE
+ */
+static void send_tree_release(PipesCommunication* pc, MessageType type)
+{
+    Message msg;
+
+    increase_lamport_time();
+    msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = type;
+    msg.s_header.s_local_time = get_lamport_time();
+    msg.s_header.s_payload_len = 0;
+
+    for (size_t i = 2 * pc->current_id + 1; i <= 2 * pc->current_id + 2 && i < pc->active_ids; i++)
+    {
+        send_blocking(pc, i, &msg);
+    }
+}
+
+/** 打开通道代理的控制套接字
+ *
+ * 这里不打开管道: 父进程的代理线程在写者第一次发送时打开每个通道
+ *
+ * @param proc_count    包含父进程的进程数量
+ * @param transport     TRANSPORT_PIPE 或 TRANSPORT_SEQPACKET (套接字对当作管道使用)
+ *
+ * @return 控制套接字文件描述符数组指针
+ */
+int* pipes_init(size_t proc_count, TransportType transport)
+{
+    return broker_init(proc_count);
 }
 
 /** 初始化管道通讯
  *
- * @param pipes			管道文件描述符数组指针
+ * @param transport		传输方式
+ * @param pipes			代理的控制套接字数组指针 (使用共享内存时为 NULL)
+ * @param shm			共享环形缓冲区指针 (使用管道时为 NULL)
+ * @param mailboxes		所有线程的邮箱 (进程不是线程时为 NULL)
  * @param proc_count    包含父进程的进程数量
  * @param curr_proc		当前进程本地ID
  *
  * @return 管道通讯对象指针
  */
-PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id curr_proc, balance_t balance) {
+PipesCommunication* communication_init(TransportType transport, int* pipes, ShmRegion* shm, Mailbox* mailboxes, size_t proc_count, local_id curr_proc, balance_t balance) {
     PipesCommunication* this = malloc(sizeof(PipesCommunication));;
-    size_t i, j;
+    struct epoll_event event;
+    size_t i;
     size_t offset = proc_count - 1;
-    this->pipes = malloc(sizeof(int) * offset * 2);
     this->total_ids = proc_count;
+    this->active_ids = proc_count;
     this->current_id = curr_proc;
     this->balance = balance;
+    this->ready = calloc(proc_count, sizeof(char));
+    this->buffers = calloc(proc_count, sizeof(ReadBuffer*));
+    this->out_buffers = calloc(proc_count, sizeof(WriteBuffer*));
+    this->send_stats = calloc(proc_count, sizeof(SendStats));
+    this->closed = calloc(proc_count, sizeof(char));
+    this->open_channels = 0;
+    this->wakeups = 0;
+    this->spurious_polls = 0;
+    this->reads = 0;
+    this->writes = 0;
+    this->flush_policy = FLUSH_IMMEDIATE;
+    this->barrier = BARRIER_ALL;
+    this->arrived = 0;
+    this->window = 1;
+    this->pending = NULL;
+    this->in_flight = 0;
+    this->next_seq = 0;
+    this->batch = 1;
+    this->batches = NULL;
+    this->batch_lens = NULL;
+    this->ack_mode = ACK_EACH;
+    this->settle = NULL;
+    this->marks = NULL;
+    this->stashes = calloc(proc_count, sizeof(Stash*));
+    this->parked = 0;
+    this->stashed = 0;
+    this->receive_policy = RECEIVE_FIRST;
+    this->scan_start = 0;
+    this->burst = 0;
+    this->weights = malloc(sizeof(size_t) * proc_count);
+    for (i = 0; i < proc_count; i++)
+    {
+        this->weights[i] = 1;
+    }
+    this->receive_stats = calloc(proc_count, sizeof(ReceiveStats));
+    this->received = 0;
+    this->last_msg_from = -1;
+    this->lanes = LANES_SINGLE;
+    this->overtaken = 0;
+    this->credit_window = 0;
+    this->credits = NULL;
+    this->credit_wait = -1;
+    this->grants = 0;
+    this->pipe_size = 0;
+    this->parent_pipe_size = 0;
+    this->pipe_grow = 0;
+    this->pipe_stats = calloc(proc_count, sizeof(PipeStats));
 
-    memcpy(this->pipes, pipes + curr_proc * 2 * offset, sizeof(int) * offset * 2);
+    this->transport = transport;
+    this->ops = transports[transport];
+    this->mailboxes = NULL;
+    this->queues = NULL;
+    this->broker_fd = -1;
 
-    /* 关闭无用的文件描述符 */
-    for (i = 0; i < proc_count; i++)
+    /* 共享内存已经映射，不需要关闭文件描述符 */
+    if (transport == TRANSPORT_SHM)
+    {
+        this->shm = shm;
+        this->pipes = NULL;
+        this->epoll_fd = -1;
+        return this;
+    }
+
+    /* 线程之间只通过邮箱通讯 */
+    if (transport == TRANSPORT_MAILBOX)
+    {
+        this->mailboxes = mailboxes;
+        this->queues = calloc(proc_count, sizeof(MailQueue));
+        this->shm = NULL;
+        this->pipes = NULL;
+        this->epoll_fd = -1;
+        return this;
+    }
+
+    /* 读端消失应是发送错误，而不是杀死进程的信号 */
+    signal(SIGPIPE, SIG_IGN);
+
+    this->shm = NULL;
+    this->pipes = malloc(sizeof(int) * offset * 2);
+    for (i = 0; i < offset * 2; i++)
+    {
+        this->pipes[i] = -1;
+    }
+    this->broker_fd = pipes[curr_proc * 2 + 1];
+
+    /* 关闭其他进程的控制套接字，父进程保留代理端 */
+    if (curr_proc != PARENT_ID)
+    {
+        close_all_but(pipes, proc_count * 2, this->broker_fd);
+    }
+    else
     {
-        if (i == curr_proc)
+        for (i = 1; i < proc_count; i++)
         {
-            continue;
+            close(pipes[i * 2 + 1]);
         }
-        for (j = 0; j < proc_count; j++)
+    }
+
+    /* 没有代理时进程会看到它已退出，发送就会失败 */
+    if (curr_proc == PARENT_ID && broker_start(pipes, proc_count, this->ops->packets))
+    {
+        for (i = 0; i < proc_count; i++)
         {
-            close(pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_READ_TYPE]);
-            close(pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_WRITE_TYPE]);
+            close(pipes[i * 2]);
         }
     }
     free(pipes);
+
+    /* 监听控制套接字，读管道在代理分发时加入 */
+    this->epoll_fd = epoll_create1(0);
+    event.events = EPOLLIN;
+    event.data.u32 = curr_proc;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->broker_fd, &event);
+    this->open_channels = proc_count - 1;
     return this;
 }
 
@@ -110,15 +481,189 @@ PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id c
 void communication_release(PipesCommunication* pc)
 {
     size_t i;
-    for (i = 0; i < pc->total_ids - 1; i++)
+
+    if (pc->transport == TRANSPORT_SHM)
+    {
+        shm_destroy(pc->shm);
+    }
+    else if (pc->transport == TRANSPORT_MAILBOX)
+    {
+        mailbox_clear(pc->queues, pc->total_ids);
+        free(pc->queues);
+    }
+    else
+    {
+        for (i = 0; i < pc->total_ids - 1; i++)
+        {
+            close(pc->pipes[i * 2 + PIPE_READ_TYPE]);
+            close(pc->pipes[i * 2 + PIPE_WRITE_TYPE]);
+        }
+        close(pc->broker_fd);
+        close(pc->epoll_fd);
+        free(pc->pipes);
+    }
+    for (i = 0; i < pc->total_ids; i++)
+    {
+        free(pc->buffers[i]);
+        free(pc->out_buffers[i]);
+    }
+    free(pc->buffers);
+    free(pc->out_buffers);
+    free(pc->send_stats);
+    free(pc->closed);
+    free(pc->pending);
+    if (pc->batches)
     {
-        close(pc->pipes[i * 2 + PIPE_READ_TYPE]);
-        close(pc->pipes[i * 2 + PIPE_WRITE_TYPE]);
+        for (i = 0; i < pc->total_ids; i++)
+        {
+            free(pc->batches[i]);
+        }
+        free(pc->batches);
+        free(pc->batch_lens);
+    }
+    free(pc->settle);
+    free(pc->marks);
+    free(pc->credits);
+    free(pc->pipe_stats);
+    for (i = 0; i < pc->total_ids; i++)
+    {
+        if (pc->stashes[i] == NULL)
+        {
+            continue;
+        }
+        for (int j = 0; j <= MESSAGE_TYPE_COUNT; j++)
+        {
+            while (pc->stashes[i]->first[j] != NULL)
+            {
+                StashNode* next = pc->stashes[i]->first[j]->next;
+
+                free(pc->stashes[i]->first[j]);
+                pc->stashes[i]->first[j] = next;
+            }
+        }
+        free(pc->stashes[i]);
     }
+    free(pc->stashes);
+    free(pc->weights);
+    free(pc->receive_stats);
+    free(pc->ready);
     free(pc);
 }
 
+/** 设置 receive_any() 服务读通道的顺序
+ * 使用 RECEIVE_WEIGHTED 时来自 PARENT_ID 的通道与其他所有子进程的权重之和相同，因为它为所有子进程传送账单和控制消息
+ *
+ * @param pc		管道通讯对象指针
+ * @param policy	RECEIVE_FIRST / RECEIVE_ROUND_ROBIN / RECEIVE_WEIGHTED / RECEIVE_OLDEST
+ */
+void set_receive_policy(PipesCommunication* pc, ReceivePolicy policy)
+{
+    pc->receive_policy = policy;
+    pc->scan_start = 0;
+    pc->burst = 0;
+    if (policy == RECEIVE_WEIGHTED && pc->total_ids > 3)
+    {
+        pc->weights[PARENT_ID] = pc->total_ids - 2;
+    }
+}
+
+/** 设置发送消息的写出策略
+ * 切换到 FLUSH_IMMEDIATE 时写出已积累的消息
+ * 共享缓冲区不需要系统调用，套接字的消息包不能合并，所以两者总是立即写出
+ *
+ * @param pc		管道通讯对象指针
+ * @param policy	FLUSH_IMMEDIATE / FLUSH_BATCH
+ */
+void set_flush_policy(PipesCommunication* pc, FlushPolicy policy)
+{
+    if (policy == FLUSH_IMMEDIATE)
+    {
+        ipc_flush(pc);
+    }
+    pc->flush_policy = pc->transport == TRANSPORT_PIPE ? policy : FLUSH_IMMEDIATE;
+}
+
+/** 设置父进程同时在途的转账数量
+ *
+ * @param pc		管道通讯对象指针
+ * @param window	1..MAX_TRANSFER_WINDOW，为 1 时每笔转账都等待 ACK
+ *
+ * @return -1 非法窗口或仍有在途转账, 0 成功
+ */
+int set_transfer_window(PipesCommunication* pc, size_t window)
+{
+    PendingTransfer* pending;
+
+    if (window < 1 || window > MAX_TRANSFER_WINDOW || pc->in_flight)
+    {
+        return -1;
+    }
+    if (!(pending = calloc(window, sizeof(PendingTransfer))))
+    {
+        return -1;
+    }
+    free(pc->pending);
+    pc->pending = pending;
+    pc->window = window;
+    return 0;
+}
+
+/** 设置发送者可以在通道中保留的接收者尚未读出的字节数
+ * 接收者为从通道读出的字节授予信用，随回程消息或用 CREDIT 消息发出
+ * 发送者只写出信用之内的消息，否则在自己的读通道上等待
+ * 所有进程必须相同，并在第一条消息之前设置
+ * 共享缓冲区和邮箱没有信用：前者自己等待，后者永远不会满
+ *
+ * @param pc		管道通讯对象指针
+ * @param window	MIN_CREDIT_WINDOW..MAX_CREDIT_WINDOW，为 0 时不使用信用
+ *
+ * @return -1 非法窗口或内存不足, 0 成功
+ */
+int set_credit_window(PipesCommunication* pc, size_t window)
+{
+    if (window && (window < MIN_CREDIT_WINDOW || window > MAX_CREDIT_WINDOW))
+    {
+        return -1;
+    }
+    if (!window || (pc->transport != TRANSPORT_PIPE && pc->transport != TRANSPORT_SEQPACKET))
+    {
+        pc->credit_window = 0;
+        return 0;
+    }
+    if (!pc->credits && !(pc->credits = calloc(pc->total_ids, sizeof(ChannelCredit))))
+    {
+        return -1;
+    }
+    pc->credit_window = window;
+    return 0;
+}
+
+/** 设置此后打开的管道的容量及其增大方式
+ * 每个进程设置自己写入的管道，所有子进程都向 PARENT_ID 报告，所以到它的管道可以更大
+ * 已满 grow 次的管道容量加倍，最多到 MAX_PIPE_SIZE
+ * 套接字、共享缓冲区和邮箱不是管道，保持原有大小
+ *
+ * @param pc			管道通讯对象指针
+ * @param size			MIN_PIPE_SIZE..MAX_PIPE_SIZE，为 0 时保持内核默认值
+ * @param parent_size	到 PARENT_ID 的管道的容量，为 0 时与 size 相同
+ * @param grow			两次增大之间管道已满的次数，为 0 时不增大
+ *
+ * @return -1 非法容量, 0 成功
+ */
+int set_pipe_size(PipesCommunication* pc, size_t size, size_t parent_size, size_t grow)
+{
+    if ((size && (size < MIN_PIPE_SIZE || size > MAX_PIPE_SIZE)) || (parent_size && (parent_size < MIN_PIPE_SIZE || parent_size > MAX_PIPE_SIZE)))
+    {
+        return -1;
+    }
+    pc->pipe_size = size;
+    pc->parent_pipe_size = parent_size;
+    pc->pipe_grow = grow;
+    return 0;
+}
+
 /** 发送事件消息给所有进程
+ * 使用树形屏障时，整个子树的事件都到达后发送给屏障树中的父节点
  *
  * @param pc		管道通讯对象指针
  * @param type		消息类型: STARTED / DONE
@@ -130,6 +675,11 @@ int send_all_proc_event_msg(PipesCommunication* pc, MessageType type) {
     uint16_t length = 0;
     char buf[MAX_PAYLOAD_LEN];
 
+    if (pc->barrier == BARRIER_TREE)
+    {
+        receive_tree_arrivals(pc);
+    }
+
     msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = type;
     msg.s_header.s_local_time = get_lamport_time();
@@ -154,7 +704,10 @@ int send_all_proc_event_msg(PipesCommunication* pc, MessageType type) {
     msg.s_header.s_payload_len = length;
     memcpy(msg.s_payload, buf, sizeof(char) * length);
 
-    send_multicast(pc, &msg);
+    if (pc->barrier == BARRIER_TREE ? send_blocking(pc, (pc->current_id - 1) / 2, &msg) : send_multicast(pc, &msg))
+    {
+        return -3;
+    }
 
     type == STARTED ? log_started(pc->current_id, pc->balance) : log_done(pc->current_id, pc->balance);
 
@@ -180,36 +733,152 @@ void send_all_stop_msg(PipesCommunication* pc)
  *
  * @param pc		管道通讯对象指针
  * @param dst 		目标ID
- * @param order 	账单信息
+ * @param order 	账单信息及其序号
  */
-void send_transfer_msg(PipesCommunication* pc, local_id dst, TransferOrder* order) {
+void send_transfer_msg(PipesCommunication* pc, local_id dst, SeqTransferOrder* order) {
     Message msg;
     msg.s_header.s_magic = MESSAGE_MAGIC;
-    msg.s_header.s_payload_len = sizeof(TransferOrder);
+    msg.s_header.s_payload_len = sizeof(SeqTransferOrder);
     msg.s_header.s_type = TRANSFER;
     msg.s_header.s_local_time = get_lamport_time();
 
     memcpy(msg.s_payload, order, msg.s_header.s_payload_len);
 
-    while (send(pc, dst, &msg) < 0);
+    send_blocking(pc, dst, &msg);
+}
+
+/** 发送批量转账消息
+ *
+ * @param pc		管道通讯对象指针
+ * @param dst 		目标ID
+ * @param seq 		该批的序号
+ * @param orders 	同一源进程或同一目标进程的账单
+ * @param count 	账单数量，最多 MAX_TRANSFER_BATCH
+ */
+void send_transfer_batch_msg(PipesCommunication* pc, local_id dst, uint16_t seq, const TransferOrder* orders, size_t count) {
+    Message msg;
+    TransferBatch* batch = (TransferBatch*)msg.s_payload;
+    msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_payload_len = sizeof(TransferBatch) + sizeof(TransferOrder) * count;
+    msg.s_header.s_type = TRANSFER_BATCH;
+    msg.s_header.s_local_time = get_lamport_time();
+
+    batch->s_seq = seq;
+    memcpy(batch->s_orders, orders, sizeof(TransferOrder) * count);
+
+    send_blocking(pc, dst, &msg);
 }
 
 /** 发送ACK
  *
  * @param pc		管道通讯对象指针
  * @param dst 		目标ID
+ * @param seq 		被确认的转账或批量转账的序号
+ * @param count 	发送者完成的账单数量
  */
-void send_ack_msg(PipesCommunication* pc, local_id dst) {
+void send_ack_msg(PipesCommunication* pc, local_id dst, uint16_t seq, uint16_t count) {
     Message msg;
+    TransferAck ack;
     msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = ACK;
     msg.s_header.s_local_time = get_lamport_time();
-    msg.s_header.s_payload_len = 0;
+    msg.s_header.s_payload_len = sizeof(TransferAck);
+
+    ack.s_seq = seq;
+    ack.s_count = count;
+    memcpy(msg.s_payload, &ack, msg.s_header.s_payload_len);
+
+    send_blocking(pc, dst, &msg);
+}
+
+/** 发送水位消息
+ *
+ * @param pc		管道通讯对象指针
+ * @param dst 		目标ID
+ * @param settled 	发给当前进程的序号小于此值的账单都已完成
+ */
+void send_watermark_msg(PipesCommunication* pc, local_id dst, uint16_t settled) {
+    Message msg;
+    TransferWatermark watermark;
+    msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = WATERMARK;
+    msg.s_header.s_local_time = get_lamport_time();
+    msg.s_header.s_payload_len = sizeof(TransferWatermark);
 
-    while (send(pc, dst, &msg) < 0);
+    watermark.s_dst = pc->current_id;
+    watermark.s_settled = settled;
+    memcpy(msg.s_payload, &watermark, msg.s_header.s_payload_len);
+
+    send_blocking(pc, dst, &msg);
 }
 
+/** 发送水位请求消息
+ *
+ * @param pc		管道通讯对象指针
+ * @param dst 		目标ID
+ * @param target 	序号小于此值的账单完成后发送的水位
+ */
+void send_watermark_request_msg(PipesCommunication* pc, local_id dst, uint16_t target) {
+    Message msg;
+    msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = WATERMARK_REQUEST;
+    msg.s_header.s_local_time = get_lamport_time();
+    msg.s_header.s_payload_len = sizeof(uint16_t);
+
+    memcpy(msg.s_payload, &target, msg.s_header.s_payload_len);
+
+    send_blocking(pc, dst, &msg);
+}
+
+/** 写入 varint：每字节 7 位，低位在前，后面还有字节时最高位为 1
+ *
+ * @return 写入的字节数，最多 5 个
+ */
+static size_t put_varint(uint8_t* data, uint32_t value)
+{
+    size_t result = 0;
+
+    while (value >= 0x80)
+    {
+        data[result++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    data[result++] = (uint8_t)value;
+    return result;
+}
+
+/** 读取 put_varint() 写入的 varint
+ *
+ * @param pos		读取位置，读完后移到 varint 之后
+ *
+ * @return -1 varint 被截断或过长, 0 成功
+ */
+static int get_varint(const uint8_t* data, size_t len, size_t* pos, uint32_t* value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 32 && *pos < len; shift += 7)
+    {
+        uint8_t byte = data[(*pos)++];
+
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* 有符号差值写成 varint：绝对值小的正负数都只占一个字节 */
+#define ZIGZAG(x) (((uint32_t)(x) << 1) ^ (uint32_t)-((x) < 0))
+#define UNZIGZAG(x) ((int32_t)((x) >> 1) ^ -(int32_t)((x) & 1))
+
 /** 发送余额历史记录给父进程
+ *
+ * 只发送状态变化的时刻，第 t 项是时刻 t 的状态。负载依次为 s_id、
+ * varint 历史长度，然后每个变化项是时刻、余额、在途余额三个 varint，
+ * 都是相对前一项的差值，第一项相对时刻 0 和全零状态。
+ * 格式本身不受 MAX_T 限制；MAX_T + 1 项全部变化时也小于 MAX_PAYLOAD_LEN。
  *
  * @param pc		管道通讯对象指针
  * @param dst 		目标ID
@@ -218,15 +887,123 @@ void send_ack_msg(PipesCommunication* pc, local_id dst) {
 void send_balance_history(PipesCommunication* pc, local_id dst, BalanceHistory* bh)
 {
     Message msg;
+    uint8_t* data = (uint8_t*)msg.s_payload;
+    BalanceState prev = {0, 0, 0};
+    size_t len = 0;
+
     msg.s_header.s_magic = MESSAGE_MAGIC;
-    msg.s_header.s_payload_len = sizeof(BalanceHistory);
     msg.s_header.s_type = BALANCE_HISTORY;
     msg.s_header.s_local_time = get_lamport_time();
-    memcpy(msg.s_payload, bh, msg.s_header.s_payload_len);
-    while (send(pc, dst, &msg) < 0);
+
+    data[len++] = bh->s_id;
+    len += put_varint(data + len, bh->s_history_len);
+    for (size_t t = 0; t < bh->s_history_len; t++)
+    {
+        const BalanceState* state = &bh->s_history[t];
+
+        if (t && state->s_balance == prev.s_balance && state->s_balance_pending_in == prev.s_balance_pending_in)
+        {
+            continue;
+        }
+        len += put_varint(data + len, t - prev.s_time);
+        len += put_varint(data + len, ZIGZAG((int32_t)state->s_balance - prev.s_balance));
+        len += put_varint(data + len, ZIGZAG((int32_t)state->s_balance_pending_in - prev.s_balance_pending_in));
+        prev = *state;
+        prev.s_time = t;
+    }
+    msg.s_header.s_payload_len = len;
+
+    send_blocking(pc, dst, &msg);
+}
+
+/** 展开 send_balance_history() 发送的余额历史
+ *
+ * 两个变化项之间的时刻沿用前一项的状态，超过 MAX_T 的时刻放不进 BalanceHistory，被丢弃。
+ *
+ * @param msg		BALANCE_HISTORY 消息
+ * @param bh		存放余额历史的位置
+ *
+ * @return -1 负载格式错误, 0 成功
+ */
+int read_balance_history(const Message* msg, BalanceHistory* bh)
+{
+    const uint8_t* data = (const uint8_t*)msg->s_payload;
+    size_t len = msg->s_header.s_payload_len;
+    size_t pos = 1;
+    BalanceState state = {0, 0, 0};
+    uint32_t history_len, delta;
+    uint32_t time = 0, t = 0;
+    int entries = 0;
+
+    if (!len || get_varint(data, len, &pos, &history_len))
+    {
+        return -1;
+    }
+    bh->s_id = data[0];
+    bh->s_history_len = history_len < MAX_T ? history_len : MAX_T;
+
+    while (pos < len)
+    {
+        if (get_varint(data, len, &pos, &delta))
+        {
+            return -1;
+        }
+        // 第一项是时刻 0，之后的时刻严格递增
+        if ((entries ? !delta : delta != 0) || delta >= history_len - time)
+        {
+            return -1;
+        }
+        time += delta;
+        // 上一项之后的时刻保持它的状态
+        for (; t < time && t < bh->s_history_len; t++)
+        {
+            bh->s_history[t] = state;
+            bh->s_history[t].s_time = t;
+        }
+        if (get_varint(data, len, &pos, &delta))
+        {
+            return -1;
+        }
+        state.s_balance = (int32_t)state.s_balance + UNZIGZAG(delta);
+        if (get_varint(data, len, &pos, &delta))
+        {
+            return -1;
+        }
+        state.s_balance_pending_in = (int32_t)state.s_balance_pending_in + UNZIGZAG(delta);
+        entries++;
+    }
+    if (history_len && !entries)
+    {
+        return -1;
+    }
+    for (; t < bh->s_history_len; t++)
+    {
+        bh->s_history[t] = state;
+        bh->s_history[t].s_time = t;
+    }
+    return 0;
+}
+
+/** 发送 RESET 消息，开始池的下一个场景
+ *
+ * @param pc		管道通讯对象指针
+ * @param dst 		目标ID
+ * @param order		场景信息
+ */
+void send_reset_msg(PipesCommunication* pc, local_id dst, ResetOrder* order)
+{
+    Message msg;
+    msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_payload_len = sizeof(ResetOrder);
+    msg.s_header.s_type = RESET;
+    msg.s_header.s_local_time = get_lamport_time();
+    memcpy(msg.s_payload, order, msg.s_header.s_payload_len);
+    send_blocking(pc, dst, &msg);
 }
 
 /** 接收所有消息
+ * 使用树形屏障时 PARENT_ID 接收屏障树中子节点的事件，其他进程接收父节点的释放消息，释放消息继续向下传
+ * 期间收到的其他类型的消息被暂存，留给之后的接收
  *
  * @param pc		管道通讯对象指针
  * @param type		消息类型
@@ -235,15 +1012,32 @@ void receive_all_msgs(PipesCommunication* pc, MessageType type)
 {
     Message msg;
 
-    for (local_id i = 1; i < pc->total_ids; i++)
+    if (pc->barrier == BARRIER_TREE)
     {
-        if (i == pc->current_id)
+        if (pc->current_id == PARENT_ID)
         {
-            continue;
+            receive_tree_arrivals(pc);
         }
-        while (receive(pc, i, &msg) < 0);
+        else
+        {
+            while (receive_type(pc, (pc->current_id - 1) / 2, type, &msg) < 0);
 
-        set_lamport_time_from_msg(&msg);
+            set_lamport_time_from_msg(&msg);
+        }
+        send_tree_release(pc, type);
+    }
+    else
+    {
+        for (local_id i = 1; i < pc->active_ids; i++)
+        {
+            if (i == pc->current_id)
+            {
+                continue;
+            }
+            while (receive_type(pc, i, type, &msg) < 0);
+
+            set_lamport_time_from_msg(&msg);
+        }
     }
 
     switch (type)
@@ -3,21 +3,331 @@
 
 #include "ipc.h"
 #include "banking.h"
+#include "shm.h"
+#include "mailbox.h"
+#include "broker.h"
 
+typedef enum
+{
+    TRANSPORT_PIPE = 0,
+    TRANSPORT_SHM = 1,
+    TRANSPORT_SEQPACKET = 2,
+    TRANSPORT_MAILBOX = 3, // 进程是同一进程中的线程
+    TRANSPORT_COUNT = 4,
+} TransportType;
+
+/**
+* 自定义的消息类型，ipc.h 的 MessageType 不能修改
+*/
+enum
+{
+    RESET = CS_RELEASE + 1, // 池模式中开始下一个场景
+    TRANSFER_BATCH,         // 同一源进程或同一目标进程的多笔账单
+    WATERMARK,              // 目标进程的累计 ACK
+    WATERMARK_REQUEST,      // 父进程向目标进程索要 WATERMARK
+    CREDIT,                 // 接收者授予通道信用，在 receive() 之前被去掉
+    MESSAGE_TYPE_COUNT,
+};
+
+/**
+* 头部扩展，写在 magic 为 MESSAGE_MAGIC_CREDIT 的消息内容之后
+*/
+typedef struct
+{
+    uint32_t s_read; // 消息发送者从其接收者的通道中读出的字节数
+} __attribute__((packed)) CreditGrant;
+
+/**
+* RESET 消息的内容
+*/
+typedef struct
+{
+    balance_t s_balance;   // 场景的初始金额
+    local_id s_proc_count; // 参与场景的子进程数量
+} __attribute__((packed)) ResetOrder;
+
+/**
+* TRANSFER 消息的内容，ACK 把 s_seq 带回父进程
+*/
+typedef struct
+{
+    TransferOrder s_order;
+    uint16_t s_seq; // 父进程分配的序号，会回绕
+} __attribute__((packed)) SeqTransferOrder;
+
+/**
+* TRANSFER_BATCH 消息的内容，账单占满其余部分
+*/
+typedef struct
+{
+    uint16_t s_seq; // 整批及其转发给各目标进程的部分使用同一序号
+    TransferOrder s_orders[];
+} __attribute__((packed)) TransferBatch;
+
+/**
+* ACK 消息的内容
+*/
+typedef struct
+{
+    uint16_t s_seq;
+    uint16_t s_count; // 发送者完成的该批账单数量，TRANSFER 为 1
+} __attribute__((packed)) TransferAck;
+
+/**
+* WATERMARK 消息的内容
+*/
+typedef struct
+{
+    local_id s_dst;     // 发送者
+    uint16_t s_settled; // 发给它的序号小于此值的账单都已完成
+} __attribute__((packed)) TransferWatermark;
+
+/**
+* 转账窗口的一格，序号为 seq 的转账占用第 seq % window 格
+*/
+typedef struct
+{
+    TransferOrder order;
+    uint16_t dst_seq;     // 账单在发给同一目标进程的账单中的序号，仅用于 ACK_WATERMARK
+    TransferOrder* batch; // TRANSFER_BATCH 的账单，TRANSFER 时为 NULL
+    size_t count;         // 已发送的账单数量
+    size_t left;          // 尚未确认的账单数量
+    uint16_t seq;
+    int busy; // 已发送，尚未收到 ACK
+} PendingTransfer;
+
+typedef enum
+{
+    FLUSH_IMMEDIATE = 0, // 每次 send() 立即写出
+    FLUSH_BATCH = 1,     // 管道消息先积累，ipc_flush() 或接收阻塞前再写出
+} FlushPolicy;
+
+typedef enum
+{
+    ACK_EACH = 0,      // 目标进程对每个 TRANSFER 发送 ACK
+    ACK_WATERMARK = 1, // 目标进程不时发送已完成的账单数量
+} AckMode;
+
+typedef enum
+{
+    RECEIVE_FIRST = 0,       // receive_any() 从 ID 0 开始扫描通道
+    RECEIVE_ROUND_ROBIN = 1, // 从上次服务的通道的下一个开始扫描
+    RECEIVE_WEIGHTED = 2,    // 同上，但每个通道可以连续给出不超过其权重的消息
+    RECEIVE_OLDEST = 3,      // 在所有通道的第一条消息中取发送时间最早的
+} ReceivePolicy;
+
+typedef enum
+{
+    LANES_SINGLE = 0,  // 同一发送者的消息按发送顺序取出
+    LANES_CONTROL = 1, // 已到达的 STOP / DONE / CS_RELEASE 先于其他消息取出
+} LaneMode;
+
+typedef enum
+{
+    BARRIER_ALL = 0,  // STARTED / DONE 发送给所有进程
+    BARRIER_TREE = 1, // 合并树: 事件沿树向上传到 PARENT_ID，释放消息沿树向下传
+} BarrierType;
+
+enum
+{
+    READ_BUFFER_SIZE = 64 * 1024,  // 每个读管道的预读缓冲区，与管道默认容量相同
+    WRITE_BUFFER_SIZE = 16 * 1024, // 每个写管道积累消息的缓冲区
+    SEND_SPIN_COUNT = 8,           // 通道满时先用 sched_yield() 重试的次数，之后休眠
+    MAX_PROCESS_COUNT = INT8_MAX,  // 包含父进程的最大进程数量：进程ID是 int8_t 类型的 local_id
+    MAX_TRANSFER_WINDOW = 1024,    // 其 ACK 能放进父进程的预读缓冲区，通道满时不会卡住 ACK
+    MAX_TRANSFER_BATCH = (MAX_PAYLOAD_LEN - sizeof(TransferBatch)) / sizeof(TransferOrder), // 一条消息最多的账单数量
+    WATERMARK_INTERVAL = 32,       // 目标进程在没人索要时每完成这么多笔账单发送一次 WATERMARK
+    MESSAGE_MAGIC_CREDIT = 0xAFAC, // 消息之后跟着 CreditGrant
+    MAX_FRAME_LEN = sizeof(Message) + sizeof(CreditGrant),
+    MIN_CREDIT_WINDOW = 2 * MAX_FRAME_LEN, // 一次授予的一半窗口放得下任何消息
+    MAX_CREDIT_WINDOW = 60 * 1024, // 给 CREDIT 消息留出管道默认容量中的空间
+    MIN_PIPE_SIZE = 4096,          // 一页，F_SETPIPE_SZ 给出的最小容量
+    MAX_PIPE_SIZE = 1024 * 1024,   // /proc/sys/fs/pipe-max-size 的默认值，普通进程不能超过
+};
+
+/**
+* 父进程保存的一个目标进程的水位
+*/
+typedef struct
+{
+    uint16_t next;      // 下一笔发给该目标进程的账单序号
+    uint16_t settled;   // 最后收到的水位
+    uint16_t requested; // 最后一次 WATERMARK_REQUEST 索要的水位
+} SettleState;
+
+/**
+* 当前进程作为目标进程已完成的账单
+*/
+typedef struct
+{
+    uint16_t settled;  // 序号小于此值的账单都已完成
+    uint16_t reported; // 最后发送的水位
+    uint16_t target;   // 父进程等待的水位
+    int asked;         // 收到了 WATERMARK_REQUEST 且尚未达到 target
+    char done[MAX_TRANSFER_WINDOW]; // 先于 settled 完成的账单，按序号 % MAX_TRANSFER_WINDOW 标记
+} SettleMarks;
+
+typedef struct
+{
+    size_t start; // 下一条消息的起始位置
+    size_t end;   // 已读入数据的结束位置
+    size_t parsed;   // 完整消息的结束位置，其信用扩展已去掉
+    size_t scanned;  // 已检查过是否为控制通道消息的消息的结束位置
+    size_t controls; // 已检查的消息中控制通道消息的数量
+    char data[READ_BUFFER_SIZE];
+} ReadBuffer;
+
+typedef struct
+{
+    size_t start; // 第一个尚未写出的字节
+    size_t end;   // 已积累数据的结束位置
+    char data[WRITE_BUFFER_SIZE];
+} WriteBuffer;
+
+/**
+* receive_type() 暂存的消息
+*/
+typedef struct StashNode
+{
+    struct StashNode* next;
+    uint32_t order; // 在同一发送者的消息中暂存的顺序
+    Message msg;    // 只分配消息头和内容的长度
+} StashNode;
+
+/**
+* receive_type() 暂存的同一发送者的消息，每种类型一个 FIFO
+*/
+typedef struct
+{
+    StashNode* first[MESSAGE_TYPE_COUNT + 1]; // 最后一个存放未知类型
+    StashNode* last[MESSAGE_TYPE_COUNT + 1];
+    uint32_t next_order;
+    size_t count;
+} Stash;
+
+/**
+* 写通道等待空闲空间的统计
+*/
+typedef struct
+{
+    size_t retries;      // 发现通道已满的发送次数
+    size_t waits;        // 休眠等待通道可写的次数
+    uint64_t blocked_ns; // 等待空闲空间的时间
+    size_t credit_waits; // 其中等待接收者信用的次数
+} SendStats;
+
+/**
+* 与一个进程之间两个方向通道的信用
+* 发送者在通道中最多保留 credit_window 个接收者尚未读出的字节
+*/
+typedef struct
+{
+    uint32_t sent;     // 累计发给该进程的字节数
+    uint32_t granted;  // 其中它最后一次授予时已读出的字节数
+    uint32_t read;     // 累计从该进程的通道读出的字节数
+    uint32_t reported; // 其中已告知它的字节数
+} ChannelCredit;
+
+/**
+* 到一个进程和来自它的管道的内核缓冲区
+*/
 typedef struct
 {
-    int* pipes;
+    size_t peak;       // 读取时在来自该进程的管道中见到的最多字节数
+    int peak_capacity; // 见到峰值时该管道的容量
+    int capacity;      // 到该进程的管道的容量，从未设置时为 0
+    size_t full;       // 到该进程的管道已满的次数
+    size_t grown;      // 因此增大容量的次数
+} PipeStats;
+
+/**
+* receive_any() 对一个读通道的服务统计
+*/
+typedef struct
+{
+    size_t served;   // 取出的消息数量
+    size_t last;     // 取出上一条消息时所有通道共取出的消息数量
+    size_t max_wait; // 两条消息之间其他通道取出的消息数量的最大值
+} ReceiveStats;
+
+/**
+* 一种传输方式的操作，self 为 PipesCommunication
+* ipc.c 的公共函数检查ID后通过它们分派
+*/
+typedef struct
+{
+    const char* name; // --transport= 选项中的名称
+    int packets;      // 一次 read() 读出一条完整消息
+    int (*send)(void* self, local_id dst, const Message* msg);       // 不等待, 通道已满时返回 -3
+    int (*send_multicast)(void* self, const Message* msg);          // 同上, 逐个发送时为 NULL
+    int (*receive)(void* self, local_id from, Message* msg);
+    int (*receive_any)(void* self, Message* msg);                   // 从 scan_start 开始扫描, 设置 last_msg_from
+    int (*try_receive)(void* self, local_id from, Message* msg);    // 不等待, 没有消息时返回 -1
+    int (*take_control)(void* self, local_id from, Message* msg);   // 不等待, 没有已到达的控制通道消息时返回 -1, 先于其他消息取出时返回 1
+    int (*wait_writable)(void* self, local_id dst, size_t attempt); // 发往 dst 的通道已满后调用, 不会满时为 NULL
+} Transport;
+
+extern const Transport* const transports[TRANSPORT_COUNT];
+
+typedef struct
+{
+    TransportType transport;
+    const Transport* ops;
+    int* pipes;            // 通道文件描述符，代理分发之前为 -1
+    int broker_fd;         // 到通道代理的控制套接字
+    ShmRegion* shm;
+    Mailbox* mailboxes;    // 所有线程的邮箱
+    MailQueue* queues;     // 从本线程邮箱取出的消息，每个发送者一个队列
     local_id current_id;
     size_t total_ids;
+    size_t active_ids;     // 当前池场景的进程数量，非池模式时等于 total_ids
     balance_t balance;
+    int epoll_fd;          // 监听所有读管道的 epoll
+    size_t open_channels;  // 写者可能还会发送的读通道数量
+    char* ready;           // 已就绪但尚未读空的通道
+    size_t wakeups;        // epoll_wait()/poll() 返回次数
+    size_t spurious_polls; // 未读到消息的唤醒次数
+    ReadBuffer** buffers;  // 读管道的预读缓冲区，首次读取时分配
+    size_t reads;          // 读通道的 read() 调用次数
+    FlushPolicy flush_policy;
+    BarrierType barrier;
+    size_t arrived;        // 先于本进程事件收到的屏障树子节点事件数量
+    WriteBuffer** out_buffers; // 写管道积累的消息，首次发送时分配
+    size_t writes;         // 写通道的 write()/writev() 调用次数
+    SendStats* send_stats; // 每个写通道一项，当前进程的一项为共享内存广播缓冲区
+    char* closed;          // 写端已关闭的读通道
+    size_t window;         // 父进程同时在途的转账数量
+    PendingTransfer* pending; // window 格，首次转账时分配
+    size_t in_flight;      // 已占用的格数
+    uint16_t next_seq;     // 下一笔转账的序号
+    size_t batch;          // 父进程打包进一条 TRANSFER_BATCH 的同一源进程账单数量，为 1 时发送 TRANSFER
+    TransferOrder** batches; // 按源进程积累的账单，首笔账单时分配
+    size_t* batch_lens;
+    AckMode ack_mode;
+    SettleState* settle;   // 父进程: 每个目标进程一项，首笔账单时分配
+    SettleMarks* marks;    // 子进程: 首笔账单时分配
+    Stash** stashes;       // 暂存的消息，每个发送者一项，首次暂存时分配
+    size_t parked;         // 当前暂存的消息数量
+    size_t stashed;        // 累计暂存的消息数量
+    ReceivePolicy receive_policy;
+    size_t scan_start;     // receive_any() 首先尝试的通道
+    size_t burst;          // 从 scan_start 通道连续取出的消息数量
+    size_t* weights;       // 每个通道可以连续给出的消息数量，只用于 RECEIVE_WEIGHTED
+    ReceiveStats* receive_stats; // 每个读通道一项
+    size_t received;       // receive_any() 取出的消息数量
+    local_id last_msg_from; // receive_any() 最后一条消息的发送者
+    LaneMode lanes;
+    size_t overtaken;      // 先于同一发送者更早的消息取出的控制通道消息数量
+    size_t credit_window;  // 发送者可以在通道中保留的未读字节数，0 为不使用信用
+    ChannelCredit* credits; // 每个进程一项，启用信用时分配
+    local_id credit_wait;  // 最后一次因没有信用而被拒绝的发送的接收者，没有时为 -1
+    size_t grants;         // 发送的 CREDIT 消息数量
+    size_t pipe_size;      // 新管道的容量，0 为内核默认值
+    size_t parent_pipe_size; // 到 PARENT_ID 的新管道的容量，0 为与 pipe_size 相同
+    size_t pipe_grow;      // 管道每满这么多次容量加倍，0 为不增大
+    PipeStats* pipe_stats; // 每个进程一项
 } PipesCommunication;
 
-enum PipeTypeOffset
-{
-    PIPE_READ_TYPE = 0,
-    PIPE_WRITE_TYPE = 1,
-};
-
 enum RESULT_SET_NONBLOCK
 {
     ERROR_SET_NONBLOCK_NO_SET = -2,
@@ -25,16 +335,45 @@ enum RESULT_SET_NONBLOCK
     RESULT_SET_NONBLOCK_SUCCESS = 0,
 };
 
-int* pipes_init(size_t proc_count);
-PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id curr_proc, balance_t balance);
+int get_transport_type(const char* name);
+int get_flush_policy(const char* name);
+int get_barrier_type(const char* name);
+int get_transfer_window(const char* value);
+int get_transfer_batch(const char* value);
+int get_ack_mode(const char* name);
+int get_receive_policy(const char* name);
+int get_lane_mode(const char* name);
+int get_credit_window(const char* value);
+int get_pipe_size(const char* value);
+int get_pipe_grow(const char* value);
+int* pipes_init(size_t proc_count, TransportType transport);
+PipesCommunication* communication_init(TransportType transport, int* pipes, ShmRegion* shm, Mailbox* mailboxes, size_t proc_count, local_id curr_proc, balance_t balance);
 void communication_release(PipesCommunication* pc);
+void set_flush_policy(PipesCommunication* pc, FlushPolicy policy);
+void set_receive_policy(PipesCommunication* pc, ReceivePolicy policy);
+int set_credit_window(PipesCommunication* pc, size_t window);
+int set_pipe_size(PipesCommunication* pc, size_t size, size_t parent_size, size_t grow);
+int set_transfer_window(PipesCommunication* pc, size_t window);
+int ipc_flush(PipesCommunication* pc);
+int send_blocking(PipesCommunication* pc, local_id dst, const Message* msg);
+int receive_type(PipesCommunication* pc, local_id from, int16_t type, Message* msg);
 
 int send_all_proc_event_msg(PipesCommunication* pc, MessageType type);
 void send_all_stop_msg(PipesCommunication* pc);
-void send_transfer_msg(PipesCommunication* pc, local_id dst, TransferOrder* order);
-void send_ack_msg(PipesCommunication* pc, local_id dst);
+void send_transfer_msg(PipesCommunication* pc, local_id dst, SeqTransferOrder* order);
+void send_transfer_batch_msg(PipesCommunication* pc, local_id dst, uint16_t seq, const TransferOrder* orders, size_t count);
+void send_ack_msg(PipesCommunication* pc, local_id dst, uint16_t seq, uint16_t count);
+void send_watermark_msg(PipesCommunication* pc, local_id dst, uint16_t settled);
+void send_watermark_request_msg(PipesCommunication* pc, local_id dst, uint16_t target);
 void send_balance_history(PipesCommunication* pc, local_id dst, BalanceHistory* history);
+int read_balance_history(const Message* msg, BalanceHistory* history);
+void send_reset_msg(PipesCommunication* pc, local_id dst, ResetOrder* order);
 
 void receive_all_msgs(PipesCommunication* pc, MessageType type);
 
+void transfer_async(PipesCommunication* pc, local_id src, local_id dst, balance_t amount);
+void transfer_wait_all(PipesCommunication* pc);
+void settle_order(PipesCommunication* pc, uint16_t seq);
+void settle_request(PipesCommunication* pc, const Message* msg);
+
 #endif
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include "fiber.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+typedef struct
+{
+    ucontext_t ctx;
+    char* stack;
+    void* arg;
+    void* const* wait;                  // *wait 不为 NULL 之前纤程处于阻塞状态
+    int done;
+    uint64_t locals[FIBER_LOCAL_COUNT]; // 纤程切出时保存的私有变量值
+} Fiber;
+
+/**
+* 调用 fiber_run() 的线程的调度器，同一时间只能运行一个
+*/
+static struct
+{
+    Fiber* fibers;
+    size_t count;
+    int current;     // 正在运行的纤程，在调度器中为 -1
+    ucontext_t ctx;  // 纤程切回的调度器上下文
+    void* (*func)(void*);
+    void* locals[FIBER_LOCAL_COUNT];
+    size_t local_sizes[FIBER_LOCAL_COUNT];
+    size_t local_count;
+} sched = { NULL, 0, -1 };
+
+/**
+* 每个纤程的入口
+*/
+static void fiber_start()
+{
+    Fiber* fiber = &sched.fibers[sched.current];
+
+    sched.func(fiber->arg);
+    fiber->done = 1;
+    // 返回后恢复 uc_link，即调度器
+}
+
+/**
+* 运行纤程直到它阻塞或返回，运行期间私有变量取它自己的值
+*/
+static void switch_to(int id)
+{
+    Fiber* fiber = &sched.fibers[id];
+
+    for (size_t i = 0; i < sched.local_count; i++)
+    {
+        memcpy(sched.locals[i], &fiber->locals[i], sched.local_sizes[i]);
+    }
+    fiber->wait = NULL;
+    sched.current = id;
+    swapcontext(&sched.ctx, &fiber->ctx);
+    sched.current = -1;
+    for (size_t i = 0; i < sched.local_count; i++)
+    {
+        memcpy(&fiber->locals[i], sched.locals[i], sched.local_sizes[i]);
+    }
+}
+
+/**
+* 释放纤程的栈
+*/
+static void free_fibers()
+{
+    for (size_t i = 0; i < sched.count; i++)
+    {
+        munmap(sched.fibers[i].stack, FIBER_STACK_SIZE);
+    }
+    free(sched.fibers);
+    sched.fibers = NULL;
+    sched.count = 0;
+}
+
+/** 把变量设为每个纤程私有
+ * 纤程切出时保存变量的值，切入时恢复
+ * 每个纤程的初始值是调用 fiber_run() 时变量的值
+ *
+ * @param var		变量指针
+ * @param size		变量大小，最多 FIBER_LOCAL_SIZE
+ *
+ * @return -1 变量太多或太大, 0 成功
+ */
+int fiber_local(void* var, size_t size)
+{
+    if (sched.local_count == FIBER_LOCAL_COUNT || size > FIBER_LOCAL_SIZE)
+    {
+        return -1;
+    }
+    sched.locals[sched.local_count] = var;
+    sched.local_sizes[sched.local_count] = size;
+    sched.local_count++;
+    return 0;
+}
+
+/** 对每个参数以纤程运行 func，所有纤程返回后结束
+ * 纤程按ID顺序切换，只在运行中的纤程在 fiber_wait() 中阻塞时切换，所以运行结果是确定的
+ * 阻塞的纤程在等待的东西到来之前被跳过
+ *
+ * @param count		纤程数量
+ * @param func		纤程函数
+ * @param args		count 个参数的数组，func 得到其中一个的指针
+ * @param arg_size	一个参数的大小
+ *
+ * @return -1 分配栈错误, -2 所有纤程都阻塞, 0 成功
+ */
+int fiber_run(size_t count, void* (*func)(void*), void* args, size_t arg_size)
+{
+    size_t alive = count;
+
+    sched.fibers = calloc(count, sizeof(Fiber));
+    sched.count = count;
+    sched.func = func;
+    for (size_t i = 0; i < count; i++)
+    {
+        Fiber* fiber = &sched.fibers[i];
+
+        fiber->stack = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (fiber->stack == MAP_FAILED)
+        {
+            sched.count = i;
+            free_fibers();
+            return -1;
+        }
+        fiber->arg = (char*)args + i * arg_size;
+        for (size_t j = 0; j < sched.local_count; j++)
+        {
+            memcpy(&fiber->locals[j], sched.locals[j], sched.local_sizes[j]);
+        }
+        getcontext(&fiber->ctx);
+        fiber->ctx.uc_stack.ss_sp = fiber->stack;
+        fiber->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+        fiber->ctx.uc_link = &sched.ctx;
+        makecontext(&fiber->ctx, fiber_start, 0);
+    }
+
+    while (alive)
+    {
+        int progress = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            Fiber* fiber = &sched.fibers[i];
+
+            if (fiber->done || (fiber->wait && !__atomic_load_n(fiber->wait, __ATOMIC_ACQUIRE)))
+            {
+                continue;
+            }
+            switch_to(i);
+            alive -= fiber->done;
+            progress = 1;
+        }
+        // 已经没有纤程可以发送消息
+        if (!progress)
+        {
+            free_fibers();
+            return -2;
+        }
+    }
+    free_fibers();
+    return 0;
+}
+
+/** 取得正在运行的纤程ID
+ *
+ * @return 纤程在 fiber_run() 参数中的序号, 调用者不是纤程时为 -1
+ */
+int fiber_current()
+{
+    return sched.current;
+}
+
+/** 阻塞当前纤程直到 *ptr 不为 NULL，切换到下一个可运行的纤程
+ *
+ * @param ptr		由其他纤程设为非 NULL 的指针，例如邮箱头
+ */
+void fiber_wait(void* const* ptr)
+{
+    Fiber* fiber = &sched.fibers[sched.current];
+
+    fiber->wait = ptr;
+    swapcontext(&fiber->ctx, &sched.ctx);
+}
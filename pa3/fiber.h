@@ -0,0 +1,19 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_FIBER__H
+#define __IFMO_DISTRIBUTED_CLASS_FIBER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    FIBER_STACK_SIZE = 1024 * 1024, // 只保留地址空间，首次访问时才分配页面
+    FIBER_LOCAL_COUNT = 4,          // 可以设为纤程私有的变量个数
+    FIBER_LOCAL_SIZE = sizeof(uint64_t),
+};
+
+int fiber_local(void* var, size_t size);
+int fiber_run(size_t count, void* (*func)(void*), void* args, size_t arg_size);
+int fiber_current();
+void fiber_wait(void* const* ptr);
+
+#endif
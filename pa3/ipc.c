@@ -1,7 +1,35 @@
-﻿#include "ipc.h"
+﻿#define _GNU_SOURCE
+
+#include "ipc.h"
 #include "communication.h"
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+// 代理无法打开的通道的写端，写入时返回 EBADF
+#define CHANNEL_REFUSED (-2)
+
+// receive_any() 第 k 个尝试的通道
+#define SCAN_ID(pc, k) ((local_id)(((pc)->scan_start + (k)) % (pc)->total_ids))
+
+// 未知类型的消息放在最后一个队列
+#define STASH_QUEUE(type) ((type) >= 0 && (type) < MESSAGE_TYPE_COUNT ? (type) : MESSAGE_TYPE_COUNT)
+#define STASH_NODE_LEN(msg) (offsetof(StashNode, msg) + sizeof(MessageHeader) + (msg)->s_header.s_payload_len)
 
+// 消息在通道中的字节数，包括信用扩展
+#define FRAME_LEN(msg) (sizeof(MessageHeader) + (msg)->s_header.s_payload_len + \
+        ((msg)->s_header.s_magic == MESSAGE_MAGIC_CREDIT ? sizeof(CreditGrant) : 0))
+
+// 读取时授予信用，由 pipe_send() 发出
+static int grant_credit(PipesCommunication* this, local_id to, size_t min);
 
 
 /**
@@ -13,87 +41,1762 @@ int8_t get_index(int8_t x, int8_t id)
 }
 
 /**
-* 发送消息
+* 取得读管道
 */
-int send(void* self, local_id dst, const Message* msg)
+static int get_read_fd(PipesCommunication* pc, local_id from)
 {
-    PipesCommunication* from = (PipesCommunication*)self;
+    return pc->pipes[get_index(from, pc->current_id) * 2 + PIPE_READ_TYPE];
+}
+
+/**
+* 取得写管道
+*/
+static int get_write_fd(PipesCommunication* pc, local_id dst)
+{
+    return pc->pipes[get_index(dst, pc->current_id) * 2 + PIPE_WRITE_TYPE];
+}
+
+/**
+* 设置与 peer 之间的通道端
+*/
+static void set_channel_fd(PipesCommunication* pc, local_id peer, int type, int fd)
+{
+    pc->pipes[get_index(peer, pc->current_id) * 2 + type] = fd;
+}
+
+/**
+* 取得预读缓冲区中第一条完整消息的长度
+*
+* @return 0 消息尚未读完整, 否则为消息长度
+*/
+static size_t buffered_length(const ReadBuffer* buf)
+{
+    MessageHeader header;
+    size_t len;
 
-    if (dst == from->current_id)
+    if (buf->parsed - buf->start < sizeof(MessageHeader))
     {
-        return -1;
+        return 0;
+    }
+    memcpy(&header, buf->data + buf->start, sizeof(MessageHeader));
+    len = sizeof(MessageHeader) + header.s_payload_len;
+    return buf->parsed - buf->start < len ? 0 : len;
+}
+
+/**
+* 检查缓冲区是否一定还能放下一条消息
+*/
+static int has_room(const ReadBuffer* buf)
+{
+    return !buf || READ_BUFFER_SIZE - (buf->end - buf->start) >= MAX_FRAME_LEN;
+}
+
+/**
+* 取得读通道的预读缓冲区，首次使用时分配
+*
+* @return NULL 内存不足
+*/
+static ReadBuffer* get_buffer(PipesCommunication* pc, local_id from)
+{
+    ReadBuffer* buf;
+
+    if (!(buf = pc->buffers[from]))
+    {
+        if (!(buf = malloc(sizeof(ReadBuffer))))
+        {
+            return NULL;
+        }
+        buf->start = buf->end = buf->parsed = 0;
+        buf->scanned = buf->controls = 0;
+        pc->buffers[from] = buf;
+    }
+    return buf;
+}
+
+/**
+* 将不完整的消息移到缓冲区开头，保证剩余部分放得下
+*/
+static void compact_buffer(ReadBuffer* buf)
+{
+    if (buf->start)
+    {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->parsed -= buf->start;
+        buf->scanned = buf->scanned > buf->start ? buf->scanned - buf->start : 0;
+        buf->start = 0;
+    }
+}
+
+/**
+* 去掉读入消息的信用扩展，应用其中的授予
+* CREDIT 消息只有扩展，直接丢弃，其后的消息前移，使 start 到 parsed 之间都是完整消息
+*/
+static void take_grants(PipesCommunication* this, local_id from, ReadBuffer* buf)
+{
+    ChannelCredit* credit = &this->credits[from];
+    MessageHeader header;
+    CreditGrant grant;
+    size_t pos = buf->parsed;
+    size_t len, ext;
+
+    while (buf->end - pos >= sizeof(MessageHeader))
+    {
+        memcpy(&header, buf->data + pos, sizeof(MessageHeader));
+        len = sizeof(MessageHeader) + header.s_payload_len;
+        ext = header.s_magic == MESSAGE_MAGIC_CREDIT ? sizeof(CreditGrant) : 0;
+        if (header.s_payload_len > MAX_PAYLOAD_LEN || buf->end - pos < len + ext)
+        {
+            break;
+        }
+        if (ext)
+        {
+            memcpy(&grant, buf->data + pos + len, sizeof(CreditGrant));
+            if ((int32_t)(grant.s_read - credit->granted) > 0)
+            {
+                credit->granted = grant.s_read;
+            }
+            header.s_magic = MESSAGE_MAGIC;
+            memcpy(buf->data + pos, &header, sizeof(MessageHeader));
+        }
+        if (header.s_type != CREDIT)
+        {
+            if (pos != buf->parsed)
+            {
+                memmove(buf->data + buf->parsed, buf->data + pos, len);
+            }
+            buf->parsed += len;
+        }
+        pos += len + ext;
+    }
+    if (pos != buf->parsed)
+    {
+        memmove(buf->data + buf->parsed, buf->data + pos, buf->end - pos);
+        buf->end -= pos - buf->parsed;
+    }
+}
+
+/**
+* 记录在来自该进程的管道中见到的最多字节数
+* 读取后缓冲区仍有空间时已取走管道中的全部数据，否则由 FIONREAD 得到剩余部分
+*/
+static void note_occupancy(PipesCommunication* pc, local_id from, size_t len, size_t space)
+{
+    PipeStats* stats = &pc->pipe_stats[from];
+    int left;
+
+    if (len == space && !ioctl(get_read_fd(pc, from), FIONREAD, &left))
+    {
+        len += left;
+    }
+    if (len > stats->peak)
+    {
+        stats->peak = len;
+        stats->peak_capacity = fcntl(get_read_fd(pc, from), F_GETPIPE_SZ);
+    }
+}
+
+/**
+* 从通道读入预读缓冲区
+* 管道一次读出其中的全部数据，套接字一次读出一条消息
+* 启用信用时，读出的字节达到窗口的一半就授予回去
+*
+* @return -2 没有读到数据, -3 读取错误或消息损坏, -4 通道已关闭, 0 成功
+*/
+static int fill_buffer(PipesCommunication* pc, local_id from, ReadBuffer* buf)
+{
+    MessageHeader header;
+    size_t space;
+    ssize_t len;
+
+    compact_buffer(buf);
+    if (buf->end >= sizeof(MessageHeader))
+    {
+        memcpy(&header, buf->data, sizeof(MessageHeader));
+        if (header.s_payload_len > MAX_PAYLOAD_LEN)
+        {
+            return -3;
+        }
+    }
+
+    // 套接字消息必须整个放下，否则剩余部分会丢失
+    space = READ_BUFFER_SIZE - buf->end;
+    if (pc->ops->packets)
+    {
+        if (space < MAX_FRAME_LEN)
+        {
+            return -2;
+        }
+        space = MAX_FRAME_LEN;
     }
-    if (write(from->pipes[get_index(dst, from->current_id) * 2 + PIPE_WRITE_TYPE],
-        msg, sizeof(MessageHeader) + msg->s_header.s_payload_len) < 0)
+    if (!space)
     {
         return -2;
     }
+
+    len = read(get_read_fd(pc, from), buf->data + buf->end, space);
+    pc->reads++;
+    if (len < 0)
+    {
+        return errno == EAGAIN ? -2 : -3;
+    }
+    if (!len)
+    {
+        return -4;
+    }
+    if (pc->ops->packets)
+    {
+        memcpy(&header, buf->data + buf->end, sizeof(MessageHeader));
+        if (len < (int)sizeof(MessageHeader) || len != FRAME_LEN((Message*)&header))
+        {
+            return -3;
+        }
+    }
+    else
+    {
+        note_occupancy(pc, from, len, space);
+    }
+    buf->end += len;
+
+    if (!pc->credit_window)
+    {
+        buf->parsed = buf->end;
+        return 0;
+    }
+    pc->credits[from].read += len;
+    take_grants(pc, from, buf);
+    grant_credit(pc, from, pc->credit_window / 2);
     return 0;
 }
 
 /**
-* 发送广播
+* 从预读缓冲区取出第一条完整消息
+*
+* @return -1 没有完整消息, 0 成功
 */
-int send_multicast(void* self, const Message* msg)
+static int take_buffered(PipesCommunication* pc, local_id from, Message* msg)
 {
-    PipesCommunication* from = (PipesCommunication*)self;
-    local_id i;
+    ReadBuffer* buf = pc->buffers[from];
+    size_t len;
+
+    if (!buf || !(len = buffered_length(buf)))
+    {
+        return -1;
+    }
+    memcpy(msg, buf->data + buf->start, len);
+    if (buf->start < buf->scanned && IS_CONTROL_TYPE(msg->s_header.s_type))
+    {
+        buf->controls--;
+    }
+    buf->start += len;
+    if (buf->start == buf->end)
+    {
+        buf->start = buf->end = buf->parsed = 0;
+        buf->scanned = 0;
+    }
+
+    // 管道可能已读空，但 receive_any() 仍需看到缓冲区中的消息
+    pc->ready[from] = buffered_length(buf) != 0;
+    return 0;
+}
+
+/**
+* 从预读缓冲区取出第一条控制通道消息
+* 先检查尚未检查过的完整消息，被跳过的消息向后移动，保持原有顺序
+*
+* @return -1 缓冲区中没有, 0 它是第一条消息, 1 它先于其他消息取出
+*/
+static int take_buffered_control(PipesCommunication* pc, local_id from, Message* msg)
+{
+    ReadBuffer* buf = pc->buffers[from];
+    MessageHeader header;
+    size_t pos, len;
 
-    for (i = 0; i < from->total_ids; i++)
+    if (!buf)
+    {
+        return -1;
+    }
+    if (buf->scanned < buf->start)
+    {
+        buf->scanned = buf->start;
+    }
+    while (buf->parsed - buf->scanned >= sizeof(MessageHeader))
     {
-        if (i == from->current_id)
+        memcpy(&header, buf->data + buf->scanned, sizeof(MessageHeader));
+        len = sizeof(MessageHeader) + header.s_payload_len;
+        if (header.s_payload_len > MAX_PAYLOAD_LEN || buf->parsed - buf->scanned < len)
         {
-            continue;
+            break;
+        }
+        if (IS_CONTROL_TYPE(header.s_type))
+        {
+            buf->controls++;
+        }
+        buf->scanned += len;
+    }
+    if (!buf->controls)
+    {
+        return -1;
+    }
+
+    for (pos = buf->start; ; pos += len)
+    {
+        memcpy(&header, buf->data + pos, sizeof(MessageHeader));
+        len = sizeof(MessageHeader) + header.s_payload_len;
+        if (IS_CONTROL_TYPE(header.s_type))
+        {
+            break;
+        }
+    }
+    if (pos == buf->start)
+    {
+        return take_buffered(pc, from, msg);
+    }
+    memcpy(msg, buf->data + pos, len);
+    memmove(buf->data + buf->start + len, buf->data + buf->start, pos - buf->start);
+    buf->start += len;
+    buf->controls--;
+    return 1;
+}
+
+/**
+* 非阻塞地读取消息
+* 通道通过预读缓冲区读取：一次 read() 取走管道中的全部数据，之后从缓冲区取消息
+*
+* @return -2 没有消息, -3 读取错误, -4 通道已关闭, 0 成功
+*/
+static int try_receive(PipesCommunication* pc, local_id from, Message* msg)
+{
+    ReadBuffer* buf;
+    int result;
+
+    if (!(buf = get_buffer(pc, from)))
+    {
+        return -3;
+    }
+
+    // 缓冲区中没有完整消息时才读通道
+    while (take_buffered(pc, from, msg))
+    {
+        if ((result = fill_buffer(pc, from, buf)))
+        {
+            return result;
         }
-        while (send(from, i, msg) < 0);
     }
     return 0;
 }
 
 /**
-* 接受消息
+* 停止监听写端已关闭的通道
 */
-int receive(void* self, local_id from, Message* msg)
+static void close_channel(PipesCommunication* pc, local_id from)
 {
-    PipesCommunication* this = (PipesCommunication*)self;
+    if (!pc->closed[from])
+    {
+        epoll_ctl(pc->epoll_fd, EPOLL_CTL_DEL, get_read_fd(pc, from), NULL);
+        pc->open_channels--;
+    }
+    pc->ready[from] = 0;
+    pc->closed[from] = 1;
+}
+
+/**
+* 设置新的到 dst 的管道的容量，无法设置时保持内核默认值
+*/
+static void size_pipe(PipesCommunication* pc, local_id dst)
+{
+    size_t size = dst == PARENT_ID && pc->parent_pipe_size ? pc->parent_pipe_size : pc->pipe_size;
+    int capacity;
 
-    if (from == this->current_id)
+    if (size && (capacity = fcntl(get_write_fd(pc, dst), F_SETPIPE_SZ, size)) > 0)
+    {
+        pc->pipe_stats[dst].capacity = capacity;
+    }
+}
+
+/**
+* 将已满的到 dst 的管道容量加倍，最多到 MAX_PIPE_SIZE
+*
+* @return -1 无法增大, 0 成功
+*/
+static int grow_pipe(PipesCommunication* pc, local_id dst)
+{
+    int capacity = fcntl(get_write_fd(pc, dst), F_GETPIPE_SZ);
+
+    if (capacity < 0 || capacity >= MAX_PIPE_SIZE || (capacity = fcntl(get_write_fd(pc, dst), F_SETPIPE_SZ, 2 * capacity)) < 0)
     {
         return -1;
     }
-    /* Read Header */
-    if (read(this->pipes[get_index(from, this->current_id) * 2 + PIPE_READ_TYPE], msg, sizeof(MessageHeader)) < (int)sizeof(MessageHeader))
+    pc->pipe_stats[dst].capacity = capacity;
+    pc->pipe_stats[dst].grown++;
+    return 0;
+}
+
+/**
+* 把代理分发的通道端放到位
+* 没有文件描述符的读端表示 peer 在写给我们之前已退出，
+* 没有文件描述符的写端表示到 peer 的通道无法打开
+*/
+static void install_channel(PipesCommunication* pc, const ChannelNotice* notice, int fd)
+{
+    struct epoll_event event;
+    local_id peer = notice->peer;
+
+    if (peer < 0 || peer >= pc->total_ids || peer == pc->current_id)
     {
-        return -2;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
     }
 
-    /* Read Body */
-    if (read(this->pipes[get_index(from, this->current_id) * 2 + PIPE_READ_TYPE], ((char*)msg) + sizeof(MessageHeader), msg->s_header.s_payload_len) < 0)
+    if (notice->type == PIPE_WRITE_TYPE)
     {
-        return -3;
+        set_channel_fd(pc, peer, PIPE_WRITE_TYPE, fd < 0 ? CHANNEL_REFUSED : fd);
+        if (fd >= 0 && !pc->ops->packets)
+        {
+            size_pipe(pc, peer);
+        }
+        return;
+    }
+    if (fd < 0)
+    {
+        close_channel(pc, peer);
+        return;
+    }
+    set_channel_fd(pc, peer, PIPE_READ_TYPE, fd);
+    event.events = EPOLLIN;
+    event.data.u32 = peer;
+    epoll_ctl(pc->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+* 放弃代理无法再分发的通道
+*/
+static void close_broker(PipesCommunication* pc)
+{
+    epoll_ctl(pc->epoll_fd, EPOLL_CTL_DEL, pc->broker_fd, NULL);
+    close(pc->broker_fd);
+    pc->broker_fd = -1;
+    for (local_id i = 0; i < pc->total_ids; i++)
+    {
+        if (i == pc->current_id)
+        {
+            continue;
+        }
+        if (get_read_fd(pc, i) < 0)
+        {
+            close_channel(pc, i);
+        }
+        if (get_write_fd(pc, i) == -1)
+        {
+            set_channel_fd(pc, i, PIPE_WRITE_TYPE, CHANNEL_REFUSED);
+        }
+    }
+}
+
+/**
+* 取出代理已分发的通道端
+*
+* @param wait 休眠直到至少一个到来
+*
+* @return -1 代理已退出, 0 成功
+*/
+static int take_channels(PipesCommunication* pc, int wait)
+{
+    ChannelNotice notice;
+    int fd, result;
+
+    while ((result = broker_take(pc->broker_fd, wait, &notice, &fd)) > 0)
+    {
+        install_channel(pc, &notice, fd);
+        wait = 0;
+    }
+    if (result < 0)
+    {
+        close_broker(pc);
+        return -1;
     }
     return 0;
 }
 
 /**
-* 接受广播消息
+* 向代理请求到 dst 的通道，休眠直到分发
+* 期间其他进程打开给我们的通道也会放到位
+*
+* @return -2 通道无法打开, 0 成功
 */
-int receive_any(void* self, Message* msg)
+static int open_channel(PipesCommunication* pc, local_id dst)
 {
-    PipesCommunication* this = (PipesCommunication*)self;
+    if (broker_request(pc->broker_fd, dst))
+    {
+        return -2;
+    }
+    while (get_write_fd(pc, dst) == -1)
+    {
+        take_channels(pc, 1);
+    }
+    return get_write_fd(pc, dst) < 0 ? -2 : 0;
+}
+
+/**
+* 将读通道中已到达的数据移入预读缓冲区
+* 消息留给 receive()，发送者得到空闲空间
+*/
+static void drain_channel(PipesCommunication* pc, local_id from)
+{
+    ReadBuffer* buf;
+    int result;
+
+    if (!(buf = get_buffer(pc, from)))
+    {
+        return;
+    }
+
+    while (!(result = fill_buffer(pc, from, buf)));
+    if (result == -4)
+    {
+        close_channel(pc, from);
+    }
+    if (buffered_length(buf))
+    {
+        pc->ready[from] = 1;
+    }
+}
+
+/**
+* 发往 dst 的管道或套接字已满时等待
+* 前几次只让出CPU，读端通常很快会腾出空间，之后休眠直到通道可写
+* 同时监听读通道并在数据到达时读空，使互相发送的两个进程不会因通道满而卡住
+* 代理分发的通道也会取出，因为代理可能在等我们读它的套接字
+* 等待 dst 的信用时不必自旋：授予只从读通道到来，只需监听它们
+* 来自 dst 的通道因缓冲区满而无法监听时，只短暂休眠
+* 使用 --pipe-grow 时，满的次数足够多的管道改为增大容量，并立即重试写入
+*
+* @return -2 poll 错误, 0 成功
+*/
+static int pipe_wait_writable(void* self, local_id dst, size_t attempt)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    struct pollfd fds[MAX_PROCESS_COUNT + 1];
+    local_id ids[MAX_PROCESS_COUNT + 1];
     local_id i;
+    int count = 1;
+    int credit = pc->credit_wait == dst;
+    int timeout = -1;
+
+    pc->credit_wait = -1;
+    if (credit)
+    {
+        if (get_read_fd(pc, dst) >= 0 && !has_room(pc->buffers[dst]))
+        {
+            timeout = 1;
+        }
+        pc->send_stats[dst].credit_waits++;
+    }
+    else
+    {
+        if (!pc->ops->packets && pc->pipe_grow && !(++pc->pipe_stats[dst].full % pc->pipe_grow) && !grow_pipe(pc, dst))
+        {
+            return 0;
+        }
+        if (attempt < SEND_SPIN_COUNT)
+        {
+            sched_yield();
+            return 0;
+        }
+    }
 
-    for (i = 0; i < this->total_ids; i++)
+    // poll() 跳过负的 fd
+    fds[0].fd = credit ? -1 : get_write_fd(pc, dst);
+    fds[0].events = POLLOUT;
+    fds[1].fd = pc->broker_fd;
+    fds[1].events = POLLIN;
+    ids[count++] = pc->current_id;
+    for (i = 0; i < pc->total_ids; i++)
     {
-        if (i == this->current_id)
+        if (i == pc->current_id || pc->closed[i] || get_read_fd(pc, i) < 0 || !has_room(pc->buffers[i]))
         {
             continue;
         }
+        fds[count].fd = get_read_fd(pc, i);
+        fds[count].events = POLLIN;
+        ids[count++] = i;
+    }
 
-        if (!receive(this, i, msg))
+    while (poll(fds, count, timeout) < 0)
+    {
+        if (errno != EINTR)
         {
-            return 0;
+            return -2;
         }
     }
-    return -1;
+    pc->send_stats[dst].waits++;
+
+    for (i = 1; i < count; i++)
+    {
+        if (!fds[i].revents)
+        {
+            continue;
+        }
+        if (ids[i] == pc->current_id)
+        {
+            take_channels(pc, 0);
+        }
+        else
+        {
+            drain_channel(pc, ids[i]);
+        }
+    }
+    return 0;
+}
+
+/**
+* 发往 dst 的通道已满时稍作等待，并统计等待时间
+*
+* @param dst 接收者ID, 共享内存广播缓冲区时为当前进程ID
+* @param attempt 之前的重试次数
+*
+* @return -2 等待错误, 0 成功
+*/
+static int backoff(PipesCommunication* pc, local_id dst, size_t attempt)
+{
+    SendStats* stats = &pc->send_stats[dst];
+    struct timespec start, end;
+    int result;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats->retries++;
+    result = pc->ops->wait_writable(pc, dst, attempt);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->blocked_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    return result;
+}
+/**
+* 用一次 writev() 写出写管道积累的消息，以及其后的一条消息
+* 管道没有接收的部分继续留在缓冲区，放得下时消息也放入缓冲区
+*
+* @param msg 积累消息之后写出的消息, 可以为 NULL
+*
+* @return -2 写入错误, -3 管道已满且缓冲区放不下, 0 成功
+*/
+static int flush_channel(PipesCommunication* pc, local_id dst, const Message* msg)
+{
+    WriteBuffer* buf = pc->out_buffers[dst];
+    size_t len = msg ? FRAME_LEN(msg) : 0;
+    size_t collected = buf->end - buf->start;
+    struct iovec iov[2];
+    int count = 0;
+    ssize_t written;
+
+    if (collected)
+    {
+        iov[count].iov_base = buf->data + buf->start;
+        iov[count++].iov_len = collected;
+    }
+    if (len)
+    {
+        iov[count].iov_base = (void*)msg;
+        iov[count++].iov_len = len;
+    }
+    if (!count)
+    {
+        return 0;
+    }
+
+    if ((written = writev(get_write_fd(pc, dst), iov, count)) < 0)
+    {
+        if (errno != EAGAIN)
+        {
+            return -2;
+        }
+        written = 0;
+    }
+    else
+    {
+        pc->writes++;
+    }
+
+    // 部分写入：先是积累的数据，然后是消息
+    if ((size_t)written < collected)
+    {
+        buf->start += written;
+        written = 0;
+    }
+    else
+    {
+        buf->start = buf->end = 0;
+        written -= collected;
+    }
+
+    if ((size_t)written < len)
+    {
+        if (buf->start)
+        {
+            memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+            buf->end -= buf->start;
+            buf->start = 0;
+        }
+        if (buf->end + len - written > WRITE_BUFFER_SIZE)
+        {
+            return -3;
+        }
+        memcpy(buf->data + buf->end, (const char*)msg + written, len - written);
+        buf->end += len - written;
+        return 0;
+    }
+    return buf->start == buf->end || msg ? 0 : -3;
+}
+
+/**
+* 将消息积累到写管道的缓冲区
+* 放不下时与已积累的消息一起写出
+*
+* @return -2 写入错误, -3 管道已满, 0 成功
+*/
+static int collect_message(PipesCommunication* pc, local_id dst, const Message* msg)
+{
+    WriteBuffer* buf;
+    size_t len = FRAME_LEN(msg);
+
+    if (!(buf = pc->out_buffers[dst]))
+    {
+        if (!(buf = malloc(sizeof(WriteBuffer))))
+        {
+            return -2;
+        }
+        buf->start = buf->end = 0;
+        pc->out_buffers[dst] = buf;
+    }
+
+    if (buf->end + len > WRITE_BUFFER_SIZE)
+    {
+        return flush_channel(pc, dst, msg);
+    }
+    memcpy(buf->data + buf->end, msg, len);
+    buf->end += len;
+    return 0;
+}
+
+/**
+* 写出所有写管道积累的消息，管道满时等待
+* 读取时没能授予的信用此时授予
+*
+* @return -2 写入错误, 0 成功
+*/
+int ipc_flush(PipesCommunication* pc)
+{
+    int result = 0;
+
+    for (local_id i = 0; i < pc->total_ids; i++)
+    {
+        size_t attempt = 0;
+        int status;
+
+        if (pc->credit_window && i != pc->current_id)
+        {
+            grant_credit(pc, i, pc->credit_window / 2);
+        }
+        if (!pc->out_buffers[i] || !pc->out_buffers[i]->end)
+        {
+            continue;
+        }
+        while ((status = flush_channel(pc, i, NULL)) == -3)
+        {
+            if (backoff(pc, i, attempt++))
+            {
+                status = -2;
+                break;
+            }
+        }
+        if (status)
+        {
+            result = -2;
+        }
+    }
+    return result;
+}
+
+/**
+* 发送消息，通道满时等待
+*
+* @return -1 接收者错误, -2 发送错误, 0 成功
+*/
+int send_blocking(PipesCommunication* pc, local_id dst, const Message* msg)
+{
+    size_t attempt = 0;
+    int result;
+
+    while ((result = send(pc, dst, msg)) == -3)
+    {
+        if (backoff(pc, dst, attempt++))
+        {
+            return -2;
+        }
+    }
+    return result;
+}
+
+/**
+* 休眠直到任意读管道就绪
+* 就绪的通道记录在 pc->ready 中，写端已关闭且读空的管道从 epoll 中移除
+* 代理分发的管道加入 epoll
+*
+* @return -1 没有可等待的管道或 epoll 错误, 0 成功
+*/
+static int wait_any(PipesCommunication* pc)
+{
+    struct epoll_event events[MAX_PROCESS_COUNT];
+    int i, count;
+
+    if (!pc->open_channels)
+    {
+        return -1;
+    }
+
+    while ((count = epoll_wait(pc->epoll_fd, events, MAX_PROCESS_COUNT, -1)) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    pc->wakeups++;
+
+    for (i = 0; i < count; i++)
+    {
+        local_id id = events[i].data.u32;
+
+        if (id == pc->current_id)
+        {
+            take_channels(pc, 0);
+        }
+        else if (events[i].events & EPOLLIN)
+        {
+            pc->ready[id] = 1;
+        }
+        else if (events[i].events & (EPOLLHUP | EPOLLERR))
+        {
+            close_channel(pc, id);
+        }
+    }
+    return 0;
+}
+
+/**
+* 将消息写入管道或套接字，或积累到 flush 时再写出
+*
+* @return -2 写入错误, -3 通道已满, 0 成功
+*/
+static int pipe_write(PipesCommunication* this, local_id dst, const Message* msg)
+{
+    int16_t type = msg->s_header.s_type;
+
+    if (this->flush_policy == FLUSH_BATCH)
+    {
+        if (type != CREDIT && (this->lanes != LANES_CONTROL || !IS_CONTROL_TYPE(type)))
+        {
+            return collect_message(this, dst, msg);
+        }
+        // 控制消息不等到 flush，之前积累的消息在它之前写出
+        if (this->out_buffers[dst] && this->out_buffers[dst]->end)
+        {
+            return flush_channel(this, dst, msg);
+        }
+    }
+    this->writes++;
+    if (write(get_write_fd(this, dst), msg, FRAME_LEN(msg)) < 0)
+    {
+        return errno == EAGAIN ? -3 : -2;
+    }
+    return 0;
+}
+
+/**
+* 在通道信用之内将消息发往管道或套接字
+* 发往 dst 的第一条消息向代理请求打开通道，欠 dst 的信用作为头部扩展随消息发出
+* CREDIT 消息不等待信用，发往已关闭通道的接收者的消息也不等待：它可能已经退出，由写入判断
+*
+* @return -2 写入错误, -3 通道已满或没有信用, 0 成功
+*/
+static int pipe_send(void* self, local_id dst, const Message* msg)
+{
+    PipesCommunication* this = (PipesCommunication*)self;
+    ChannelCredit* credit;
+    union
+    {
+        Message msg;
+        char data[MAX_FRAME_LEN];
+    } frame;
+    CreditGrant grant;
+    size_t len = sizeof(MessageHeader) + msg->s_header.s_payload_len;
+    size_t ext;
+    int result;
+
+    if (get_write_fd(this, dst) == -1 && open_channel(this, dst))
+    {
+        return -2;
+    }
+    if (!this->credit_window)
+    {
+        return pipe_write(this, dst, msg);
+    }
+
+    credit = &this->credits[dst];
+    ext = credit->read != credit->reported || msg->s_header.s_type == CREDIT ? sizeof(CreditGrant) : 0;
+    if (msg->s_header.s_type != CREDIT && !this->closed[dst] && (uint32_t)(credit->sent - credit->granted) + len + ext > this->credit_window)
+    {
+        // dst 只授予已读出的字节，积累的消息必须先送到
+        if (this->out_buffers[dst] && this->out_buffers[dst]->end)
+        {
+            flush_channel(this, dst, NULL);
+        }
+        this->credit_wait = dst;
+        return -3;
+    }
+    if (ext)
+    {
+        memcpy(&frame.msg, msg, len);
+        frame.msg.s_header.s_magic = MESSAGE_MAGIC_CREDIT;
+        grant.s_read = credit->read;
+        memcpy(frame.data + len, &grant, sizeof(CreditGrant));
+        msg = &frame.msg;
+    }
+
+    if (!(result = pipe_write(this, dst, msg)))
+    {
+        credit->sent += len + ext;
+        if (ext)
+        {
+            credit->reported = grant.s_read;
+        }
+    }
+    return result;
+}
+
+/**
+* 欠进程的信用足够多时发送 CREDIT 消息
+*
+* @param min 需要发送时从它读出且尚未授予的字节数
+*
+* @return -1 欠得太少, 否则同 pipe_send()
+*/
+static int grant_credit(PipesCommunication* this, local_id to, size_t min)
+{
+    ChannelCredit* credit = &this->credits[to];
+    Message msg;
+    int result;
+
+    if ((uint32_t)(credit->read - credit->reported) < min || get_write_fd(this, to) == CHANNEL_REFUSED)
+    {
+        return -1;
+    }
+    msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_payload_len = 0;
+    msg.s_header.s_type = CREDIT;
+    msg.s_header.s_local_time = 0;
+    if (!(result = pipe_send(this, to, &msg)))
+    {
+        this->grants++;
+    }
+    return result;
+}
+
+/**
+* 从管道或套接字接收消息
+* 没有消息时在通道上休眠，直到消息到达或写端关闭
+* from 还没写过任何消息时，休眠直到代理分发通道
+*
+* @return -2 通道已关闭或 poll 错误, -3 读取错误, 0 成功
+*/
+static int pipe_receive(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    struct pollfd fds[2];
+    int result, polled = 0;
+
+    // from 第一次写给我们时代理才分发通道
+    while (get_read_fd(pc, from) < 0)
+    {
+        if (pc->closed[from])
+        {
+            return -2;
+        }
+        ipc_flush(pc);
+        take_channels(pc, 1);
+        pc->wakeups++;
+    }
+
+    fds[0].fd = get_read_fd(pc, from);
+    fds[0].events = POLLIN;
+    fds[1].fd = pc->broker_fd;
+    fds[1].events = POLLIN;
+
+    while ((result = try_receive(pc, from, msg)) == -2)
+    {
+        if (polled)
+        {
+            pc->spurious_polls++;
+        }
+        ipc_flush(pc);
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            return result;
+        }
+        pc->wakeups++;
+        if (fds[1].revents)
+        {
+            take_channels(pc, 0);
+            fds[1].fd = pc->broker_fd;
+        }
+        if ((fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) && !(fds[0].revents & POLLIN))
+        {
+            return result;
+        }
+        polled = 1;
+    }
+    return result;
+}
+
+/**
+* 从任意管道或套接字接收消息
+* 从 scan_start 开始扫描就绪通道，没有消息时休眠等待
+*
+* @return -1 所有通道已关闭或 epoll 错误, 0 成功
+*/
+static int pipe_receive_any(void* self, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    int polled = 0;
+
+    while (1)
+    {
+        for (size_t k = 0; k < pc->total_ids; k++)
+        {
+            local_id i = SCAN_ID(pc, k);
+
+            if (i == pc->current_id || !pc->ready[i])
+            {
+                continue;
+            }
+
+            switch (try_receive(pc, i, msg))
+            {
+            case 0:
+                pc->last_msg_from = i;
+                return 0;
+            case -4:
+                close_channel(pc, i);
+                break;
+            default:
+                pc->ready[i] = 0;
+            }
+        }
+
+        if (polled)
+        {
+            pc->spurious_polls++;
+        }
+        ipc_flush(pc);
+        if (wait_any(pc))
+        {
+            return -1;
+        }
+        polled = 1;
+    }
+}
+
+/**
+* 不等待地从管道或套接字读取消息，通道未报告可读时也读取
+*
+* @return -1 没有消息, 0 成功
+*/
+static int pipe_try_receive(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    // 已关闭的通道只在缓冲区中还有消息时读取
+    if (get_read_fd(pc, from) < 0 || (pc->closed[from] && !pc->ready[from]))
+    {
+        return -1;
+    }
+    switch (try_receive(pc, from, msg))
+    {
+    case 0:
+        return 0;
+    case -4:
+        close_channel(pc, from);
+        break;
+    default:
+        pc->ready[from] = 0;
+    }
+    return -1;
+}
+
+/**
+* 不等待地取出通道的控制通道消息
+* 缓冲区中没有完整消息时先预读已就绪的通道，这样能看到排在大量消息之后的控制消息
+*
+* @return -1 没有, 0 它是第一条消息, 1 它先于其他消息取出
+*/
+static int pipe_take_control(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    ReadBuffer* buf;
+
+    if (get_read_fd(pc, from) < 0 || !(buf = get_buffer(pc, from)))
+    {
+        return -1;
+    }
+    if (pc->ready[from] && !pc->closed[from] && !buffered_length(buf))
+    {
+        switch (fill_buffer(pc, from, buf))
+        {
+        case -2:
+            pc->ready[from] = 0;
+            break;
+        case -4:
+            close_channel(pc, from);
+            break;
+        }
+    }
+    return take_buffered_control(pc, from, msg);
+}
+
+/**
+* 把共享缓冲区中的消息移入预读缓冲区，直到放不下为止
+*/
+static void shm_drain(PipesCommunication* pc, local_id from)
+{
+    ReadBuffer* buf = get_buffer(pc, from);
+    Message msg;
+
+    while (buf && has_room(buf) && !shm_try_receive(pc->shm, from, pc->current_id, &msg))
+    {
+        size_t len = sizeof(MessageHeader) + msg.s_header.s_payload_len;
+
+        compact_buffer(buf);
+        memcpy(buf->data + buf->end, &msg, len);
+        buf->end += len;
+        buf->parsed = buf->end;
+    }
+}
+
+/**
+* 从共享缓冲区取消息，发送时读出的消息优先
+*
+* @return -1 没有消息, 0 成功
+*/
+static int shm_take(PipesCommunication* pc, local_id from, Message* msg)
+{
+    if (!take_buffered(pc, from, msg))
+    {
+        return 0;
+    }
+    return shm_try_receive(pc->shm, from, pc->current_id, msg);
+}
+
+/**
+* 不等待地将消息放入共享缓冲区
+*
+* @return -3 缓冲区已满, 0 成功
+*/
+static int shm_send_message(void* self, local_id dst, const Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    return shm_send(pc->shm, pc->current_id, dst, msg) ? -3 : 0;
+}
+
+/**
+* 将消息只放入一次当前进程的广播缓冲区，接收者从那里读取
+*
+* @return -3 缓冲区已满, 0 成功
+*/
+static int shm_multicast_message(void* self, const Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    return shm_multicast(pc->shm, pc->current_id, msg) ? -3 : 0;
+}
+
+/**
+* 从共享缓冲区接收消息，缓冲区为空时休眠
+*/
+static int shm_receive(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    int slept = 0;
+
+    while (shm_take(pc, from, msg))
+    {
+        if (slept)
+        {
+            pc->spurious_polls++;
+        }
+        slept = shm_wait(pc->shm, pc->current_id, from);
+        pc->wakeups += slept;
+    }
+    return 0;
+}
+
+/**
+* 从 scan_start 开始从任意共享缓冲区接收消息，全部为空时休眠
+*/
+static int shm_receive_any(void* self, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    int slept = 0;
+
+    while (1)
+    {
+        for (size_t k = 0; k < pc->total_ids; k++)
+        {
+            local_id i = SCAN_ID(pc, k);
+
+            if (i != pc->current_id && !shm_take(pc, i, msg))
+            {
+                pc->last_msg_from = i;
+                return 0;
+            }
+        }
+
+        if (slept)
+        {
+            pc->spurious_polls++;
+        }
+        slept = shm_wait(pc->shm, pc->current_id, -1);
+        pc->wakeups += slept;
+    }
+}
+
+/**
+* 不等待地从共享缓冲区取消息
+*
+* @return -1 没有消息, 0 成功
+*/
+static int shm_try_take(void* self, local_id from, Message* msg)
+{
+    return shm_take((PipesCommunication*)self, from, msg) ? -1 : 0;
+}
+
+/**
+* 共享缓冲区已满时等待
+* 缓冲区无法 poll，只能让出CPU并将读缓冲区中已到达的消息移入预读缓冲区，
+* 因为接收者可能正在等待这些消息被读走
+*
+* @return 0
+*/
+static int shm_wait_writable(void* self, local_id dst, size_t attempt)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    sched_yield();
+    for (local_id i = 0; i < pc->total_ids; i++)
+    {
+        if (i != pc->current_id)
+        {
+            shm_drain(pc, i);
+        }
+    }
+    return 0;
+}
+
+/**
+* 不等待地取出共享缓冲区的控制通道消息，为此先把缓冲区读空
+*
+* @return -1 没有, 0 它是第一条消息, 1 它先于其他消息取出
+*/
+static int shm_take_control(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    shm_drain(pc, from);
+    return take_buffered_control(pc, from, msg);
+}
+
+/**
+* 把消息放入 dst 的邮箱
+*
+* @return -2 内存不足, 0 成功
+*/
+static int mailbox_send_message(void* self, local_id dst, const Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    return mailbox_send(&pc->mailboxes[dst], pc->current_id, msg) ? -2 : 0;
+}
+
+/**
+* 从线程接收消息，没有消息时休眠
+*/
+static int mailbox_receive(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    Mailbox* box = &pc->mailboxes[pc->current_id];
+    int slept = 0;
+
+    while (mailbox_take(&pc->queues[from], msg))
+    {
+        if (mailbox_collect(box, pc->queues))
+        {
+            continue;
+        }
+        if (slept)
+        {
+            pc->spurious_polls++;
+        }
+        slept = mailbox_wait(box);
+        pc->wakeups += slept;
+    }
+    return 0;
+}
+
+/**
+* 从 scan_start 开始从任意线程接收消息，没有消息时休眠
+*/
+static int mailbox_receive_any(void* self, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+    Mailbox* box = &pc->mailboxes[pc->current_id];
+    int slept = 0;
+
+    while (1)
+    {
+        mailbox_collect(box, pc->queues);
+        for (size_t k = 0; k < pc->total_ids; k++)
+        {
+            local_id i = SCAN_ID(pc, k);
+
+            if (!mailbox_take(&pc->queues[i], msg))
+            {
+                pc->last_msg_from = i;
+                return 0;
+            }
+        }
+
+        if (slept)
+        {
+            pc->spurious_polls++;
+        }
+        slept = mailbox_wait(box);
+        pc->wakeups += slept;
+    }
+}
+
+/**
+* 不等待地取出线程发来的消息
+*
+* @return -1 没有消息, 0 成功
+*/
+static int mailbox_try_receive(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    mailbox_collect(&pc->mailboxes[pc->current_id], pc->queues);
+    return mailbox_take(&pc->queues[from], msg);
+}
+
+/**
+* 不等待地取出线程发来的控制通道消息
+*
+* @return -1 没有, 0 它是第一条消息, 1 它先于其他消息取出
+*/
+static int mailbox_take_control_message(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* pc = (PipesCommunication*)self;
+
+    mailbox_collect(&pc->mailboxes[pc->current_id], pc->queues);
+    return mailbox_take_control(&pc->queues[from], msg);
+}
+
+/**
+* 按 TransportType 排列的传输方式，由 --transport= 选择
+*/
+static const Transport pipe_transport = {
+    "pipe", 0, pipe_send, NULL, pipe_receive, pipe_receive_any, pipe_try_receive, pipe_take_control, pipe_wait_writable
+};
+
+static const Transport shm_transport = {
+    "shm", 0, shm_send_message, shm_multicast_message, shm_receive, shm_receive_any, shm_try_take, shm_take_control, shm_wait_writable
+};
+
+static const Transport seqpacket_transport = {
+    "seqpacket", 1, pipe_send, NULL, pipe_receive, pipe_receive_any, pipe_try_receive, pipe_take_control, pipe_wait_writable
+};
+
+// 邮箱永远不会满
+static const Transport mailbox_transport = {
+    "mailbox", 0, mailbox_send_message, NULL, mailbox_receive, mailbox_receive_any, mailbox_try_receive, mailbox_take_control_message, NULL
+};
+
+const Transport* const transports[TRANSPORT_COUNT] = {
+    &pipe_transport, &shm_transport, &seqpacket_transport, &mailbox_transport
+};
+
+/**
+* 暂存发送者的消息，留给之后的接收
+*
+* @return -1 内存不足, 0 成功
+*/
+static int stash_message(PipesCommunication* this, local_id from, const Message* msg)
+{
+    Stash* stash = this->stashes[from];
+    int queue = STASH_QUEUE(msg->s_header.s_type);
+
+    if (stash == NULL && (stash = this->stashes[from] = calloc(1, sizeof(Stash))) == NULL)
+    {
+        return -1;
+    }
+    StashNode* node = malloc(STASH_NODE_LEN(msg));
+    if (node == NULL)
+    {
+        return -1;
+    }
+    node->next = NULL;
+    node->order = stash->next_order++;
+    memcpy(&node->msg, msg, sizeof(MessageHeader) + msg->s_header.s_payload_len);
+
+    if (stash->last[queue] != NULL)
+    {
+        stash->last[queue]->next = node;
+    }
+    else
+    {
+        stash->first[queue] = node;
+    }
+    stash->last[queue] = node;
+    stash->count++;
+    this->parked++;
+    this->stashed++;
+    return 0;
+}
+
+/**
+* 取得存放最早暂存的消息的队列
+*
+* @return -1 没有暂存的消息, 成功时返回队列
+*/
+static int oldest_queue(const Stash* stash)
+{
+    int queue = -1;
+
+    if (stash == NULL || stash->count == 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i <= MESSAGE_TYPE_COUNT; i++)
+    {
+        if (stash->first[i] != NULL && (queue < 0 || (int32_t)(stash->first[i]->order - stash->first[queue]->order) < 0))
+        {
+            queue = i;
+        }
+    }
+    return queue;
+}
+
+/**
+* 取出发送者暂存的消息
+*
+* @param type		要取的类型, -1 取任意类型中最早暂存的消息
+*
+* @return -1 没有这样的消息, 0 成功
+*/
+static int unstash_message(PipesCommunication* this, local_id from, int type, Message* msg)
+{
+    Stash* stash = this->stashes[from];
+    int queue = type < 0 ? oldest_queue(stash) : type;
+
+    if (stash == NULL || queue < 0)
+    {
+        return -1;
+    }
+    StashNode* node = stash->first[queue];
+    if (node == NULL)
+    {
+        return -1;
+    }
+    if ((stash->first[queue] = node->next) == NULL)
+    {
+        stash->last[queue] = NULL;
+    }
+    memcpy(msg, &node->msg, sizeof(MessageHeader) + node->msg.s_header.s_payload_len);
+    free(node);
+    stash->count--;
+    this->parked--;
+    return 0;
+}
+
+/**
+* 从指定进程接收指定类型的消息
+* 期间读到的其他类型的消息不会丢弃，而是暂存起来：之后同类型的 receive_type() 不读通道直接取走它们，
+* receive() / receive_any() 则按暂存顺序取走
+*
+* @param type		要等待的消息类型
+*
+* @return -1 发送者或类型错误, -5 无法暂存消息, 通道没有消息时与 receive() 相同, 0 成功
+*/
+int receive_type(PipesCommunication* pc, local_id from, int16_t type, Message* msg)
+{
+    int result;
+
+    if (from < 0 || from >= pc->total_ids || from == pc->current_id || type < 0 || type >= MESSAGE_TYPE_COUNT)
+    {
+        return -1;
+    }
+    if (pc->parked && unstash_message(pc, from, type, msg) == 0)
+    {
+        return 0;
+    }
+
+    while ((result = pc->ops->receive(pc, from, msg)) == 0)
+    {
+        if (msg->s_header.s_type == type)
+        {
+            return 0;
+        }
+        if (stash_message(pc, from, msg))
+        {
+            return -5;
+        }
+    }
+    return result;
+}
+
+/**
+* 记录 receive_any() 的消息的发送者，并选择下次首先扫描的通道
+* 通道的等待是从它的上一条消息以来其他通道给出的消息数量，通道一直有消息等待时它反映饥饿程度
+*/
+static void count_served(PipesCommunication* this, local_id from)
+{
+    ReceiveStats* stats = &this->receive_stats[from];
+    size_t wait = this->received - stats->last;
+
+    if (wait > stats->max_wait)
+    {
+        stats->max_wait = wait;
+    }
+    stats->served++;
+    stats->last = ++this->received;
+    this->last_msg_from = from;
+
+    if (this->receive_policy == RECEIVE_FIRST)
+    {
+        return;
+    }
+    if (this->scan_start != (size_t)from)
+    {
+        this->scan_start = from;
+        this->burst = 0;
+    }
+    if (++this->burst >= (this->receive_policy == RECEIVE_WEIGHTED ? this->weights[from] : 1))
+    {
+        this->scan_start = (from + 1) % this->total_ids;
+        this->burst = 0;
+    }
+}
+
+/**
+* 在所有通道的第一条消息中接收发送时间最早的消息
+* 每个通道的第一条消息先被暂存，以便比较。Lamport 时间会回绕，所以按差值比较，时间相同时按轮转顺序
+*
+* @return 与传输方式的 receive_any() 相同
+*/
+static int receive_oldest(PipesCommunication* this, Message* msg)
+{
+    local_id oldest = -1;
+    timestamp_t time = 0;
+
+    for (local_id i = 0; i < this->total_ids; i++)
+    {
+        if (i == this->current_id || oldest_queue(this->stashes[i]) >= 0 || this->ops->try_receive(this, i, msg))
+        {
+            continue;
+        }
+        if (stash_message(this, i, msg))
+        {
+            this->last_msg_from = i;
+            return 0;
+        }
+    }
+    if (!this->parked)
+    {
+        return this->ops->receive_any(this, msg);
+    }
+
+    for (size_t k = 0; k < this->total_ids; k++)
+    {
+        local_id i = SCAN_ID(this, k);
+        const Stash* stash = this->stashes[i];
+        int queue = oldest_queue(stash);
+
+        if (queue < 0)
+        {
+            continue;
+        }
+        if (oldest < 0 || (int16_t)(stash->first[queue]->msg.s_header.s_local_time - time) < 0)
+        {
+            oldest = i;
+            time = stash->first[queue]->msg.s_header.s_local_time;
+        }
+    }
+    this->last_msg_from = oldest;
+    return unstash_message(this, oldest, -1, msg);
+}
+
+/**
+* 发送消息，不等待
+*
+* @return -1 接收者错误, -2 写入错误, -3 通道已满, 0 成功
+*/
+int send(void* self, local_id dst, const Message* msg)
+{
+    PipesCommunication* from = (PipesCommunication*)self;
+
+    if (dst < 0 || dst >= from->total_ids || dst == from->current_id)
+    {
+        return -1;
+    }
+    return from->ops->send(from, dst, msg);
+}
+
+/**
+* 发送广播，通道满时等待
+*
+* @return -2 有进程没有收到消息, 0 成功
+*/
+int send_multicast(void* self, const Message* msg)
+{
+    PipesCommunication* from = (PipesCommunication*)self;
+    local_id i;
+    int result = 0;
+
+    // 不参与池场景的进程不能收到它的消息
+    if (from->ops->send_multicast && from->active_ids == from->total_ids)
+    {
+        size_t attempt = 0;
+
+        while ((result = from->ops->send_multicast(from, msg)) == -3)
+        {
+            if (backoff(from, from->current_id, attempt++))
+            {
+                return -2;
+            }
+        }
+        return result;
+    }
+
+    for (i = 0; i < from->active_ids; i++)
+    {
+        if (i != from->current_id && send_blocking(from, i, msg))
+        {
+            result = -2;
+        }
+    }
+    return result;
+}
+
+/**
+* 不等待地取出发送者的控制通道消息
+* receive_type() 暂存的控制消息早于通道中的消息，先取出，最旧的在前
+*
+* @return -1 没有, 0 成功
+*/
+static int take_control(PipesCommunication* this, local_id from, Message* msg)
+{
+    static const int16_t types[] = {STOP, DONE, CS_RELEASE};
+    const Stash* stash = this->stashes[from];
+    int queue = -1;
+    int result;
+
+    for (size_t i = 0; this->parked && stash && i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (stash->first[types[i]] && (queue < 0 || (int32_t)(stash->first[types[i]]->order - stash->first[queue]->order) < 0))
+        {
+            queue = types[i];
+        }
+    }
+    if (queue >= 0)
+    {
+        return unstash_message(this, from, queue, msg);
+    }
+
+    if ((result = this->ops->take_control(this, from, msg)) > 0)
+    {
+        this->overtaken++;
+    }
+    return result < 0 ? -1 : 0;
+}
+
+/**
+* 接受消息
+*/
+int receive(void* self, local_id from, Message* msg)
+{
+    PipesCommunication* this = (PipesCommunication*)self;
+
+    if (from < 0 || from >= this->total_ids || from == this->current_id)
+    {
+        return -1;
+    }
+    if (this->lanes == LANES_CONTROL && take_control(this, from, msg) == 0)
+    {
+        return 0;
+    }
+    if (this->parked && unstash_message(this, from, -1, msg) == 0)
+    {
+        return 0;
+    }
+    return this->ops->receive(this, from, msg);
+}
+
+/**
+* 按接收策略的顺序接收任意进程的消息
+* LANES_CONTROL 时已到达的控制通道消息优先
+* 发送者记在 last_msg_from 中，并计入 receive_stats
+*/
+int receive_any(void* self, Message* msg)
+{
+    PipesCommunication* this = (PipesCommunication*)self;
+    int result;
+
+    // 控制通道优先于任何策略
+    for (size_t k = 0; this->lanes == LANES_CONTROL && k < this->total_ids; k++)
+    {
+        local_id i = SCAN_ID(this, k);
+
+        if (i != this->current_id && take_control(this, i, msg) == 0)
+        {
+            count_served(this, i);
+            return 0;
+        }
+    }
+
+    if (this->receive_policy == RECEIVE_OLDEST)
+    {
+        result = receive_oldest(this, msg);
+    }
+    else
+    {
+        // receive_type() 暂存的消息早于通道中的任何消息
+        for (size_t k = 0; this->parked && k < this->total_ids; k++)
+        {
+            local_id i = SCAN_ID(this, k);
+
+            if (unstash_message(this, i, -1, msg) == 0)
+            {
+                count_served(this, i);
+                return 0;
+            }
+        }
+        result = this->ops->receive_any(this, msg);
+    }
+
+    if (result == 0)
+    {
+        count_served(this, this->last_msg_from);
+    }
+    return result;
 }
@@ -1,6 +1,7 @@
 #include "lamporttime.h"
+#include "fiber.h"
 
-static timestamp_t lamport_time = 0;
+static __thread timestamp_t lamport_time = 0; // 进程以线程运行时每个线程有自己的时钟，纤程在 lamport_fiber_local() 之后也有
 
 /**
 * 增加时间戳
@@ -19,13 +20,21 @@ timestamp_t set_lamport_time(const timestamp_t new_lamport_time)
     return lamport_time;
 }
 
+/**
+* 把逻辑时间清零，池模式开始下一个场景时调用
+*/
+void reset_lamport_time()
+{
+    lamport_time = 0;
+}
+
 /**
 * 从消息中设置逻辑时间
 */
 timestamp_t set_lamport_time_from_msg(const Message* msg)
 {
     set_lamport_time(msg->s_header.s_local_time);
-    return increment_lamport_time();
+    return increase_lamport_time();
 }
 
 /**
@@ -35,3 +44,11 @@ timestamp_t get_lamport_time()
 {
     return lamport_time;
 }
+
+/**
+* 把逻辑时间设为每个纤程私有，必须在 fiber_run() 之前调用
+*/
+int lamport_fiber_local()
+{
+    return fiber_local(&lamport_time, sizeof(lamport_time));
+}
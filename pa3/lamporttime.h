@@ -7,5 +7,7 @@ timestamp_t get_lamport_time();
 timestamp_t increase_lamport_time();
 timestamp_t set_lamport_time(const timestamp_t new_lamport_time);
 timestamp_t set_lamport_time_from_msg(const Message* msg);
+void reset_lamport_time();
+int lamport_fiber_local();
 
 #endif
@@ -1,18 +1,24 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "pa2345.h"
 #include "logger.h"
 #include "common.h"
 
+static const char* const log_startup_fmt = "%d: process %1d started up in %lu us\n";
 
 FILE* pipes_log_file, * events_log_file;
+static struct timespec launch_time; // 启动时间，到收到所有 STARTED 为止计算启动耗时
 
 /**
 * 初始化日志
 */
 void log_init()
 {
+    clock_gettime(CLOCK_MONOTONIC, &launch_time);
     pipes_log_file = fopen(pipes_log, "w");
     events_log_file = fopen(events_log, "w");
 }
@@ -47,7 +53,18 @@ void log_pipes(const PipesCommunication* comm)
 
     size_t i;
 
-    fprintf(pipes_log_file, "Process %d pipes:\n", comm->current_id);
+    if (comm->transport == TRANSPORT_SHM)
+    {
+        fprintf(pipes_log_file, "Process %d uses shared memory rings\n", comm->current_id);
+        return;
+    }
+    if (comm->transport == TRANSPORT_MAILBOX)
+    {
+        fprintf(pipes_log_file, "Process %d is a thread with mailbox\n", comm->current_id);
+        return;
+    }
+
+    fprintf(pipes_log_file, "Process %d %s opened on demand (-1 if never used):\n", comm->current_id, comm->transport == TRANSPORT_SEQPACKET ? "sockets" : "pipes");
 
     for (i = 0; i < comm->total_ids; i++)
     {
@@ -62,6 +79,73 @@ void log_pipes(const PipesCommunication* comm)
     fprintf(pipes_log_file, "\n");
 }
 
+/**
+* 记录等待统计
+*/
+void log_poll_stats(const PipesCommunication* comm)
+{
+    if (pipes_log_file == NULL)
+    {
+        fprintf(stderr, "Please init pipes log file\n");
+        return;
+    }
+    fprintf(pipes_log_file, "Process %d\twakeups %lu\tspurious %lu\treads %lu\twrites %lu\n", comm->current_id, comm->wakeups, comm->spurious_polls, comm->reads, comm->writes);
+    if (comm->stashed)
+    {
+        fprintf(pipes_log_file, "Process %d\tstash\tparked %lu\tleft %lu\n", comm->current_id, comm->stashed, comm->parked);
+    }
+    if (comm->grants)
+    {
+        fprintf(pipes_log_file, "Process %d\tcredit\tCREDIT sent %lu\n", comm->current_id, comm->grants);
+    }
+    if (comm->overtaken)
+    {
+        fprintf(pipes_log_file, "Process %d\tlanes\ttaken ahead %lu\n", comm->current_id, comm->overtaken);
+    }
+
+    for (local_id i = 0; i < comm->total_ids; i++)
+    {
+        const SendStats* stats = &comm->send_stats[i];
+
+        if (!stats->retries)
+        {
+            continue;
+        }
+        if (i == comm->current_id)
+        {
+            fprintf(pipes_log_file, "Process %d\tbroadcast\tretries %lu\twaits %lu\tblocked %lu us\n", comm->current_id, stats->retries, stats->waits, (unsigned long)(stats->blocked_ns / 1000));
+        }
+        else
+        {
+            fprintf(pipes_log_file, "Process %d\tsend to %d\tretries %lu\twaits %lu\tfor credit %lu\tblocked %lu us\n", comm->current_id, i, stats->retries, stats->waits, stats->credit_waits, (unsigned long)(stats->blocked_ns / 1000));
+        }
+    }
+
+    for (local_id i = 0; i < comm->total_ids; i++)
+    {
+        const PipeStats* stats = &comm->pipe_stats[i];
+
+        if (stats->peak)
+        {
+            fprintf(pipes_log_file, "Process %d\tpipe from %d\tpeak %lu\tof %d\n", comm->current_id, i, stats->peak, stats->peak_capacity);
+        }
+        if (stats->capacity)
+        {
+            fprintf(pipes_log_file, "Process %d\tpipe to %d\tcapacity %d\tfull %lu\tgrown %lu\n", comm->current_id, i, stats->capacity, stats->full, stats->grown);
+        }
+    }
+
+    for (local_id i = 0; i < comm->total_ids; i++)
+    {
+        const ReceiveStats* stats = &comm->receive_stats[i];
+
+        if (stats->served)
+        {
+            fprintf(pipes_log_file, "Process %d\treceive from %d\tserved %lu\tmax wait %lu\n", comm->current_id, i, stats->served, stats->max_wait);
+        }
+    }
+}
+
 /**
 * 记录初始余额
 */
@@ -88,8 +172,13 @@ void log_received_all_started(const local_id id)
         fprintf(stderr, "Please init events log file\n");
         return;
     }
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
     fprintf(events_log_file, log_received_all_started_fmt, get_lamport_time(), id);
     printf(log_received_all_started_fmt, get_lamport_time(), id);
+    fprintf(events_log_file, log_startup_fmt, get_lamport_time(), id,
+        (unsigned long)((now.tv_sec - launch_time.tv_sec) * 1000000 + (now.tv_nsec - launch_time.tv_nsec) / 1000));
 }
 
 /**
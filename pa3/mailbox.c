@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include "mailbox.h"
+#include "fiber.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define NODE_LEN(msg) (offsetof(MailNode, msg) + sizeof(MessageHeader) + (msg)->s_header.s_payload_len)
+
+/**
+* 释放消息链表
+*/
+static void free_nodes(MailNode* node)
+{
+    while (node)
+    {
+        MailNode* next = node->next;
+
+        free(node);
+        node = next;
+    }
+}
+
+/** 为所有进程分配邮箱，必须在创建线程之前调用
+ *
+ * @param proc_count    包含父进程的进程数量
+ *
+ * @return 邮箱数组指针, 出错时为 NULL
+ */
+Mailbox* mailbox_init(size_t proc_count)
+{
+    return calloc(proc_count, sizeof(Mailbox));
+}
+
+/** 释放邮箱和没有被取走的消息，所有线程结束后调用
+ *
+ * @param boxes			邮箱数组指针
+ * @param proc_count    包含父进程的进程数量
+ */
+void mailbox_destroy(Mailbox* boxes, size_t proc_count)
+{
+    for (size_t i = 0; i < proc_count; i++)
+    {
+        free_nodes(boxes[i].head);
+    }
+    free(boxes);
+}
+
+/** 把消息的副本放入邮箱，除非所有者在休眠，否则没有系统调用
+ *
+ * @return -1 内存不足, 0 成功
+ */
+int mailbox_send(Mailbox* box, local_id from, const Message* msg)
+{
+    MailNode* node = malloc(NODE_LEN(msg));
+
+    if (!node)
+    {
+        return -1;
+    }
+    node->from = from;
+    memcpy(&node->msg, msg, sizeof(MessageHeader) + msg->s_header.s_payload_len);
+
+    node->next = __atomic_load_n(&box->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&box->head, &node->next, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // 与 mailbox_wait() 中的内存屏障配对：要么所有者看到新消息，要么我们看到它在等待
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&box->waiting, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&box->seq, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &box->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+/** 取出邮箱中所有消息，追加到各发送者的队列
+ * 消息按最新的在前放入，所以先把链表反转恢复发送顺序
+ *
+ * @param queues		接收者的队列，每个发送者一个
+ *
+ * @return 取出的消息数量
+ */
+size_t mailbox_collect(Mailbox* box, MailQueue* queues)
+{
+    MailNode* node = __atomic_exchange_n(&box->head, NULL, __ATOMIC_ACQUIRE);
+    MailNode* list = NULL;
+    size_t count = 0;
+
+    while (node)
+    {
+        MailNode* next = node->next;
+
+        node->next = list;
+        list = node;
+        node = next;
+    }
+
+    while (list)
+    {
+        MailQueue* queue = &queues[list->from];
+
+        node = list;
+        list = list->next;
+        node->next = NULL;
+        if (queue->last)
+        {
+            queue->last->next = node;
+        }
+        else
+        {
+            queue->first = node;
+        }
+        queue->last = node;
+        if (IS_CONTROL_TYPE(node->msg.s_header.s_type))
+        {
+            queue->controls++;
+        }
+        count++;
+    }
+    return count;
+}
+
+/** 取出队列中最旧的消息
+ *
+ * @return -1 队列为空, 0 成功
+ */
+int mailbox_take(MailQueue* queue, Message* msg)
+{
+    MailNode* node = queue->first;
+
+    if (!node)
+    {
+        return -1;
+    }
+    if (!(queue->first = node->next))
+    {
+        queue->last = NULL;
+    }
+    if (IS_CONTROL_TYPE(node->msg.s_header.s_type))
+    {
+        queue->controls--;
+    }
+    memcpy(msg, &node->msg, sizeof(MessageHeader) + node->msg.s_header.s_payload_len);
+    free(node);
+    return 0;
+}
+
+/** 取出队列中最旧的控制通道消息，其他消息保持顺序
+ *
+ * @return -1 队列中没有, 0 它是第一条消息, 1 它先于其他消息取出
+ */
+int mailbox_take_control(MailQueue* queue, Message* msg)
+{
+    MailNode* prev = NULL;
+    MailNode* node = queue->first;
+
+    if (!queue->controls)
+    {
+        return -1;
+    }
+    while (!IS_CONTROL_TYPE(node->msg.s_header.s_type))
+    {
+        prev = node;
+        node = node->next;
+    }
+    if (!prev)
+    {
+        return mailbox_take(queue, msg);
+    }
+    if (!(prev->next = node->next))
+    {
+        queue->last = prev;
+    }
+    queue->controls--;
+    memcpy(msg, &node->msg, sizeof(MessageHeader) + node->msg.s_header.s_payload_len);
+    free(node);
+    return 1;
+}
+
+/** 释放接收者队列中剩余的消息
+ *
+ * @param queues		接收者的队列，每个发送者一个
+ * @param proc_count    包含父进程的进程数量
+ */
+void mailbox_clear(MailQueue* queues, size_t proc_count)
+{
+    for (size_t i = 0; i < proc_count; i++)
+    {
+        free_nodes(queues[i].first);
+        queues[i].first = queues[i].last = NULL;
+        queues[i].controls = 0;
+    }
+}
+
+/** 等待邮箱中有新消息
+ * 先轮询邮箱，然后在 futex 上休眠
+ * 纤程则切换到下一个可运行的纤程：它轮询时别人无法放入消息
+ *
+ * @return 1 线程休眠过或纤程被切出过, 0 轮询时发现消息
+ */
+int mailbox_wait(Mailbox* box)
+{
+    uint32_t seq;
+    int slept = 0;
+
+    if (fiber_current() >= 0)
+    {
+        fiber_wait((void* const*)&box->head);
+        return 1;
+    }
+
+    for (int i = 0; i < MAILBOX_SPIN_COUNT; i++)
+    {
+        if (__atomic_load_n(&box->head, __ATOMIC_ACQUIRE))
+        {
+            return 0;
+        }
+    }
+
+    seq = __atomic_load_n(&box->seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&box->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&box->head, __ATOMIC_ACQUIRE))
+    {
+        syscall(SYS_futex, &box->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        slept = 1;
+    }
+    __atomic_store_n(&box->waiting, 0, __ATOMIC_RELAXED);
+    return slept;
+}
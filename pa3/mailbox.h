@@ -0,0 +1,52 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_MAILBOX__H
+#define __IFMO_DISTRIBUTED_CLASS_MAILBOX__H
+
+#include "ipc.h"
+
+#include <stddef.h>
+
+enum
+{
+    MAILBOX_CACHE_LINE = 64,
+    MAILBOX_SPIN_COUNT = 512, // 休眠前检查邮箱的次数
+};
+
+/* 发往接收者的消息，由发送者分配，接收者释放 */
+typedef struct MailNode
+{
+    struct MailNode* next;
+    local_id from;
+    Message msg; // 只分配消息头和消息体
+} MailNode;
+
+/* 一个线程的多生产者单消费者邮箱 */
+typedef struct
+{
+    MailNode* head;   // 已放入的消息，最新的在前
+    uint32_t seq;     // futex 字，发送者递增以唤醒所有者
+    uint32_t waiting; // 所有者准备在 seq 上休眠
+    char pad[MAILBOX_CACHE_LINE - sizeof(MailNode*) - 2 * sizeof(uint32_t)];
+} Mailbox;
+
+/* 控制通道的消息类型：开启通道时先于同一发送者更早的消息取出 */
+#define IS_CONTROL_TYPE(type) ((type) == STOP || (type) == DONE || (type) == CS_RELEASE)
+
+/* 从邮箱取出的一个发送者的消息，最旧的在前，属于接收者 */
+typedef struct
+{
+    MailNode* first;
+    MailNode* last;
+    size_t controls; // 其中控制通道消息的数量
+} MailQueue;
+
+Mailbox* mailbox_init(size_t proc_count);
+void mailbox_destroy(Mailbox* boxes, size_t proc_count);
+
+int mailbox_send(Mailbox* box, local_id from, const Message* msg);
+size_t mailbox_collect(Mailbox* box, MailQueue* queues);
+int mailbox_take(MailQueue* queue, Message* msg);
+int mailbox_take_control(MailQueue* queue, Message* msg);
+void mailbox_clear(MailQueue* queues, size_t proc_count);
+int mailbox_wait(Mailbox* box);
+
+#endif
@@ -1,103 +1,541 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include "banking.h"
 #include "communication.h"
 #include "logger.h"
 #include "lamporttime.h"
+#include "fiber.h"
 
 /* 定义主函数返回类型 */
 #define ERROR_INVALID_ARGUMENTS -1
 #define ERROR_FORK -2
+#define ERROR_CHANNELS_INIT -3
 #define SUCCESS 0
 
 #define true 1
 #define false 0
 
-int get_children_count(int argc, char** argv);
+const char* get_option(int* argc, char** argv, const char* option, const char* value);
+int get_children_count(int argc, char** argv, int balances);
+
+/**
+* 以线程运行的进程的参数
+*/
+typedef struct
+{
+    Mailbox* mailboxes;
+    size_t proc_count;
+    local_id id;
+    balance_t balance;
+    int flush;
+    int barrier;
+    int window;
+    int batch;
+    int ack;
+    int receive;
+    int lanes;
+    int credit;
+    int pipe_size;
+    int parent_pipe_size;
+    int pipe_grow;
+    FILE* pool;
+} ThreadArgs;
 
-int parent_handler(PipesCommunication* pc);
+/**
+* 池模式的一个场景
+*/
+typedef struct
+{
+    local_id proc_count;
+    balance_t balances[MAX_PROCESS_COUNT];
+    size_t transfers_count;
+    size_t transfers_size;    // 已分配的账单数量
+    TransferOrder* transfers; // 没有账单时执行 bank_robbery()
+} Scenario;
+
+local_id fork_children(size_t child_count, int tree, pid_t* children, size_t* count);
+int run_threads(int child_count, int fibers, int flush, int barrier, int window, int batch, int ack, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow, FILE* pool, char** argv);
+void* thread_handler(void* arg);
+
+int parent_pool_handler(PipesCommunication* pc, FILE* pool);
+int child_pool_handler(PipesCommunication* pc);
+int parse_scenario(char* line, size_t pool_size, Scenario* scenario);
+
+int parent_handler(PipesCommunication* pc, const Scenario* scenario);
 int child_handler(PipesCommunication* pc);
 
 int transfer_amount(PipesCommunication* pc, Message* msg, BalanceState* bs, BalanceHistory* bh);
+int transfer_amount_batch(PipesCommunication* pc, Message* msg, BalanceState* bs, BalanceHistory* bh);
 void update_balance_history(BalanceState* bs, BalanceHistory* bh, balance_t amount, timestamp_t timestamp_msg, char inc, char fix);
 
 /**
- * @return -1 无效参数, -2 创建子进程错误, 0 正常结束
+ * @return -1 无效参数, -2 创建子进程错误, -3 创建通道错误, 0 正常结束
  */
 int main(int argc, char** argv)
 {
     size_t i;
     int child_count;
-    int* pipes;
+    int threads;
+    int fibers;
+    int fork_tree;
+    int transport;
+    int flush;
+    int barrier;
+    int window;
+    int batch;
+    int ack;
+    int receive;
+    int lanes;
+    int credit;
+    int pipe_size;
+    int parent_pipe_size;
+    int pipe_grow;
+    const char* pool_name;
+    FILE* pool = NULL;
+    int* pipes = NULL;
+    ShmRegion* shm = NULL;
     pid_t* children;
-    pid_t fork_id;
+    size_t children_count;
     local_id current_proc_id;
     PipesCommunication* pc;
 
     // 检查参数
-    if (argc < 4 || (child_count = get_children_count(argc, argv)) == -1)
+    threads = get_option(&argc, argv, "--threads", NULL) != NULL;
+    fibers = get_option(&argc, argv, "--fibers", NULL) != NULL;
+    fork_tree = get_option(&argc, argv, "--fork-tree", NULL) != NULL;
+    transport = get_transport_type(get_option(&argc, argv, "--transport=", threads || fibers ? "mailbox" : "pipe"));
+    flush = get_flush_policy(get_option(&argc, argv, "--flush=", "immediate"));
+    barrier = get_barrier_type(get_option(&argc, argv, "--barrier=", "all"));
+    window = get_transfer_window(get_option(&argc, argv, "--window=", "1"));
+    batch = get_transfer_batch(get_option(&argc, argv, "--batch=", "1"));
+    ack = get_ack_mode(get_option(&argc, argv, "--ack=", "each"));
+    receive = get_receive_policy(get_option(&argc, argv, "--receive=", "first"));
+    lanes = get_lane_mode(get_option(&argc, argv, "--lanes=", "single"));
+    credit = get_credit_window(get_option(&argc, argv, "--credit=", "off"));
+    pipe_size = get_pipe_size(get_option(&argc, argv, "--pipe-size=", "default"));
+    parent_pipe_size = get_pipe_size(get_option(&argc, argv, "--parent-pipe-size=", "default"));
+    pipe_grow = get_pipe_grow(get_option(&argc, argv, "--pipe-grow=", "off"));
+    pool_name = get_option(&argc, argv, "--pool=", NULL);
+    if (transport == -1 || flush == -1 || barrier == -1 || window == -1 || batch == -1 || ack == -1 || receive == -1 || lanes == -1 || credit == -1 || pipe_size == -1 || parent_pipe_size == -1 || pipe_grow == -1 || (threads && fibers) || (threads || fibers) != (transport == TRANSPORT_MAILBOX)
+        || argc < 3 || (child_count = get_children_count(argc, argv, pool_name == NULL)) == -1)
+    {
+        //fprintf(stderr, "Usage: %s [--threads | --fibers | --transport=pipe|shm|seqpacket] [--flush=immediate|batch] [--barrier=all|tree] [--window=N] [--batch=N] [--ack=each|watermark] [--receive=first|round-robin|weighted|oldest] [--lanes=single|control] [--credit=off|BYTES] [--pipe-size=default|BYTES] [--parent-pipe-size=default|BYTES] [--pipe-grow=off|N] [--fork-tree] -p X y1 y2 ... yX\n", argv[0]);
+        //fprintf(stderr, "       %s [options] --pool=FILE|- -p X\n", argv[0]);
+        return ERROR_INVALID_ARGUMENTS;
+    }
+
+    // 场景只由父进程读取，子进程通过 RESET 消息得到
+    if (pool_name && !(pool = strcmp(pool_name, "-") ? fopen(pool_name, "r") : stdin))
     {
-        //fprintf(stderr, "Usage: %s -p X y1 y2 ... yX\n", argv[0]);
+        perror(pool_name);
         return ERROR_INVALID_ARGUMENTS;
     }
 
     // 初始化日志
     log_init();
 
+    // 所有进程作为本进程的线程或纤程运行
+    if (threads || fibers)
+    {
+        return run_threads(child_count, fibers, flush, barrier, window, batch, ack, receive, lanes, credit, pipe_size, parent_pipe_size, pipe_grow, pool, argv);
+    }
+
     // 分配内存
     children = malloc(sizeof(pid_t) * child_count);
 
     // 为所有进程打开管道
-    pipes = pipes_init(child_count + 1);
+    if (transport == TRANSPORT_SHM)
+    {
+        shm = shm_init(child_count + 1);
+    }
+    else
+    {
+        pipes = pipes_init(child_count + 1, transport);
+    }
+    if (pipes == NULL && shm == NULL)
+    {
+        return ERROR_CHANNELS_INIT;
+    }
 
     // 创建子进程
-    for (i = 0; i < child_count; i++)
+    current_proc_id = fork_children(child_count, fork_tree, children, &children_count);
+    if (current_proc_id < 0)
     {
-        fork_id = fork();
-        if (fork_id < 0)
-        {
-            return ERROR_FORK;
-        }
-        else if (!fork_id)
-        {
-            free(children);
-            break;
-        }
-        children[i] = fork_id;
+        return ERROR_FORK;
     }
 
-    // 设置当前进程ID
-    current_proc_id = (fork_id == 0) ? i + 1 : PARENT_ID;
-
 
     // 为进程设置管道管理器  */
-    balance_t balance = atoi(argv[current_proc_id + 2]); //获得初始金额
-    pc = communication_init(pipes, child_count + 1, current_proc_id, balance);
-    log_pipes(pc);
+    balance_t balance = pool ? 0 : atoi(argv[current_proc_id + 2]); //获得初始金额，池模式由 RESET 消息给出
+    pc = communication_init(transport, pipes, shm, NULL, child_count + 1, current_proc_id, balance);
+    set_flush_policy(pc, flush);
+    pc->barrier = barrier;
+    pc->window = window;
+    pc->batch = batch;
+    pc->ack_mode = ack;
+    set_receive_policy(pc, receive);
+    pc->lanes = lanes;
+    set_credit_window(pc, credit);
+    set_pipe_size(pc, pipe_size, parent_pipe_size, pipe_grow);
 
     // 进入工作函数
     if (current_proc_id == PARENT_ID)
     {
-        parent_handler(pc);
-        for (i = 0; i < child_count; i++)
-        { // 如果是父进程，等待所有子进程结束
-            waitpid(children[i], NULL, 0);
-        }
+        pool ? parent_pool_handler(pc, pool) : parent_handler(pc, NULL);
+        ipc_flush(pc); // 写出积累的消息后再等待
     }
     else
     {
-        child_handler(pc);
+        pool ? child_pool_handler(pc) : child_handler(pc);
+        ipc_flush(pc); // 退出后没有人会读积累的消息
+    }
+    for (i = 0; i < children_count; i++)
+    { // 等待本进程创建的子进程结束
+        waitpid(children[i], NULL, 0);
     }
 
 
     // 后处理
+    log_pipes(pc);//记录打开过的通道
+    log_poll_stats(pc);//记录等待统计
     log_destroy();//释放日志文件
     communication_release(pc);//释放管道
+    free(children);
+    return 0;
+}
+
+/** 创建子进程
+ * 顺序创建时父进程创建所有子进程；树形创建时进程 i 创建 2i + 1 和 2i + 2，
+ * 同一层的 fork 并行进行，启动时间随进程数量的对数增长。每个进程等待自己创建的子进程
+ *
+ * @param child_count	子进程数量
+ * @param tree			按二叉树创建
+ * @param children		保存当前进程创建的子进程 pid
+ * @param count			保存它们的数量
+ *
+ * @return -1 创建子进程错误, 否则为当前进程本地ID
+ */
+local_id fork_children(size_t child_count, int tree, pid_t* children, size_t* count)
+{
+    local_id id = PARENT_ID;
+    size_t next = 1;
+    size_t last = tree ? 2 : child_count;
+
+    *count = 0;
+    while (next <= last && next <= child_count)
+    {
+        pid_t pid = fork();
+
+        if (pid < 0)
+        {
+            return -1;
+        }
+        if (pid)
+        {
+            children[(*count)++] = pid;
+            next++;
+            continue;
+        }
+
+        id = next;
+        *count = 0;
+        next = 2 * id + 1;
+        last = tree ? next + 1 : 0;
+    }
+    return id;
+}
+
+/** 所有进程作为线程在同一地址空间中运行
+ * 子进程各有一个线程，父进程的工作由主线程完成，消息通过邮箱而不是管道传递
+ * 使用纤程时所有进程都是主线程的纤程，邮箱为空时切换，每次切换保存和恢复逻辑时间
+ *
+ * @param child_count	子进程数量
+ * @param fibers		以纤程而不是线程运行
+ * @param flush			写出策略
+ * @param barrier		STARTED / DONE 的屏障类型
+ * @param window		父进程同时在途的转账数量
+ * @param batch			父进程在一条消息中发送的同一源进程账单数量
+ * @param ack			转账的 ACK 方式
+ * @param receive		receive_any() 服务通道的顺序
+ * @param lanes			控制消息是否先于其他消息取出
+ * @param credit		通道的信用窗口, 不使用时为 0
+ * @param pipe_size		管道的容量, 内核默认值时为 0
+ * @param parent_pipe_size	到父进程的管道的容量, 与 pipe_size 相同时为 0
+ * @param pipe_grow		管道满这么多次后容量加倍, 不增大时为 0
+ * @param pool			池模式的场景文件, 只运行一次时为 NULL
+ * @param argv			参数字符串数组指针
+ *
+ * @return -2 创建线程错误或纤程死锁, -3 创建邮箱错误, 0 正常结束
+ */
+int run_threads(int child_count, int fibers, int flush, int barrier, int window, int batch, int ack, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow, FILE* pool, char** argv)
+{
+    pthread_t* threads = malloc(sizeof(pthread_t) * child_count);
+    ThreadArgs* args = malloc(sizeof(ThreadArgs) * (child_count + 1));
+    Mailbox* mailboxes = mailbox_init(child_count + 1);
+    int result = SUCCESS;
+
+    if (mailboxes == NULL)
+    {
+        return ERROR_CHANNELS_INIT;
+    }
+
+    for (local_id i = 0; i <= child_count; i++)
+    {
+        args[i].mailboxes = mailboxes;
+        args[i].proc_count = child_count + 1;
+        args[i].id = i;
+        args[i].balance = pool ? 0 : atoi(argv[i + 2]); //获得初始金额
+        args[i].flush = flush;
+        args[i].barrier = barrier;
+        args[i].window = window;
+        args[i].batch = batch;
+        args[i].ack = ack;
+        args[i].receive = receive;
+        args[i].lanes = lanes;
+        args[i].credit = credit;
+        args[i].pipe_size = pipe_size;
+        args[i].parent_pipe_size = parent_pipe_size;
+        args[i].pipe_grow = pipe_grow;
+        args[i].pool = pool;
+    }
+    if (fibers)
+    {
+        lamport_fiber_local();
+        result = fiber_run(child_count + 1, thread_handler, args, sizeof(ThreadArgs)) ? ERROR_FORK : SUCCESS;
+    }
+    else
+    {
+        for (local_id i = 1; i <= child_count; i++)
+        {
+            if (pthread_create(&threads[i - 1], NULL, thread_handler, &args[i]))
+            {
+                return ERROR_FORK;
+            }
+        }
+
+        thread_handler(&args[PARENT_ID]);
+
+        // 等待所有子线程结束
+        for (int i = 0; i < child_count; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    log_destroy();//释放日志文件
+    mailbox_destroy(mailboxes, child_count + 1);
+    free(args);
+    free(threads);
+    return result;
+}
+
+/**
+* 线程或纤程处理函数，运行一个进程的工作
+*
+* @param arg		ThreadArgs 指针
+*
+* @return NULL
+*/
+void* thread_handler(void* arg)
+{
+    ThreadArgs* args = (ThreadArgs*)arg;
+    PipesCommunication* pc = communication_init(TRANSPORT_MAILBOX, NULL, NULL, args->mailboxes, args->proc_count, args->id, args->balance);
+
+    set_flush_policy(pc, args->flush);
+    pc->barrier = args->barrier;
+    pc->window = args->window;
+    pc->batch = args->batch;
+    pc->ack_mode = args->ack;
+    set_receive_policy(pc, args->receive);
+    pc->lanes = args->lanes;
+    set_credit_window(pc, args->credit);
+    set_pipe_size(pc, args->pipe_size, args->parent_pipe_size, args->pipe_grow);
+    log_pipes(pc);
+
+    if (args->id == PARENT_ID)
+    {
+        args->pool ? parent_pool_handler(pc, args->pool) : parent_handler(pc, NULL);
+    }
+    else
+    {
+        args->pool ? child_pool_handler(pc) : child_handler(pc);
+    }
+    ipc_flush(pc);
+
+    log_poll_stats(pc);//记录等待统计
+    communication_release(pc);//释放邮箱队列
+    return NULL;
+}
+
+/**
+ * 池模式父进程处理函数
+ * 每行场景为 "X y1 ... yX [src dst amount]..."，子进程 1..X 收到 RESET 消息后
+ * 执行该场景，其余子进程等待下一个场景。每个场景结束后立即输出历史记录
+ *
+ * @param pc		管道管理器指针
+ * @param pool		场景文件
+ *
+ * @return -1 有场景失败, 0 正常返回.
+ */
+int parent_pool_handler(PipesCommunication* pc, FILE* pool)
+{
+    Scenario scenario;
+    char* line = NULL;
+    size_t line_size = 0;
+    size_t number = 0;
+    int result = 0;
+
+    scenario.transfers = NULL;
+    scenario.transfers_size = 0;
+
+    while (getline(&line, &line_size, pool) != -1)
+    {
+        ResetOrder order;
+        int parsed = parse_scenario(line, pc->total_ids - 1, &scenario);
+
+        if (parsed > 0)
+        {
+            continue;
+        }
+        number++;
+        if (parsed < 0)
+        {
+            fprintf(stderr, "Scenario %lu is invalid, skipped\n", (unsigned long)number);
+            continue;
+        }
+
+        // 每个场景的逻辑时间都从 0 开始
+        pc->active_ids = scenario.proc_count + 1;
+        reset_lamport_time();
+        order.s_proc_count = scenario.proc_count;
+        for (local_id i = 1; i <= scenario.proc_count; i++)
+        {
+            order.s_balance = scenario.balances[i - 1];
+            send_reset_msg(pc, i, &order);
+        }
+
+        printf("Scenario %lu:\n", (unsigned long)number);
+        if (parent_handler(pc, &scenario))
+        {
+            result = -1;
+            break;
+        }
+        fflush(stdout);
+    }
+
+    // 等待 RESET 的子进程也停止
+    pc->active_ids = pc->total_ids;
+    increase_lamport_time();
+    send_all_stop_msg(pc);
+
+    free(scenario.transfers);
+    free(line);
+    if (pool != stdin)
+    {
+        fclose(pool);
+    }
+    return result;
+}
+
+/** 池模式子进程处理函数，每收到一个 RESET 执行一个场景，直到收到 STOP
+ *
+ * @param pc		管道管理器指针
+ *
+ * @return -1 不正确的消息类型, 0 正常返回.
+ */
+int child_pool_handler(PipesCommunication* pc)
+{
+    for (;;)
+    {
+        Message msg;
+        ResetOrder order;
+
+        while (receive(pc, PARENT_ID, &msg));
+
+        if (msg.s_header.s_type == STOP)
+        {
+            return 0;
+        }
+        if (msg.s_header.s_type != RESET)
+        {
+            return -1;
+        }
+
+        memcpy(&order, msg.s_payload, sizeof(ResetOrder));
+        pc->balance = order.s_balance;
+        pc->active_ids = order.s_proc_count + 1;
+        reset_lamport_time();
+
+        if (child_handler(pc))
+        {
+            return -1;
+        }
+    }
+}
+
+/** 解析池的一行场景
+ *
+ * @param line			场景行，会被分割
+ * @param pool_size		池中子进程数量
+ * @param scenario		保存场景
+ *
+ * @return 1 空行或注释行, -1 非法场景, 0 成功.
+ */
+int parse_scenario(char* line, size_t pool_size, Scenario* scenario)
+{
+    const char* delim = " \t\r\n";
+    char* token = strtok(line, delim);
+    int proc_count;
+
+    if (!token || token[0] == '#')
+    {
+        return 1;
+    }
+    proc_count = atoi(token);
+    if (proc_count <= 0 || (size_t)proc_count > pool_size)
+    {
+        return -1;
+    }
+    scenario->proc_count = proc_count;
+    for (local_id i = 0; i < proc_count; i++)
+    {
+        if (!(token = strtok(NULL, delim)))
+        {
+            return -1;
+        }
+        scenario->balances[i] = atoi(token);
+    }
+
+    scenario->transfers_count = 0;
+    while ((token = strtok(NULL, delim)))
+    {
+        TransferOrder* order;
+        int src = atoi(token);
+        int dst = (token = strtok(NULL, delim)) ? atoi(token) : 0;
+        int amount = (token = strtok(NULL, delim)) ? atoi(token) : 0;
+
+        if (src <= 0 || src > proc_count || dst <= 0 || dst > proc_count || src == dst || amount <= 0)
+        {
+            return -1;
+        }
+        if (scenario->transfers_count == scenario->transfers_size)
+        {
+            scenario->transfers_size = scenario->transfers_size ? scenario->transfers_size * 2 : 16;
+            scenario->transfers = realloc(scenario->transfers, sizeof(TransferOrder) * scenario->transfers_size);
+        }
+        order = &scenario->transfers[scenario->transfers_count++];
+        order->s_src = src;
+        order->s_dst = dst;
+        order->s_amount = amount;
+    }
     return 0;
 }
 
@@ -106,19 +544,35 @@ int main(int argc, char** argv)
  * 负责接收消息，账单，输出历史记录
  *
  * @param pc		管道管理器指针
+ * @param scenario	池场景的账单, 为 NULL 时执行 bank_robbery()
  *
- * @return -1 不正确的消息类型, 0 正常返回.
+ * @return -1 没有收到某个子进程的历史记录, 0 正常返回.
  */
-int parent_handler(PipesCommunication* pc)
+int parent_handler(PipesCommunication* pc, const Scenario* scenario)
 {
-    AllHistory all_history; //总体记录
+    // 总体记录，print_history() 只读取 s_history_len 项，所以可以多于 MAX_PROCESS_ID + 1 项
+    AllHistory* all_history = malloc(offsetof(AllHistory, s_history) + sizeof(BalanceHistory) * (pc->active_ids - 1));
+    uint8_t history_len = 0;
 
-    all_history.s_history_len = pc->total_ids - 1; //等于子进程数量
+    all_history->s_history_len = pc->active_ids - 1; //等于子进程数量
 
     receive_all_msgs(pc, STARTED); //等待其他进程的就绪消息
 
     /* 处理账单 */
-    bank_robbery(pc, pc->total_ids - 1);
+    if (scenario && scenario->transfers_count)
+    {
+        for (size_t j = 0; j < scenario->transfers_count; j++)
+        {
+            const TransferOrder* order = &scenario->transfers[j];
+
+            transfer_async(pc, order->s_src, order->s_dst, order->s_amount);
+        }
+    }
+    else
+    {
+        bank_robbery(pc, pc->active_ids - 1);
+    }
+    transfer_wait_all(pc);
 
     /* 处理完成，等待子进程结束 */
     increase_lamport_time();
@@ -126,23 +580,36 @@ int parent_handler(PipesCommunication* pc)
     receive_all_msgs(pc, DONE);
 
     /* 输出历史记录 */
-    for (local_id i = 1; i < pc->total_ids; i++)
+    for (local_id i = 1; i < pc->active_ids; i++)
     {
-        BalanceHistory balance_history;
         Message msg;
 
-        while (receive(pc, i, &msg));
-
-        if (msg.s_header.s_type != BALANCE_HISTORY)
+        if (receive_type(pc, i, BALANCE_HISTORY, &msg) || read_balance_history(&msg, &all_history->s_history[i - 1]))
         {
+            free(all_history);
             return -1;
         }
 
-        memcpy((void*)&balance_history, msg.s_payload, sizeof(char) * msg.s_header.s_payload_len);
-        all_history.s_history[i - 1] = balance_history;
+        if (all_history->s_history[i - 1].s_history_len > history_len)
+        {
+            history_len = all_history->s_history[i - 1].s_history_len;
+        }
     }
 
-    print_history(&all_history);
+    // 收到 DONE 的顺序不同，子进程最后的逻辑时间可能不同，用最后的状态补齐，否则缺少的项按 0 输出
+    for (local_id i = 1; i < pc->active_ids; i++)
+    {
+        BalanceHistory* bh = &all_history->s_history[i - 1];
+
+        for (; bh->s_history_len < history_len; bh->s_history_len++)
+        {
+            bh->s_history[bh->s_history_len] = bh->s_history[bh->s_history_len - 1];
+            bh->s_history[bh->s_history_len].s_time = bh->s_history_len;
+        }
+    }
+
+    print_history(all_history);
+    free(all_history);
     return 0;
 }
 
@@ -156,7 +623,7 @@ int child_handler(PipesCommunication* pc)
 {
     BalanceState bs; //余额状态
     BalanceHistory bh; //余额历史
-    size_t done_left = pc->total_ids - 2;
+    size_t done_left = pc->barrier == BARRIER_TREE ? 0 : pc->active_ids - 2; // 树形屏障时只接收屏障树中子节点的 DONE
     int stopped = false;
 
     bh.s_id = pc->current_id;
@@ -184,6 +651,14 @@ int child_handler(PipesCommunication* pc)
         {
             transfer_amount(pc, &msg, &bs, &bh);
         }
+        else if (msg.s_header.s_type == TRANSFER_BATCH)
+        {
+            transfer_amount_batch(pc, &msg, &bs, &bh);
+        }
+        else if (msg.s_header.s_type == WATERMARK_REQUEST)
+        {
+            settle_request(pc, &msg);
+        }
         else if (msg.s_header.s_type == STOP)
         {
             update_balance_history(&bs, &bh, 0, msg.s_header.s_local_time, 1, 0);
@@ -193,7 +668,14 @@ int child_handler(PipesCommunication* pc)
         else if (msg.s_header.s_type == DONE)
         {
             update_balance_history(&bs, &bh, 0, msg.s_header.s_local_time, 1, 0);
-            done_left--;
+            if (pc->barrier == BARRIER_TREE)
+            {
+                pc->arrived++; // 屏障树中的子树可能在 STOP 到达本进程之前完成
+            }
+            else
+            {
+                done_left--;
+            }
         }
         else
         {
@@ -201,7 +683,14 @@ int child_handler(PipesCommunication* pc)
         }
     }
 
-    log_received_all_done(pc->current_id); //接受其他进程的完成消息
+    if (pc->barrier == BARRIER_TREE)
+    {
+        receive_all_msgs(pc, DONE); //等待屏障树父节点的释放消息
+    }
+    else
+    {
+        log_received_all_done(pc->current_id); //接受其他进程的完成消息
+    }
 
     // 更新历史记录并发送给父进程
     update_balance_history(&bs, &bh, 0, 0, 1, 0);
@@ -220,26 +709,38 @@ int child_handler(PipesCommunication* pc)
  */
 int transfer_amount(PipesCommunication* pc, Message* msg, BalanceState* bs, BalanceHistory* bh)
 {
-    TransferOrder order;
-    memcpy(&order, msg->s_payload, sizeof(char) * msg->s_header.s_payload_len);
+    SeqTransferOrder order;
+
+    if (msg->s_header.s_payload_len != sizeof(SeqTransferOrder))
+    {
+        return -1;
+    }
+    memcpy(&order, msg->s_payload, sizeof(SeqTransferOrder));
 
     update_balance_history(bs, bh, 0, 0, 1, 0);
 
-    // 处理支出Transfer request */
-    if (pc->current_id == order.s_src)
+    // 处理支出Transfer request，序号随转账传给目标 */
+    if (pc->current_id == order.s_order.s_src)
     {
-        update_balance_history(bs, bh, -order.s_amount, msg->s_header.s_local_time, 1, 0);
+        update_balance_history(bs, bh, -order.s_order.s_amount, msg->s_header.s_local_time, 1, 0);
         update_balance_history(bs, bh, 0, 0, 1, 0);
-        send_transfer_msg(pc, order.s_dst, &order);
-        pc->balance -= order.s_amount;
+        send_transfer_msg(pc, order.s_order.s_dst, &order);
+        pc->balance -= order.s_order.s_amount;
     }
     /* 处理收入Transfer income */
-    else if (pc->current_id == order.s_dst)
+    else if (pc->current_id == order.s_order.s_dst)
     {
-        update_balance_history(bs, bh, order.s_amount, msg->s_header.s_local_time, 1, 1);
-        increase_lamport_time();
-        send_ack_msg(pc, PARENT_ID);
-        pc->balance += order.s_amount;
+        update_balance_history(bs, bh, order.s_order.s_amount, msg->s_header.s_local_time, 1, 1);
+        if (pc->ack_mode == ACK_WATERMARK)
+        {
+            settle_order(pc, order.s_seq);
+        }
+        else
+        {
+            increase_lamport_time();
+            send_ack_msg(pc, PARENT_ID, order.s_seq, 1);
+        }
+        pc->balance += order.s_order.s_amount;
     }
     else
     {
@@ -248,6 +749,75 @@ int transfer_amount(PipesCommunication* pc, Message* msg, BalanceState* bs, Bala
     return 0;
 }
 
+/** 处理批量转账消息
+ * 源进程从父进程收到账单，一次扣除总金额，按目标进程分批转发
+ * 目标进程一次收入该批的总金额，用一个 ACK 确认其全部账单
+ *
+ * @param pc		管道管理器指针
+ * @param msg		收到的消息
+ * @param bs		余额状态
+ * @param bh		余额历史记录
+ *
+ * @return -1 不正确的地址或消息内容, 0 正常返回.
+ */
+int transfer_amount_batch(PipesCommunication* pc, Message* msg, BalanceState* bs, BalanceHistory* bh)
+{
+    TransferBatch* batch = (TransferBatch*)msg->s_payload;
+    balance_t amount = 0;
+
+    if (msg->s_header.s_payload_len <= sizeof(TransferBatch))
+    {
+        return -1;
+    }
+    size_t count = (msg->s_header.s_payload_len - sizeof(TransferBatch)) / sizeof(TransferOrder);
+    int source = batch->s_orders[0].s_src == pc->current_id;
+    for (size_t i = 0; i < count; i++)
+    {
+        if ((source ? batch->s_orders[i].s_src : batch->s_orders[i].s_dst) != pc->current_id)
+        {
+            return -1;
+        }
+        amount += batch->s_orders[i].s_amount;
+    }
+
+    update_balance_history(bs, bh, 0, 0, 1, 0);
+
+    // 处理支出，账单按目标进程分批转发，保持原来的顺序
+    if (source)
+    {
+        TransferOrder orders[MAX_TRANSFER_BATCH];
+
+        update_balance_history(bs, bh, -amount, msg->s_header.s_local_time, 1, 0);
+        update_balance_history(bs, bh, 0, 0, 1, 0);
+        for (local_id dst = 1; dst < pc->active_ids; dst++)
+        {
+            size_t len = 0;
+
+            for (size_t i = 0; i < count; i++)
+            {
+                if (batch->s_orders[i].s_dst == dst)
+                {
+                    orders[len++] = batch->s_orders[i];
+                }
+            }
+            if (len)
+            {
+                send_transfer_batch_msg(pc, dst, batch->s_seq, orders, len);
+            }
+        }
+        pc->balance -= amount;
+    }
+    // 处理收入
+    else
+    {
+        update_balance_history(bs, bh, amount, msg->s_header.s_local_time, 1, 1);
+        increase_lamport_time();
+        send_ack_msg(pc, PARENT_ID, batch->s_seq, count);
+        pc->balance += amount;
+    }
+    return 0;
+}
+
 /** 更新分行余额历史记录
  *
  * @param bs				余额状态
@@ -259,7 +829,7 @@ int transfer_amount(PipesCommunication* pc, Message* msg, BalanceState* bs, Bala
  */
 void update_balance_history(BalanceState* state, BalanceHistory* bh, balance_t amount, timestamp_t timestamp_msg, char inc, char fix)
 {
-    static timestamp_t prev_time = 0;
+    timestamp_t prev_time = state->s_time; // 上次更新的时间
     timestamp_t curr_time = get_lamport_time() < timestamp_msg ? timestamp_msg : get_lamport_time();
     timestamp_t i;
 
@@ -273,9 +843,12 @@ void update_balance_history(BalanceState* state, BalanceHistory* bh, balance_t a
         timestamp_msg--;
     }
 
-    bh->s_history_len = curr_time + 1;
+    // 进程很多时逻辑时间会超过 MAX_T，历史记录只能保存到 MAX_T - 1 (s_history_len 是 uint8_t)
+    timestamp_t last_time = curr_time < MAX_T ? curr_time : MAX_T - 1;
+
+    bh->s_history_len = last_time + 1;
 
-    for (i = prev_time; i < curr_time; i++)
+    for (i = prev_time; i < curr_time && i <= last_time; i++)
     {
         state->s_time = i;
         bh->s_history[i] = *state;
@@ -283,29 +856,64 @@ void update_balance_history(BalanceState* state, BalanceHistory* bh, balance_t a
 
     if (amount > 0)
     {
-        for (i = timestamp_msg; i < curr_time; i++)
+        for (i = timestamp_msg; i < curr_time && i <= last_time; i++)
         {
             bh->s_history[i].s_balance_pending_in += amount;
         }
     }
 
-    prev_time = curr_time;
     state->s_time = curr_time;
     state->s_balance += amount;
-    bh->s_history[curr_time] = *state;
+    if (curr_time == last_time)
+    {
+        bh->s_history[curr_time] = *state;
+    }
+}
+
+/** 从命令行参数中得到 "--name=VALUE" 选项的值，并从参数中删除该选项
+ *
+ * @param argc		参数数量指针
+ * @param argv		参数字符串数组指针
+ * @param option	选项前缀, 例如 "--transport="
+ * @param value		默认值
+ *
+ * @return 选项的值, 没有该选项时返回默认值
+ */
+const char* get_option(int* argc, char** argv, const char* option, const char* value)
+{
+    size_t len = strlen(option);
+
+    for (int i = 1; i < *argc; i++)
+    {
+        if (!strncmp(argv[i], option, len))
+        {
+            value = argv[i] + len;
+            memmove(argv + i, argv + i + 1, sizeof(char*) * (*argc - i));
+            (*argc)--;
+            return value;
+        }
+    }
+    return value;
 }
 
 /** 从命令行参数中得到子进程数
  *
  * @param argc		参数数量
  * @param argv		参数字符串数组指针
+ * @param balances	子进程数之后是各进程的初始金额
  *
  * @return -1 on error, any other values on success.
  */
-int get_children_count(int argc, char** argv)
+int get_children_count(int argc, char** argv, int balances)
 {
     int proc_count;
-    if (!strcmp(argv[1], "-p") && (proc_count = atoi(argv[2])) == (argc - 3))
+    if (strcmp(argv[1], "-p"))
+    {
+        return -1;
+    }
+    proc_count = atoi(argv[2]);
+    if (argc - 3 == (balances ? proc_count : 0)
+        && proc_count > 0 && proc_count < MAX_PROCESS_COUNT)
     {
         return proc_count;
     }
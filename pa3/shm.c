@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include "shm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define GET_INDEX(x, id) ((x) < (id) ? (x) : (x) - 1)
+#define RING_OFFSET(pos) ((pos) & (SHM_RING_SIZE - 1))
+#define RECORD_LEN(msg) (sizeof(uint32_t) + sizeof(MessageHeader) + (msg)->s_header.s_payload_len)
+
+/**
+* 取得 (src, dst) 的环形缓冲区
+* 按接收者分组，一个进程的所有输入缓冲区相邻
+*/
+static ShmRing* get_ring(ShmRegion* shm, local_id src, local_id dst)
+{
+    return &shm->rings[dst * (shm->proc_count - 1) + GET_INDEX(src, dst)];
+}
+
+/**
+* 取得接收者 dst 在 src 广播缓冲区中的读位置
+*/
+static ShmCursor* get_cursor(ShmRegion* shm, local_id src, local_id dst)
+{
+    return &shm->cursors[src * shm->proc_count + dst];
+}
+
+/**
+* 从位置 pos 开始写入缓冲区（到末尾时回绕）
+*/
+static void ring_write(ShmRing* ring, uint32_t pos, const void* buf, size_t len)
+{
+    size_t offset = RING_OFFSET(pos);
+    size_t first = SHM_RING_SIZE - offset < len ? SHM_RING_SIZE - offset : len;
+
+    memcpy(ring->data + offset, buf, first);
+    memcpy(ring->data, (const char*) buf + first, len - first);
+}
+
+/**
+* 从位置 pos 开始读取缓冲区（到末尾时回绕）
+*/
+static void ring_read(ShmRing* ring, uint32_t pos, void* buf, size_t len)
+{
+    size_t offset = RING_OFFSET(pos);
+    size_t first = SHM_RING_SIZE - offset < len ? SHM_RING_SIZE - offset : len;
+
+    memcpy(buf, ring->data + offset, first);
+    memcpy((char*) buf + first, ring->data, len - first);
+}
+
+/**
+* 在 head 处写入记录（发送者序号 + 消息）并发布
+* 由调用者检查剩余空间
+*/
+static void put_record(ShmRing* ring, uint32_t seq, const Message* msg)
+{
+    uint32_t head = ring->head;
+
+    ring_write(ring, head, &seq, sizeof(uint32_t));
+    ring_write(ring, head + sizeof(uint32_t), msg, sizeof(MessageHeader) + msg->s_header.s_payload_len);
+    __atomic_store_n(&ring->head, head + RECORD_LEN(msg), __ATOMIC_RELEASE);
+}
+
+/**
+* 读取位置 pos 处的记录
+*
+* @return 记录长度
+*/
+static uint32_t get_record(ShmRing* ring, uint32_t pos, Message* msg)
+{
+    ring_read(ring, pos + sizeof(uint32_t), msg, sizeof(MessageHeader));
+    ring_read(ring, pos + sizeof(uint32_t) + sizeof(MessageHeader), msg->s_payload, msg->s_header.s_payload_len);
+    return RECORD_LEN(msg);
+}
+
+/**
+* 取得位置 pos 处记录的发送者序号
+*/
+static uint32_t get_seq(ShmRing* ring, uint32_t pos)
+{
+    uint32_t seq;
+
+    ring_read(ring, pos, &seq, sizeof(uint32_t));
+    return seq;
+}
+
+/**
+* 检查位置 pos 之后是否有记录
+*/
+static int has_record(ShmRing* ring, uint32_t pos)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != pos;
+}
+
+/**
+* 如果接收者在休眠则唤醒它，调用者在发布后设置内存屏障
+*/
+static void ring_doorbell(ShmRegion* shm, local_id dst)
+{
+    ShmDoorbell* bell = &shm->doorbells[dst];
+
+    if (__atomic_load_n(&bell->waiting, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&bell->seq, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &bell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+* 检查是否有发给进程的消息
+*
+* @param from 发送者ID, -1 表示任意发送者
+*/
+static int has_pending(ShmRegion* shm, local_id self, local_id from)
+{
+    local_id i;
+
+    for (i = 0; i < shm->proc_count; i++)
+    {
+        if (i == self || (from >= 0 && i != from))
+        {
+            continue;
+        }
+        if (has_record(get_ring(shm, i, self), get_ring(shm, i, self)->tail)
+            || has_record(&shm->broadcasts[i], get_cursor(shm, i, self)->pos))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* 为所有进程映射共享环形缓冲区，必须在 fork 之前调用
+*
+* @param proc_count 包含父进程的进程数量
+*
+* @return 共享内存区域指针, 错误时返回 NULL
+*/
+ShmRegion* shm_init(size_t proc_count)
+{
+    ShmRegion* shm;
+    void* addr;
+    int fd;
+    size_t size = sizeof(ShmDoorbell) * proc_count + sizeof(ShmRing) * proc_count * proc_count
+        + sizeof(ShmCursor) * proc_count * proc_count;
+
+    if ((fd = memfd_create("ipc_rings", MFD_CLOEXEC)) < 0)
+    {
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    shm = malloc(sizeof(ShmRegion));
+    shm->proc_count = proc_count;
+    shm->size = size;
+    shm->doorbells = addr;
+    shm->rings = (ShmRing*) (shm->doorbells + proc_count);
+    shm->broadcasts = shm->rings + proc_count * (proc_count - 1);
+    shm->cursors = (ShmCursor*) (shm->broadcasts + proc_count);
+    shm->send_seq = 0;
+    return shm;
+}
+
+/**
+* 解除映射并释放资源
+*
+* @param shm 共享内存区域指针
+*/
+void shm_destroy(ShmRegion* shm)
+{
+    munmap(shm->doorbells, shm->size);
+    free(shm);
+}
+
+/**
+* 把消息放入 (src, dst) 缓冲区，除非接收者在休眠，否则没有系统调用
+*
+* @return -1 缓冲区已满, 0 成功
+*/
+int shm_send(ShmRegion* shm, local_id src, local_id dst, const Message* msg)
+{
+    ShmRing* ring = get_ring(shm, src, dst);
+
+    if (SHM_RING_SIZE - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < RECORD_LEN(msg))
+    {
+        return -1;
+    }
+    put_record(ring, shm->send_seq++, msg);
+
+    // 与 shm_wait() 中的内存屏障配对：要么接收者看到新的 head，要么我们看到它在等待
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ring_doorbell(shm, dst);
+    return 0;
+}
+
+/**
+* 把消息一次性放入 src 的广播缓冲区，发给所有其他进程
+* 每个接收者按自己的读位置读取，所有读位置都越过后空间才被重用
+*
+* @return -1 缓冲区已满, 0 成功
+*/
+int shm_multicast(ShmRegion* shm, local_id src, const Message* msg)
+{
+    ShmRing* ring = &shm->broadcasts[src];
+    local_id i;
+
+    if (SHM_RING_SIZE - (ring->head - ring->tail) < RECORD_LEN(msg))
+    {
+        // 找到最慢的接收者
+        ring->tail = ring->head;
+        for (i = 0; i < shm->proc_count; i++)
+        {
+            uint32_t pos;
+
+            if (i == src)
+            {
+                continue;
+            }
+            pos = __atomic_load_n(&get_cursor(shm, src, i)->pos, __ATOMIC_ACQUIRE);
+            if (ring->head - pos > ring->head - ring->tail)
+            {
+                ring->tail = pos;
+            }
+        }
+        if (SHM_RING_SIZE - (ring->head - ring->tail) < RECORD_LEN(msg))
+        {
+            return -1;
+        }
+    }
+    put_record(ring, shm->send_seq++, msg);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < shm->proc_count; i++)
+    {
+        if (i != src)
+        {
+            ring_doorbell(shm, i);
+        }
+    }
+    return 0;
+}
+
+/**
+* 非阻塞地取出 src 发来的消息
+* src 的消息来自 (src, dst) 缓冲区和 src 的广播缓冲区，按记录序号以发送顺序取出
+*
+* @return -1 两个缓冲区都为空, 0 成功
+*/
+int shm_try_receive(ShmRegion* shm, local_id src, local_id dst, Message* msg)
+{
+    ShmRing* ring = get_ring(shm, src, dst);
+    ShmRing* broadcast = &shm->broadcasts[src];
+    ShmCursor* cursor = get_cursor(shm, src, dst);
+    uint32_t tail = ring->tail;
+    uint32_t pos = cursor->pos;
+    int unicast = has_record(ring, tail);
+    int multicast = has_record(broadcast, pos);
+
+    // 记录按序号顺序发布：在一个缓冲区看到记录后，另一个缓冲区中更早的记录也一定可见，所以再检查一次
+    if (unicast && !multicast)
+    {
+        multicast = has_record(broadcast, pos);
+    }
+    else if (!unicast && multicast)
+    {
+        unicast = has_record(ring, tail);
+    }
+    if (!unicast && !multicast)
+    {
+        return -1;
+    }
+
+    if (unicast && multicast && (int32_t) (get_seq(broadcast, pos) - get_seq(ring, tail)) < 0)
+    {
+        unicast = 0;
+    }
+    if (unicast)
+    {
+        __atomic_store_n(&ring->tail, tail + get_record(ring, tail, msg), __ATOMIC_RELEASE);
+    }
+    else
+    {
+        __atomic_store_n(&cursor->pos, pos + get_record(broadcast, pos, msg), __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+* 等待发给进程 self 的消息
+* 先轮询缓冲区，然后在进程的 futex 上休眠
+*
+* @param self 接收者ID
+* @param from 发送者ID, -1 表示任意发送者
+*
+* @return 1 进程休眠过, 0 轮询时发现消息
+*/
+int shm_wait(ShmRegion* shm, local_id self, local_id from)
+{
+    ShmDoorbell* bell = &shm->doorbells[self];
+    uint32_t seq;
+    int i, slept = 0;
+
+    for (i = 0; i < SHM_SPIN_COUNT; i++)
+    {
+        if (has_pending(shm, self, from))
+        {
+            return 0;
+        }
+    }
+
+    seq = __atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&bell->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!has_pending(shm, self, from))
+    {
+        syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+        slept = 1;
+    }
+    __atomic_store_n(&bell->waiting, 0, __ATOMIC_RELAXED);
+    return slept;
+}
@@ -0,0 +1,57 @@
+#ifndef __IFMO_DISTRIBUTED_CLASS_SHM__H
+#define __IFMO_DISTRIBUTED_CLASS_SHM__H
+
+#include "ipc.h"
+
+enum
+{
+    SHM_RING_SIZE = 64 * 1024, // 与管道默认容量相同，必须是2的幂
+    SHM_CACHE_LINE = 64,
+    SHM_SPIN_COUNT = 512, // 休眠前轮询环形缓冲区的次数
+};
+
+/* 一对 (src, dst) 的单生产者单消费者环形缓冲区 */
+typedef struct
+{
+    uint32_t head; // 已写入的字节数，只由生产者修改
+    char head_pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail; // 已读取的字节数，只由消费者修改
+    char tail_pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+    char data[SHM_RING_SIZE];
+} ShmRing;
+
+/* 一个接收者在一个发送者广播缓冲区中的读位置 */
+typedef struct
+{
+    uint32_t pos; // 已读取的广播字节数，只由接收者修改
+    char pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+} ShmCursor;
+
+/* 每个进程的唤醒字 */
+typedef struct
+{
+    uint32_t seq;     // futex 字，发送者递增以唤醒接收进程
+    uint32_t waiting; // 接收进程准备在 seq 上休眠
+    char pad[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+} ShmDoorbell;
+
+typedef struct
+{
+    size_t proc_count;
+    size_t size;            // 映射的字节数
+    ShmDoorbell* doorbells; // 每个进程一个
+    ShmRing* rings;         // proc_count * (proc_count - 1) 个，按接收者分组
+    ShmRing* broadcasts;    // 每个发送者一个，tail 由发送者维护：尚有进程未读的最早字节
+    ShmCursor* cursors;     // proc_count * proc_count 个，按发送者分组
+    uint32_t send_seq;      // 本进程下一条发送消息的序号
+} ShmRegion;
+
+ShmRegion* shm_init(size_t proc_count);
+void shm_destroy(ShmRegion* shm);
+
+int shm_send(ShmRegion* shm, local_id src, local_id dst, const Message* msg);
+int shm_multicast(ShmRegion* shm, local_id src, const Message* msg);
+int shm_try_receive(ShmRegion* shm, local_id src, local_id dst, Message* msg);
+int shm_wait(ShmRegion* shm, local_id self, local_id from);
+
+#endif
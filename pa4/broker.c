@@ -0,0 +1,273 @@
+/**
+ * @file     broker.c
+ * @Author   @seniorkot
+ * @date     June, 2018
+ * @brief    Channel broker: thread of parent process opening pipes or sockets
+ *           on demand and passing their ends over SCM_RIGHTS. Kept apart from
+ *           ipc.h, whose send() conflicts with the one declared in sys/socket.h
+ */
+
+#define _GNU_SOURCE
+
+#include "broker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* State of broker thread */
+typedef struct{
+	size_t proc_count;
+	int packets;			/* Open SOCK_SEQPACKET pairs instead of pipes */
+	struct pollfd* fds;		/* Broker ends of control sockets, -1 after process is gone */
+	char* opened;			/* proc_count * proc_count, (src, dst) channels handed out */
+} Broker;
+
+/** Send channel end to process
+ *
+ * @param fd			Channel end, -1 to tell that there is none
+ *
+ * @return -1 on error, 0 on success
+ */
+static int send_notice(int sock, int8_t peer, int8_t type, int fd){
+	ChannelNotice notice;
+	struct msghdr msg;
+	struct iovec iov;
+	union{
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	
+	notice.peer = peer;
+	notice.type = type;
+	iov.iov_base = &notice;
+	iov.iov_len = sizeof(ChannelNotice);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	
+	if (fd >= 0){
+		struct cmsghdr* cmsg;
+		
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/** Open (src, dst) channel, read end goes to dst, write end to src
+ *
+ * Channel is refused if dst is gone or it can't be opened.
+ */
+static void open_channel(Broker* broker, int8_t src, int8_t dst){
+	int fd[2];
+	int retval;
+	
+	if (dst < 0 || dst >= (int) broker->proc_count || dst == src || broker->fds[dst].fd < 0){
+		send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, -1);
+		return;
+	}
+	
+	retval = broker->packets ? socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fd) : pipe2(fd, O_NONBLOCK);
+	if (retval < 0){
+		send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, -1);
+		return;
+	}
+	
+	/* Reader learns about channel before the first message can be written */
+	if (send_notice(broker->fds[dst].fd, src, PIPE_READ_TYPE, fd[0])){
+		send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, -1);
+	}
+	else{
+		broker->opened[src * broker->proc_count + dst] = 1;
+		send_notice(broker->fds[src].fd, dst, PIPE_WRITE_TYPE, fd[1]);
+	}
+	close(fd[0]);
+	close(fd[1]);
+}
+
+/** Forget process which has closed its control socket
+ *
+ * Processes it has never written to are told that it is gone,
+ * like a closed pipe tells its reader.
+ */
+static void close_process(Broker* broker, int8_t src){
+	size_t i;
+	
+	close(broker->fds[src].fd);
+	broker->fds[src].fd = -1;
+	
+	for (i = 0; i < broker->proc_count; i++){
+		if (broker->fds[i].fd >= 0 && !broker->opened[src * broker->proc_count + i]){
+			send_notice(broker->fds[i].fd, src, PIPE_READ_TYPE, -1);
+		}
+	}
+}
+
+/** Serve channel requests until all processes are gone
+ *
+ * Request is id of receiver the process wants to write to.
+ */
+static void* broker_main(void* arg){
+	Broker* broker = (Broker*) arg;
+	size_t open = broker->proc_count;
+	size_t i;
+	
+	while (open){
+		if (poll(broker->fds, broker->proc_count, -1) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		
+		for (i = 0; i < broker->proc_count; i++){
+			int8_t dst;
+			ssize_t len;
+			
+			if (!broker->fds[i].revents){
+				continue;
+			}
+			len = recv(broker->fds[i].fd, &dst, sizeof(dst), MSG_DONTWAIT);
+			if (len > 0){
+				open_channel(broker, i, dst);
+			}
+			else if (!len || errno != EAGAIN){
+				close_process(broker, i);
+				open--;
+			}
+		}
+	}
+	
+	for (i = 0; i < broker->proc_count; i++){
+		if (broker->fds[i].fd >= 0){
+			close(broker->fds[i].fd);
+		}
+	}
+	free(broker->fds);
+	free(broker->opened);
+	free(broker);
+	return NULL;
+}
+
+/** Open control sockets between broker and every process. Must be called before fork.
+ *
+ * @param proc_count    Process count including parent process.
+ *
+ * @return fds array: [id * 2] - broker end, [id * 2 + 1] - process end; NULL on error
+ */
+int* broker_init(size_t proc_count){
+	int* sockets = malloc(sizeof(int) * 2 * proc_count);
+	size_t i;
+	
+	for (i = 0; i < proc_count; i++){
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets + i * 2) < 0){
+			return NULL;
+		}
+	}
+	return sockets;
+}
+
+/** Start broker thread. Called by parent after fork.
+ *
+ * @param sockets		Array returned by broker_init(), broker ends are taken by the thread
+ * @param proc_count    Process count including parent process.
+ * @param packets		Open SOCK_SEQPACKET pairs instead of pipes
+ *
+ * @return -1 on error, 0 on success
+ */
+int broker_start(int* sockets, size_t proc_count, int packets){
+	Broker* broker = malloc(sizeof(Broker));
+	pthread_attr_t attr;
+	pthread_t thread;
+	size_t i;
+	int retval;
+	
+	broker->proc_count = proc_count;
+	broker->packets = packets;
+	broker->fds = malloc(sizeof(struct pollfd) * proc_count);
+	broker->opened = calloc(proc_count * proc_count, sizeof(char));
+	for (i = 0; i < proc_count; i++){
+		broker->fds[i].fd = sockets[i * 2];
+		broker->fds[i].events = POLLIN;
+	}
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	retval = pthread_create(&thread, &attr, broker_main, broker);
+	pthread_attr_destroy(&attr);
+	if (retval){
+		free(broker->fds);
+		free(broker->opened);
+		free(broker);
+		return -1;
+	}
+	return 0;
+}
+
+/** Ask broker for channel to dst. Its end comes by broker_take().
+ *
+ * @param sock			Process end of control socket
+ *
+ * @return -1 on error, 0 on success
+ */
+int broker_request(int sock, int8_t dst){
+	return write(sock, &dst, sizeof(dst)) == sizeof(dst) ? 0 : -1;
+}
+
+/** Take channel end handed out by broker
+ *
+ * @param sock			Process end of control socket
+ * @param wait			Sleep until it comes
+ * @param notice		Where to store channel peer and type
+ * @param fd			Where to store channel end, -1 if channel is closed or refused
+ *
+ * @return -1 if broker is gone or on error, 0 if there is nothing, 1 on success
+ */
+int broker_take(int sock, int wait, ChannelNotice* notice, int* fd){
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	union{
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	ssize_t len;
+	
+	iov.iov_base = notice;
+	iov.iov_len = sizeof(ChannelNotice);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	
+	while ((len = recvmsg(sock, &msg, wait ? 0 : MSG_DONTWAIT)) < 0){
+		if (errno == EAGAIN){
+			return 0;
+		}
+		if (errno != EINTR){
+			return -1;
+		}
+	}
+	if (len != sizeof(ChannelNotice)){
+		return -1;
+	}
+	
+	*fd = -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return 1;
+}
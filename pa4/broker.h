@@ -0,0 +1,32 @@
+/**
+ * @file     broker.h
+ * @Author   @seniorkot
+ * @date     June, 2018
+ * @brief    Header file for channel broker
+ */
+
+#ifndef __IFMO_DISTRIBUTED_CLASS_BROKER__H
+#define __IFMO_DISTRIBUTED_CLASS_BROKER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum PipeTypeOffset 
+{
+    PIPE_READ_TYPE = 0,
+    PIPE_WRITE_TYPE
+};
+
+/* Channel end handed out by broker, fd is passed along with it */
+typedef struct{
+	int8_t peer;		/* Process on the other end of the channel */
+	int8_t type;		/* PIPE_READ_TYPE / PIPE_WRITE_TYPE */
+} ChannelNotice;
+
+int* broker_init(size_t proc_count);
+int broker_start(int* sockets, size_t proc_count, int packets);
+
+int broker_request(int sock, int8_t dst);
+int broker_take(int sock, int wait, ChannelNotice* notice, int* fd);
+
+#endif
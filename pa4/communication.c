@@ -4,7 +4,9 @@
  * @date     June, 2018
  * @brief    Functions that help to organize IPC
  */
- 
+
+#define _GNU_SOURCE
+
 #include "communication.h"
 #include "log4pa.h"
 #include "pa2345.h"
@@ -15,6 +17,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/epoll.h>
 
 /** Set 0_NONBLOCK flag to fd
  * 
@@ -34,68 +39,329 @@ int set_nonblock(int pipe_id){
     return 0;
 }
 
-/** Open pipes fds
+/** Close all fds of array but one
+ *
+ * Fds opened one after another are closed by close_range() around the one
+ * kept, so a child drops descriptors of all other processes in two syscalls.
+ *
+ * @param fds			Fds array
+ * @param count			Count of fds
+ * @param keep			Fd left open
+ */
+static void close_all_but(const int* fds, size_t count, int keep){
+	int first = fds[0];
+	int last = fds[count - 1];
+	size_t i;
+	
+	for (i = 0; i < count && fds[i] == first + (int) i; i++);
+	if (i == count && (keep == first || !close_range(first, keep - 1, 0)) && (keep == last || !close_range(keep + 1, last, 0))){
+		return;
+	}
+	
+	for (i = 0; i < count; i++){
+		if (fds[i] != keep){
+			close(fds[i]);
+		}
+	}
+}
+
+/** Get transport type by its command line name
  * 
- * @param proc_count    Process count including parent process.
+ * @param name			Transport name: pipe / shm / seqpacket
  *
- * @return pointer to pipe fds array
+ * @return -1 on unknown name, TransportType on success
  */
-int* pipes_init(size_t proc_count){
-	size_t i, j;
-	size_t offset = proc_count - 1;
-	int* pipes = malloc(sizeof(int) * 2 * proc_count * (proc_count-1));
+int get_transport_type(const char* name){
+	int i;
 	
-	for (i = 0; i < proc_count; i++){
-		for (j = 0; j < proc_count; j++){
-			int tmp_fd[2];
-			
-			if (i == j){
-				continue;
-			}
-			
-			if (pipe(tmp_fd) < 0){
-				return (int*)NULL;
-			}
-			
-			if (set_nonblock(tmp_fd[0]) || set_nonblock(tmp_fd[1])){
-				return (int*)NULL;
-			}
-			pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_READ_TYPE] = tmp_fd[0];  /* READ */
-			pipes[j * offset * 2 + (j > i ? i : i - 1) * 2 + PIPE_WRITE_TYPE] = tmp_fd[1]; /* WRITE */
+	for (i = 0; i < TRANSPORT_COUNT; i++){
+		if (!strcmp(name, transports[i]->name)){
+			return i;
 		}
 	}
-	return pipes;
+	return -1;
+}
+
+/** Get flush policy by its command line name
+ * 
+ * @param name			Policy name: immediate / batch
+ *
+ * @return -1 on unknown name, FlushPolicy on success
+ */
+int get_flush_policy(const char* name){
+	if (!strcmp(name, "immediate")){
+		return FLUSH_IMMEDIATE;
+	}
+	if (!strcmp(name, "batch")){
+		return FLUSH_BATCH;
+	}
+	return -1;
+}
+
+/** Get barrier type by its command line name
+ * 
+ * @param name			Barrier name: all / tree
+ *
+ * @return -1 on unknown name, BarrierType on success
+ */
+int get_barrier_type(const char* name){
+	if (!strcmp(name, "all")){
+		return BARRIER_ALL;
+	}
+	if (!strcmp(name, "tree")){
+		return BARRIER_TREE;
+	}
+	return -1;
+}
+
+/** Get receive_any() policy by its command line name
+ * 
+ * @param name			Policy name: first / round-robin / weighted / oldest
+ *
+ * @return -1 on unknown name, ReceivePolicy on success
+ */
+int get_receive_policy(const char* name){
+	if (!strcmp(name, "first")){
+		return RECEIVE_FIRST;
+	}
+	if (!strcmp(name, "round-robin")){
+		return RECEIVE_ROUND_ROBIN;
+	}
+	if (!strcmp(name, "weighted")){
+		return RECEIVE_WEIGHTED;
+	}
+	if (!strcmp(name, "oldest")){
+		return RECEIVE_OLDEST;
+	}
+	return -1;
+}
+
+/** Get lane mode by its command line name
+ * 
+ * @param name			Mode name: single / control
+ *
+ * @return -1 on unknown name, LaneMode on success
+ */
+int get_lane_mode(const char* name){
+	if (!strcmp(name, "single")){
+		return LANES_SINGLE;
+	}
+	if (!strcmp(name, "control")){
+		return LANES_CONTROL;
+	}
+	return -1;
+}
+
+/** Get credit window by its command line value
+ * 
+ * @param value			off, or bytes: MIN_CREDIT_WINDOW..MAX_CREDIT_WINDOW
+ *
+ * @return -1 on invalid value, 0 for off, window on success
+ */
+int get_credit_window(const char* value){
+	char* end;
+	long window;
+	
+	if (!strcmp(value, "off")){
+		return 0;
+	}
+	window = strtol(value, &end, 10);
+	return *end || window < MIN_CREDIT_WINDOW || window > MAX_CREDIT_WINDOW ? -1 : window;
+}
+
+/** Get pipe capacity by its command line value
+ * 
+ * @param value			default, or bytes: MIN_PIPE_SIZE..MAX_PIPE_SIZE
+ *
+ * @return -1 on invalid value, 0 for default, capacity on success
+ */
+int get_pipe_size(const char* value){
+	char* end;
+	long size;
+	
+	if (!strcmp(value, "default")){
+		return 0;
+	}
+	size = strtol(value, &end, 10);
+	return *end || size < MIN_PIPE_SIZE || size > MAX_PIPE_SIZE ? -1 : size;
+}
+
+/** Get pipe growth threshold by its command line value
+ * 
+ * @param value			off, or times pipe is found full between growths: 1..INT_MAX
+ *
+ * @return -1 on invalid value, 0 for off, threshold on success
+ */
+int get_pipe_grow(const char* value){
+	char* end;
+	long grow;
+	
+	if (!strcmp(value, "off")){
+		return 0;
+	}
+	grow = strtol(value, &end, 10);
+	return *end || grow < 1 || grow > INT_MAX ? -1 : grow;
+}
+
+/** Get count of children of current process in barrier tree
+ *
+ * Process i is the parent of 2i + 1 and 2i + 2, like in --fork-tree.
+ */
+size_t tree_children_count(PipesCommunication* comm){
+	size_t first = 2 * comm->current_id + 1;
+	
+	if (first >= comm->total_ids){
+		return 0;
+	}
+	return first + 1 < comm->total_ids ? 2 : 1;
+}
+
+/** Wait for STARTED of all children in barrier tree
+ *
+ * Nothing else can come meanwhile: the rest of processes wait for release,
+ * which needs our STARTED, so receive_any() is enough.
+ */
+static void receive_tree_arrivals(PipesCommunication* comm){
+	Message msg;
+	
+	while (comm->arrived < tree_children_count(comm)){
+		while (receive_any(comm, &msg));
+		
+		set_lamport_time_from_msg(&msg);
+		comm->arrived++;
+	}
+	comm->arrived = 0;
+}
+
+/** Open control sockets of channel broker
+ * 
+ * Pipes are not opened here: broker thread of parent opens every channel
+ * when its writer sends to it for the first time.
+ * 
+ * @param proc_count    Process count including parent process.
+ * @param transport		TRANSPORT_PIPE or TRANSPORT_SEQPACKET (socketpairs are used as pipes)
+ *
+ * @return pointer to control socket fds array
+ */
+int* pipes_init(size_t proc_count, TransportType transport){
+	return broker_init(proc_count);
 }
 
 /** Init PipesCommunication
  * 
- * @param pipes			Pointer to opened pipes fd
+ * @param transport		Transport type
+ * @param pipes			Pointer to control sockets of broker (NULL if shm is used)
+ * @param shm			Pointer to mapped shared rings (NULL if pipes are used)
+ * @param mailboxes		Pointer to mailboxes of all threads (NULL if processes are forked)
  * @param proc_count    Process count including parent process.
  * @param curr_proc		Current process local id
  *
  * @return pointer to PipesCommunication
  */
-PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id curr_proc){
+PipesCommunication* communication_init(TransportType transport, int* pipes, ShmRegion* shm, Mailbox* mailboxes, size_t proc_count, local_id curr_proc){
 	PipesCommunication* this = malloc(sizeof(PipesCommunication));;
-	size_t i, j;
+	struct epoll_event event;
+	size_t i;
 	size_t offset = proc_count - 1;
-	this->pipes = malloc(sizeof(int) * offset * 2);
 	this->total_ids = proc_count;
 	this->current_id = curr_proc;
 	
-	memcpy(this->pipes, pipes + curr_proc * 2 * offset, sizeof(int) * offset * 2);
-	
-	/* Close unnecessary fds */
+	this->ready = calloc(proc_count, sizeof(char));
+	this->buffers = calloc(proc_count, sizeof(ReadBuffer*));
+	this->out_buffers = calloc(proc_count, sizeof(WriteBuffer*));
+	this->send_stats = calloc(proc_count, sizeof(SendStats));
+	this->closed = calloc(proc_count, sizeof(char));
+	this->open_channels = 0;
+	this->wakeups = 0;
+	this->spurious_polls = 0;
+	this->reads = 0;
+	this->writes = 0;
+	this->flush_policy = FLUSH_IMMEDIATE;
+	this->barrier = BARRIER_ALL;
+	this->arrived = 0;
+	this->stashes = calloc(proc_count, sizeof(Stash*));
+	this->parked = 0;
+	this->stashed = 0;
+	this->receive_policy = RECEIVE_FIRST;
+	this->scan_start = 0;
+	this->burst = 0;
+	this->weights = malloc(sizeof(size_t) * proc_count);
 	for (i = 0; i < proc_count; i++){
-		if (i == curr_proc){
-			continue;
+		this->weights[i] = 1;
+	}
+	this->receive_stats = calloc(proc_count, sizeof(ReceiveStats));
+	this->received = 0;
+	this->last_msg_from = -1;
+	this->lanes = LANES_SINGLE;
+	this->overtaken = 0;
+	this->credit_window = 0;
+	this->credits = NULL;
+	this->credit_wait = -1;
+	this->grants = 0;
+	this->pipe_size = 0;
+	this->parent_pipe_size = 0;
+	this->pipe_grow = 0;
+	this->pipe_stats = calloc(proc_count, sizeof(PipeStats));
+	
+	this->transport = transport;
+	this->ops = transports[transport];
+	
+	this->mailboxes = NULL;
+	this->queues = NULL;
+	this->broker_fd = -1;
+	
+	/* Shared rings are already mapped, nothing to close */
+	if (transport == TRANSPORT_SHM){
+		this->shm = shm;
+		this->pipes = NULL;
+		this->epoll_fd = -1;
+		return this;
+	}
+	
+	/* Mailboxes belong to all threads, each thread keeps only its queues */
+	if (transport == TRANSPORT_MAILBOX){
+		this->mailboxes = mailboxes;
+		this->queues = calloc(proc_count, sizeof(MailQueue));
+		this->shm = NULL;
+		this->pipes = NULL;
+		this->epoll_fd = -1;
+		return this;
+	}
+	
+	/* Gone reader must be a send error, not a signal killing the process */
+	signal(SIGPIPE, SIG_IGN);
+	
+	this->shm = NULL;
+	this->pipes = malloc(sizeof(int) * offset * 2);
+	for (i = 0; i < offset * 2; i++){
+		this->pipes[i] = -1;
+	}
+	this->broker_fd = pipes[curr_proc * 2 + 1];
+	
+	/* Close control sockets of other processes, parent keeps broker ends */
+	if (curr_proc != PARENT_ID){
+		close_all_but(pipes, proc_count * 2, this->broker_fd);
+	}
+	else{
+		for (i = 1; i < proc_count; i++){
+			close(pipes[i * 2 + 1]);
 		}
-		for (j = 0; j < proc_count; j++){
-			close(pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_READ_TYPE]);
-			close(pipes[i * offset * 2 + (i > j ? j : j - 1) * 2 + PIPE_WRITE_TYPE]);
+	}
+	
+	/* Without broker processes see it gone, so their sends fail */
+	if (curr_proc == PARENT_ID && broker_start(pipes, proc_count, this->ops->packets)){
+		for (i = 0; i < proc_count; i++){
+			close(pipes[i * 2]);
 		}
 	}
 	free(pipes);
+	
+	/* Watch control socket, inbound pipes are added when broker hands them out */
+	this->epoll_fd = epoll_create1(0);
+	event.events = EPOLLIN;
+	event.data.u32 = curr_proc;
+	epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->broker_fd, &event);
+	this->open_channels = proc_count - 1;
 	return this;
 }
 
@@ -104,14 +370,142 @@ PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id c
  * @param comm		Pointer to PipesCommunication
  */
 void communication_destroy(PipesCommunication* comm){
-	size_t i;
-	for (i = 0; i < comm->total_ids - 1; i++){
-		close(comm->pipes[i * 2 + PIPE_READ_TYPE]);
-		close(comm->pipes[i * 2 + PIPE_WRITE_TYPE]);
+	size_t i, j;
+	
+	if (comm->transport == TRANSPORT_SHM){
+		shm_destroy(comm->shm);
+	}
+	else if (comm->transport == TRANSPORT_MAILBOX){
+		mailbox_clear(comm->queues, comm->total_ids);
+		free(comm->queues);
+	}
+	else{
+		for (i = 0; i < comm->total_ids - 1; i++){
+			close(comm->pipes[i * 2 + PIPE_READ_TYPE]);
+			close(comm->pipes[i * 2 + PIPE_WRITE_TYPE]);
+		}
+		close(comm->broker_fd);
+		close(comm->epoll_fd);
+		free(comm->pipes);
 	}
+	
+	for (i = 0; i < comm->total_ids; i++){
+		free(comm->buffers[i]);
+		free(comm->out_buffers[i]);
+	}
+	free(comm->buffers);
+	free(comm->out_buffers);
+	free(comm->send_stats);
+	free(comm->closed);
+	for (i = 0; i < comm->total_ids; i++){
+		if (comm->stashes[i]){
+			for (j = 0; j <= MESSAGE_TYPE_COUNT; j++){
+				while (comm->stashes[i]->first[j]){
+					StashNode* next = comm->stashes[i]->first[j]->next;
+					
+					free(comm->stashes[i]->first[j]);
+					comm->stashes[i]->first[j] = next;
+				}
+			}
+			free(comm->stashes[i]);
+		}
+	}
+	free(comm->stashes);
+	free(comm->weights);
+	free(comm->receive_stats);
+	free(comm->ready);
+	free(comm->credits);
+	free(comm->pipe_stats);
 	free(comm);
 }
 
+/** Set order in which receive_any() serves inbound channels
+ * 
+ * With RECEIVE_WEIGHTED the channel from PARENT_ID weighs as much as all
+ * other children, like in PA2. Parent sends nothing but STOP here, so it
+ * differs from RECEIVE_ROUND_ROBIN only once STOP comes.
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param policy	RECEIVE_FIRST / RECEIVE_ROUND_ROBIN / RECEIVE_WEIGHTED / RECEIVE_OLDEST
+ */
+void set_receive_policy(PipesCommunication* comm, ReceivePolicy policy){
+	comm->receive_policy = policy;
+	comm->scan_start = 0;
+	comm->burst = 0;
+	if (policy == RECEIVE_WEIGHTED && comm->total_ids > 3){
+		comm->weights[PARENT_ID] = comm->total_ids - 2;
+	}
+}
+
+/** Set bytes a sender may have in channel which its receiver hasn't read yet
+ * 
+ * Receivers grant credit for what they read out of channels, on messages
+ * going back or by CREDIT messages. Senders write only what fits into the
+ * credit and otherwise wait for their own inbound channels. Must be the
+ * same in all processes and set before the first message. Shared rings
+ * and mailboxes have no credit: rings wait on their own and mailboxes
+ * are never full.
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param window	MIN_CREDIT_WINDOW..MAX_CREDIT_WINDOW, 0 turns credit off
+ *
+ * @return -1 on invalid window or if there is no memory, 0 on success
+ */
+int set_credit_window(PipesCommunication* comm, size_t window){
+	if (window && (window < MIN_CREDIT_WINDOW || window > MAX_CREDIT_WINDOW)){
+		return -1;
+	}
+	if (!window || (comm->transport != TRANSPORT_PIPE && comm->transport != TRANSPORT_SEQPACKET)){
+		comm->credit_window = 0;
+		return 0;
+	}
+	if (!comm->credits && !(comm->credits = calloc(comm->total_ids, sizeof(ChannelCredit)))){
+		return -1;
+	}
+	comm->credit_window = window;
+	return 0;
+}
+
+/** Set capacity of pipes opened from now on, and how they grow
+ * 
+ * Every process sizes pipes it writes to, pipes to PARENT_ID may be
+ * given more as all children report to it. A pipe found full grow
+ * times is doubled, up to MAX_PIPE_SIZE. Sockets, shared rings and
+ * mailboxes aren't pipes and keep their size.
+ * 
+ * @param comm			Pointer to PipesCommunication
+ * @param size			MIN_PIPE_SIZE..MAX_PIPE_SIZE, 0 keeps the kernel default
+ * @param parent_size	The same for pipes to PARENT_ID, 0 makes it size
+ * @param grow			Times pipe is found full between growths, 0 never grows it
+ *
+ * @return -1 on invalid size, 0 on success
+ */
+int set_pipe_size(PipesCommunication* comm, size_t size, size_t parent_size, size_t grow){
+	if ((size && (size < MIN_PIPE_SIZE || size > MAX_PIPE_SIZE)) || (parent_size && (parent_size < MIN_PIPE_SIZE || parent_size > MAX_PIPE_SIZE))){
+		return -1;
+	}
+	comm->pipe_size = size;
+	comm->parent_pipe_size = parent_size;
+	comm->pipe_grow = grow;
+	return 0;
+}
+
+/** Set how sent messages are written to pipes
+ * 
+ * Messages collected so far are written out when switching to FLUSH_IMMEDIATE.
+ * Shared rings and sockets always write at once: rings need no syscalls and
+ * socket packets can't be merged.
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param policy	FLUSH_IMMEDIATE / FLUSH_BATCH
+ */
+void set_flush_policy(PipesCommunication* comm, FlushPolicy policy){
+	if (policy == FLUSH_IMMEDIATE){
+		ipc_flush(comm);
+	}
+	comm->flush_policy = comm->transport == TRANSPORT_PIPE ? policy : FLUSH_IMMEDIATE;
+}
+
 /** Send event (STARTED / DONE) message to all processes
  * 
  * @param comm		Pointer to PipesCommunication
@@ -124,10 +518,15 @@ int send_all_proc_event_msg(PipesCommunication* comm, MessageType type){
 	uint16_t length = 0;
 	char buf[MAX_PAYLOAD_LEN];
 	
+	/* DONE of subtree comes along with CS messages, do_child_work() counts it */
+	if (comm->barrier == BARRIER_TREE && type == STARTED){
+		receive_tree_arrivals(comm);
+	}
+	
 	msg.s_header.s_magic = MESSAGE_MAGIC;
     msg.s_header.s_type = type;
     msg.s_header.s_local_time = increment_lamport_time();
-	
+
 	switch (type){
         case STARTED:
 			length = snprintf(buf, MAX_PAYLOAD_LEN, log_started_fmt, get_lamport_time(), comm->current_id, getpid(), getppid(), 0);
@@ -138,15 +537,17 @@ int send_all_proc_event_msg(PipesCommunication* comm, MessageType type){
 		default:
 			return -1;
 	}
-		
+	
 	if (length <= 0){
 		return -2;
 	}
 	
 	msg.s_header.s_payload_len = length;
     memcpy(msg.s_payload, buf, sizeof(char) * length);
-	
-	send_multicast(comm, &msg);
+
+	if (comm->barrier == BARRIER_TREE ? send_blocking(comm, (comm->current_id - 1) / 2, &msg) : send_multicast(comm, &msg)){
+		return -3;
+	}
 	
 	type == STARTED ? log_started(comm->current_id) : log_done(comm->current_id);
 	
@@ -193,10 +594,33 @@ void send_reply_msg(PipesCommunication* comm, local_id dst){
     msg.s_header.s_local_time = increment_lamport_time();
 	msg.s_header.s_payload_len = 0;
 	
-	while (send(comm, dst, &msg) < 0);
+	send_blocking(comm, dst, &msg);
+}
+
+/** Send release of barrier to children in barrier tree
+ * 
+ * @param comm		Pointer to PipesCommunication
+ * @param type		STARTED, or STOP when all processes are done
+ */
+void send_tree_release(PipesCommunication* comm, MessageType type){
+	Message msg;
+	size_t i;
+	
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+    msg.s_header.s_type = type;
+    msg.s_header.s_local_time = increment_lamport_time();
+	msg.s_header.s_payload_len = 0;
+	
+	for (i = 2 * comm->current_id + 1; i <= 2 * comm->current_id + 2 && i < comm->total_ids; i++){
+		send_blocking(comm, i, &msg);
+	}
 }
 
 /** Receive all messages
+ * 
+ * With tree barrier PARENT_ID receives events of its children in barrier tree,
+ * other processes receive release from their parent. Release is passed down.
+ * Messages of other types coming meanwhile are parked for later receives.
  * 
  * @param comm		Pointer to PipesCommunication
  * @param type		Message Type
@@ -205,13 +629,26 @@ void receive_all_msgs(PipesCommunication* comm, MessageType type){
 	Message msg;
 	local_id i;
 	
-	for (i = 1; i < comm->total_ids; i++){
-		if (i == comm->current_id){
-			continue;
+	if (comm->barrier == BARRIER_TREE){
+		if (comm->current_id == PARENT_ID){
+			receive_tree_arrivals(comm);
+		}
+		else{
+			while (receive_type(comm, (comm->current_id - 1) / 2, type, &msg) < 0);
+			
+			set_lamport_time_from_msg(&msg);
+		}
+		send_tree_release(comm, type);
+	}
+	else{
+		for (i = 1; i < comm->total_ids; i++){
+			if (i == comm->current_id){
+				continue;
+			}
+			while (receive_type(comm, i, type, &msg) < 0);
+			
+			set_lamport_time_from_msg(&msg);
 		}
-		while (receive(comm, i, &msg) < 0);
-		
-		set_lamport_time_from_msg(&msg);
 	}
 	
 	switch (type){
@@ -9,28 +9,216 @@
 #define __IFMO_DISTRIBUTED_CLASS_COMMUNICATION__H
 
 #include "ipc.h"
+#include "shm.h"
+#include "mailbox.h"
+#include "broker.h"
 
+typedef enum{
+	TRANSPORT_PIPE = 0,
+	TRANSPORT_SHM,
+	TRANSPORT_SEQPACKET,
+	TRANSPORT_MAILBOX,		/* Processes are threads of one process */
+	TRANSPORT_COUNT
+} TransportType;
+
+typedef enum{
+	FLUSH_IMMEDIATE = 0,	/* Every send() is written at once */
+	FLUSH_BATCH				/* Pipe messages are collected until ipc_flush() or blocking receive */
+} FlushPolicy;
+
+typedef enum{
+	RECEIVE_FIRST = 0,		/* receive_any() scans channels from id 0 */
+	RECEIVE_ROUND_ROBIN,	/* Scan starts next to the channel served last */
+	RECEIVE_WEIGHTED,		/* Same, but channel gives up to its weight of messages in a row */
+	RECEIVE_OLDEST			/* Message with the oldest sender time among heads of all channels */
+} ReceivePolicy;
+
+typedef enum{
+	LANES_SINGLE = 0,		/* Messages of a sender are taken in send order */
+	LANES_CONTROL			/* STOP / DONE / CS_RELEASE already come are taken ahead of other messages */
+} LaneMode;
+
+typedef enum{
+	BARRIER_ALL = 0,		/* STARTED / DONE are sent to every process */
+	BARRIER_TREE			/* Combining tree: events go up to PARENT_ID, release or STOP comes down */
+} BarrierType;
+
+/* Message types receive_type() waits for, MessageType of ipc.h isn't ours to extend */
+enum {
+	CREDIT = CS_RELEASE + 1,	/* Receiver grants credit of channel, taken off before receive() */
+	MESSAGE_TYPE_COUNT
+};
+
+/* Header extension written after payload of message whose magic is MESSAGE_MAGIC_CREDIT */
+typedef struct{
+	uint32_t s_read;		/* Bytes sender of the message has read out of channel from its receiver */
+} __attribute__((packed)) CreditGrant;
+
+enum {
+	READ_BUFFER_SIZE = 64 * 1024,	/* Read-ahead of one inbound pipe, same as default pipe capacity */
+	WRITE_BUFFER_SIZE = 16 * 1024,	/* Outbound messages collected for one pipe */
+	SEND_SPIN_COUNT = 8,			/* Retries of full channel with sched_yield() before sleeping */
+	MAX_PROCESS_COUNT = INT8_MAX,	/* Processes including parent: ids are local_id, which is int8_t */
+	MESSAGE_MAGIC_CREDIT = 0xAFAC,	/* Message is followed by CreditGrant */
+	MAX_FRAME_LEN = sizeof(Message) + sizeof(CreditGrant),
+	MIN_CREDIT_WINDOW = 2 * MAX_FRAME_LEN,	/* Half of it, granted at once, fits any message */
+	MAX_CREDIT_WINDOW = 60 * 1024,	/* Leaves room of default pipe capacity for CREDIT messages */
+	MIN_PIPE_SIZE = 4096,			/* One page, the least capacity F_SETPIPE_SZ gives */
+	MAX_PIPE_SIZE = 1024 * 1024		/* Default of /proc/sys/fs/pipe-max-size, unprivileged processes can't pass it */
+};
+
+/* Bytes read from inbound pipe but not taken as messages yet */
+typedef struct{
+	size_t start;		/* First byte of the next message */
+	size_t end;			/* End of bytes read so far */
+	size_t parsed;		/* End of complete messages, credit extensions are taken off them */
+	size_t scanned;		/* End of messages checked for control lane ones */
+	size_t controls;	/* Control lane messages among checked ones */
+	char data[READ_BUFFER_SIZE];
+} ReadBuffer;
+
+/* Message parked by receive_type() */
+typedef struct StashNode{
+	struct StashNode* next;
+	uint32_t order;			/* Parking order among messages of its sender */
+	Message msg;			/* Header and payload only are allocated */
+} StashNode;
+
+/* Messages of one sender parked by receive_type(), one FIFO per type */
+typedef struct{
+	StashNode* first[MESSAGE_TYPE_COUNT + 1];	/* The last one holds types we don't know */
+	StashNode* last[MESSAGE_TYPE_COUNT + 1];
+	uint32_t next_order;
+	size_t count;
+} Stash;
+
+/* Messages sent to outbound pipe but not written yet */
 typedef struct{
-	int* pipes;
+	size_t start;		/* First byte not written yet */
+	size_t end;			/* End of collected bytes */
+	char data[WRITE_BUFFER_SIZE];
+} WriteBuffer;
+
+/* Waiting of one outbound channel for free space */
+typedef struct{
+	size_t retries;			/* Sends which found channel full */
+	size_t waits;			/* Sleeps until channel became writable */
+	uint64_t blocked_ns;	/* Time spent waiting for free space */
+	size_t credit_waits;	/* Of waits, ones for credit of receiver */
+} SendStats;
+
+/* Credit of channels to and from one process. Sender keeps at most
+ * credit_window bytes the receiver hasn't read out of channel yet. */
+typedef struct{
+	uint32_t sent;			/* Bytes ever sent to the process */
+	uint32_t granted;		/* Bytes of them it has read, by its last grant */
+	uint32_t read;			/* Bytes ever read out of channel from the process */
+	uint32_t reported;		/* Bytes of them told to it */
+} ChannelCredit;
+
+/* Kernel buffers of pipes to and from one process */
+typedef struct{
+	size_t peak;			/* Most bytes found in pipe from the process by a read */
+	int peak_capacity;		/* Capacity of that pipe when its peak was found */
+	int capacity;			/* Capacity of pipe to the process, 0 if it was never set */
+	size_t full;			/* Times pipe to the process was found full */
+	size_t grown;			/* Times it was grown for that */
+} PipeStats;
+
+/* Service of one inbound channel by receive_any() */
+typedef struct{
+	size_t served;			/* Messages taken */
+	size_t last;			/* Messages of all channels taken by the time of the last one */
+	size_t max_wait;		/* Most messages of other channels taken between two of this one */
+} ReceiveStats;
+
+/* Operations of one transport, self is PipesCommunication.
+ * Public functions of ipc.c check ids and dispatch through them. */
+typedef struct{
+	const char* name;		/* Name of --transport= option */
+	int packets;			/* One read() gives one whole message */
+	int (*send)(void* self, local_id dst, const Message* msg);		/* Doesn't wait, -3 if channel is full */
+	int (*send_multicast)(void* self, const Message* msg);			/* Same, NULL if messages are sent one by one */
+	int (*receive)(void* self, local_id from, Message* msg);
+	int (*receive_any)(void* self, Message* msg);		/* Scans channels from scan_start, sets last_msg_from */
+	int (*try_receive)(void* self, local_id from, Message* msg);	/* Doesn't wait, -1 if there is nothing */
+	int (*take_control)(void* self, local_id from, Message* msg);	/* Doesn't wait, -1 if no control lane message has come, 1 if it was taken ahead of others */
+	int (*wait_writable)(void* self, local_id dst, size_t attempt);	/* Called after channel to dst was found full, NULL if it can't be */
+} Transport;
+
+extern const Transport* const transports[TRANSPORT_COUNT];
+
+typedef struct{
+	TransportType transport;
+	const Transport* ops;
+	int* pipes;				/* Channel fds, -1 until broker hands channel out */
+	int broker_fd;			/* Control socket to broker of channels */
+	ShmRegion* shm;
+	Mailbox* mailboxes;		/* Shared by all threads, one per process */
+	MailQueue* queues;		/* Messages taken out of own mailbox, one queue per sender */
 	size_t total_ids;
 	local_id current_id;
-	local_id last_msg_from;
+	local_id last_msg_from;	/* Sender of the last message of receive_any() */
+	int epoll_fd;			/* Watches read fds of all inbound pipes */
+	size_t open_channels;	/* Inbound channels whose writer may still send */
+	char* ready;			/* Channels reported readable and not drained yet */
+	size_t wakeups;			/* Returns from epoll_wait() / poll() */
+	size_t spurious_polls;	/* Wakeups that didn't yield a message */
+	ReadBuffer** buffers;	/* Read-ahead of inbound pipes, allocated on first read */
+	size_t reads;			/* read() calls on inbound channels */
+	FlushPolicy flush_policy;
+	BarrierType barrier;
+	size_t arrived;			/* STARTED of tree children received ahead of own one */
+	WriteBuffer** out_buffers;	/* Collected messages of outbound pipes, allocated on first send */
+	size_t writes;			/* write() / writev() calls on outbound channels */
+	SendStats* send_stats;	/* Per outbound channel, slot of current process is shm broadcast ring */
+	char* closed;			/* Inbound channels whose writer is gone */
+	Stash** stashes;		/* Parked messages, one per sender, allocated on first one */
+	size_t parked;			/* Messages in stashes now */
+	size_t stashed;			/* Messages ever parked */
+	ReceivePolicy receive_policy;
+	size_t scan_start;		/* Channel receive_any() tries first */
+	size_t burst;			/* Messages of scan_start channel taken in a row */
+	size_t* weights;		/* Messages channel may give in a row, RECEIVE_WEIGHTED only */
+	ReceiveStats* receive_stats;	/* Per inbound channel */
+	size_t received;		/* Messages taken by receive_any() */
+	LaneMode lanes;
+	size_t overtaken;		/* Control lane messages taken ahead of earlier messages of their sender */
+	size_t credit_window;	/* Bytes sender may have unread in channel, 0 without credit */
+	ChannelCredit* credits;	/* Per process, allocated when credit is on */
+	local_id credit_wait;	/* Receiver the last send was refused to for lack of credit, -1 if none */
+	size_t grants;			/* CREDIT messages sent */
+	size_t pipe_size;		/* Capacity of new pipes, 0 keeps the kernel default */
+	size_t parent_pipe_size;	/* Capacity of new pipes to PARENT_ID, 0 makes it pipe_size */
+	size_t pipe_grow;		/* Pipe is doubled every this many times it is found full, 0 never */
+	PipeStats* pipe_stats;	/* Per process */
 } PipesCommunication;
 
-enum PipeTypeOffset 
-{
-    PIPE_READ_TYPE = 0,
-    PIPE_WRITE_TYPE
-};
-
-int* pipes_init(size_t proc_count);
-PipesCommunication* communication_init(int* pipes, size_t proc_count, local_id curr_proc);
+int get_transport_type(const char* name);
+int get_flush_policy(const char* name);
+int get_barrier_type(const char* name);
+int get_receive_policy(const char* name);
+int get_lane_mode(const char* name);
+int get_credit_window(const char* value);
+int get_pipe_size(const char* value);
+int get_pipe_grow(const char* value);
+size_t tree_children_count(PipesCommunication* comm);
+int* pipes_init(size_t proc_count, TransportType transport);
+PipesCommunication* communication_init(TransportType transport, int* pipes, ShmRegion* shm, Mailbox* mailboxes, size_t proc_count, local_id curr_proc);
 void communication_destroy(PipesCommunication* comm);
+void set_flush_policy(PipesCommunication* comm, FlushPolicy policy);
+void set_receive_policy(PipesCommunication* comm, ReceivePolicy policy);
+int set_credit_window(PipesCommunication* comm, size_t window);
+int set_pipe_size(PipesCommunication* comm, size_t size, size_t parent_size, size_t grow);
+int ipc_flush(PipesCommunication* comm);
+int send_blocking(PipesCommunication* comm, local_id dst, const Message* msg);
+int receive_type(PipesCommunication* comm, local_id from, int16_t type, Message* msg);
 
 int send_all_proc_event_msg(PipesCommunication* comm, MessageType type);
 void send_all_request_msg(PipesCommunication* comm);
 void send_all_release_msg(PipesCommunication* comm);
 void send_reply_msg(PipesCommunication* comm, local_id dst);
+void send_tree_release(PipesCommunication* comm, MessageType type);
 
 void receive_all_msgs(PipesCommunication* comm, MessageType type);
 
@@ -4,7 +4,7 @@
  * @date     June, 2018
  * @brief    Implementation of CS functions
  */
- 
+
 #include "cs.h"
 #include "pa2345.h"
 
@@ -51,6 +51,9 @@ int release_cs(const void * self){
 	
 	send_all_release_msg(comm);
 	lamport_queue_get(queue);
+	
+	/* Others are waiting for release, don't keep it until next receive */
+	ipc_flush(comm);
 	return 0;
 }
 
@@ -1,73 +1,1531 @@
 /**
  * @file     ipc.c
  * @Author   @seniorkot
- * @date     May, 2018
+ * @date     June, 2018
  * @brief    IPC functions
  */
 
+#define _GNU_SOURCE
+
 #include "ipc.h"
 #include "communication.h"
- 
+
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #define GET_INDEX(x, id) ((x) < (id) ? (x) : (x) - 1)
+#define READ_FD(comm, x) ((comm)->pipes[GET_INDEX(x, (comm)->current_id) * 2 + PIPE_READ_TYPE])
+#define WRITE_FD(comm, x) ((comm)->pipes[GET_INDEX(x, (comm)->current_id) * 2 + PIPE_WRITE_TYPE])
 
-int send(void * self, local_id dst, const Message * msg){
-	PipesCommunication* from = (PipesCommunication*) self;
+/* k-th channel receive_any() tries */
+#define SCAN_ID(comm, k) ((local_id) (((comm)->scan_start + (k)) % (comm)->total_ids))
+
+/* Write fd of channel broker couldn't open, writes fail with EBADF */
+#define CHANNEL_REFUSED (-2)
+
+/* Types we don't know are parked in the last queue */
+#define STASH_QUEUE(type) ((type) >= 0 && (type) < MESSAGE_TYPE_COUNT ? (type) : MESSAGE_TYPE_COUNT)
+#define STASH_NODE_LEN(msg) (offsetof(StashNode, msg) + sizeof(MessageHeader) + (msg)->s_header.s_payload_len)
+
+/* Bytes of message in channel, with credit extension if it has one */
+#define FRAME_LEN(msg) (sizeof(MessageHeader) + (msg)->s_header.s_payload_len + \
+		((msg)->s_header.s_magic == MESSAGE_MAGIC_CREDIT ? sizeof(CreditGrant) : 0))
+
+/* Reading grants credit, which is sent by pipe_send() */
+static int grant_credit(PipesCommunication* this, local_id to, size_t min);
+
+/** Get length of the first complete message in read-ahead buffer
+ *
+ * @return 0 if message is not read completely yet, message length otherwise
+ */
+static size_t buffered_length(const ReadBuffer* buf){
+	MessageHeader header;
+	size_t len;
 	
-	if (dst == from->current_id){
-		return -1;
+	if (buf->parsed - buf->start < sizeof(MessageHeader)){
+		return 0;
+	}
+	memcpy(&header, buf->data + buf->start, sizeof(MessageHeader));
+	len = sizeof(MessageHeader) + header.s_payload_len;
+	return buf->parsed - buf->start < len ? 0 : len;
+}
+
+/** Check if one more message surely fits into read-ahead buffer */
+static int has_room(const ReadBuffer* buf){
+	return !buf || READ_BUFFER_SIZE - (buf->end - buf->start) >= MAX_FRAME_LEN;
+}
+
+/** Get read-ahead buffer of inbound channel, allocate it on first use
+ *
+ * @return NULL if there is no memory
+ */
+static ReadBuffer* get_buffer(PipesCommunication* this, local_id from){
+	ReadBuffer* buf;
+	
+	if (!(buf = this->buffers[from])){
+		if (!(buf = malloc(sizeof(ReadBuffer)))){
+			return NULL;
+		}
+		buf->start = buf->end = buf->parsed = 0;
+		buf->scanned = buf->controls = 0;
+		this->buffers[from] = buf;
+	}
+	return buf;
+}
+
+/** Move partial message to the beginning of read-ahead buffer, so the rest of it fits */
+static void compact_buffer(ReadBuffer* buf){
+	if (buf->start){
+		memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->parsed -= buf->start;
+		buf->scanned = buf->scanned > buf->start ? buf->scanned - buf->start : 0;
+		buf->start = 0;
+	}
+}
+
+/** Take credit extensions off messages read, apply grants they carry
+ *
+ * CREDIT messages carry nothing else and are dropped. Messages behind
+ * them are moved up, so complete messages lie from start to parsed.
+ */
+static void take_grants(PipesCommunication* this, local_id from, ReadBuffer* buf){
+	ChannelCredit* credit = &this->credits[from];
+	MessageHeader header;
+	CreditGrant grant;
+	size_t pos = buf->parsed;
+	size_t len, ext;
+	
+	while (buf->end - pos >= sizeof(MessageHeader)){
+		memcpy(&header, buf->data + pos, sizeof(MessageHeader));
+		len = sizeof(MessageHeader) + header.s_payload_len;
+		ext = header.s_magic == MESSAGE_MAGIC_CREDIT ? sizeof(CreditGrant) : 0;
+		if (header.s_payload_len > MAX_PAYLOAD_LEN || buf->end - pos < len + ext){
+			break;
+		}
+		if (ext){
+			memcpy(&grant, buf->data + pos + len, sizeof(CreditGrant));
+			if ((int32_t) (grant.s_read - credit->granted) > 0){
+				credit->granted = grant.s_read;
+			}
+			header.s_magic = MESSAGE_MAGIC;
+			memcpy(buf->data + pos, &header, sizeof(MessageHeader));
+		}
+		if (header.s_type != CREDIT){
+			if (pos != buf->parsed){
+				memmove(buf->data + buf->parsed, buf->data + pos, len);
+			}
+			buf->parsed += len;
+		}
+		pos += len + ext;
+	}
+	if (pos != buf->parsed){
+		memmove(buf->data + buf->parsed, buf->data + pos, buf->end - pos);
+		buf->end -= pos - buf->parsed;
+	}
+}
+
+/** Remember the most bytes found in pipe from the process
+ *
+ * A read which leaves space in the buffer has taken all the pipe held,
+ * otherwise FIONREAD tells what is left in it.
+ */
+static void note_occupancy(PipesCommunication* this, local_id from, size_t len, size_t space){
+	PipeStats* stats = &this->pipe_stats[from];
+	int left;
+	
+	if (len == space && !ioctl(READ_FD(this, from), FIONREAD, &left)){
+		len += left;
+	}
+	if (len > stats->peak){
+		stats->peak = len;
+		stats->peak_capacity = fcntl(READ_FD(this, from), F_GETPIPE_SZ);
+	}
+}
+
+/** Read from channel into its read-ahead buffer
+ *
+ * Pipe gives as many bytes as it holds, socket gives one message.
+ * With credit on, what is read is granted back once it is half the window.
+ *
+ * @return -2 if nothing was read, -3 on read error or broken message, -4 if channel is closed, 0 on success
+ */
+static int fill_buffer(PipesCommunication* this, local_id from, ReadBuffer* buf){
+	MessageHeader header;
+	size_t space;
+	ssize_t len;
+	
+	compact_buffer(buf);
+	if (buf->end >= sizeof(MessageHeader)){
+		memcpy(&header, buf->data, sizeof(MessageHeader));
+		if (header.s_payload_len > MAX_PAYLOAD_LEN){
+			return -3;
+		}
+	}
+	
+	/* Socket message must fit whole, or the rest of it is lost */
+	space = READ_BUFFER_SIZE - buf->end;
+	if (this->ops->packets){
+		if (space < MAX_FRAME_LEN){
+			return -2;
+		}
+		space = MAX_FRAME_LEN;
 	}
-	if (write(from->pipes[GET_INDEX(dst, from->current_id) * 2 + PIPE_WRITE_TYPE], msg, sizeof(MessageHeader) + msg->s_header.s_payload_len) < 0){
+	if (!space){
 		return -2;
 	}
+	
+	len = read(READ_FD(this, from), buf->data + buf->end, space);
+	this->reads++;
+	if (len < 0){
+		return errno == EAGAIN ? -2 : -3;
+	}
+	if (!len){
+		return -4;
+	}
+	if (this->ops->packets){
+		memcpy(&header, buf->data + buf->end, sizeof(MessageHeader));
+		if (len < (int)sizeof(MessageHeader) || len != FRAME_LEN((Message*) &header)){
+			return -3;
+		}
+	}
+	else{
+		note_occupancy(this, from, len, space);
+	}
+	buf->end += len;
+	
+	if (!this->credit_window){
+		buf->parsed = buf->end;
+		return 0;
+	}
+	this->credits[from].read += len;
+	take_grants(this, from, buf);
+	grant_credit(this, from, this->credit_window / 2);
 	return 0;
 }
 
-int send_multicast(void * self, const Message * msg){
-	PipesCommunication* from = (PipesCommunication*) self;
+/** Take the first complete message out of read-ahead buffer
+ *
+ * @return -1 if there is no complete message, 0 on success
+ */
+static int take_buffered(PipesCommunication* this, local_id from, Message* msg){
+	ReadBuffer* buf = this->buffers[from];
+	size_t len;
+	
+	if (!buf || !(len = buffered_length(buf))){
+		return -1;
+	}
+	memcpy(msg, buf->data + buf->start, len);
+	if (buf->start < buf->scanned && IS_CONTROL_TYPE(msg->s_header.s_type)){
+		buf->controls--;
+	}
+	buf->start += len;
+	if (buf->start == buf->end){
+		buf->start = buf->end = buf->parsed = 0;
+		buf->scanned = 0;
+	}
+	
+	/* Channel may be empty now, but receive_any() must still see buffered messages */
+	this->ready[from] = buffered_length(buf) != 0;
+	return 0;
+}
+
+/** Take the first control lane message out of read-ahead buffer
+ *
+ * Complete messages not checked yet are checked first. Messages
+ * before the taken one are moved up, so they keep their order.
+ *
+ * @return -1 if buffer has none, 0 if it was the first message, 1 if it was taken ahead of others
+ */
+static int take_buffered_control(PipesCommunication* this, local_id from, Message* msg){
+	ReadBuffer* buf = this->buffers[from];
+	MessageHeader header;
+	size_t pos, len;
+	
+	if (!buf){
+		return -1;
+	}
+	if (buf->scanned < buf->start){
+		buf->scanned = buf->start;
+	}
+	while (buf->parsed - buf->scanned >= sizeof(MessageHeader)){
+		memcpy(&header, buf->data + buf->scanned, sizeof(MessageHeader));
+		len = sizeof(MessageHeader) + header.s_payload_len;
+		if (header.s_payload_len > MAX_PAYLOAD_LEN || buf->parsed - buf->scanned < len){
+			break;
+		}
+		if (IS_CONTROL_TYPE(header.s_type)){
+			buf->controls++;
+		}
+		buf->scanned += len;
+	}
+	if (!buf->controls){
+		return -1;
+	}
+	
+	for (pos = buf->start; ; pos += len){
+		memcpy(&header, buf->data + pos, sizeof(MessageHeader));
+		len = sizeof(MessageHeader) + header.s_payload_len;
+		if (IS_CONTROL_TYPE(header.s_type)){
+			break;
+		}
+	}
+	if (pos == buf->start){
+		return take_buffered(this, from, msg);
+	}
+	memcpy(msg, buf->data + pos, len);
+	memmove(buf->data + buf->start + len, buf->data + buf->start, pos - buf->start);
+	buf->start += len;
+	buf->controls--;
+	return 1;
+}
+
+/** Read message from pipe or socket without blocking
+ *
+ * Channels are read through per channel buffer: one read() takes everything
+ * the pipe holds, following calls take messages from the buffer.
+ *
+ * @return -2 if there is no message, -3 on read error, -4 if channel is closed, 0 on success
+ */
+static int try_receive(PipesCommunication* this, local_id from, Message* msg){
+	ReadBuffer* buf;
+	int retval;
+	
+	if (!(buf = get_buffer(this, from))){
+		return -3;
+	}
+	
+	/* Go to the channel only when no complete message is buffered */
+	while (take_buffered(this, from, msg)){
+		if ((retval = fill_buffer(this, from, buf))){
+			return retval;
+		}
+	}
+	return 0;
+}
+
+/** Stop watching channel which writer has closed
+ */
+static void close_channel(PipesCommunication* this, local_id from){
+	if (!this->closed[from]){
+		epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, READ_FD(this, from), NULL);
+		this->open_channels--;
+	}
+	this->ready[from] = 0;
+	this->closed[from] = 1;
+}
+
+/** Set capacity of new pipe to dst, the kernel default stays if it can't be set
+ */
+static void size_pipe(PipesCommunication* this, local_id dst){
+	size_t size = dst == PARENT_ID && this->parent_pipe_size ? this->parent_pipe_size : this->pipe_size;
+	int capacity;
+	
+	if (size && (capacity = fcntl(WRITE_FD(this, dst), F_SETPIPE_SZ, size)) > 0){
+		this->pipe_stats[dst].capacity = capacity;
+	}
+}
+
+/** Double capacity of full pipe to dst, up to MAX_PIPE_SIZE
+ *
+ * @return -1 if it can't grow, 0 on success
+ */
+static int grow_pipe(PipesCommunication* this, local_id dst){
+	int capacity = fcntl(WRITE_FD(this, dst), F_GETPIPE_SZ);
+	
+	if (capacity < 0 || capacity >= MAX_PIPE_SIZE || (capacity = fcntl(WRITE_FD(this, dst), F_SETPIPE_SZ, 2 * capacity)) < 0){
+		return -1;
+	}
+	this->pipe_stats[dst].capacity = capacity;
+	this->pipe_stats[dst].grown++;
+	return 0;
+}
+
+/** Put channel end handed out by broker in place
+ *
+ * Read end without fd tells that peer is gone before writing to us,
+ * write end without fd that channel to peer couldn't be opened.
+ */
+static void install_channel(PipesCommunication* this, const ChannelNotice* notice, int fd){
+	struct epoll_event event;
+	local_id peer = notice->peer;
+	
+	if (peer < 0 || peer >= this->total_ids || peer == this->current_id){
+		if (fd >= 0){
+			close(fd);
+		}
+		return;
+	}
+	
+	if (notice->type == PIPE_WRITE_TYPE){
+		WRITE_FD(this, peer) = fd < 0 ? CHANNEL_REFUSED : fd;
+		if (fd >= 0 && !this->ops->packets){
+			size_pipe(this, peer);
+		}
+		return;
+	}
+	if (fd < 0){
+		close_channel(this, peer);
+		return;
+	}
+	READ_FD(this, peer) = fd;
+	event.events = EPOLLIN;
+	event.data.u32 = peer;
+	epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/** Give up channels broker can't hand out anymore
+ */
+static void close_broker(PipesCommunication* this){
 	local_id i;
 	
-	for (i = 0; i < from->total_ids; i++){
-		if (i == from->current_id){
+	epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, this->broker_fd, NULL);
+	close(this->broker_fd);
+	this->broker_fd = -1;
+	for (i = 0; i < this->total_ids; i++){
+		if (i == this->current_id){
 			continue;
 		}
-		while(send(from, i, msg) < 0);
+		if (READ_FD(this, i) < 0){
+			close_channel(this, i);
+		}
+		if (WRITE_FD(this, i) == -1){
+			WRITE_FD(this, i) = CHANNEL_REFUSED;
+		}
 	}
-	return 0;
 }
 
-int receive(void * self, local_id from, Message * msg){
-	PipesCommunication* this = (PipesCommunication*) self;
+/** Take channel ends broker has handed out
+ *
+ * @param wait		Sleep until at least one comes
+ *
+ * @return -1 if broker is gone, 0 otherwise
+ */
+static int take_channels(PipesCommunication* this, int wait){
+	ChannelNotice notice;
+	int fd, retval;
 	
-	if (from == this->current_id){
+	while ((retval = broker_take(this->broker_fd, wait, &notice, &fd)) > 0){
+		install_channel(this, &notice, fd);
+		wait = 0;
+	}
+	if (retval < 0){
+		close_broker(this);
 		return -1;
 	}
-	/* Read Header */
-	if (read(this->pipes[GET_INDEX(from, this->current_id) * 2 + PIPE_READ_TYPE], msg, sizeof(MessageHeader)) < (int)sizeof(MessageHeader)){
+	return 0;
+}
+
+/** Ask broker for channel to dst, sleep until it is handed out
+ *
+ * Channels other processes open to us meanwhile are put in place too.
+ *
+ * @return -2 if channel can't be opened, 0 on success
+ */
+static int open_channel(PipesCommunication* this, local_id dst){
+	if (broker_request(this->broker_fd, dst)){
 		return -2;
 	}
+	while (WRITE_FD(this, dst) == -1){
+		take_channels(this, 1);
+	}
+	return WRITE_FD(this, dst) < 0 ? -2 : 0;
+}
+
+/** Move what has come to inbound channel into its read-ahead buffer
+ *
+ * Messages stay there for receive(), but the sender gets free space.
+ */
+static void drain_channel(PipesCommunication* this, local_id from){
+	ReadBuffer* buf;
+	int retval;
+	
+	if (!(buf = get_buffer(this, from))){
+		return;
+	}
 	
-	/* Read Body */
-	if (read(this->pipes[GET_INDEX(from, this->current_id) * 2 + PIPE_READ_TYPE], ((char*) msg) + sizeof(MessageHeader), msg->s_header.s_payload_len) < 0){
-		return -3;
+	while (!(retval = fill_buffer(this, from, buf)));
+	if (retval == -4){
+		close_channel(this, from);
+	}
+	if (buffered_length(buf)){
+		this->ready[from] = 1;
 	}
-	return 0;
 }
 
-int receive_any(void * self, Message * msg){
+/** Wait after pipe or socket to dst was found full
+ *
+ * The first retries only yield, as the reader usually frees space soon.
+ * Then process sleeps until channel becomes writable. Inbound channels are
+ * watched too and drained when something comes, so two processes sending
+ * to each other over full channels go on. Channels handed out by broker
+ * are taken, as it may wait for us to read its socket.
+ *
+ * Without credit of dst there is nothing to spin on: grants come by inbound
+ * channels only, so they are all the process sleeps on. If channel from
+ * dst can't be watched as its buffer is full, sleep is short.
+ *
+ * With --pipe-grow a pipe found full often enough is grown instead, and
+ * the write is retried at once.
+ *
+ * @return -2 on poll error, 0 on success
+ */
+static int pipe_wait_writable(void* self, local_id dst, size_t attempt){
 	PipesCommunication* this = (PipesCommunication*) self;
+	struct pollfd fds[MAX_PROCESS_COUNT + 1];
+	local_id ids[MAX_PROCESS_COUNT + 1];
 	local_id i;
+	int count = 1;
+	int credit = this->credit_wait == dst;
+	int timeout = -1;
 	
+	this->credit_wait = -1;
+	if (credit){
+		if (READ_FD(this, dst) >= 0 && !has_room(this->buffers[dst])){
+			timeout = 1;
+		}
+		this->send_stats[dst].credit_waits++;
+	}
+	else{
+		if (!this->ops->packets && this->pipe_grow && !(++this->pipe_stats[dst].full % this->pipe_grow) && !grow_pipe(this, dst)){
+			return 0;
+		}
+		if (attempt < SEND_SPIN_COUNT){
+			sched_yield();
+			return 0;
+		}
+	}
+	
+	/* Negative fd is skipped by poll() */
+	fds[0].fd = credit ? -1 : WRITE_FD(this, dst);
+	fds[0].events = POLLOUT;
+	fds[1].fd = this->broker_fd;
+	fds[1].events = POLLIN;
+	ids[count++] = this->current_id;
 	for (i = 0; i < this->total_ids; i++){
-		if (i == this->current_id){
+		if (i == this->current_id || this->closed[i] || READ_FD(this, i) < 0 || !has_room(this->buffers[i])){
+			continue;
+		}
+		fds[count].fd = READ_FD(this, i);
+		fds[count].events = POLLIN;
+		ids[count++] = i;
+	}
+	
+	while (poll(fds, count, timeout) < 0){
+		if (errno != EINTR){
+			return -2;
+		}
+	}
+	this->send_stats[dst].waits++;
+	
+	for (i = 1; i < count; i++){
+		if (!fds[i].revents){
+			continue;
+		}
+		if (ids[i] == this->current_id){
+			take_channels(this, 0);
+		}
+		else{
+			drain_channel(this, ids[i]);
+		}
+	}
+	return 0;
+}
+
+/** Wait a bit after channel to dst was found full, count the time
+ *
+ * @param dst		Receiver local id, current process id for shm broadcast ring
+ * @param attempt	Number of retries made before
+ *
+ * @return -2 on wait error, 0 on success
+ */
+static int backoff(PipesCommunication* this, local_id dst, size_t attempt){
+	SendStats* stats = &this->send_stats[dst];
+	struct timespec start, end;
+	int retval;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stats->retries++;
+	retval = this->ops->wait_writable(this, dst, attempt);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->blocked_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+	return retval;
+}
+
+/** Write collected messages of outbound pipe, and one more message after them
+ *
+ * Everything goes by a single writev(). What the pipe doesn't take stays
+ * collected, the message is collected too if there is space for it.
+ *
+ * @param msg		Message to write after collected ones, may be NULL
+ *
+ * @return -2 on write error, -3 if pipe is full and nothing more can be collected, 0 on success
+ */
+static int flush_channel(PipesCommunication* this, local_id dst, const Message* msg){
+	WriteBuffer* buf = this->out_buffers[dst];
+	size_t len = msg ? FRAME_LEN(msg) : 0;
+	size_t collected = buf->end - buf->start;
+	struct iovec iov[2];
+	int count = 0;
+	ssize_t written;
+	
+	if (collected){
+		iov[count].iov_base = buf->data + buf->start;
+		iov[count++].iov_len = collected;
+	}
+	if (len){
+		iov[count].iov_base = (void*) msg;
+		iov[count++].iov_len = len;
+	}
+	if (!count){
+		return 0;
+	}
+	
+	if ((written = writev(WRITE_FD(this, dst), iov, count)) < 0){
+		if (errno != EAGAIN){
+			return -2;
+		}
+		written = 0;
+	}
+	else{
+		this->writes++;
+	}
+	
+	/* Partial write: collected bytes go first, then the message */
+	if ((size_t) written < collected){
+		buf->start += written;
+		written = 0;
+	}
+	else{
+		buf->start = buf->end = 0;
+		written -= collected;
+	}
+	
+	if ((size_t) written < len){
+		if (buf->start){
+			memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+			buf->end -= buf->start;
+			buf->start = 0;
+		}
+		if (buf->end + len - written > WRITE_BUFFER_SIZE){
+			return -3;
+		}
+		memcpy(buf->data + buf->end, (const char*) msg + written, len - written);
+		buf->end += len - written;
+		return 0;
+	}
+	return buf->start == buf->end || msg ? 0 : -3;
+}
+
+/** Collect message for outbound pipe until flush
+ *
+ * When message doesn't fit, collected ones are written together with it.
+ *
+ * @return -2 on write error, -3 if pipe is full, 0 on success
+ */
+static int collect_message(PipesCommunication* this, local_id dst, const Message* msg){
+	WriteBuffer* buf;
+	size_t len = FRAME_LEN(msg);
+	
+	if (!(buf = this->out_buffers[dst])){
+		if (!(buf = malloc(sizeof(WriteBuffer)))){
+			return -2;
+		}
+		buf->start = buf->end = 0;
+		this->out_buffers[dst] = buf;
+	}
+	
+	if (buf->end + len > WRITE_BUFFER_SIZE){
+		return flush_channel(this, dst, msg);
+	}
+	memcpy(buf->data + buf->end, msg, len);
+	buf->end += len;
+	return 0;
+}
+
+/** Write messages collected for all outbound pipes, wait while pipes are full
+ *
+ * Credit that couldn't be granted when it was read is granted now.
+ *
+ * @param comm		Pointer to PipesCommunication
+ *
+ * @return -2 on write error, 0 on success
+ */
+int ipc_flush(PipesCommunication* comm){
+	local_id i;
+	int retval = 0;
+	
+	for (i = 0; i < comm->total_ids; i++){
+		size_t attempt = 0;
+		int result;
+		
+		if (comm->credit_window && i != comm->current_id){
+			grant_credit(comm, i, comm->credit_window / 2);
+		}
+		if (!comm->out_buffers[i] || !comm->out_buffers[i]->end){
 			continue;
 		}
+		while ((result = flush_channel(comm, i, NULL)) == -3){
+			if (backoff(comm, i, attempt++)){
+				result = -2;
+				break;
+			}
+		}
+		if (result){
+			retval = -2;
+		}
+	}
+	return retval;
+}
+
+/** Send message, wait while channel is full
+ *
+ * @param comm		Pointer to PipesCommunication
+ * @param dst		Receiver local id
+ * @param msg		Message to send
+ *
+ * @return -1 on wrong receiver, -2 on send error, 0 on success
+ */
+int send_blocking(PipesCommunication* comm, local_id dst, const Message* msg){
+	size_t attempt = 0;
+	int retval;
+	
+	while ((retval = send(comm, dst, msg)) == -3){
+		if (backoff(comm, dst, attempt++)){
+			return -2;
+		}
+	}
+	return retval;
+}
+
+/** Sleep until any inbound pipe becomes readable
+ *
+ * Marks readable channels in this->ready. Pipes whose writer is gone and
+ * which have nothing left to read are removed from epoll. Pipes handed out
+ * by broker are added to it.
+ *
+ * @return -1 if there is nothing to wait for or on epoll error, 0 on success
+ */
+static int wait_any(PipesCommunication* this){
+	struct epoll_event events[MAX_PROCESS_COUNT];
+	int i, count;
+	
+	if (!this->open_channels){
+		return -1;
+	}
+	
+	while ((count = epoll_wait(this->epoll_fd, events, MAX_PROCESS_COUNT, -1)) < 0){
+		if (errno != EINTR){
+			return -1;
+		}
+	}
+	this->wakeups++;
+	
+	for (i = 0; i < count; i++){
+		local_id id = events[i].data.u32;
 		
-		if (!receive(this, i, msg)){
-			this->last_msg_from = i;
-			return 0;
+		if (id == this->current_id){
+			take_channels(this, 0);
+		}
+		else if (events[i].events & EPOLLIN){
+			this->ready[id] = 1;
+		}
+		else if (events[i].events & (EPOLLHUP | EPOLLERR)){
+			close_channel(this, id);
 		}
 	}
-	return -1;
+	return 0;
+}
+
+/** Write message to pipe or socket, or collect it until flush
+ *
+ * @return -2 on write error, -3 if channel is full, 0 on success
+ */
+static int pipe_write(PipesCommunication* this, local_id dst, const Message* msg){
+	int16_t type = msg->s_header.s_type;
+	
+	if (this->flush_policy == FLUSH_BATCH){
+		if (type != CREDIT && (this->lanes != LANES_CONTROL || !IS_CONTROL_TYPE(type))){
+			return collect_message(this, dst, msg);
+		}
+		/* Control message isn't kept until flush, messages collected before go out ahead of it */
+		if (this->out_buffers[dst] && this->out_buffers[dst]->end){
+			return flush_channel(this, dst, msg);
+		}
+	}
+	this->writes++;
+	if (write(WRITE_FD(this, dst), msg, FRAME_LEN(msg)) < 0){
+		return errno == EAGAIN ? -3 : -2;
+	}
+	return 0;
+}
+
+/** Send message to pipe or socket if it fits into credit of channel
+ *
+ * The first message to dst asks broker to open the channel. Credit owed
+ * to dst rides on the message as header extension. CREDIT messages don't
+ * wait for credit, and neither do messages to receiver which has closed
+ * its channel to us: it may be gone, the write tells.
+ *
+ * @return -2 on write error, -3 if channel is full or there is no credit, 0 on success
+ */
+static int pipe_send(void* self, local_id dst, const Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	ChannelCredit* credit;
+	union{
+		Message msg;
+		char data[MAX_FRAME_LEN];
+	} frame;
+	CreditGrant grant;
+	size_t len = sizeof(MessageHeader) + msg->s_header.s_payload_len;
+	size_t ext;
+	int retval;
+	
+	if (WRITE_FD(this, dst) == -1 && open_channel(this, dst)){
+		return -2;
+	}
+	if (!this->credit_window){
+		return pipe_write(this, dst, msg);
+	}
+	
+	credit = &this->credits[dst];
+	ext = credit->read != credit->reported || msg->s_header.s_type == CREDIT ? sizeof(CreditGrant) : 0;
+	if (msg->s_header.s_type != CREDIT && !this->closed[dst] && (uint32_t) (credit->sent - credit->granted) + len + ext > this->credit_window){
+		/* dst grants only what it has read, so collected messages must reach it */
+		if (this->out_buffers[dst] && this->out_buffers[dst]->end){
+			flush_channel(this, dst, NULL);
+		}
+		this->credit_wait = dst;
+		return -3;
+	}
+	if (ext){
+		memcpy(&frame.msg, msg, len);
+		frame.msg.s_header.s_magic = MESSAGE_MAGIC_CREDIT;
+		grant.s_read = credit->read;
+		memcpy(frame.data + len, &grant, sizeof(CreditGrant));
+		msg = &frame.msg;
+	}
+	
+	if (!(retval = pipe_write(this, dst, msg))){
+		credit->sent += len + ext;
+		if (ext){
+			credit->reported = grant.s_read;
+		}
+	}
+	return retval;
+}
+
+/** Send CREDIT message if enough is owed to the process
+ *
+ * @param min		Bytes read from it and not granted yet needed to send
+ *
+ * @return -1 if too little is owed, the same as pipe_send() otherwise
+ */
+static int grant_credit(PipesCommunication* this, local_id to, size_t min){
+	ChannelCredit* credit = &this->credits[to];
+	Message msg;
+	int retval;
+	
+	if ((uint32_t) (credit->read - credit->reported) < min || WRITE_FD(this, to) == CHANNEL_REFUSED){
+		return -1;
+	}
+	msg.s_header.s_magic = MESSAGE_MAGIC;
+	msg.s_header.s_payload_len = 0;
+	msg.s_header.s_type = CREDIT;
+	msg.s_header.s_local_time = 0;
+	if (!(retval = pipe_send(this, to, &msg))){
+		this->grants++;
+	}
+	return retval;
+}
+
+/** Receive message from pipe or socket, sleep on it until message comes or writer closes it
+ *
+ * Before from has written anything, sleeps until broker hands the channel out.
+ *
+ * @return -2 if channel is closed or on poll error, -3 on read error, 0 on success
+ */
+static int pipe_receive(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	struct pollfd fds[2];
+	int retval, polled = 0;
+	
+	/* Channel is handed out by broker when from sends to us for the first time */
+	while (READ_FD(this, from) < 0){
+		if (this->closed[from]){
+			return -2;
+		}
+		ipc_flush(this);
+		take_channels(this, 1);
+		this->wakeups++;
+	}
+	
+	fds[0].fd = READ_FD(this, from);
+	fds[0].events = POLLIN;
+	fds[1].fd = this->broker_fd;
+	fds[1].events = POLLIN;
+	
+	while ((retval = try_receive(this, from, msg)) == -2){
+		if (polled){
+			this->spurious_polls++;
+		}
+		ipc_flush(this);
+		fds[0].revents = fds[1].revents = 0;
+		if (poll(fds, 2, -1) < 0 && errno != EINTR){
+			return retval;
+		}
+		this->wakeups++;
+		if (fds[1].revents){
+			take_channels(this, 0);
+			fds[1].fd = this->broker_fd;
+		}
+		if ((fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) && !(fds[0].revents & POLLIN)){
+			return retval;
+		}
+		polled = 1;
+	}
+	return retval;
+}
+
+/** Receive message from any pipe or socket, scan ready channels from scan_start
+ *
+ * @return -1 if all channels are closed or on epoll error, 0 on success
+ */
+static int pipe_receive_any(void* self, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	local_id i;
+	size_t k;
+	int polled = 0;
+	
+	while (1){
+		for (k = 0; k < this->total_ids; k++){
+			i = SCAN_ID(this, k);
+			if (i == this->current_id || !this->ready[i]){
+				continue;
+			}
+			
+			switch (try_receive(this, i, msg)){
+				case 0:
+					this->last_msg_from = i;
+					return 0;
+				case -4:
+					close_channel(this, i);
+					break;
+				default:
+					this->ready[i] = 0;
+			}
+		}
+		
+		if (polled){
+			this->spurious_polls++;
+		}
+		ipc_flush(this);
+		if (wait_any(this)){
+			return -1;
+		}
+		polled = 1;
+	}
+}
+
+/** Read message from pipe or socket without waiting, even if channel isn't reported readable
+ *
+ * @return -1 if there is no message, 0 on success
+ */
+static int pipe_try_receive(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	/* Closed channel is read only while something is left in its buffer */
+	if (READ_FD(this, from) < 0 || (this->closed[from] && !this->ready[from])){
+		return -1;
+	}
+	switch (try_receive(this, from, msg)){
+		case 0:
+			return 0;
+		case -4:
+			close_channel(this, from);
+			break;
+		default:
+			this->ready[from] = 0;
+	}
+	return -1;
+}
+
+/** Take control lane message of channel without waiting
+ *
+ * Channel reported readable is read ahead when nothing complete is buffered,
+ * so control messages sent behind bulk ones can be seen.
+ *
+ * @return -1 if there is none, 0 if it was the first message, 1 if it was taken ahead of others
+ */
+static int pipe_take_control(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	ReadBuffer* buf;
+	
+	if (READ_FD(this, from) < 0 || !(buf = get_buffer(this, from))){
+		return -1;
+	}
+	if (this->ready[from] && !this->closed[from] && !buffered_length(buf)){
+		switch (fill_buffer(this, from, buf)){
+			case -2:
+				this->ready[from] = 0;
+				break;
+			case -4:
+				close_channel(this, from);
+				break;
+		}
+	}
+	return take_buffered_control(this, from, msg);
+}
+
+/** Move messages of shared ring into read-ahead buffer while they surely fit */
+static void shm_drain(PipesCommunication* this, local_id from){
+	ReadBuffer* buf = get_buffer(this, from);
+	Message msg;
+	
+	while (buf && has_room(buf) && !shm_try_receive(this->shm, from, this->current_id, &msg)){
+		size_t len = sizeof(MessageHeader) + msg.s_header.s_payload_len;
+		
+		compact_buffer(buf);
+		memcpy(buf->data + buf->end, &msg, len);
+		buf->end += len;
+		buf->parsed = buf->end;
+	}
+}
+
+/** Take message from shared ring, messages drained while sending go first
+ *
+ * @return -1 if there is no message, 0 on success
+ */
+static int shm_take(PipesCommunication* this, local_id from, Message* msg){
+	if (!take_buffered(this, from, msg)){
+		return 0;
+	}
+	return shm_try_receive(this->shm, from, this->current_id, msg);
+}
+
+/** Put message into shared ring without waiting
+ *
+ * @return -3 if ring is full, 0 on success
+ */
+static int shm_send_message(void* self, local_id dst, const Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	return shm_send(this->shm, this->current_id, dst, msg) ? -3 : 0;
+}
+
+/** Put message once into broadcast ring of current process, receivers read it there
+ *
+ * @return -3 if ring is full, 0 on success
+ */
+static int shm_multicast_message(void* self, const Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	return shm_multicast(this->shm, this->current_id, msg) ? -3 : 0;
+}
+
+/** Receive message from shared ring, sleep while it is empty
+ *
+ * @return 0 on success
+ */
+static int shm_receive(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	int slept = 0;
+	
+	while (shm_take(this, from, msg)){
+		if (slept){
+			this->spurious_polls++;
+		}
+		slept = shm_wait(this->shm, this->current_id, from);
+		this->wakeups += slept;
+	}
+	return 0;
+}
+
+/** Receive message from any shared ring from scan_start on, sleep while all are empty
+ *
+ * @return 0 on success
+ */
+static int shm_receive_any(void* self, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	local_id i;
+	size_t k;
+	int slept = 0;
+	
+	while (1){
+		for (k = 0; k < this->total_ids; k++){
+			i = SCAN_ID(this, k);
+			if (i != this->current_id && !shm_take(this, i, msg)){
+				this->last_msg_from = i;
+				return 0;
+			}
+		}
+		
+		if (slept){
+			this->spurious_polls++;
+		}
+		slept = shm_wait(this->shm, this->current_id, -1);
+		this->wakeups += slept;
+	}
+}
+
+/** Take message from shared ring without waiting
+ *
+ * @return -1 if there is no message, 0 on success
+ */
+static int shm_try_take(void* self, local_id from, Message* msg){
+	return shm_take((PipesCommunication*) self, from, msg) ? -1 : 0;
+}
+
+/** Wait after shared ring was found full
+ *
+ * Rings can't be polled, so process yields and moves what has come to its
+ * inbound rings into read-ahead buffers, as the receiver may wait for it.
+ *
+ * @return 0
+ */
+static int shm_wait_writable(void* self, local_id dst, size_t attempt){
+	PipesCommunication* this = (PipesCommunication*) self;
+	local_id i;
+	
+	sched_yield();
+	for (i = 0; i < this->total_ids; i++){
+		if (i != this->current_id){
+			shm_drain(this, i);
+		}
+	}
+	return 0;
+}
+
+/** Take control lane message of shared ring without waiting, the ring is drained to find it
+ *
+ * @return -1 if there is none, 0 if it was the first message, 1 if it was taken ahead of others
+ */
+static int shm_take_control(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	shm_drain(this, from);
+	return take_buffered_control(this, from, msg);
+}
+
+/** Push message into mailbox of dst
+ *
+ * @return -2 if there is no memory, 0 on success
+ */
+static int mailbox_send_message(void* self, local_id dst, const Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	return mailbox_send(&this->mailboxes[dst], this->current_id, msg) ? -2 : 0;
+}
+
+/** Receive message from thread, sleep while there is none
+ *
+ * @return 0 on success
+ */
+static int mailbox_receive(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	Mailbox* box = &this->mailboxes[this->current_id];
+	int slept = 0;
+	
+	while (mailbox_take(&this->queues[from], msg)){
+		if (mailbox_collect(box, this->queues)){
+			continue;
+		}
+		if (slept){
+			this->spurious_polls++;
+		}
+		slept = mailbox_wait(box);
+		this->wakeups += slept;
+	}
+	return 0;
+}
+
+/** Receive message from any thread from scan_start on, sleep while there is none
+ *
+ * @return 0 on success
+ */
+static int mailbox_receive_any(void* self, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	Mailbox* box = &this->mailboxes[this->current_id];
+	local_id i;
+	size_t k;
+	int slept = 0;
+	
+	while (1){
+		mailbox_collect(box, this->queues);
+		for (k = 0; k < this->total_ids; k++){
+			i = SCAN_ID(this, k);
+			if (!mailbox_take(&this->queues[i], msg)){
+				this->last_msg_from = i;
+				return 0;
+			}
+		}
+		
+		if (slept){
+			this->spurious_polls++;
+		}
+		slept = mailbox_wait(box);
+		this->wakeups += slept;
+	}
+}
+
+/** Take message of thread without waiting
+ *
+ * @return -1 if there is no message, 0 on success
+ */
+static int mailbox_try_receive(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	mailbox_collect(&this->mailboxes[this->current_id], this->queues);
+	return mailbox_take(&this->queues[from], msg);
+}
+
+/** Take control lane message of thread without waiting
+ *
+ * @return -1 if there is none, 0 if it was the first message, 1 if it was taken ahead of others
+ */
+static int mailbox_take_control_message(void* self, local_id from, Message* msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	mailbox_collect(&this->mailboxes[this->current_id], this->queues);
+	return mailbox_take_control(&this->queues[from], msg);
+}
+
+/** Transports by TransportType, chosen with --transport= */
+static const Transport pipe_transport = {
+	"pipe", 0, pipe_send, NULL, pipe_receive, pipe_receive_any, pipe_try_receive, pipe_take_control, pipe_wait_writable
+};
+
+static const Transport shm_transport = {
+	"shm", 0, shm_send_message, shm_multicast_message, shm_receive, shm_receive_any, shm_try_take, shm_take_control, shm_wait_writable
+};
+
+static const Transport seqpacket_transport = {
+	"seqpacket", 1, pipe_send, NULL, pipe_receive, pipe_receive_any, pipe_try_receive, pipe_take_control, pipe_wait_writable
+};
+
+/* Mailboxes are never full */
+static const Transport mailbox_transport = {
+	"mailbox", 0, mailbox_send_message, NULL, mailbox_receive, mailbox_receive_any, mailbox_try_receive, mailbox_take_control_message, NULL
+};
+
+const Transport* const transports[TRANSPORT_COUNT] = {
+	&pipe_transport, &shm_transport, &seqpacket_transport, &mailbox_transport
+};
+
+/** Park message of sender for a later receive
+ *
+ * @return -1 if there is no memory, 0 on success
+ */
+static int stash_message(PipesCommunication* this, local_id from, const Message* msg){
+	Stash* stash = this->stashes[from];
+	StashNode* node;
+	int queue = STASH_QUEUE(msg->s_header.s_type);
+	
+	if (!stash && !(stash = this->stashes[from] = calloc(1, sizeof(Stash)))){
+		return -1;
+	}
+	if (!(node = malloc(STASH_NODE_LEN(msg)))){
+		return -1;
+	}
+	node->next = NULL;
+	node->order = stash->next_order++;
+	memcpy(&node->msg, msg, sizeof(MessageHeader) + msg->s_header.s_payload_len);
+	
+	if (stash->last[queue]){
+		stash->last[queue]->next = node;
+	}
+	else{
+		stash->first[queue] = node;
+	}
+	stash->last[queue] = node;
+	stash->count++;
+	this->parked++;
+	this->stashed++;
+	return 0;
+}
+
+/** Get queue of stash holding the message parked first
+ *
+ * @return -1 if stash is empty, queue on success
+ */
+static int oldest_queue(const Stash* stash){
+	int queue = -1;
+	int i;
+	
+	if (!stash || !stash->count){
+		return -1;
+	}
+	for (i = 0; i <= MESSAGE_TYPE_COUNT; i++){
+		if (stash->first[i] && (queue < 0 || (int32_t) (stash->first[i]->order - stash->first[queue]->order) < 0)){
+			queue = i;
+		}
+	}
+	return queue;
+}
+
+/** Take parked message of sender
+ *
+ * @param type			Type to take, -1 for the oldest message of any type
+ *
+ * @return -1 if there is none, 0 on success
+ */
+static int unstash_message(PipesCommunication* this, local_id from, int type, Message* msg){
+	Stash* stash = this->stashes[from];
+	StashNode* node;
+	int queue = type < 0 ? oldest_queue(stash) : type;
+	
+	if (!stash || queue < 0){
+		return -1;
+	}
+	if (!(node = stash->first[queue])){
+		return -1;
+	}
+	if (!(stash->first[queue] = node->next)){
+		stash->last[queue] = NULL;
+	}
+	memcpy(msg, &node->msg, sizeof(MessageHeader) + node->msg.s_header.s_payload_len);
+	free(node);
+	stash->count--;
+	this->parked--;
+	return 0;
+}
+
+/** Receive message of given type from process
+ *
+ * Messages of other types read meanwhile are parked, not dropped: they are
+ * given out by later receive_type() of their type, which takes them without
+ * reading the channel, or by receive() / receive_any(), oldest first.
+ *
+ * @param type			Type to wait for
+ *
+ * @return -1 on wrong sender or type, -5 if message can't be parked,
+ *         the same as receive() if channel gives nothing, 0 on success
+ */
+int receive_type(PipesCommunication* comm, local_id from, int16_t type, Message* msg){
+	int retval;
+	
+	if (from < 0 || from >= comm->total_ids || from == comm->current_id || type < 0 || type >= MESSAGE_TYPE_COUNT){
+		return -1;
+	}
+	if (comm->parked && !unstash_message(comm, from, type, msg)){
+		return 0;
+	}
+	
+	while (!(retval = comm->ops->receive(comm, from, msg))){
+		if (msg->s_header.s_type == type){
+			return 0;
+		}
+		if (stash_message(comm, from, msg)){
+			return -5;
+		}
+	}
+	return retval;
+}
+
+/** Count message of receive_any() for its sender and choose the channel to scan first next time
+ *
+ * Wait of channel is the number of messages other channels gave since its
+ * previous one. It shows starvation while the channel has messages waiting.
+ */
+static void count_served(PipesCommunication* this, local_id from){
+	ReceiveStats* stats = &this->receive_stats[from];
+	size_t wait = this->received - stats->last;
+	
+	if (wait > stats->max_wait){
+		stats->max_wait = wait;
+	}
+	stats->served++;
+	stats->last = ++this->received;
+	this->last_msg_from = from;
+	
+	if (this->receive_policy == RECEIVE_FIRST){
+		return;
+	}
+	if (this->scan_start != (size_t) from){
+		this->scan_start = from;
+		this->burst = 0;
+	}
+	if (++this->burst >= (this->receive_policy == RECEIVE_WEIGHTED ? this->weights[from] : 1)){
+		this->scan_start = (from + 1) % this->total_ids;
+		this->burst = 0;
+	}
+}
+
+/** Receive message whose sender time is the oldest among heads of all channels
+ *
+ * The first message of every channel is parked, so heads of all channels can
+ * be compared. Times are compared by their difference, as Lamport time wraps
+ * around. Equal times are taken in round robin order.
+ *
+ * @return the same as receive_any() of transport
+ */
+static int receive_oldest(PipesCommunication* this, Message* msg){
+	local_id i, oldest = -1;
+	timestamp_t time = 0;
+	size_t k;
+	
+	for (i = 0; i < this->total_ids; i++){
+		if (i == this->current_id || oldest_queue(this->stashes[i]) >= 0 || this->ops->try_receive(this, i, msg)){
+			continue;
+		}
+		if (stash_message(this, i, msg)){
+			this->last_msg_from = i;
+			return 0;
+		}
+	}
+	if (!this->parked){
+		return this->ops->receive_any(this, msg);
+	}
+	
+	for (k = 0; k < this->total_ids; k++){
+		const Stash* stash;
+		int queue;
+		
+		i = SCAN_ID(this, k);
+		stash = this->stashes[i];
+		if ((queue = oldest_queue(stash)) < 0){
+			continue;
+		}
+		if (oldest < 0 || (int16_t) (stash->first[queue]->msg.s_header.s_local_time - time) < 0){
+			oldest = i;
+			time = stash->first[queue]->msg.s_header.s_local_time;
+		}
+	}
+	this->last_msg_from = oldest;
+	return unstash_message(this, oldest, -1, msg);
+}
+
+/** Take control lane message of sender without waiting
+ *
+ * Control messages parked by receive_type() came earlier than ones in the
+ * channel and are taken first, oldest first.
+ *
+ * @return -1 if there is none, 0 on success
+ */
+static int take_control(PipesCommunication* this, local_id from, Message* msg){
+	static const int16_t types[] = {STOP, DONE, CS_RELEASE};
+	const Stash* stash = this->stashes[from];
+	int queue = -1;
+	size_t i;
+	int retval;
+	
+	for (i = 0; this->parked && stash && i < sizeof(types) / sizeof(types[0]); i++){
+		if (stash->first[types[i]] && (queue < 0 || (int32_t) (stash->first[types[i]]->order - stash->first[queue]->order) < 0)){
+			queue = types[i];
+		}
+	}
+	if (queue >= 0){
+		return unstash_message(this, from, queue, msg);
+	}
+	
+	if ((retval = this->ops->take_control(this, from, msg)) > 0){
+		this->overtaken++;
+	}
+	return retval < 0 ? -1 : 0;
+}
+
+/** Send message without waiting
+ *
+ * @return -1 on wrong receiver, -2 on write error, -3 if channel is full, 0 on success
+ */
+int send(void * self, local_id dst, const Message * msg){
+	PipesCommunication* from = (PipesCommunication*) self;
+	
+	if (dst < 0 || dst >= from->total_ids || dst == from->current_id){
+		return -1;
+	}
+	return from->ops->send(from, dst, msg);
+}
+
+/** Send message to all other processes, wait while channels are full
+ *
+ * @return -2 if message wasn't sent to somebody, 0 on success
+ */
+int send_multicast(void * self, const Message * msg){
+	PipesCommunication* from = (PipesCommunication*) self;
+	local_id i;
+	int retval = 0;
+	
+	if (from->ops->send_multicast){
+		size_t attempt = 0;
+		
+		while ((retval = from->ops->send_multicast(from, msg)) == -3){
+			if (backoff(from, from->current_id, attempt++)){
+				return -2;
+			}
+		}
+		return retval;
+	}
+	
+	for (i = 0; i < from->total_ids; i++){
+		if (i != from->current_id && send_blocking(from, i, msg)){
+			retval = -2;
+		}
+	}
+	return retval;
+}
+
+int receive(void * self, local_id from, Message * msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	
+	if (from < 0 || from >= this->total_ids || from == this->current_id){
+		return -1;
+	}
+	if (this->lanes == LANES_CONTROL && !take_control(this, from, msg)){
+		return 0;
+	}
+	if (this->parked && !unstash_message(this, from, -1, msg)){
+		return 0;
+	}
+	return this->ops->receive(this, from, msg);
+}
+
+/** Receive message from any process in order of receive policy
+ *
+ * With LANES_CONTROL control lane messages that have come go first.
+ * Sender is left in last_msg_from and counted in receive_stats.
+ */
+int receive_any(void * self, Message * msg){
+	PipesCommunication* this = (PipesCommunication*) self;
+	local_id i;
+	size_t k;
+	int retval;
+	
+	/* Control lane goes ahead of any policy */
+	for (k = 0; this->lanes == LANES_CONTROL && k < this->total_ids; k++){
+		i = SCAN_ID(this, k);
+		if (i != this->current_id && !take_control(this, i, msg)){
+			count_served(this, i);
+			return 0;
+		}
+	}
+	
+	if (this->receive_policy == RECEIVE_OLDEST){
+		retval = receive_oldest(this, msg);
+	}
+	else{
+		/* Messages parked by receive_type() came earlier than anything in channels */
+		for (k = 0; this->parked && k < this->total_ids; k++){
+			i = SCAN_ID(this, k);
+			if (!unstash_message(this, i, -1, msg)){
+				count_served(this, i);
+				return 0;
+			}
+		}
+		retval = this->ops->receive_any(this, msg);
+	}
+	
+	if (!retval){
+		count_served(this, this->last_msg_from);
+	}
+	return retval;
 }
@@ -6,10 +6,13 @@
  */
  
 #include "lamport.h"
+#include "fiber.h"
 
 #include <stdlib.h>
 
-static timestamp_t lamport_time = 0;
+/* Each thread has its own clock when processes run as threads,
+ * fibers of one thread get their own after lamport_fiber_local() */
+static __thread timestamp_t lamport_time = 0;
 
 /** Compare 2 QueueNodes
  *
@@ -19,10 +22,12 @@ static timestamp_t lamport_time = 0;
  * @return -1 if @one comes first, 1 if @two comes first, 0 on equal.
  */
 int node_cmp(QueueNode* one, QueueNode* two){
-	if (one->key < two->key){
+	timestamp_t diff = (timestamp_t) (one->key - two->key);	/* Clock wraps around, see set_lamport_time() */
+	
+	if (diff < 0){
 		return -1;
 	}
-	if (one->key > two->key){
+	if (diff > 0){
 		return 1;
 	}
     if (one->value < two->value){
@@ -149,8 +154,10 @@ timestamp_t increment_lamport_time(){
 	return lamport_time;
 }
 
+/* timestamp_t is 16 bit and wraps around when many processes enter CS many times.
+ * Times are compared by their difference, it is fine while they are less than 2^15 apart. */
 timestamp_t set_lamport_time(timestamp_t new_lamport_time){
-	if (lamport_time < new_lamport_time){
+	if ((timestamp_t) (new_lamport_time - lamport_time) > 0){
 		lamport_time = new_lamport_time;
 	}
 	return lamport_time;
@@ -164,3 +171,11 @@ timestamp_t set_lamport_time_from_msg(Message* msg){
 timestamp_t get_lamport_time(){
 	return lamport_time;
 }
+
+/** Make clock private to every fiber, must be called before fiber_run()
+ *
+ * @return -1 on error, 0 on success
+ */
+int lamport_fiber_local(){
+	return fiber_local(&lamport_time, sizeof(lamport_time));
+}
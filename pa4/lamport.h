@@ -36,5 +36,6 @@ timestamp_t increment_lamport_time();
 timestamp_t set_lamport_time(timestamp_t new_lamport_time);
 timestamp_t set_lamport_time_from_msg(Message* msg);
 timestamp_t get_lamport_time();
+int lamport_fiber_local();
 
 #endif
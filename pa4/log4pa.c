@@ -5,6 +5,8 @@
  * @brief    Logger functions
  */
  
+#define _GNU_SOURCE
+
 #include "log4pa.h"
 #include "common.h"
 #include "pa2345.h"
@@ -12,11 +14,16 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+
+static const char * const log_startup_fmt = "%d: process %1d started up in %lu us\n";
 
 FILE* pipes_log_f;
 FILE* events_log_f;
+static struct timespec launch_time;
 
 void log_init(){
+	clock_gettime(CLOCK_MONOTONIC, &launch_time);
 	pipes_log_f = fopen(pipes_log, "w");
 	events_log_f = fopen(events_log, "w");
 }
@@ -29,7 +36,16 @@ void log_destroy(){
 void log_pipes(PipesCommunication* comm){
 	size_t i;
 	
-	fprintf(pipes_log_f, "Process %d pipes:\n", comm->current_id);
+	if (comm->transport == TRANSPORT_SHM){
+		fprintf(pipes_log_f, "Process %d uses shared memory rings\n", comm->current_id);
+		return;
+	}
+	if (comm->transport == TRANSPORT_MAILBOX){
+		fprintf(pipes_log_f, "Process %d is a thread with mailbox\n", comm->current_id);
+		return;
+	}
+	
+	fprintf(pipes_log_f, "Process %d %s opened on demand (-1 if never used):\n", comm->current_id, comm->transport == TRANSPORT_SEQPACKET ? "sockets" : "pipes");
 	
 	for (i = 0; i < comm->total_ids; i++){
 		if (i == comm->current_id){
@@ -42,14 +58,67 @@ void log_pipes(PipesCommunication* comm){
 	fprintf(pipes_log_f, "\n");
 }
 
+void log_poll_stats(PipesCommunication* comm){
+	local_id i;
+	
+	fprintf(pipes_log_f, "Process %d polling: %lu wakeups, %lu spurious, %lu reads, %lu writes\n", comm->current_id, comm->wakeups, comm->spurious_polls, comm->reads, comm->writes);
+	if (comm->stashed){
+		fprintf(pipes_log_f, "Process %d stash: %lu parked, %lu left\n", comm->current_id, comm->stashed, comm->parked);
+	}
+	if (comm->grants){
+		fprintf(pipes_log_f, "Process %d credit: %lu CREDIT messages sent\n", comm->current_id, comm->grants);
+	}
+	if (comm->overtaken){
+		fprintf(pipes_log_f, "Process %d lanes: %lu control messages taken ahead\n", comm->current_id, comm->overtaken);
+	}
+	
+	for (i = 0; i < comm->total_ids; i++){
+		SendStats* stats = &comm->send_stats[i];
+		
+		if (!stats->retries){
+			continue;
+		}
+		if (i == comm->current_id){
+			fprintf(pipes_log_f, "Process %d broadcast: %lu retries, %lu waits, %lu us blocked\n", comm->current_id, stats->retries, stats->waits, (unsigned long) (stats->blocked_ns / 1000));
+		}
+		else{
+			fprintf(pipes_log_f, "Process %d send to %d: %lu retries, %lu waits, %lu for credit, %lu us blocked\n", comm->current_id, i, stats->retries, stats->waits, stats->credit_waits, (unsigned long) (stats->blocked_ns / 1000));
+		}
+	}
+	
+	for (i = 0; i < comm->total_ids; i++){
+		PipeStats* stats = &comm->pipe_stats[i];
+		
+		if (stats->peak){
+			fprintf(pipes_log_f, "Process %d pipe from %d: %lu bytes peak of %d\n", comm->current_id, i, stats->peak, stats->peak_capacity);
+		}
+		if (stats->capacity){
+			fprintf(pipes_log_f, "Process %d pipe to %d: %d bytes, found full %lu times, grown %lu times\n", comm->current_id, i, stats->capacity, stats->full, stats->grown);
+		}
+	}
+	
+	for (i = 0; i < comm->total_ids; i++){
+		ReceiveStats* stats = &comm->receive_stats[i];
+		
+		if (stats->served){
+			fprintf(pipes_log_f, "Process %d receive from %d: %lu served, %lu max wait\n", comm->current_id, i, stats->served, stats->max_wait);
+		}
+	}
+}
+
 void log_started(local_id id){
 	printf(log_started_fmt, get_lamport_time(), id, getpid(), getppid(), 0);
     fprintf(events_log_f, log_started_fmt, get_lamport_time(), id, getpid(), getppid(), 0);
 }
 
 void log_received_all_started(local_id id){
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	printf(log_received_all_started_fmt, get_lamport_time(), id);
     fprintf(events_log_f, log_received_all_started_fmt, get_lamport_time(), id);
+	fprintf(events_log_f, log_startup_fmt, get_lamport_time(), id,
+		(unsigned long) ((now.tv_sec - launch_time.tv_sec) * 1000000 + (now.tv_nsec - launch_time.tv_nsec) / 1000));
 }
 
 void log_done(local_id id){
@@ -0,0 +1,218 @@
+/**
+ * @file     mailbox.c
+ * @Author   @seniorkot
+ * @date     June, 2018
+ * @brief    Lock-free mailboxes used instead of pipes when processes run as threads
+ */
+
+#define _GNU_SOURCE
+
+#include "mailbox.h"
+#include "fiber.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define NODE_LEN(msg) (offsetof(MailNode, msg) + sizeof(MessageHeader) + (msg)->s_header.s_payload_len)
+
+/** Free list of nodes */
+static void free_nodes(MailNode* node){
+	while (node){
+		MailNode* next = node->next;
+		
+		free(node);
+		node = next;
+	}
+}
+
+/** Allocate mailboxes for all processes. Must be called before threads start.
+ *
+ * @param proc_count    Process count including parent process.
+ *
+ * @return pointer to mailboxes array, NULL on error
+ */
+Mailbox* mailbox_init(size_t proc_count){
+	return calloc(proc_count, sizeof(Mailbox));
+}
+
+/** Free mailboxes and messages nobody has taken. Called after all threads are joined.
+ *
+ * @param boxes			Pointer to mailboxes array
+ * @param proc_count    Process count including parent process.
+ */
+void mailbox_destroy(Mailbox* boxes, size_t proc_count){
+	size_t i;
+	
+	for (i = 0; i < proc_count; i++){
+		free_nodes(boxes[i].head);
+	}
+	free(boxes);
+}
+
+/** Push copy of message into mailbox. No syscalls unless owner is sleeping.
+ *
+ * @return -1 if there is no memory, 0 on success
+ */
+int mailbox_send(Mailbox* box, local_id from, const Message* msg){
+	MailNode* node = malloc(NODE_LEN(msg));
+	
+	if (!node){
+		return -1;
+	}
+	node->from = from;
+	memcpy(&node->msg, msg, sizeof(MessageHeader) + msg->s_header.s_payload_len);
+	
+	node->next = __atomic_load_n(&box->head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&box->head, &node->next, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	
+	/* Pairs with the fence in mailbox_wait(): either owner sees new head or we see it waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&box->waiting, __ATOMIC_RELAXED)){
+		__atomic_add_fetch(&box->seq, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &box->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+	return 0;
+}
+
+/** Take all pushed nodes out of mailbox and append them to queues of their senders
+ *
+ * Nodes are pushed newest first, so the list is reversed to restore send order.
+ *
+ * @param queues		Queues of receiver, one per sender
+ *
+ * @return number of messages taken
+ */
+size_t mailbox_collect(Mailbox* box, MailQueue* queues){
+	MailNode* node = __atomic_exchange_n(&box->head, NULL, __ATOMIC_ACQUIRE);
+	MailNode* list = NULL;
+	size_t count = 0;
+	
+	while (node){
+		MailNode* next = node->next;
+		
+		node->next = list;
+		list = node;
+		node = next;
+	}
+	
+	while (list){
+		MailQueue* queue = &queues[list->from];
+		
+		node = list;
+		list = list->next;
+		node->next = NULL;
+		if (queue->last){
+			queue->last->next = node;
+		}
+		else{
+			queue->first = node;
+		}
+		queue->last = node;
+		if (IS_CONTROL_TYPE(node->msg.s_header.s_type)){
+			queue->controls++;
+		}
+		count++;
+	}
+	return count;
+}
+
+/** Take the oldest message of queue
+ *
+ * @return -1 if queue is empty, 0 on success
+ */
+int mailbox_take(MailQueue* queue, Message* msg){
+	MailNode* node = queue->first;
+	
+	if (!node){
+		return -1;
+	}
+	if (!(queue->first = node->next)){
+		queue->last = NULL;
+	}
+	if (IS_CONTROL_TYPE(node->msg.s_header.s_type)){
+		queue->controls--;
+	}
+	memcpy(msg, &node->msg, sizeof(MessageHeader) + node->msg.s_header.s_payload_len);
+	free(node);
+	return 0;
+}
+
+/** Take the oldest control lane message of queue, other messages keep their order
+ *
+ * @return -1 if queue has none, 0 if it was the first message, 1 if it was taken ahead of others
+ */
+int mailbox_take_control(MailQueue* queue, Message* msg){
+	MailNode* prev = NULL;
+	MailNode* node = queue->first;
+	
+	if (!queue->controls){
+		return -1;
+	}
+	while (!IS_CONTROL_TYPE(node->msg.s_header.s_type)){
+		prev = node;
+		node = node->next;
+	}
+	if (!prev){
+		return mailbox_take(queue, msg);
+	}
+	if (!(prev->next = node->next)){
+		queue->last = prev;
+	}
+	queue->controls--;
+	memcpy(msg, &node->msg, sizeof(MessageHeader) + node->msg.s_header.s_payload_len);
+	free(node);
+	return 1;
+}
+
+/** Free messages left in queues of receiver
+ *
+ * @param queues		Queues of receiver, one per sender
+ * @param proc_count    Process count including parent process.
+ */
+void mailbox_clear(MailQueue* queues, size_t proc_count){
+	size_t i;
+	
+	for (i = 0; i < proc_count; i++){
+		free_nodes(queues[i].first);
+		queues[i].first = queues[i].last = NULL;
+		queues[i].controls = 0;
+	}
+}
+
+/** Wait until something is pushed into mailbox
+ *
+ * Spins over the mailbox first, then sleeps on its futex.
+ * A fiber switches to the next runnable fiber instead: nobody else can push while it spins.
+ *
+ * @return 1 if thread was sleeping or fiber was switched out, 0 if message was found while spinning
+ */
+int mailbox_wait(Mailbox* box){
+	uint32_t seq;
+	int i, slept = 0;
+	
+	if (fiber_current() >= 0){
+		fiber_wait((void* const*) &box->head);
+		return 1;
+	}
+	
+	for (i = 0; i < MAILBOX_SPIN_COUNT; i++){
+		if (__atomic_load_n(&box->head, __ATOMIC_ACQUIRE)){
+			return 0;
+		}
+	}
+	
+	seq = __atomic_load_n(&box->seq, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&box->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	if (!__atomic_load_n(&box->head, __ATOMIC_ACQUIRE)){
+		syscall(SYS_futex, &box->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+		slept = 1;
+	}
+	__atomic_store_n(&box->waiting, 0, __ATOMIC_RELAXED);
+	return slept;
+}
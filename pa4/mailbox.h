@@ -0,0 +1,55 @@
+/**
+ * @file     mailbox.h
+ * @Author   @seniorkot
+ * @date     June, 2018
+ * @brief    Header file for in-memory mailboxes of threads
+ */
+
+#ifndef __IFMO_DISTRIBUTED_CLASS_MAILBOX__H
+#define __IFMO_DISTRIBUTED_CLASS_MAILBOX__H
+
+#include "ipc.h"
+
+#include <stddef.h>
+
+enum {
+	MAILBOX_CACHE_LINE = 64,
+	MAILBOX_SPIN_COUNT = 512	/* Checks of the mailbox before going to sleep */
+};
+
+/* Message on its way to receiver, allocated by sender and freed by receiver */
+typedef struct MailNode{
+	struct MailNode* next;
+	local_id from;
+	Message msg;			/* Only header and payload are allocated */
+} MailNode;
+
+/* Multiple producer / single consumer mailbox of one thread */
+typedef struct{
+	MailNode* head;			/* Pushed nodes, newest first */
+	uint32_t seq;			/* Futex word, bumped by senders to wake owner */
+	uint32_t waiting;		/* Owner is going to sleep on seq */
+	char pad[MAILBOX_CACHE_LINE - sizeof(MailNode*) - 2 * sizeof(uint32_t)];
+} Mailbox;
+
+/* Types of control lane: taken ahead of earlier messages of their sender when lanes are on */
+#define IS_CONTROL_TYPE(type) ((type) == STOP || (type) == DONE || (type) == CS_RELEASE)
+
+/* Messages of one sender taken out of mailbox, oldest first. Owned by receiver. */
+typedef struct{
+	MailNode* first;
+	MailNode* last;
+	size_t controls;		/* Messages of control lane among them */
+} MailQueue;
+
+Mailbox* mailbox_init(size_t proc_count);
+void mailbox_destroy(Mailbox* boxes, size_t proc_count);
+
+int mailbox_send(Mailbox* box, local_id from, const Message* msg);
+size_t mailbox_collect(Mailbox* box, MailQueue* queues);
+int mailbox_take(MailQueue* queue, Message* msg);
+int mailbox_take_control(MailQueue* queue, Message* msg);
+void mailbox_clear(MailQueue* queues, size_t proc_count);
+int mailbox_wait(Mailbox* box);
+
+#endif
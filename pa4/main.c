@@ -3,7 +3,7 @@
  * @Author   @seniorkot
  * @date     June, 2018
  */
- 
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -11,93 +11,285 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "log4pa.h"
 #include "communication.h"
 #include "lamport.h"
 #include "cs.h"
+#include "fiber.h"
 #include "pa2345.h"
 
-int get_agrs(int argc, char** argv, int* processes, int* mutexl);
+int get_agrs(int argc, char** argv, int* processes, int* mutexl, int* threads, int* fibers, int* fork_tree, int* transport, int* flush, int* barrier, int* receive, int* lanes, int* credit, int* pipe_size, int* parent_pipe_size, int* pipe_grow);
+
+/* Arguments of process running as thread */
+typedef struct{
+	Mailbox* mailboxes;
+	size_t proc_count;
+	local_id id;
+	int mutexl;
+	int flush;
+	int barrier;
+	int receive;
+	int lanes;
+	int credit;
+	int pipe_size;
+	int parent_pipe_size;
+	int pipe_grow;
+} ThreadArgs;
+
+local_id fork_children(size_t proc_count, int tree, pid_t* children, size_t* count);
+int run_threads(int proc_count, int fibers, int mutexl, int flush, int barrier, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow);
+void* thread_main(void* arg);
+void do_work(PipesCommunication* comm, int mutexl, int flush, int barrier, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow);
 
 int do_parent_work(PipesCommunication* comm);
 int do_child_work(PipesCommunication* comm, int mutexl);
 
 /**
- * @return -1 on invalid arguments, -2 on fork error, 0 on success
+ * @return -1 on invalid arguments, -2 on fork error, -3 on channels init error, 0 on success
  */
 int main(int argc, char** argv){
 	size_t i;
 	int proc_count;
 	int mutexl;
-	int* pipes;
+	int threads;
+	int fibers;
+	int fork_tree;
+	int transport;
+	int flush;
+	int barrier;
+	int receive;
+	int lanes;
+	int credit;
+	int pipe_size;
+	int parent_pipe_size;
+	int pipe_grow;
+	int* pipes = NULL;
+	ShmRegion* shm = NULL;
 	pid_t* children;
-	pid_t fork_id;
+	size_t children_count;
 	local_id current_proc_id;
 	PipesCommunication* comm;
 	
 	/* Check args */
-	if (argc < 3 || get_agrs(argc, argv, &proc_count, &mutexl) == -1){
-		fprintf(stderr, "Usage: %s -p X [--mutexl]\n", argv[0]);
+	if (argc < 3 || get_agrs(argc, argv, &proc_count, &mutexl, &threads, &fibers, &fork_tree, &transport, &flush, &barrier, &receive, &lanes, &credit, &pipe_size, &parent_pipe_size, &pipe_grow) == -1){
+		fprintf(stderr, "Usage: %s -p X [--mutexl] [--threads | --fibers | --transport=pipe|shm|seqpacket] [--flush=immediate|batch] [--barrier=all|tree] [--receive=first|round-robin|weighted|oldest] [--lanes=single|control] [--credit=off|BYTES] [--pipe-size=default|BYTES] [--parent-pipe-size=default|BYTES] [--pipe-grow=off|N] [--fork-tree]\n", argv[0]);
 		return -1;
 	}
 	
 	/* Initialize log files */
 	log_init();
 	
+	/* Run processes as threads or fibers of this one */
+	if (threads || fibers){
+		return run_threads(proc_count, fibers, mutexl, flush, barrier, receive, lanes, credit, pipe_size, parent_pipe_size, pipe_grow);
+	}
+	
 	/* Allocate memory for children */
 	children = malloc(sizeof(pid_t) * proc_count);
 	
-	/* Open pipes for all processes */
-	pipes = pipes_init(proc_count + 1);
+	/* Open pipes or map shared rings for all processes */
+	if (transport == TRANSPORT_SHM){
+		shm = shm_init(proc_count + 1);
+	}
+	else{
+		pipes = pipes_init(proc_count + 1, transport);
+	}
+	if (pipes == NULL && shm == NULL){
+		return -3;
+	}
 	
 	/* Create children processes */
-	for (i = 0; i < proc_count; i++){
-		fork_id = fork();
-		if (fork_id < 0){
-			return -2;
+	if ((current_proc_id = fork_children(proc_count, fork_tree, children, &children_count)) < 0){
+		return -2;
+	}
+	
+	/* Set pipe fds to process params */
+	comm = communication_init(transport, pipes, shm, NULL, proc_count + 1, current_proc_id);
+	do_work(comm, mutexl, flush, barrier, receive, lanes, credit, pipe_size, parent_pipe_size, pipe_grow);
+	
+	/* Waiting for children forked by this process */
+	for (i = 0; i < children_count; i++){
+		waitpid(children[i], NULL, 0);
+	}
+	
+	/* Finish work */
+	log_poll_stats(comm);
+	log_destroy();
+	communication_destroy(comm);
+	free(children);
+	return 0;
+}
+
+/** Fork child processes
+ *
+ * Serially the parent forks all children. As a tree process i forks
+ * 2i + 1 and 2i + 2, so forks of one level run in parallel and startup
+ * grows with log of process count. Every process waits for its own children.
+ *
+ * @param proc_count	Count of child processes
+ * @param tree			Fork as a binary tree
+ * @param children		Where to store pids of children forked by current process
+ * @param count			Where to store count of them
+ *
+ * @return -1 on fork error, local id of current process otherwise
+ */
+local_id fork_children(size_t proc_count, int tree, pid_t* children, size_t* count){
+	local_id id = PARENT_ID;
+	size_t next = 1;
+	size_t last = tree ? 2 : proc_count;
+	
+	*count = 0;
+	while (next <= last && next <= proc_count){
+		pid_t pid = fork();
+		
+		if (pid < 0){
+			return -1;
 		}
-		else if (!fork_id){
-			free(children);
-			break;
+		if (pid){
+			children[(*count)++] = pid;
+			next++;
+			continue;
 		}
-		children[i] = fork_id;
+		
+		id = next;
+		*count = 0;
+		next = 2 * id + 1;
+		last = tree ? next + 1 : 0;
 	}
+	return id;
+}
+
+/** Run every process as a thread sharing one address space
+ *
+ * Children get threads of their own, parent work is done by the main thread.
+ * With fibers all processes are fibers of the main thread, switched when
+ * their mailbox is empty. Lamport clocks are then saved and restored on every switch.
+ * Messages go through mailboxes instead of pipes.
+ *
+ * @param proc_count	Count of child processes
+ * @param fibers		Run processes as fibers instead of threads
+ * @param mutexl		Mutexl flag
+ * @param flush			Flush policy
+ * @param barrier		Barrier type of STARTED / DONE
+ * @param receive		Order in which receive_any() serves channels
+ * @param lanes			Take control messages ahead of others
+ * @param credit		Credit window of channels, 0 for none
+ * @param pipe_size		Capacity of pipes, 0 for the kernel default
+ * @param parent_pipe_size	Capacity of pipes to parent, 0 for pipe_size
+ * @param pipe_grow		Times pipe is found full before it is doubled, 0 for never
+ *
+ * @return -2 on thread creation error, -3 on mailboxes init error, 0 on success
+ */
+int run_threads(int proc_count, int fibers, int mutexl, int flush, int barrier, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow){
+	pthread_t* threads = malloc(sizeof(pthread_t) * proc_count);
+	ThreadArgs* args = malloc(sizeof(ThreadArgs) * (proc_count + 1));
+	Mailbox* mailboxes = mailbox_init(proc_count + 1);
+	local_id i;
+	int retval = 0;
 	
-	/* Set current process id */
-	if (!fork_id){
-		current_proc_id = i + 1;
-	}
-	else{
-		current_proc_id = PARENT_ID;
+	if (mailboxes == NULL){
+		return -3;
 	}
 	
-	/* Set pipe fds to process params */
-	comm = communication_init(pipes, proc_count + 1, current_proc_id);
-	log_pipes(comm);
+	for (i = 0; i <= proc_count; i++){
+		args[i].mailboxes = mailboxes;
+		args[i].proc_count = proc_count + 1;
+		args[i].id = i;
+		args[i].mutexl = mutexl;
+		args[i].flush = flush;
+		args[i].barrier = barrier;
+		args[i].receive = receive;
+		args[i].lanes = lanes;
+		args[i].credit = credit;
+		args[i].pipe_size = pipe_size;
+		args[i].parent_pipe_size = parent_pipe_size;
+		args[i].pipe_grow = pipe_grow;
+	}
 	
-	/* Do process work */
-	if (current_proc_id == PARENT_ID){
-		do_parent_work(comm);
+	if (fibers){
+		lamport_fiber_local();
+		retval = fiber_run(proc_count + 1, thread_main, args, sizeof(ThreadArgs)) ? -2 : 0;
 	}
 	else{
-		do_child_work(comm, mutexl);
-	}
-	
-	/* Waiting for all children if parent process */
-	if (current_proc_id == PARENT_ID){
+		for (i = 1; i <= proc_count; i++){
+			if (pthread_create(&threads[i - 1], NULL, thread_main, &args[i])){
+				return -2;
+			}
+		}
+		
+		thread_main(&args[PARENT_ID]);
+		
+		/* Waiting for all children */
 		for (i = 0; i < proc_count; i++){
-			waitpid(children[i], NULL, 0);
+			pthread_join(threads[i], NULL);
 		}
 	}
 	
 	/* Finish work */
 	log_destroy();
+	mailbox_destroy(mailboxes, proc_count + 1);
+	free(args);
+	free(threads);
+	return retval;
+}
+
+/** Run process work in its own thread or fiber
+ *
+ * @param arg		Pointer to ThreadArgs
+ *
+ * @return NULL
+ */
+void* thread_main(void* arg){
+	ThreadArgs* args = (ThreadArgs*) arg;
+	PipesCommunication* comm;
+	
+	comm = communication_init(TRANSPORT_MAILBOX, NULL, NULL, args->mailboxes, args->proc_count, args->id);
+	do_work(comm, args->mutexl, args->flush, args->barrier, args->receive, args->lanes, args->credit, args->pipe_size, args->parent_pipe_size, args->pipe_grow);
+	log_poll_stats(comm);
 	communication_destroy(comm);
-	return 0;
+	return NULL;
+}
+
+/** Do work of parent or child process
+ *
+ * @param comm		Pointer to PipesCommunication
+ * @param mutexl	Mutexl flag
+ * @param flush		Flush policy
+ * @param barrier	Barrier type of STARTED / DONE
+ * @param receive	Order in which receive_any() serves channels
+ * @param lanes		Take control messages ahead of others
+ * @param credit	Credit window of channels, 0 for none
+ * @param pipe_size	Capacity of pipes, 0 for the kernel default
+ * @param parent_pipe_size	Capacity of pipes to parent, 0 for pipe_size
+ * @param pipe_grow	Times pipe is found full before it is doubled, 0 for never
+ */
+void do_work(PipesCommunication* comm, int mutexl, int flush, int barrier, int receive, int lanes, int credit, int pipe_size, int parent_pipe_size, int pipe_grow){
+	set_flush_policy(comm, flush);
+	comm->barrier = barrier;
+	set_receive_policy(comm, receive);
+	comm->lanes = lanes;
+	set_credit_window(comm, credit);
+	set_pipe_size(comm, pipe_size, parent_pipe_size, pipe_grow);
+	
+	if (comm->current_id == PARENT_ID){
+		do_parent_work(comm);
+	}
+	else{
+		do_child_work(comm, mutexl);
+	}
+	
+	/* Write out collected messages, nobody would read them after exit */
+	ipc_flush(comm);
+	log_pipes(comm);
 }
 
 /** Do parent process work
+ *
+ * With tree barrier DONE comes from children in barrier tree only, each
+ * of them sends it once its whole subtree is done. Then nobody will request
+ * critical area anymore, and STOP is sent down the tree.
  *
  * @param comm		Pointer to PipesCommunication
  *
@@ -107,7 +299,7 @@ int do_parent_work(PipesCommunication* comm){
 	CS lamport_comm;
 	lamport_comm.comm = comm;
 	lamport_comm.queue = NULL;
-	lamport_comm.done_left = comm->total_ids - 1;
+	lamport_comm.done_left = comm->barrier == BARRIER_TREE ? tree_children_count(comm) : comm->total_ids - 1;
 	
 	/* Receive STARTED messages from children */
 	receive_all_msgs(comm, STARTED);
@@ -118,18 +310,25 @@ int do_parent_work(PipesCommunication* comm){
 		
 		while (receive_any(comm, &msg));
 		
-		/* Ignore REQUEST & RELEASE messages */
+		/* Parent isn't in mutex: REQUEST & RELEASE multicast to it are dropped,
+		 * parking them for receive_type() would pile them up until exit */
 		if (msg.s_header.s_type == DONE){
 			set_lamport_time_from_msg(&msg);
 			cs_work(&lamport_comm, &msg);
 		}
 	}
 	
+	if (comm->barrier == BARRIER_TREE){
+		send_tree_release(comm, STOP);
+	}
 	log_received_all_done(comm->current_id);
 	return 0;
 }
 
 /** Do child process work
+ *
+ * With tree barrier DONE goes to the parent in barrier tree once the process
+ * and its subtree are done. Requests are answered until STOP comes down.
  *
  * @param comm		Pointer to PipesCommunication
  * @param mutexl	Mutexl flag
@@ -139,12 +338,14 @@ int do_parent_work(PipesCommunication* comm){
 int do_child_work(PipesCommunication* comm, int mutexl){
 	LamportQueue* queue = lamport_queue_init();
 	CS lamport_comm;
-	local_id i;
+	int i;					/* Iterations go up to current_id * 5, past local_id range */
 	char buf[MAX_PAYLOAD_LEN];
+	int notified = 0;
+	int stopped = comm->barrier != BARRIER_TREE;
 	
 	lamport_comm.comm = comm;
 	lamport_comm.queue = queue;
-	lamport_comm.done_left = comm->total_ids - 2;
+	lamport_comm.done_left = comm->barrier == BARRIER_TREE ? tree_children_count(comm) : comm->total_ids - 2;
 	
 	/* Send & receive STARTED messages */
 	send_all_proc_event_msg(comm, STARTED);
@@ -166,17 +367,26 @@ int do_child_work(PipesCommunication* comm, int mutexl){
 		}
 	}
 	
-	/* Notify all that process is done */
-	send_all_proc_event_msg(comm, DONE);
-	
 	/* Receive messages: wait for all done, reply on requests */
-	while (lamport_comm.done_left){
+	while (!notified || lamport_comm.done_left || !stopped){
 		Message msg;
 		
+		/* Notify all that process is done, with tree barrier after the subtree */
+		if (!notified && (comm->barrier != BARRIER_TREE || !lamport_comm.done_left)){
+			send_all_proc_event_msg(comm, DONE);
+			notified = 1;
+			continue;
+		}
+		
 		while (receive_any(comm, &msg));
 		
 		set_lamport_time_from_msg(&msg);
 		cs_work(&lamport_comm, &msg);
+		
+		if (msg.s_header.s_type == STOP){
+			send_tree_release(comm, STOP);
+			stopped = 1;
+		}
 	}
 	log_received_all_done(comm->current_id);
 	
@@ -190,25 +400,115 @@ int do_child_work(PipesCommunication* comm, int mutexl){
  * @param argv			Double char array containing command line arguments
  * @param processes		Pointer to proc_count variable
  * @param mutexl		Pointer to mutexl flag variable
+ * @param threads		Pointer to threads flag variable
+ * @param fibers		Pointer to fibers flag variable
+ * @param fork_tree		Pointer to fork tree flag variable
+ * @param transport		Pointer to transport type variable
+ * @param flush			Pointer to flush policy variable
+ * @param barrier		Pointer to barrier type variable
+ * @param receive		Pointer to receive policy variable
+ * @param lanes			Pointer to lane mode variable
+ * @param credit		Pointer to credit window variable
+ * @param pipe_size		Pointer to pipe capacity variable
+ * @param parent_pipe_size	Pointer to capacity variable of pipes to parent
+ * @param pipe_grow		Pointer to pipe growth threshold variable
  *
  * @return -1 on error, 0 on success.
  */
-int get_agrs(int argc, char** argv, int* processes, int* mutexl){
+int get_agrs(int argc, char** argv, int* processes, int* mutexl, int* threads, int* fibers, int* fork_tree, int* transport, int* flush, int* barrier, int* receive, int* lanes, int* credit, int* pipe_size, int* parent_pipe_size, int* pipe_grow){
 	int res;
 	const struct option long_options[] = {
         {"mutexl", no_argument, mutexl, 1},
+        {"threads", no_argument, threads, 1},
+        {"fibers", no_argument, fibers, 1},
+        {"fork-tree", no_argument, fork_tree, 1},
+        {"transport", required_argument, NULL, 't'},
+        {"flush", required_argument, NULL, 'f'},
+        {"barrier", required_argument, NULL, 'b'},
+        {"receive", required_argument, NULL, 'r'},
+        {"lanes", required_argument, NULL, 'l'},
+        {"credit", required_argument, NULL, 'c'},
+        {"pipe-size", required_argument, NULL, 's'},
+        {"parent-pipe-size", required_argument, NULL, 'P'},
+        {"pipe-grow", required_argument, NULL, 'g'},
         {NULL, 0, NULL, 0}
     };
-	
+
+	*processes = 0;
 	*mutexl = 0;
+	*threads = 0;
+	*fibers = 0;
+	*fork_tree = 0;
+	*transport = TRANSPORT_COUNT;
+	*flush = FLUSH_IMMEDIATE;
+	*barrier = BARRIER_ALL;
+	*receive = RECEIVE_FIRST;
+	*lanes = LANES_SINGLE;
+	*credit = 0;
+	*pipe_size = 0;
+	*parent_pipe_size = 0;
+	*pipe_grow = 0;
 	
 	while ((res = getopt_long(argc, argv, "p:", long_options, NULL)) != -1){
 		if (res == 'p'){
 			*processes = atoi(optarg);
 		}
+		else if (res == 't'){
+			if ((*transport = get_transport_type(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'f'){
+			if ((*flush = get_flush_policy(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'b'){
+			if ((*barrier = get_barrier_type(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'r'){
+			if ((*receive = get_receive_policy(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'l'){
+			if ((*lanes = get_lane_mode(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'c'){
+			if ((*credit = get_credit_window(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 's'){
+			if ((*pipe_size = get_pipe_size(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'P'){
+			if ((*parent_pipe_size = get_pipe_size(optarg)) == -1){
+				return -1;
+			}
+		}
+		else if (res == 'g'){
+			if ((*pipe_grow = get_pipe_grow(optarg)) == -1){
+				return -1;
+			}
+		}
 		else if (res == '?'){
 			return -1;
 		}
 	}
-	return 0;
+	
+	/* Threads and fibers talk through mailboxes only, and mailboxes work for them only */
+	if (*transport == TRANSPORT_COUNT){
+		*transport = *threads || *fibers ? TRANSPORT_MAILBOX : TRANSPORT_PIPE;
+	}
+	if ((*threads && *fibers) || *processes < 1 || *processes >= MAX_PROCESS_COUNT){
+		return -1;
+	}
+	return (*threads || *fibers) == (*transport == TRANSPORT_MAILBOX) ? 0 : -1;
 }
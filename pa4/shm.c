@@ -0,0 +1,292 @@
+/**
+ * @file     shm.c
+ * @Author   @seniorkot
+ * @date     June, 2018
+ * @brief    Lock-free rings in shared memory used instead of pipes
+ */
+
+#define _GNU_SOURCE
+
+#include "shm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define GET_INDEX(x, id) ((x) < (id) ? (x) : (x) - 1)
+#define RING_OFFSET(pos) ((pos) & (SHM_RING_SIZE - 1))
+#define RECORD_LEN(msg) (sizeof(uint32_t) + sizeof(MessageHeader) + (msg)->s_header.s_payload_len)
+
+/** Get ring of (src, dst) pair
+ *
+ * Rings are grouped by receiver, so all inbound rings of a process are adjacent.
+ */
+static ShmRing* get_ring(ShmRegion* shm, local_id src, local_id dst){
+	return &shm->rings[dst * (shm->proc_count - 1) + GET_INDEX(src, dst)];
+}
+
+/** Get position of receiver dst in broadcast ring of src */
+static ShmCursor* get_cursor(ShmRegion* shm, local_id src, local_id dst){
+	return &shm->cursors[src * shm->proc_count + dst];
+}
+
+/** Copy bytes into ring starting from position pos (wraps around the end) */
+static void ring_write(ShmRing* ring, uint32_t pos, const void* buf, size_t len){
+	size_t offset = RING_OFFSET(pos);
+	size_t first = SHM_RING_SIZE - offset < len ? SHM_RING_SIZE - offset : len;
+	
+	memcpy(ring->data + offset, buf, first);
+	memcpy(ring->data, (const char*) buf + first, len - first);
+}
+
+/** Copy bytes out of ring starting from position pos (wraps around the end) */
+static void ring_read(ShmRing* ring, uint32_t pos, void* buf, size_t len){
+	size_t offset = RING_OFFSET(pos);
+	size_t first = SHM_RING_SIZE - offset < len ? SHM_RING_SIZE - offset : len;
+	
+	memcpy(buf, ring->data + offset, first);
+	memcpy((char*) buf + first, ring->data, len - first);
+}
+
+/** Write record (sender sequence number + message) to ring head and publish it.
+ *  Caller checks free space.
+ */
+static void put_record(ShmRing* ring, uint32_t seq, const Message* msg){
+	uint32_t head = ring->head;
+	
+	ring_write(ring, head, &seq, sizeof(uint32_t));
+	ring_write(ring, head + sizeof(uint32_t), msg, sizeof(MessageHeader) + msg->s_header.s_payload_len);
+	__atomic_store_n(&ring->head, head + RECORD_LEN(msg), __ATOMIC_RELEASE);
+}
+
+/** Read record at position pos
+ *
+ * @return record length
+ */
+static uint32_t get_record(ShmRing* ring, uint32_t pos, Message* msg){
+	ring_read(ring, pos + sizeof(uint32_t), msg, sizeof(MessageHeader));
+	ring_read(ring, pos + sizeof(uint32_t) + sizeof(MessageHeader), msg->s_payload, msg->s_header.s_payload_len);
+	return RECORD_LEN(msg);
+}
+
+/** Get sender sequence number of record at position pos */
+static uint32_t get_seq(ShmRing* ring, uint32_t pos){
+	uint32_t seq;
+	
+	ring_read(ring, pos, &seq, sizeof(uint32_t));
+	return seq;
+}
+
+/** Check if ring has a record after position pos */
+static int has_record(ShmRing* ring, uint32_t pos){
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != pos;
+}
+
+/** Wake receiver up if it sleeps. Caller issues the fence after publishing. */
+static void ring_doorbell(ShmRegion* shm, local_id dst){
+	ShmDoorbell* bell = &shm->doorbells[dst];
+	
+	if (__atomic_load_n(&bell->waiting, __ATOMIC_RELAXED)){
+		__atomic_add_fetch(&bell->seq, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &bell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/** Check if any message is waiting for process
+ *
+ * @param from		Sender local id or -1 for any sender
+ */
+static int has_pending(ShmRegion* shm, local_id self, local_id from){
+	local_id i;
+	
+	for (i = 0; i < shm->proc_count; i++){
+		if (i == self || (from >= 0 && i != from)){
+			continue;
+		}
+		if (has_record(get_ring(shm, i, self), get_ring(shm, i, self)->tail)
+				|| has_record(&shm->broadcasts[i], get_cursor(shm, i, self)->pos)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Map shared rings for all processes. Must be called before fork.
+ *
+ * @param proc_count    Process count including parent process.
+ *
+ * @return pointer to ShmRegion, NULL on error
+ */
+ShmRegion* shm_init(size_t proc_count){
+	ShmRegion* shm;
+	void* addr;
+	int fd;
+	size_t size = sizeof(ShmDoorbell) * proc_count + sizeof(ShmRing) * proc_count * proc_count
+			+ sizeof(ShmCursor) * proc_count * proc_count;
+	
+	if ((fd = memfd_create("ipc_rings", MFD_CLOEXEC)) < 0){
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0){
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED){
+		return NULL;
+	}
+	
+	shm = malloc(sizeof(ShmRegion));
+	shm->proc_count = proc_count;
+	shm->size = size;
+	shm->doorbells = addr;
+	shm->rings = (ShmRing*) (shm->doorbells + proc_count);
+	shm->broadcasts = shm->rings + proc_count * (proc_count - 1);
+	shm->cursors = (ShmCursor*) (shm->broadcasts + proc_count);
+	shm->send_seq = 0;
+	return shm;
+}
+
+/** Unmap rings & free space
+ *
+ * @param shm		Pointer to ShmRegion
+ */
+void shm_destroy(ShmRegion* shm){
+	munmap(shm->doorbells, shm->size);
+	free(shm);
+}
+
+/** Put message into (src, dst) ring. No syscalls unless dst is sleeping.
+ *
+ * @return -1 if ring is full, 0 on success
+ */
+int shm_send(ShmRegion* shm, local_id src, local_id dst, const Message* msg){
+	ShmRing* ring = get_ring(shm, src, dst);
+	
+	if (SHM_RING_SIZE - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < RECORD_LEN(msg)){
+		return -1;
+	}
+	put_record(ring, shm->send_seq++, msg);
+	
+	/* Pairs with the fence in shm_wait(): either receiver sees new head or we see it waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ring_doorbell(shm, dst);
+	return 0;
+}
+
+/** Put message into broadcast ring of src once for all other processes
+ *
+ * Every receiver reads it at its own cursor. Space is reused after
+ * all cursors have passed it.
+ *
+ * @return -1 if ring is full, 0 on success
+ */
+int shm_multicast(ShmRegion* shm, local_id src, const Message* msg){
+	ShmRing* ring = &shm->broadcasts[src];
+	local_id i;
+	
+	if (SHM_RING_SIZE - (ring->head - ring->tail) < RECORD_LEN(msg)){
+		/* Find the slowest receiver */
+		ring->tail = ring->head;
+		for (i = 0; i < shm->proc_count; i++){
+			uint32_t pos;
+			
+			if (i == src){
+				continue;
+			}
+			pos = __atomic_load_n(&get_cursor(shm, src, i)->pos, __ATOMIC_ACQUIRE);
+			if (ring->head - pos > ring->head - ring->tail){
+				ring->tail = pos;
+			}
+		}
+		if (SHM_RING_SIZE - (ring->head - ring->tail) < RECORD_LEN(msg)){
+			return -1;
+		}
+	}
+	put_record(ring, shm->send_seq++, msg);
+	
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < shm->proc_count; i++){
+		if (i != src){
+			ring_doorbell(shm, i);
+		}
+	}
+	return 0;
+}
+
+/** Take message from src without blocking
+ *
+ * Messages of src come from (src, dst) ring and src broadcast ring. They are
+ * taken in the order src has sent them, by sequence numbers of records.
+ *
+ * @return -1 if both rings are empty, 0 on success
+ */
+int shm_try_receive(ShmRegion* shm, local_id src, local_id dst, Message* msg){
+	ShmRing* ring = get_ring(shm, src, dst);
+	ShmRing* broadcast = &shm->broadcasts[src];
+	ShmCursor* cursor = get_cursor(shm, src, dst);
+	uint32_t tail = ring->tail;
+	uint32_t pos = cursor->pos;
+	int unicast = has_record(ring, tail);
+	int multicast = has_record(broadcast, pos);
+	
+	/* Records are published in sequence order: once a record is seen in one ring,
+	 * all older records of the other ring are visible too. Look there again. */
+	if (unicast && !multicast){
+		multicast = has_record(broadcast, pos);
+	}
+	else if (!unicast && multicast){
+		unicast = has_record(ring, tail);
+	}
+	if (!unicast && !multicast){
+		return -1;
+	}
+	
+	if (unicast && multicast && (int32_t) (get_seq(broadcast, pos) - get_seq(ring, tail)) < 0){
+		unicast = 0;
+	}
+	if (unicast){
+		__atomic_store_n(&ring->tail, tail + get_record(ring, tail, msg), __ATOMIC_RELEASE);
+	}
+	else{
+		__atomic_store_n(&cursor->pos, pos + get_record(broadcast, pos, msg), __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/** Wait until a message for process self comes
+ *
+ * Spins over the rings first, then sleeps on the process futex.
+ *
+ * @param self		Receiver local id
+ * @param from		Sender local id or -1 for any sender
+ *
+ * @return 1 if process was sleeping, 0 if message was found while spinning
+ */
+int shm_wait(ShmRegion* shm, local_id self, local_id from){
+	ShmDoorbell* bell = &shm->doorbells[self];
+	uint32_t seq;
+	int i, slept = 0;
+	
+	for (i = 0; i < SHM_SPIN_COUNT; i++){
+		if (has_pending(shm, self, from)){
+			return 0;
+		}
+	}
+	
+	seq = __atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&bell->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	if (!has_pending(shm, self, from)){
+		syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+		slept = 1;
+	}
+	__atomic_store_n(&bell->waiting, 0, __ATOMIC_RELAXED);
+	return slept;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file     shm.h
+ * @Author   @seniorkot
+ * @date     June, 2018
+ * @brief    Header file for shared memory ring transport
+ */
+
+#ifndef __IFMO_DISTRIBUTED_CLASS_SHM__H
+#define __IFMO_DISTRIBUTED_CLASS_SHM__H
+
+#include "ipc.h"
+
+enum {
+	SHM_RING_SIZE = 64 * 1024,	/* Same as default pipe capacity, must be power of 2 */
+	SHM_CACHE_LINE = 64,
+	SHM_SPIN_COUNT = 512		/* Polls of the rings before going to sleep */
+};
+
+/* Single producer / single consumer ring of one (src, dst) pair */
+typedef struct{
+	uint32_t head;		/* Bytes ever written, changed by producer only */
+	char head_pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+	uint32_t tail;		/* Bytes ever read, changed by consumer only */
+	char tail_pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+	char data[SHM_RING_SIZE];
+} ShmRing;
+
+/* Position of one receiver in broadcast ring of one sender */
+typedef struct{
+	uint32_t pos;		/* Bytes of broadcast ring read, changed by receiver only */
+	char pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+} ShmCursor;
+
+/* Per process wake up word */
+typedef struct{
+	uint32_t seq;		/* Futex word, bumped by senders to wake owner */
+	uint32_t waiting;	/* Owner is going to sleep on seq */
+	char pad[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+} ShmDoorbell;
+
+typedef struct{
+	size_t proc_count;
+	size_t size;			/* Mapped bytes */
+	ShmDoorbell* doorbells;	/* One per process */
+	ShmRing* rings;			/* proc_count * (proc_count - 1), grouped by receiver */
+	ShmRing* broadcasts;	/* One per sender, tail is kept by sender: oldest byte somebody hasn't read */
+	ShmCursor* cursors;		/* proc_count * proc_count, grouped by sender */
+	uint32_t send_seq;		/* Sequence number of the next message sent by this process */
+} ShmRegion;
+
+ShmRegion* shm_init(size_t proc_count);
+void shm_destroy(ShmRegion* shm);
+
+int shm_send(ShmRegion* shm, local_id src, local_id dst, const Message* msg);
+int shm_multicast(ShmRegion* shm, local_id src, const Message* msg);
+int shm_try_receive(ShmRegion* shm, local_id src, local_id dst, Message* msg);
+int shm_wait(ShmRegion* shm, local_id self, local_id from);
+
+#endif